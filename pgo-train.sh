@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Training workload for profile-guided optimization (see "make pgo").
+# Runs a private dopewars server, and plays several games against it with
+# AI players, so that the instrumented binary records a profile of the
+# server's and the client's hot paths. The server must be a text-mode
+# one (i.e. dopewars not configured with --enable-gui-server).
+#
+# usage: pgo-train.sh path/to/dopewars profile-dir [games] [port]
+
+dopewars="$1"
+pgodir="$2"
+games="${3:-6}"
+port="${4:-17902}"
+
+if test ! -x "$dopewars" || test -z "$pgodir"; then
+  echo "usage: $0 path/to/dopewars profile-dir [games] [port]" >&2
+  exit 1
+fi
+
+tmpdir=`mktemp -d 2>/dev/null || echo /tmp/dopewars-pgo.$$`
+mkdir -p "$tmpdir"
+trap 'rm -rf "$tmpdir"' 0
+
+cat > "$tmpdir/config" <<EOF
+Daemonize = FALSE
+MetaServer.Active = FALSE
+AITurnPause = 0
+NumTurns = 31
+EOF
+touch "$tmpdir/dopewars.sco"
+
+"$dopewars" -S -p "$port" -g "$tmpdir/config" -f "$tmpdir/dopewars.sco" \
+            -l "$tmpdir/server.log" > /dev/null 2>&1 &
+server=$!
+sleep 2
+
+# Play the games in pairs, so that the AI players meet (and fight) each other
+game=0
+while test $game -lt $games; do
+  "$dopewars" -c -o localhost -p "$port" -g "$tmpdir/config" \
+              > /dev/null 2>&1 &
+  ai1=$!
+  "$dopewars" -c -o localhost -p "$port" -g "$tmpdir/config" \
+              > /dev/null 2>&1
+  wait $ai1
+  game=`expr $game + 2`
+done
+
+# The server writes its profile when it exits cleanly on SIGTERM
+kill -TERM $server
+wait $server
+
+# clang writes raw profiles, which must be merged before they can be used
+if ls "$pgodir"/*.profraw > /dev/null 2>&1; then
+  llvm-profdata merge -output="$pgodir/default.profdata" "$pgodir"/*.profraw
+fi
+exit 0
@@ -83,6 +83,7 @@ static void AIStartGame(Player *AIPlay)
   Client = Network = TRUE;
   InitAbilities(AIPlay);
   SetAbility(AIPlay, A_DONEFIGHT, FALSE);
+  SetAbility(AIPlay, A_RULESET, TRUE);
   SendAbilities(AIPlay);
 
   AISetName(AIPlay);
@@ -570,12 +571,11 @@ void AIJet(Player *AIPlay)
  */
 void AIPayLoan(Player *AIPlay)
 {
-  gchar *prstr;
+  gchar prstr[PRICE_BUFLEN];
 
   if (AIPlay->Cash - AIPlay->Debt >= MINSAFECASH) {
-    prstr = pricetostr(AIPlay->Debt);
-    SendClientMessage(AIPlay, C_NONE, C_PAYLOAN, NULL, prstr);
-    g_free(prstr);
+    SendClientMessage(AIPlay, C_NONE, C_PAYLOAN, NULL,
+                      PriceToBuf(AIPlay->Debt, prstr));
     dpg_print(_("Debt of %P paid off to loan shark\n"), AIPlay->Debt);
   }
   SendClientMessage(AIPlay, C_NONE, C_DONE, NULL, NULL);
@@ -0,0 +1,374 @@
+/************************************************************************
+ * codecbench.c   Microbenchmarks for the message codecs                *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+/* 
+ * Times each codec function on the test corpora (see codectest.c), in
+ * the manner of Google Benchmark: each benchmark is run for more and
+ * more iterations until it takes at least the minimum time, and the
+ * time per iteration is reported. With --json=FILE the results are also
+ * written in Google Benchmark's JSON format, so that the usual tools
+ * can compare two runs. "make bench" writes codecbench.json.
+ *
+ * The decoders modify the message they are given, so each iteration
+ * first copies a message from the corpus; BM_Copy times just that.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "dopewars.h"
+#include "message.h"
+#include "nls.h"
+#include "tstring.h"
+#include "codectest.h"
+
+/* Default minimum time (in seconds) to run each benchmark for */
+#define BENCH_MINTIME (0.5)
+
+/* Largest number of iterations to try */
+#define BENCH_MAXITERS (G_GUINT64_CONSTANT(1) << 32)
+
+typedef void (*BenchFunc) (gchar *data, guint index);
+
+typedef struct _Benchmark {
+  const gchar *Name;
+  CodecCorpus Corpus;
+  BenchFunc Func;
+} Benchmark;
+
+typedef struct _BenchResult {
+  guint64 Iterations;
+  gdouble RealNs, CpuNs;        /* Time per iteration */
+} BenchResult;
+
+/* Results are added here, so that the compiler can't optimize the
+ * benchmarked calls away */
+static volatile glong Sink;
+
+static void BenchCopy(gchar *data, guint index)
+{
+  Sink += data[0];
+}
+
+static void BenchProcessMessage(gchar *data, guint index)
+{
+  Player *Other;
+  AICode AI;
+  MsgCode Code;
+  gchar *Data;
+
+  Sink += ProcessMessage(data, CodecPlay, &Other, &AI, &Code, &Data,
+                         FirstClient);
+}
+
+static void BenchGetNextWord(gchar *data, guint index)
+{
+  while (GetNextWord(&data, NULL)) {
+    Sink++;
+  }
+}
+
+static void BenchGetNextPrice(gchar *data, guint index)
+{
+  while (*data) {
+    Sink += (glong)GetNextPrice(&data, (price_t)0);
+  }
+}
+
+static void BenchStrToPrice(gchar *data, guint index)
+{
+  Sink += (glong)strtoprice(data);
+}
+
+static void BenchReceivePlayerData(gchar *data, guint index)
+{
+  ReceivePlayerData(CodecPlay, data, CodecOther);
+  Sink += CodecOther->Health;
+}
+
+static void BenchReceiveFightMessage(gchar *data, guint index)
+{
+  gchar *AttackName, *DefendName, *BitchName, *Message;
+  int DefendHealth, DefendBitches, BitchesKilled, ArmPercent;
+  gboolean CanRunHere, Loot, CanFire;
+  FightPoint fp;
+
+  ReceiveFightMessage(data, &AttackName, &DefendName, &DefendHealth,
+                      &DefendBitches, &BitchName, &BitchesKilled,
+                      &ArmPercent, &fp, &CanRunHere, &Loot, &CanFire,
+                      &Message);
+  Sink += DefendHealth;
+}
+
+static void BenchReceiveDrugsHere(gchar *data, guint index)
+{
+  ReceiveDrugsHere(data, CodecPlay);
+  Sink += (glong)CodecPlay->Drugs[0].Price;
+}
+
+static void BenchReceiveInventory(gchar *data, guint index)
+{
+  ReceiveInventory(data, CodecOther->Guns, CodecOther->Drugs);
+  Sink += CodecOther->Drugs[0].Carried;
+}
+
+static void BenchReceiveInitialData(gchar *data, guint index)
+{
+  ReceiveInitialData(CodecPlay, data);
+  Sink += NumDrug;
+}
+
+static void BenchReceiveMiscData(gchar *data, guint index)
+{
+  ReceiveMiscData(data);
+  Sink += NumDrug;
+}
+
+/* 
+ * Formats some typical messages, as the server does for events and
+ * questions (the corpus is not used).
+ */
+static void BenchHandleTFmt(gchar *data, guint index)
+{
+  gchar *text;
+
+  switch (index % 4) {
+  case 0:
+    text = dpg_strdup_printf(_("YN^Do you pay a doctor %P to sew you up?"),
+                             (price_t)12345);
+    break;
+  case 1:
+    text = dpg_strdup_printf(_("You meet a friend! He gives you %d %tde."),
+                             5, Drug[0].Name);
+    break;
+  case 2:
+    text = dpg_strdup_printf(_("YN^Would you like to visit %tde?"),
+                             Names.LoanSharkName);
+    break;
+  default:
+    text = dpg_strdup_printf(_("Police dogs chase you for %d blocks! "
+                               "You dropped some %tde! That's a drag, man!"),
+                             3, Names.Guns);
+    break;
+  }
+  Sink += text[0];
+  g_free(text);
+}
+
+static const Benchmark Benchmarks[] = {
+  { "BM_Copy", CC_MESSAGE, BenchCopy },
+  { "BM_ProcessMessage", CC_MESSAGE, BenchProcessMessage },
+  { "BM_GetNextWord", CC_UPDATE, BenchGetNextWord },
+  { "BM_GetNextPrice", CC_DRUGHERE, BenchGetNextPrice },
+  { "BM_strtoprice", CC_PRICE, BenchStrToPrice },
+  { "BM_ReceivePlayerData", CC_UPDATE, BenchReceivePlayerData },
+  { "BM_ReceiveFightMessage", CC_FIGHT, BenchReceiveFightMessage },
+  { "BM_ReceiveDrugsHere", CC_DRUGHERE, BenchReceiveDrugsHere },
+  { "BM_ReceiveInventory", CC_INVENTORY, BenchReceiveInventory },
+  { "BM_ReceiveInitialData", CC_INIT, BenchReceiveInitialData },
+  { "BM_ReceiveMiscData", CC_DATA, BenchReceiveMiscData },
+  { "BM_HandleTFmt", CC_MESSAGE, BenchHandleTFmt }
+};
+
+/* 
+ * Runs "bench" for "iters" iterations, cycling through its corpus, and
+ * fills in the time taken.
+ */
+static void RunBenchmark(const Benchmark *bench, guint64 iters,
+                         BenchResult *result)
+{
+  GPtrArray *corpus;
+  gsize *lens, maxlen = 0;
+  gchar *buf, *msg;
+  guint64 i;
+  gint64 start;
+  clock_t cpustart;
+  guint ind;
+
+  corpus = GetCodecCorpus(bench->Corpus);
+  lens = g_new(gsize, corpus->len);
+  for (ind = 0; ind < corpus->len; ind++) {
+    lens[ind] = strlen(g_ptr_array_index(corpus, ind)) + 1;
+    maxlen = MAX(maxlen, lens[ind]);
+  }
+  buf = g_malloc(maxlen);
+
+  start = g_get_monotonic_time();
+  cpustart = clock();
+  for (i = 0, ind = 0; i < iters; i++) {
+    msg = g_ptr_array_index(corpus, ind);
+    memcpy(buf, msg, lens[ind]);
+    bench->Func(buf, (guint)i);
+    if (++ind == corpus->len) {
+      ind = 0;
+    }
+  }
+  result->Iterations = iters;
+  result->RealNs = (g_get_monotonic_time() - start) * 1000.0 / iters;
+  result->CpuNs = (clock() - cpustart) * 1e9 / CLOCKS_PER_SEC / iters;
+
+  g_free(buf);
+  g_free(lens);
+  ResetCodecTests();
+}
+
+/* 
+ * Increases the number of iterations until the benchmark runs for at
+ * least "mintime" seconds.
+ */
+static void TimeBenchmark(const Benchmark *bench, gdouble mintime,
+                          BenchResult *result)
+{
+  guint64 iters = 1;
+  gdouble secs, mult;
+
+  while (TRUE) {
+    RunBenchmark(bench, iters, result);
+    secs = result->RealNs * iters / 1e9;
+    if (secs >= mintime || iters >= BENCH_MAXITERS) {
+      break;
+    }
+    /* Aim a little over the minimum time, but grow by at most 10x */
+    mult = secs > 0.0 ? mintime * 1.4 / secs : 10.0;
+    mult = CLAMP(mult, 2.0, 10.0);
+    iters = (guint64)(iters * mult);
+  }
+}
+
+static void WriteJSONString(FILE *fp, const gchar *str)
+{
+  const guchar *pt;
+
+  fputc('"', fp);
+  for (pt = (const guchar *)str; *pt; pt++) {
+    if (*pt == '"' || *pt == '\\') {
+      fprintf(fp, "\\%c", *pt);
+    } else if (*pt < 0x20) {
+      fprintf(fp, "\\u%04x", *pt);
+    } else {
+      fputc(*pt, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+static gboolean WriteJSON(const gchar *filename, const gchar *progname,
+                          gdouble mintime, const BenchResult *results,
+                          const gboolean *ran)
+{
+  FILE *fp;
+  time_t now;
+  gchar date[64];
+  guint i;
+  gboolean first = TRUE;
+
+  fp = fopen(filename, "w");
+  if (!fp) {
+    return FALSE;
+  }
+  now = time(NULL);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+  fprintf(fp, "{\n  \"context\": {\n    \"date\": ");
+  WriteJSONString(fp, date);
+  fprintf(fp, ",\n    \"host_name\": ");
+  WriteJSONString(fp, g_get_host_name());
+  fprintf(fp, ",\n    \"executable\": ");
+  WriteJSONString(fp, progname);
+  fprintf(fp, ",\n    \"dopewars_version\": ");
+  WriteJSONString(fp, VERSION);
+  fprintf(fp, ",\n    \"min_time\": %g\n  },\n  \"benchmarks\": [", mintime);
+  for (i = 0; i < G_N_ELEMENTS(Benchmarks); i++) {
+    if (!ran[i]) {
+      continue;
+    }
+    fprintf(fp, "%s\n    {\n      \"name\": ", first ? "" : ",");
+    WriteJSONString(fp, Benchmarks[i].Name);
+    fprintf(fp, ",\n      \"run_name\": ");
+    WriteJSONString(fp, Benchmarks[i].Name);
+    fprintf(fp, ",\n      \"run_type\": \"iteration\",\n"
+            "      \"iterations\": %" G_GUINT64_FORMAT ",\n"
+            "      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n"
+            "      \"time_unit\": \"ns\",\n"
+            "      \"items_per_second\": %.1f\n    }",
+            results[i].Iterations, results[i].RealNs, results[i].CpuNs,
+            results[i].RealNs > 0.0 ? 1e9 / results[i].RealNs : 0.0);
+    first = FALSE;
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  return fclose(fp) == 0;
+}
+
+static void Usage(const gchar *progname)
+{
+  fprintf(stderr, "usage: %s [--filter=SUBSTRING] [--min-time=SECONDS] "
+          "[--json=FILE]\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+  BenchResult results[G_N_ELEMENTS(Benchmarks)];
+  gboolean ran[G_N_ELEMENTS(Benchmarks)];
+  gchar *filter = NULL, *json = NULL;
+  gdouble mintime = BENCH_MINTIME;
+  guint i;
+
+  for (i = 1; i < (guint)argc; i++) {
+    if (strncmp(argv[i], "--filter=", 9) == 0) {
+      filter = argv[i] + 9;
+    } else if (strncmp(argv[i], "--min-time=", 11) == 0) {
+      mintime = atof(argv[i] + 11);
+    } else if (strncmp(argv[i], "--json=", 7) == 0) {
+      json = argv[i] + 7;
+    } else {
+      Usage(argv[0]);
+      return 2;
+    }
+  }
+
+  InitCodecTests(argc, argv);
+  printf("%-28s %12s %12s %12s\n", "Benchmark", "Time (ns)", "CPU (ns)",
+         "Iterations");
+  for (i = 0; i < G_N_ELEMENTS(Benchmarks); i++) {
+    ran[i] = (!filter || strstr(Benchmarks[i].Name, filter));
+    if (!ran[i]) {
+      continue;
+    }
+    TimeBenchmark(&Benchmarks[i], mintime, &results[i]);
+    printf("%-28s %12.1f %12.1f %12" G_GUINT64_FORMAT "\n",
+           Benchmarks[i].Name, results[i].RealNs, results[i].CpuNs,
+           results[i].Iterations);
+    fflush(stdout);
+  }
+
+  if (json && !WriteJSON(json, argv[0], mintime, results, ran)) {
+    fprintf(stderr, "Cannot write %s\n", json);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,253 @@
+/************************************************************************
+ * codecfuzz.c    Fuzz harness for the client-side message decoders     *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+/* 
+ * Feeds arbitrary data to the Receive* decoders (and ProcessMessage and
+ * the price parsers), which all handle data straight from the server.
+ * The first byte of each input picks the decoder, and the rest is the
+ * message data.
+ *
+ * Built normally, this runs a fixed number of randomly mutated messages
+ * from the test corpora (see codectest.c) through the decoders, which
+ * is what "make check" does. Built with -DUSE_LIBFUZZER and
+ * -fsanitize=fuzzer, LLVMFuzzerTestOneInput is driven by libFuzzer
+ * instead, e.g.
+ *   make -C src codecfuzz CPPFLAGS=-DUSE_LIBFUZZER \
+ *        CFLAGS="-g -fsanitize=fuzzer,address" CC=clang
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "codectest.h"
+
+/* Number of inputs given to each decoder by default */
+#define FUZZ_RUNS   (20000)
+
+/* Largest input that is generated */
+#define FUZZ_MAXLEN (4096)
+
+static guint64 Runs[CC_NUM];
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const guint8 *data, size_t size);
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+  InitCodecTests(*argc, *argv);
+  return 0;
+}
+
+int LLVMFuzzerTestOneInput(const guint8 *data, size_t size)
+{
+  CodecCorpus corpus;
+  gchar *text;
+
+  if (size < 1) {
+    return 0;
+  }
+  corpus = data[0] % CC_NUM;
+  /* The decoders work on nul-terminated text, which they may modify */
+  text = g_malloc(size);
+  memcpy(text, data + 1, size - 1);
+  text[size - 1] = '\0';
+  DecodeCodecInput(corpus, text);
+  g_free(text);
+  ResetCodecTests();
+  Runs[corpus]++;
+  return 0;
+}
+
+#ifndef USE_LIBFUZZER
+
+/* Characters that are most likely to confuse the decoders */
+static const gchar Interesting[] = "^=*-.,0123456789KkMm\n\377";
+
+/* 
+ * Makes a random change to the "len" bytes of message in "buf" (which
+ * has room for FUZZ_MAXLEN bytes), and returns the new length.
+ */
+static gsize Mutate(GRand *rand, guint8 *buf, gsize len)
+{
+  gsize pos, n;
+
+  pos = len ? g_rand_int_range(rand, 0, len) : 0;
+  switch (g_rand_int_range(rand, 0, 7)) {
+  case 0:                      /* Flip a bit */
+    if (len) {
+      buf[pos] ^= 1 << g_rand_int_range(rand, 0, 8);
+    }
+    break;
+  case 1:                      /* Replace a byte */
+    if (len) {
+      buf[pos] = Interesting[g_rand_int_range(rand, 0,
+                                              sizeof(Interesting) - 1)];
+    }
+    break;
+  case 2:                      /* Insert a byte */
+    if (len < FUZZ_MAXLEN) {
+      memmove(&buf[pos + 1], &buf[pos], len - pos);
+      buf[pos] = Interesting[g_rand_int_range(rand, 0,
+                                              sizeof(Interesting) - 1)];
+      len++;
+    }
+    break;
+  case 3:                      /* Delete some bytes */
+    n = MIN(len - pos, (gsize)g_rand_int_range(rand, 1, 16));
+    memmove(&buf[pos], &buf[pos + n], len - pos - n);
+    len -= n;
+    break;
+  case 4:                      /* Truncate */
+    len = pos;
+    break;
+  case 5:                      /* Insert a huge number */
+    n = MIN((gsize)40, FUZZ_MAXLEN - len);
+    memmove(&buf[pos + n], &buf[pos], len - pos);
+    memset(&buf[pos], '9', n);
+    len += n;
+    break;
+  default:                     /* Duplicate a chunk */
+    n = MIN(len - pos, FUZZ_MAXLEN - len);
+    n = MIN(n, (gsize)g_rand_int_range(rand, 1, 64));
+    memmove(&buf[pos + n], &buf[pos], len - pos);
+    len += n;
+    break;
+  }
+  return len;
+}
+
+/* 
+ * Runs each file named on the command line through the decoders, as
+ * libFuzzer would, so that crashing inputs can be reproduced.
+ */
+static gboolean RunFiles(int argc, char *argv[], int first)
+{
+  gchar *contents;
+  gsize len;
+  int i;
+
+  for (i = first; i < argc; i++) {
+    if (!g_file_get_contents(argv[i], &contents, &len, NULL)) {
+      fprintf(stderr, "Cannot read %s\n", argv[i]);
+      return FALSE;
+    }
+    LLVMFuzzerTestOneInput((const guint8 *)contents, len);
+    g_free(contents);
+  }
+  return TRUE;
+}
+
+static gboolean WriteJSON(const gchar *filename, guint32 seed, gint runs,
+                          gdouble seconds)
+{
+  FILE *fp;
+  int i;
+
+  fp = fopen(filename, "w");
+  if (!fp) {
+    return FALSE;
+  }
+  fprintf(fp, "{\n  \"seed\": %u,\n  \"runs_per_decoder\": %d,\n"
+          "  \"seconds\": %.3f,\n  \"decoders\": [\n", seed, runs, seconds);
+  for (i = 0; i < CC_NUM; i++) {
+    fprintf(fp, "    {\"name\": \"%s\", \"runs\": %" G_GUINT64_FORMAT "}%s\n",
+            GetCodecCorpusName(i), Runs[i], i == CC_NUM - 1 ? "" : ",");
+  }
+  fprintf(fp, "  ]\n}\n");
+  return fclose(fp) == 0;
+}
+
+static void Usage(const gchar *progname)
+{
+  fprintf(stderr, "usage: %s [--runs=N] [--seed=N] [--json=FILE] "
+          "[input files...]\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+  guint8 buf[FUZZ_MAXLEN + 1];
+  GPtrArray *corpus;
+  const gchar *seedmsg;
+  gchar *json = NULL;
+  GTimer *timer;
+  GRand *rand;
+  guint32 seed = 1998;
+  gint runs = FUZZ_RUNS, i, c, nmut;
+  gsize len;
+
+  for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+    if (strncmp(argv[i], "--runs=", 7) == 0) {
+      runs = atoi(argv[i] + 7);
+    } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+      seed = (guint32)strtoul(argv[i] + 7, NULL, 10);
+    } else if (strncmp(argv[i], "--json=", 7) == 0) {
+      json = argv[i] + 7;
+    } else {
+      Usage(argv[0]);
+      return 2;
+    }
+  }
+
+  LLVMFuzzerInitialize(&argc, &argv);
+  if (i < argc) {
+    return RunFiles(argc, argv, i) ? 0 : 1;
+  }
+
+  rand = g_rand_new_with_seed(seed);
+  timer = g_timer_new();
+  for (c = 0; c < CC_NUM; c++) {
+    corpus = GetCodecCorpus(c);
+    for (i = 0; i < runs; i++) {
+      /* Start from a valid message, and make a few changes to it */
+      seedmsg = g_ptr_array_index(corpus, i % corpus->len);
+      buf[0] = c;
+      len = MIN(strlen(seedmsg), FUZZ_MAXLEN - 1);
+      memcpy(&buf[1], seedmsg, len);
+      len++;
+      nmut = g_rand_int_range(rand, 0, 8);
+      while (nmut-- > 0) {
+        len = Mutate(rand, &buf[1], len - 1) + 1;
+      }
+      LLVMFuzzerTestOneInput(buf, len);
+    }
+  }
+  g_timer_stop(timer);
+
+  printf("Decoded %d mutated messages for each of %d decoders "
+         "(seed %u) in %.2f s\n", runs, CC_NUM, seed,
+         g_timer_elapsed(timer, NULL));
+  if (json && !WriteJSON(json, seed, runs, g_timer_elapsed(timer, NULL))) {
+    fprintf(stderr, "Cannot write %s\n", json);
+    return 1;
+  }
+  g_timer_destroy(timer);
+  g_rand_free(rand);
+  return 0;
+}
+
+#endif /* USE_LIBFUZZER */
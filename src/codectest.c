@@ -0,0 +1,446 @@
+/************************************************************************
+ * codectest.c    Shared set-up for the message codec tests/benchmarks  *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+
+#include "dopewars.h"
+#include "message.h"
+#include "serverside.h"
+#include "codectest.h"
+
+/* 
+ * The corpora are built from the default configuration, in the same
+ * formats that the server uses (see SendSpyReport, SendPlayerDelta,
+ * SendFightMessage and so on), with a fixed random seed so that every
+ * run decodes exactly the same messages.
+ */
+#define CORPUS_SEED  (1998)
+#define CORPUS_SIZE  (64)
+
+Player *CodecPlay = NULL, *CodecOther = NULL;
+
+static GPtrArray *Corpus[CC_NUM];
+static int OrigNumLocation, OrigNumGun, OrigNumDrug;
+
+static const gchar *CorpusName[CC_NUM] = {
+  "message", "update", "fight", "drughere", "inventory", "init", "data",
+  "abilities", "price"
+};
+
+/* 
+ * Loads the built-in default configuration, and sets up two players in a
+ * client-side game for the decoders to work on. Only the program name
+ * from "argv" is used; the caller handles any other arguments.
+ */
+void InitCodecTests(int argc, char *argv[])
+{
+  struct CMDLINE *cmdline;
+
+  cmdline = GeneralStartup(argc > 0 ? 1 : 0, argv);
+  /* Ignore /etc/dopewars and ~/.dopewars, so that results don't depend
+   * on who runs the tests */
+  cmdline->noconfig = TRUE;
+  InitConfiguration(cmdline);
+  FreeCmdLine(cmdline);
+  CloseHighScoreFile();
+
+  Client = TRUE;
+  Server = Network = FALSE;
+  CodecPlay = g_new(Player, 1);
+  FirstClient = AddPlayer(0, CodecPlay, FirstClient);
+  SetPlayerName(CodecPlay, "Dealer");
+  CodecOther = g_new(Player, 1);
+  FirstClient = AddPlayer(0, CodecOther, FirstClient);
+  SetPlayerName(CodecOther, "Rival");
+
+  OrigNumLocation = NumLocation;
+  OrigNumGun = NumGun;
+  OrigNumDrug = NumDrug;
+  ResetCodecTests();
+}
+
+/* 
+ * Undoes any changes the decoders made to the game that would affect
+ * later inputs (the number of locations, guns and drugs, and the
+ * players' IDs).
+ */
+void ResetCodecTests(void)
+{
+  GSList *list;
+
+  if (NumLocation != OrigNumLocation || NumGun != OrigNumGun
+      || NumDrug != OrigNumDrug) {
+    ResizeLocations(OrigNumLocation);
+    ResizeGuns(OrigNumGun);
+    ResizeDrugs(OrigNumDrug);
+    for (list = FirstClient; list; list = g_slist_next(list)) {
+      UpdatePlayer((Player *)list->data);
+    }
+  }
+  CodecPlay->ID = 1;
+  CodecOther->ID = 2;
+}
+
+static void AppendPrice(GString *text, GRand *rand, gint32 max)
+{
+  gchar buf[PRICE_BUFLEN];
+
+  g_string_append(text, PriceToBuf((price_t)g_rand_int_range(rand, 0, max),
+                                   buf));
+  g_string_append_c(text, '^');
+}
+
+/* 
+ * Formats a full C_UPDATE, as sent by SendSpyReport.
+ */
+static void MakeFullUpdate(GString *text, GRand *rand)
+{
+  int i;
+
+  g_string_printf(text, "%d^%d^%d^%d^%d^%d^%d^%d^",
+                  g_rand_int_range(rand, 0, 5000000),
+                  g_rand_int_range(rand, 0, 100000),
+                  g_rand_int_range(rand, 0, 2000000),
+                  g_rand_int_range(rand, 1, 101),
+                  g_rand_int_range(rand, 0, 300),
+                  g_rand_int_range(rand, 0, NumLocation),
+                  g_rand_int_range(rand, 1, 32), 0);
+  g_string_append_printf(text, "%d^%d^%d^", g_rand_int_range(rand, 1, 29),
+                         g_rand_int_range(rand, 1, 13), 1984);
+  for (i = 0; i < NumGun; i++) {
+    g_string_append_printf(text, "%d^", g_rand_int_range(rand, 0, 3));
+  }
+  for (i = 0; i < NumDrug; i++) {
+    g_string_append_printf(text, "%d^", g_rand_int_range(rand, 0, 120));
+  }
+  for (i = 0; i < NumDrug; i++) {
+    AppendPrice(text, rand, 1000000);
+  }
+  g_string_append_printf(text, "%d", g_rand_int_range(rand, 0, 20));
+}
+
+/* 
+ * Formats a delta C_UPDATE, as sent by SendPlayerDelta after a typical
+ * trade or jet.
+ */
+static void MakeDeltaUpdate(GString *text, GRand *rand)
+{
+  int drug = g_rand_int_range(rand, 0, NumDrug);
+
+  g_string_printf(text, "*c=%d^s=%d^r%d=%d^v%d=%d",
+                  g_rand_int_range(rand, 0, 5000000),
+                  g_rand_int_range(rand, 0, 300),
+                  drug, g_rand_int_range(rand, 0, 120),
+                  drug, g_rand_int_range(rand, 0, 1000000));
+  if (g_rand_boolean(rand)) {
+    g_string_append_printf(text, "^l=%d^t=%d^D=%d",
+                           g_rand_int_range(rand, 0, NumLocation),
+                           g_rand_int_range(rand, 1, 32),
+                           g_rand_int_range(rand, 1, 29));
+  }
+}
+
+/* 
+ * Formats C_FIGHTPRINT data, as sent by SendFightMessage.
+ */
+static void MakeFight(GString *text, GRand *rand)
+{
+  static const gchar fps[] = {
+    F_ARRIVED, F_STAND, F_HIT, F_MISS, F_RELOAD, F_LEAVE, F_FAILFLEE
+  };
+  gboolean cop = g_rand_boolean(rand);
+  int bitches = g_rand_int_range(rand, 0, 12);
+
+  g_string_printf(text, "%s^%s^%d^%d^%s^%d^%d^%c%c%c%c^%s",
+                  cop ? Cop[0].Name : "Rival", "",
+                  g_rand_int_range(rand, 0, 101), bitches,
+                  bitches == 1 ? Names.Bitch : Names.Bitches,
+                  g_rand_int_range(rand, 0, 2),
+                  g_rand_int_range(rand, 0, 101),
+                  fps[g_rand_int_range(rand, 0, G_N_ELEMENTS(fps))],
+                  g_rand_boolean(rand) ? '1' : '0',
+                  g_rand_boolean(rand) ? '1' : '0',
+                  g_rand_boolean(rand) ? '1' : '0',
+                  cop ? "Officer Hardass fires and hits you!"
+                  : "Rival shoots at you... and misses!");
+}
+
+static void MakeDrugsHere(GString *text, GRand *rand)
+{
+  int i;
+
+  g_string_truncate(text, 0);
+  for (i = 0; i < NumDrug; i++) {
+    if (g_rand_int_range(rand, 0, 4) == 0) {
+      g_string_append(text, "0^");      /* Not on sale here */
+    } else {
+      AppendPrice(text, rand, 30000);
+    }
+  }
+}
+
+static void MakeInventory(GString *text, GRand *rand)
+{
+  int i;
+
+  g_string_truncate(text, 0);
+  for (i = 0; i < NumGun + NumDrug; i++) {
+    g_string_append_printf(text, "%d^", g_rand_int_range(rand, 0, 120));
+  }
+}
+
+/* 
+ * Formats C_INIT data, as sent by SendInitialData to a client with
+ * A_DATE and A_PLAYERID.
+ */
+static void MakeInit(GString *text, GRand *rand)
+{
+  g_string_printf(text, "%s^%d^%d^%d^%s^%s^%s^%s^%s^%s^%s^%d^%s^%s^%s^%s^"
+                  "%c%s^", VERSION, NumLocation, NumGun, NumDrug,
+                  Names.Bitch, Names.Bitches, Names.Gun, Names.Guns,
+                  Names.Drug, Names.Drugs, Names.Date,
+                  g_rand_int_range(rand, 1, 50), Names.LoanSharkName,
+                  Names.BankName, Names.GunShopName, Names.RoughPubName,
+                  Currency.Prefix ? '1' : '0', Currency.Symbol);
+}
+
+/* 
+ * Formats C_DATA data (one ruleset entry), as built by GetRuleset.
+ */
+static void MakeData(GString *text, GRand *rand)
+{
+  gchar buf[2][PRICE_BUFLEN];
+  int i;
+
+  switch (g_rand_int_range(rand, 0, 4)) {
+  case 0:
+    i = g_rand_int_range(rand, 0, NumGun);
+    g_string_printf(text, "%d^%c%s^%s^%d^%d^", i, DT_GUN, Gun[i].Name,
+                    PriceToBuf(Gun[i].Price, buf[0]), Gun[i].Space,
+                    Gun[i].Damage);
+    break;
+  case 1:
+    i = g_rand_int_range(rand, 0, NumDrug);
+    g_string_printf(text, "%d^%c%s^%s^%s^", i, DT_DRUG, Drug[i].Name,
+                    PriceToBuf(Drug[i].MinPrice, buf[0]),
+                    PriceToBuf(Drug[i].MaxPrice, buf[1]));
+    break;
+  case 2:
+    i = g_rand_int_range(rand, 0, NumLocation);
+    g_string_printf(text, "%d^%c%s^", i, DT_LOCATION, Location[i].Name);
+    break;
+  default:
+    g_string_printf(text, "0^%c%s^%s^", DT_PRICES,
+                    PriceToBuf(Prices.Spy, buf[0]),
+                    PriceToBuf(Prices.Tipoff, buf[1]));
+    break;
+  }
+}
+
+static void MakeAbilities(GString *text, GRand *rand)
+{
+  int i;
+
+  g_string_truncate(text, 0);
+  for (i = 0; i < A_NUM; i++) {
+    g_string_append_c(text, g_rand_int_range(rand, 0, 4) ? '1' : '0');
+  }
+  if (g_rand_boolean(rand)) {
+    g_string_append(text, "^2fd4e1c67a2d28fced849ee1bb76e7391b93eb12");
+  }
+}
+
+static void MakePrice(GString *text, GRand *rand)
+{
+  gchar buf[PRICE_BUFLEN];
+  price_t price;
+
+  price = (price_t)g_rand_int_range(rand, 0, G_MAXINT32);
+  if (g_rand_int_range(rand, 0, 4) == 0) {
+    price = -price;
+  } else if (sizeof(price_t) > 4 && g_rand_int_range(rand, 0, 4) == 0) {
+    price *= 1000;              /* Needs more than 32 bits */
+  }
+  g_string_assign(text, PriceToBuf(price, buf));
+}
+
+/* 
+ * Formats a complete message, as read from the server by a client with
+ * A_PLAYERID.
+ */
+static void MakeMessage(GString *text, GRand *rand)
+{
+  GString *data = g_string_new("");
+  MsgCode code;
+
+  switch (g_rand_int_range(rand, 0, 4)) {
+  case 0:
+    MakeFullUpdate(data, rand);
+    code = C_UPDATE;
+    break;
+  case 1:
+    MakeDeltaUpdate(data, rand);
+    code = C_UPDATE;
+    break;
+  case 2:
+    MakeDrugsHere(data, rand);
+    code = C_DRUGHERE;
+    break;
+  default:
+    MakeFight(data, rand);
+    code = C_FIGHTPRINT;
+    break;
+  }
+  g_string_printf(text, "%s^%c%c%s",
+                  g_rand_boolean(rand) ? "" : "2", C_NONE, code, data->str);
+  g_string_free(data, TRUE);
+}
+
+/* 
+ * Returns the test messages of the given kind. The strings must not be
+ * modified; copy them before decoding.
+ */
+GPtrArray *GetCodecCorpus(CodecCorpus corpus)
+{
+  GRand *rand;
+  GString *text;
+  int i;
+
+  if (Corpus[corpus]) {
+    return Corpus[corpus];
+  }
+  rand = g_rand_new_with_seed(CORPUS_SEED + corpus);
+  text = g_string_new("");
+  Corpus[corpus] = g_ptr_array_new();
+  for (i = 0; i < CORPUS_SIZE; i++) {
+    switch (corpus) {
+    case CC_MESSAGE:
+      MakeMessage(text, rand);
+      break;
+    case CC_UPDATE:
+      if (i % 4 == 0) {
+        MakeFullUpdate(text, rand);
+      } else {
+        MakeDeltaUpdate(text, rand);
+      }
+      break;
+    case CC_FIGHT:
+      MakeFight(text, rand);
+      break;
+    case CC_DRUGHERE:
+      MakeDrugsHere(text, rand);
+      break;
+    case CC_INVENTORY:
+      MakeInventory(text, rand);
+      break;
+    case CC_INIT:
+      MakeInit(text, rand);
+      break;
+    case CC_DATA:
+      MakeData(text, rand);
+      break;
+    case CC_ABILITIES:
+      MakeAbilities(text, rand);
+      break;
+    case CC_PRICE:
+    case CC_NUM:
+      MakePrice(text, rand);
+      break;
+    }
+    g_ptr_array_add(Corpus[corpus], g_strdup(text->str));
+  }
+  g_string_free(text, TRUE);
+  g_rand_free(rand);
+  return Corpus[corpus];
+}
+
+const gchar *GetCodecCorpusName(CodecCorpus corpus)
+{
+  return CorpusName[corpus];
+}
+
+/* 
+ * Passes "data" (which may be modified) to the client-side decoder for
+ * messages of the given kind.
+ */
+void DecodeCodecInput(CodecCorpus corpus, gchar *data)
+{
+  gchar *AttackName, *DefendName, *BitchName, *Message, *pt;
+  int DefendHealth, DefendBitches, BitchesKilled, ArmPercent;
+  gboolean CanRunHere, Loot, CanFire;
+  FightPoint fp;
+  Player *Other, scratch;
+  AICode AI;
+  MsgCode Code;
+
+  switch (corpus) {
+  case CC_MESSAGE:
+    if (ProcessMessage(data, CodecPlay, &Other, &AI, &Code, &pt,
+                       FirstClient) == 0 && Code == C_UPDATE) {
+      ReceivePlayerData(CodecPlay, pt, Other == &Noone ? CodecPlay : Other);
+    }
+    break;
+  case CC_UPDATE:
+    ReceivePlayerData(CodecPlay, data, CodecOther);
+    break;
+  case CC_FIGHT:
+    ReceiveFightMessage(data, &AttackName, &DefendName, &DefendHealth,
+                        &DefendBitches, &BitchName, &BitchesKilled,
+                        &ArmPercent, &fp, &CanRunHere, &Loot, &CanFire,
+                        &Message);
+    break;
+  case CC_DRUGHERE:
+    ReceiveDrugsHere(data, CodecPlay);
+    break;
+  case CC_INVENTORY:
+    ReceiveInventory(data, CodecOther->Guns, CodecOther->Drugs);
+    break;
+  case CC_INIT:
+    ReceiveInitialData(CodecPlay, data);
+    break;
+  case CC_DATA:
+    ReceiveMiscData(data);
+    break;
+  case CC_ABILITIES:
+    /* Abilities are only read from the network, and would replace the
+     * ones the other decoders rely on, so use a throwaway player */
+    memset(&scratch, 0, sizeof(scratch));
+    Network = TRUE;
+    ReceiveAbilities(&scratch, data);
+    Network = FALSE;
+    g_free(scratch.RulesetHash);
+    break;
+  case CC_PRICE:
+  case CC_NUM:
+    strtoprice(data);
+    pt = data;
+    while (*pt) {
+      GetNextPrice(&pt, (price_t)0);
+    }
+    break;
+  }
+}
@@ -0,0 +1,58 @@
+/************************************************************************
+ * codectest.h    Shared set-up for the message codec tests/benchmarks  *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifndef __DP_CODECTEST_H__
+#define __DP_CODECTEST_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include "dopewars.h"
+
+/* The kinds of message data in the test corpora */
+typedef enum {
+  CC_MESSAGE,                   /* Complete messages, as read from the
+                                 * network (for ProcessMessage) */
+  CC_UPDATE,                    /* C_UPDATE data, full and delta */
+  CC_FIGHT,                     /* C_FIGHTPRINT data */
+  CC_DRUGHERE,                  /* C_DRUGHERE data */
+  CC_INVENTORY,                 /* Inventories, e.g. from C_SPYON */
+  CC_INIT,                      /* C_INIT data */
+  CC_DATA,                      /* C_DATA (ruleset) data */
+  CC_ABILITIES,                 /* C_ABILITIES data */
+  CC_PRICE,                     /* Single prices */
+  CC_NUM
+} CodecCorpus;
+
+/* The client-side player that decoded messages are for, and another
+ * player in the same game */
+extern Player *CodecPlay, *CodecOther;
+
+void InitCodecTests(int argc, char *argv[]);
+void ResetCodecTests(void);
+GPtrArray *GetCodecCorpus(CodecCorpus corpus);
+const gchar *GetCodecCorpusName(CodecCorpus corpus);
+void DecodeCodecInput(CodecCorpus corpus, gchar *data);
+
+#endif /* __DP_CODECTEST_H__ */
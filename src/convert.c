@@ -24,6 +24,7 @@
 # include <config.h>
 #endif
 
+#include <errno.h>
 #include <string.h>
 #include <glib.h>
 
@@ -31,6 +32,25 @@
 
 static gchar *int_codeset = NULL;
 
+/* Bumped whenever the internal codeset changes, so that converters know
+ * to reopen their iconv handles */
+static guint int_serial = 0;
+
+/*
+ * iconv handles for converting between one external codeset and the
+ * internal codeset. These are opened once and shared by all converters
+ * for the same pair of codesets (e.g. every UTF-8 client on a server).
+ */
+struct _ConvHandles {
+  gchar *key;
+  GIConv to_int, to_ext;
+  gboolean ascii_safe;          /* TRUE if ASCII text is the same in both */
+  gboolean ext_utf8, int_utf8;
+  guint refcount;
+};
+
+static GHashTable *handle_cache = NULL;
+
 static const gchar *FixedCodeset(const gchar *codeset)
 {
   if (strcmp(codeset, "ANSI_X3.4-1968") == 0
@@ -45,6 +65,7 @@ void Conv_SetInternalCodeset(const gchar *codeset)
 {
   g_free(int_codeset);
   int_codeset = g_strdup(FixedCodeset(codeset));
+  int_serial++;
 }
 
 static const gchar *GetLocaleCodeset(void)
@@ -55,12 +76,86 @@ static const gchar *GetLocaleCodeset(void)
   return FixedCodeset(codeset);
 }
 
+/*
+ * Returns TRUE if plain 7-bit ASCII text is encoded identically in
+ * the given codeset.
+ */
+static gboolean IsAsciiSafe(const gchar *codeset)
+{
+  return (g_ascii_strcasecmp(codeset, "UTF-8") == 0
+          || g_ascii_strncasecmp(codeset, "ISO-8859-", 9) == 0
+          || g_ascii_strncasecmp(codeset, "ISO8859-", 8) == 0
+          || g_ascii_strncasecmp(codeset, "CP125", 5) == 0
+          || g_ascii_strncasecmp(codeset, "WINDOWS-125", 11) == 0
+          || g_ascii_strncasecmp(codeset, "KOI8-", 5) == 0);
+}
+
+static void ReleaseHandles(Converter *conv)
+{
+  ConvHandles *h = conv->handles;
+
+  conv->handles = NULL;
+  if (!h || --h->refcount > 0) {
+    return;
+  }
+  g_hash_table_remove(handle_cache, h->key);
+  if (h->to_int != (GIConv)-1) {
+    g_iconv_close(h->to_int);
+  }
+  if (h->to_ext != (GIConv)-1) {
+    g_iconv_close(h->to_ext);
+  }
+  g_free(h->key);
+  g_free(h);
+}
+
+/*
+ * Returns the (possibly shared) iconv handles for the given converter,
+ * opening them if necessary.
+ */
+static ConvHandles *GetHandles(Converter *conv)
+{
+  ConvHandles *h;
+  gchar *key;
+
+  if (conv->handles && conv->int_serial == int_serial) {
+    return conv->handles;
+  }
+  ReleaseHandles(conv);
+
+  if (!handle_cache) {
+    handle_cache = g_hash_table_new(g_str_hash, g_str_equal);
+  }
+  key = g_strdup_printf("%s\n%s", conv->ext_codeset, int_codeset);
+  h = g_hash_table_lookup(handle_cache, key);
+  if (h) {
+    g_free(key);
+  } else {
+    h = g_new(ConvHandles, 1);
+    h->key = key;
+    h->to_int = g_iconv_open(int_codeset, conv->ext_codeset);
+    h->to_ext = g_iconv_open(conv->ext_codeset, int_codeset);
+    h->ascii_safe = IsAsciiSafe(conv->ext_codeset)
+                    && IsAsciiSafe(int_codeset);
+    h->ext_utf8 = (strcmp(conv->ext_codeset, "UTF-8") == 0);
+    h->int_utf8 = (strcmp(int_codeset, "UTF-8") == 0);
+    h->refcount = 0;
+    g_hash_table_insert(handle_cache, h->key, h);
+  }
+  h->refcount++;
+  conv->handles = h;
+  conv->int_serial = int_serial;
+  return h;
+}
+
 Converter *Conv_New(void)
 {
   Converter *conv;
 
   conv = g_new(Converter, 1);
   conv->ext_codeset = g_strdup(GetLocaleCodeset());
+  conv->handles = NULL;
+  conv->int_serial = 0;
   if (!int_codeset) {
     int_codeset = g_strdup(GetLocaleCodeset());
   }
@@ -69,14 +164,20 @@ Converter *Conv_New(void)
 
 void Conv_Free(Converter *conv)
 {
+  ReleaseHandles(conv);
   g_free(conv->ext_codeset);
   g_free(conv);
 }
 
 void Conv_SetCodeset(Converter *conv, const gchar *codeset)
 {
+  codeset = FixedCodeset(codeset);
+  if (strcmp(conv->ext_codeset, codeset) == 0) {
+    return;
+  }
+  ReleaseHandles(conv);
   g_free(conv->ext_codeset);
-  conv->ext_codeset = g_strdup(FixedCodeset(codeset));
+  conv->ext_codeset = g_strdup(codeset);
 }
 
 gboolean Conv_Needed(Converter *conv)
@@ -85,43 +186,167 @@ gboolean Conv_Needed(Converter *conv)
           || strcmp(int_codeset, "UTF-8") == 0);
 }
 
-static gchar *do_convert(const gchar *from_codeset, const gchar *to_codeset,
-                         const gchar *from_str, int from_len)
+static gboolean IsAscii(const gchar *str, int len)
 {
-  gchar *to_str;
+  int i;
 
-  if (strcmp(to_codeset, "UTF-8") == 0 && strcmp(from_codeset, "UTF-8") == 0) {
-    const gchar *start, *end;
+  for (i = 0; i < len; i++) {
+    if (str[i] & 0x80) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
 
-    if (from_len == -1) {
-      to_str = g_strdup(from_str);
-    } else {
-      to_str = g_strndup(from_str, from_len);
+/*
+ * Returns TRUE if the given string (of length "len", or nul-terminated
+ * if len is -1) would come out of a conversion by "conv" in either
+ * direction unchanged, so that callers can skip the conversion (and
+ * the copy) entirely.
+ */
+gboolean Conv_IsVerbatim(Converter *conv, const gchar *str, int len)
+{
+  ConvHandles *h;
+
+  if (len == -1) {
+    len = strlen(str);
+  }
+  h = GetHandles(conv);
+  if (h->ext_utf8 && h->int_utf8) {
+    return g_utf8_validate(str, len, NULL);
+  } else if (!Conv_Needed(conv)) {
+    return TRUE;
+  } else {
+    return h->ascii_safe && IsAscii(str, len);
+  }
+}
+
+/*
+ * Copies UTF-8 text to the end of "buf", replacing any invalid bytes
+ * with '?'.
+ */
+static void CopyValidUtf8(const gchar *from_str, int from_len, GString *buf)
+{
+  const gchar *end;
+
+  while (from_len > 0) {
+    if (g_utf8_validate(from_str, from_len, &end)) {
+      g_string_append_len(buf, from_str, from_len);
+      return;
     }
-    start = to_str;
-    while (start && *start && !g_utf8_validate(start, -1, &end)
-	   && end && *end) {
-      *((gchar *)end) = '?';
-      start = ++end;
+    g_string_append_len(buf, from_str, end - from_str);
+    g_string_append_c(buf, '?');
+    from_len -= end - from_str + 1;
+    from_str = end + 1;
+  }
+}
+
+/*
+ * Converts text with the iconv handle "cd" and appends it to "buf".
+ * Unconvertable characters are replaced with '?'.
+ */
+static void IconvAppend(GIConv cd, gboolean from_utf8,
+                        const gchar *from_str, int from_len, GString *buf)
+{
+  gchar *inbuf, *outbuf;
+  gsize inleft, outleft, used;
+
+  g_iconv(cd, NULL, NULL, NULL, NULL);
+  inbuf = (gchar *)from_str;
+  inleft = from_len;
+  used = buf->len;
+  g_string_set_size(buf, used + inleft + 16);
+
+  while (TRUE) {
+    outbuf = buf->str + used;
+    outleft = buf->len - used;
+    if (inleft > 0) {
+      if (g_iconv(cd, &inbuf, &inleft, &outbuf, &outleft) != (gsize)-1) {
+        used = outbuf - buf->str;
+        continue;
+      }
+    } else if (g_iconv(cd, NULL, NULL, &outbuf, &outleft) != (gsize)-1) {
+      used = outbuf - buf->str;
+      break;
     }
-    return to_str;
-  } else {
-    to_str = g_convert_with_fallback(from_str, from_len, to_codeset,
-                                     from_codeset, "?", NULL, NULL, NULL);
-    if (to_str) {
-      return to_str;
+    used = outbuf - buf->str;
+    if (errno == E2BIG || outleft == 0) {
+      g_string_set_size(buf, buf->len + inleft + 16);
+    } else if (errno == EILSEQ && inleft > 0) {
+      gsize skip = 1;
+
+      if (from_utf8 && g_utf8_get_char_validated(inbuf, inleft)
+                       < (gunichar)-2) {
+        skip = g_utf8_skip[*(guchar *)inbuf];
+      }
+      buf->str[used++] = '?';
+      inbuf += MIN(skip, inleft);
+      inleft -= MIN(skip, inleft);
+    } else if (inleft > 0) {
+      /* Incomplete character at the end of the input, or some other
+       * error; mark it and just flush what we have */
+      buf->str[used++] = '?';
+      inleft = 0;
     } else {
-      return g_strdup("[?]");
+      break;
     }
   }
+  g_string_truncate(buf, used);
+}
+
+static void do_convert(ConvHandles *h, gboolean to_int,
+                       const gchar *from_str, int from_len, GString *buf)
+{
+  gboolean from_utf8, to_utf8;
+  GIConv cd;
+
+  if (from_len == -1) {
+    from_len = strlen(from_str);
+  }
+  from_utf8 = to_int ? h->ext_utf8 : h->int_utf8;
+  to_utf8 = to_int ? h->int_utf8 : h->ext_utf8;
+  cd = to_int ? h->to_int : h->to_ext;
+
+  if (from_utf8 && to_utf8) {
+    CopyValidUtf8(from_str, from_len, buf);
+  } else if (h->ascii_safe && IsAscii(from_str, from_len)) {
+    g_string_append_len(buf, from_str, from_len);
+  } else if (cd == (GIConv)-1) {
+    g_string_append(buf, "[?]");
+  } else {
+    IconvAppend(cd, from_utf8, from_str, from_len, buf);
+  }
+}
+
+/*
+ * Converts a string in the internal codeset to the converter's external
+ * codeset, appending the result to "buf". This lets callers reuse the
+ * same buffer for every message rather than allocating a new string.
+ */
+void Conv_ToExternalBuf(Converter *conv, const gchar *int_str, int len,
+                        GString *buf)
+{
+  do_convert(GetHandles(conv), FALSE, int_str, len, buf);
+}
+
+void Conv_ToInternalBuf(Converter *conv, const gchar *ext_str, int len,
+                        GString *buf)
+{
+  do_convert(GetHandles(conv), TRUE, ext_str, len, buf);
 }
 
 gchar *Conv_ToExternal(Converter *conv, const gchar *int_str, int len)
 {
-  return do_convert(int_codeset, conv->ext_codeset, int_str, len);
+  GString *buf = g_string_new("");
+
+  Conv_ToExternalBuf(conv, int_str, len, buf);
+  return g_string_free(buf, FALSE);
 }
 
 gchar *Conv_ToInternal(Converter *conv, const gchar *ext_str, int len)
 {
-  return do_convert(conv->ext_codeset, int_codeset, ext_str, len);
+  GString *buf = g_string_new("");
+
+  Conv_ToInternalBuf(conv, ext_str, len, buf);
+  return g_string_free(buf, FALSE);
 }
@@ -29,17 +29,27 @@
 
 #include <glib.h>
 
+typedef struct _ConvHandles ConvHandles;
+
 typedef struct _Converter Converter;
 struct _Converter {
   gchar *ext_codeset;
+  ConvHandles *handles;         /* iconv handles, shared with any other
+                                 * converters for the same codesets */
+  guint int_serial;             /* Internal codeset the handles are for */
 };
 
 void Conv_SetInternalCodeset(const gchar *codeset);
 Converter *Conv_New(void);
 void Conv_SetCodeset(Converter *conv, const gchar *codeset);
 gboolean Conv_Needed(Converter *conv);
+gboolean Conv_IsVerbatim(Converter *conv, const gchar *str, int len);
 gchar *Conv_ToExternal(Converter *conv, const gchar *int_str, int len);
 gchar *Conv_ToInternal(Converter *conv, const gchar *ext_str, int len);
+void Conv_ToExternalBuf(Converter *conv, const gchar *int_str, int len,
+                        GString *buf);
+void Conv_ToInternalBuf(Converter *conv, const gchar *ext_str, int len,
+                        GString *buf);
 void Conv_Free(Converter *conv);
 
 #endif /* __DP_CONVERT_H__ */
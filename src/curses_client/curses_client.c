@@ -41,6 +41,7 @@
 #include "dopewars.h"
 #include "message.h"
 #include "nls.h"
+#include "serverprobe.h"
 #include "serverside.h"
 #include "sound.h"
 #include "tstring.h"
@@ -61,6 +62,35 @@ static int Width, Depth;
 /* Maximum number of messages to store (for scrollback etc.) */
 const static int MaxMessages = 1000;
 
+/* 
+ * Regions of the screen tracked by the retained screen model. A region
+ * is marked dirty when something else draws over it (e.g. clear_line)
+ * and is then repainted in full the next time it is drawn; otherwise
+ * only rows whose contents have changed are repainted.
+ */
+enum {
+  REGION_HEADER = 1 << 0,       /* Date, space and location (top line) */
+  REGION_FRAME = 1 << 1,        /* Panel borders and titles */
+  REGION_STATS = 1 << 2,        /* Cash, guns, health, bank and debt */
+  REGION_INVENTORY = 1 << 3,    /* Carried drugs or guns */
+  REGION_MESSAGES = 1 << 4,     /* Network message area */
+  REGION_ALL = (1 << 5) - 1
+};
+
+/* What was last drawn on a single screen row of a region */
+typedef struct _ScreenRow {
+  gchar *text;
+  int attr;
+} ScreenRow;
+
+static guint DirtyRegions = REGION_ALL;
+static ScreenRow *StatsRows = NULL, *InventoryRows = NULL,
+                 *MessageRows = NULL;
+static int CachedDepth = 0;
+static gchar *HeaderText = NULL;
+static int FrameWidth = -1, FrameSeparator = -1;
+static gboolean FrameNetwork = FALSE, FrameDrugs = FALSE;
+
 #ifdef NETWORKING
 /* Data waiting to be sent to/read from the metaserver */
 static CurlConnection MetaConn;
@@ -82,6 +112,7 @@ static int GetKey(const char *orig_allowed, gboolean AllowOther,
                   gboolean PrintAllowed, gboolean ExpandOut);
 static void clear_bottom(void), clear_screen(void);
 static void clear_line(int line), clear_exceptfor(int skip);
+static void flush_screen(void);
 static void nice_wait(void);
 static void DisplayFightMessage(Player *Play, char *text);
 static void DisplaySpyReports(char *Data, Player *From, Player *To);
@@ -92,6 +123,8 @@ static char *nice_input(char *prompt, int sy, int sx, gboolean digitsonly,
                         char *displaystr, char passwdchar);
 static Player *ListPlayers(Player *Play, gboolean Select, char *Prompt);
 static void HandleClientMessage(char *buf, Player *Play);
+static void DispatchClientMessage(Player *From, AICode AI, MsgCode Code,
+                                  char *Data, Player *Play);
 static void PrintMessage(const gchar *text);
 static void GunShop(Player *Play);
 static void LoanShark(Player *Play);
@@ -181,6 +214,14 @@ static int get_msg_area_bottom(void)
   return get_separator_line() - 1;
 }
 
+/*
+ * Returns the bottommost row of the stats and inventory panels
+ */
+static int get_stats_area_bottom(void)
+{
+  return Network ? 8 : 13;
+}
+
 static int get_ui_area_top(void)
 {
   return get_separator_line() + (Network ? 1 : 2);
@@ -409,9 +450,120 @@ static void SelectServerManually(void)
   g_free(PortText);
 }
 
+/* 
+ * Returns the key in "orig_allowed" that corresponds to the keypress
+ * "ch" (which may be a translated key), or 0 if it isn't an allowed key.
+ * This is the non-blocking counterpart of GetKey().
+ */
+static int MatchKey(const char *orig_allowed, gunichar ch)
+{
+  const char *allowed_str = _(orig_allowed), *pt;
+  int i;
+
+  ch = LocaleIsUTF8 ? g_unichar_toupper(ch) : toupper(ch);
+  if (LocaleIsUTF8) {
+    for (pt = allowed_str, i = 0; pt && *pt; pt = g_utf8_next_char(pt), ++i) {
+      if (g_utf8_get_char(pt) == ch) {
+        return orig_allowed[i];
+      }
+    }
+  } else {
+    for (i = 0; allowed_str[i]; ++i) {
+      if ((guchar)allowed_str[i] == ch) {
+        return orig_allowed[i];
+      }
+    }
+  }
+  return 0;
+}
+
+/* 
+ * Displays the details of the server at "index" in ServerList.
+ * "Loading" and "Probing" indicate whether we are still receiving the
+ * list, and measuring the latency of the servers in it.
+ */
+static void DisplayMetaServer(guint index, gboolean Loading,
+                              gboolean Probing)
+{
+  ServerData *ThisServer;
+  GString *text;
+  gchar *latency;
+  int top = get_ui_area_top();
+
+  ThisServer = (ServerData *)g_ptr_array_index(ServerList, index);
+  text = g_string_new("");
+  attrset(TextAttr);
+  clear_bottom();
+  /* Printout of metaserver information in curses client */
+  g_string_printf(text, _("Server : %s"), ThisServer->Name);
+  mvaddstr(top + 1, 1, text->str);
+  if (Loading) {
+    /* Position of the displayed server in the metaserver list, while
+       the rest of the list is still being received */
+    g_string_printf(text, _("(%u of %u so far...)"), index + 1,
+                    ServerList->len);
+  } else if (Probing) {
+    /* Position of the displayed server in the metaserver list, while
+       the servers are being pinged */
+    g_string_printf(text, _("(%u of %u, pinging...)"), index + 1,
+                    ServerList->len);
+  } else {
+    g_string_printf(text, _("(%u of %u)"), index + 1, ServerList->len);
+  }
+  mvaddstr(top + 1, 40, text->str);
+  g_string_printf(text, _("Port   : %d"), ThisServer->Port);
+  mvaddstr(top + 2, 1, text->str);
+  latency = FormatServerLatency(ThisServer);
+  /* Round trip time to a server, e.g. "Ping: 35 ms" */
+  g_string_printf(text, _("Ping: %s"), latency);
+  g_free(latency);
+  mvaddstr(top + 2, 20, text->str);
+  g_string_printf(text, _("Version    : %s"), ThisServer->Version);
+  mvaddstr(top + 2, 40, text->str);
+  if (ThisServer->CurPlayers == -1) {
+    g_string_printf(text, _("Players: -unknown- (maximum %d)"),
+                     ThisServer->MaxPlayers);
+  } else {
+    g_string_printf(text, _("Players: %d (maximum %d)"),
+                     ThisServer->CurPlayers, ThisServer->MaxPlayers);
+  }
+  mvaddstr(top + 3, 1, text->str);
+  g_string_printf(text, _("Up since   : %s"), ThisServer->UpSince);
+  mvaddstr(top + 3, 40, text->str);
+  g_string_printf(text, _("Comment: %s"), ThisServer->Comment);
+  mvaddstr(top + 4, 1, text->str);
+  attrset(PromptAttr);
+  mvaddstr(top + 5, 1,
+           _("N>ext server; P>revious server; S>elect this server... "));
+  refresh();
+  g_string_free(text, TRUE);
+}
+
+/* 
+ * Sorts ServerList so that the best servers come first, and returns
+ * the new index of the server that was at "index".
+ */
+static guint RankMetaServers(guint index)
+{
+  gpointer current = g_ptr_array_index(ServerList, index);
+  guint i;
+
+  RankServerList(ServerList);
+  for (i = 0; i < ServerList->len; i++) {
+    if (g_ptr_array_index(ServerList, i) == current) {
+      return i;
+    }
+  }
+  return 0;
+}
+
 /* 
  * Contacts the dopewars metaserver, and obtains a list of valid
- * server/port pairs, one of which the user should select.
+ * server/port pairs, one of which the user should select. Servers are
+ * shown as soon as they arrive, so the user can browse (and select)
+ * while the rest of the list is still being received. Meanwhile, each
+ * server is pinged, and once all have answered (or timed out) the list
+ * is sorted so that the closest, least busy servers come first.
  * Returns TRUE on success; on failure FALSE is returned, and
  * errstr is assigned an error message.
  */
@@ -419,10 +571,11 @@ static gboolean SelectServerFromMetaServer(Player *Play, GString *errstr)
 {
   int c;
   GError *tmp_error = NULL;
-  GSList *ListPt;
+  MetaListParser parser;
+  ProbeSet *probes;
   ServerData *ThisServer;
-  GString *text;
-  gint index;
+  guint index = 0, shown = 0, probed = 0;
+  gboolean Loading = TRUE, Probing, Redraw = FALSE;
   fd_set readfds, writefds, errorfds;
   int maxsock;
   int top = get_ui_area_top();
@@ -432,116 +585,143 @@ static gboolean SelectServerFromMetaServer(Player *Play, GString *errstr)
   mvaddstr(top + 1, 1, _("Please wait... attempting to contact metaserver..."));
   refresh();
 
-  if (!OpenMetaHttpConnection(&MetaConn, &tmp_error)) {
+  if (ServerList) {
+    ClearServerList(ServerList);
+  } else {
+    ServerList = NewServerList();
+  }
+
+  if (!OpenMetaHttpConnection(&MetaConn, &parser, ServerList, NULL, NULL,
+                              &tmp_error)) {
     g_string_assign(errstr, tmp_error->message);
     g_error_free(tmp_error);
     return FALSE;
   }
-
-  ClearServerList(&ServerList);
+  probes = StartServerProbes(ServerList, NULL, NULL, NULL);
+  Probing = (probes != NULL);
 
   while(TRUE) {
-    long mintime;
+    long mintime = -1, probetime;
     struct timeval timeout;
     int still_running;
+
+    if (Probing && !Loading && ServerProbesFinished(probes)) {
+      Probing = FALSE;
+      index = RankMetaServers(index);
+      Redraw = TRUE;
+    }
+    if (ServerList->len > 0 && (Redraw || shown != ServerList->len
+                                || probed != CountServerProbes(probes))) {
+      DisplayMetaServer(index, Loading, Probing);
+      shown = ServerList->len;
+      probed = CountServerProbes(probes);
+      Redraw = FALSE;
+    }
+
     FD_ZERO(&readfds);
     FD_ZERO(&writefds);
     FD_ZERO(&errorfds);
     FD_SET(0, &readfds);
-    curl_multi_fdset(MetaConn.multi, &readfds, &writefds, &errorfds, &maxsock);
-    curl_multi_timeout(MetaConn.multi, &mintime);
-    timeout.tv_sec = mintime < 0 ? 5 : mintime;
-    timeout.tv_usec = 0;
+    maxsock = -1;
+    if (Loading) {
+      curl_multi_fdset(MetaConn.multi, &readfds, &writefds, &errorfds,
+                       &maxsock);
+      curl_multi_timeout(MetaConn.multi, &mintime);
+      if (mintime < 0) {
+        mintime = 5000;
+      }
+    }
     maxsock = MAX(maxsock+1, 1);
+    if (Probing) {
+      SetSelectForServerProbes(probes, &readfds, &writefds, &errorfds,
+                               &maxsock);
+      probetime = GetServerProbeTimeout(probes);
+      if (probetime >= 0 && (mintime < 0 || probetime < mintime)) {
+        mintime = probetime;
+      }
+    }
+    timeout.tv_sec = mintime / 1000;
+    timeout.tv_usec = (mintime % 1000) * 1000;
 
-    if (bselect(maxsock, &readfds, &writefds, &errorfds, &timeout) == -1) {
+    if (bselect(maxsock, &readfds, &writefds, &errorfds,
+                mintime >= 0 ? &timeout : NULL) == -1) {
       if (errno == EINTR) {
         CheckForResize(Play);
+        Redraw = TRUE;
         continue;
       }
       perror("bselect");
       exit(EXIT_FAILURE);
     }
     if (FD_ISSET(0, &readfds)) {
-      /* So that Ctrl-L works */
-      c = getch();
-      if (c == '\f')
+      c = bgetch();
+      if (c == '\f') {
+        /* So that Ctrl-L works */
         wrefresh(curscr);
+      } else if (ServerList->len > 0) {
+        /* The three keys that are valid responses to the "N>ext server"
+           question - if you translate them, keep the keys in the same
+           order (N>ext, P>revious, S>elect) as they are here, otherwise
+           they'll do the wrong things. */
+        c = MatchKey(N_("NPS"), c);
+        if (c == 'S') {
+          ThisServer = (ServerData *)g_ptr_array_index(ServerList, index);
+          AssignName(&ServerName, ThisServer->Name);
+          Port = ThisServer->Port;
+          break;
+        } else if (c == 'N') {
+          index = (index + 1) % ServerList->len;
+          Redraw = TRUE;
+        } else if (c == 'P') {
+          index = (index > 0 ? index : ServerList->len) - 1;
+          Redraw = TRUE;
+        }
+      }
+    }
+    if (Probing) {
+      RespondToServerProbes(probes, &readfds, &writefds, &errorfds);
+      UpdateServerProbes(probes);
+    }
+    if (!Loading) {
+      continue;
     }
     if (!CurlConnectionPerform(&MetaConn, &still_running, &tmp_error)) {
-      g_string_assign(errstr, tmp_error->message);
+      FinishMetaListParser(&parser, NULL, NULL);
+      Loading = FALSE;
+      Redraw = TRUE;
+      if (ServerList->len == 0) {
+        FreeServerProbes(probes);
+        g_string_assign(errstr, tmp_error->message);
+        g_error_free(tmp_error);
+        return FALSE;
+      }
+      /* Keep the servers we already have */
       g_error_free(tmp_error);
-      return FALSE;
+      tmp_error = NULL;
     } else if (still_running == 0) {
-      if (!HandleWaitingMetaServerData(&MetaConn, &ServerList, &tmp_error)) {
+      Loading = FALSE;
+      Redraw = TRUE;
+      if (!FinishMetaListParser(&parser, &MetaConn, &tmp_error)) {
         CloseCurlConnection(&MetaConn);
+        FreeServerProbes(probes);
         g_string_assign(errstr, tmp_error->message);
-	g_error_free(tmp_error);
-	return FALSE;
+        g_error_free(tmp_error);
+        return FALSE;
       }
       CloseCurlConnection(&MetaConn);
-      break;
-    }
-  }
-
-  text = g_string_new("");
-
-  ListPt = ServerList;
-  while (ListPt) {
-    ThisServer = (ServerData *)(ListPt->data);
-    attrset(TextAttr);
-    clear_bottom();
-    /* Printout of metaserver information in curses client */
-    g_string_printf(text, _("Server : %s"), ThisServer->Name);
-    mvaddstr(top + 1, 1, text->str);
-    g_string_printf(text, _("Port   : %d"), ThisServer->Port);
-    mvaddstr(top + 2, 1, text->str);
-    g_string_printf(text, _("Version    : %s"), ThisServer->Version);
-    mvaddstr(top + 2, 40, text->str);
-    if (ThisServer->CurPlayers == -1) {
-      g_string_printf(text, _("Players: -unknown- (maximum %d)"),
-                       ThisServer->MaxPlayers);
     } else {
-      g_string_printf(text, _("Players: %d (maximum %d)"),
-                       ThisServer->CurPlayers, ThisServer->MaxPlayers);
-    }
-    mvaddstr(top + 3, 1, text->str);
-    g_string_printf(text, _("Up since   : %s"), ThisServer->UpSince);
-    mvaddstr(top + 3, 40, text->str);
-    g_string_printf(text, _("Comment: %s"), ThisServer->Comment);
-    mvaddstr(top + 4, 1, text->str);
-    attrset(PromptAttr);
-    mvaddstr(top + 5, 1,
-             _("N>ext server; P>revious server; S>elect this server... "));
-
-    /* The three keys that are valid responses to the previous question -
-       if you translate them, keep the keys in the same order (N>ext,
-       P>revious, S>elect) as they are here, otherwise they'll do the
-       wrong things. */
-    c = GetKey(N_("NPS"), FALSE, FALSE, FALSE);
-    switch (c) {
-    case 'S':
-      AssignName(&ServerName, ThisServer->Name);
-      Port = ThisServer->Port;
-      ListPt = NULL;
-      break;
-    case 'N':
-      ListPt = g_slist_next(ListPt);
-      if (!ListPt)
-        ListPt = ServerList;
-      break;
-    case 'P':
-      index = g_slist_position(ServerList, ListPt) - 1;
-      if (index >= 0)
-        ListPt = g_slist_nth(ServerList, (guint)index);
-      else
-        ListPt = g_slist_last(ListPt);
-      break;
+      /* Start pinging any servers that just arrived */
+      UpdateServerProbes(probes);
     }
   }
+  FreeServerProbes(probes);
+  if (Loading) {
+    /* The user chose a server before the whole list arrived */
+    FinishMetaListParser(&parser, NULL, NULL);
+    CloseCurlConnection(&MetaConn);
+  }
   clear_line(top + 1);
   refresh();
-  g_string_free(text, TRUE);
   return TRUE;
 }
 
@@ -1115,20 +1295,32 @@ static void change_name(Player *Play, gboolean nullname)
  */
 void HandleClientMessage(char *Message, Player *Play)
 {
-  char *pt, *Data, *wrd;
+  char *Data;
   AICode AI;
   MsgCode Code;
-  Player *From, *tmp;
-  GSList *list;
-  gchar *text;
-  int i;
-  gboolean Handled;
+  Player *From;
 
   /* Ignore To: field - all messages will be for Player "Play" */
   if (ProcessMessage(Message, Play, &From, &AI, &Code, &Data, FirstClient)
       == -1) {
     return;
   }
+  DispatchClientMessage(From, AI, Code, Data, Play);
+}
+
+/* 
+ * Handles an already-decoded message from player "From" (as for
+ * HandleClientMessage). "Data" may be modified.
+ */
+void DispatchClientMessage(Player *From, AICode AI, MsgCode Code,
+                           char *Data, Player *Play)
+{
+  char *pt, *wrd;
+  Player *tmp;
+  GSList *list;
+  gchar *text;
+  int i;
+  gboolean Handled;
 
   Handled =
       HandleGenericClientMessage(From, AI, Code, Play, Data, &DisplayMode);
@@ -1152,7 +1344,6 @@ void HandleClientMessage(char *Message, Player *Play)
       clear_screen();
       display_message("");
       print_status(Play, TRUE);
-      refresh();
     }
     break;
   case C_PUSH:
@@ -1226,10 +1417,10 @@ void HandleClientMessage(char *Message, Player *Play)
     SoundPlay(Sounds.Jet);
     for (i = 0; i < 4; i++) {
       print_location(_("S U B W A Y"));
-      refresh();
+      flush_screen();
       MicroSleep(100000);
       print_location("");
-      refresh();
+      flush_screen();
       MicroSleep(100000);
     }
     text = dpg_strdup_printf(_("%/Current location/%tde"),
@@ -1264,7 +1455,6 @@ void HandleClientMessage(char *Message, Player *Play)
     if (From == &Noone) {
       ReceivePlayerData(Play, Data, Play);
       print_status(Play, TRUE);
-      refresh();
     } else {
       DisplaySpyReports(Data, From, Play);
     }
@@ -1709,6 +1899,103 @@ int GetKey(const char *orig_allowed, gboolean AllowOther,
   return 0;
 }
 
+/* 
+ * Marks any regions of the screen model that overlap lines "from"
+ * through "to" as needing a full repaint.
+ */
+static void invalidate_lines(int from, int to)
+{
+  if (from <= 0 && to >= 0) {
+    DirtyRegions |= REGION_HEADER;
+  }
+  if (from <= get_separator_line() && to >= 1) {
+    DirtyRegions |= REGION_FRAME;
+  }
+  if (from <= get_stats_area_bottom() && to >= 2) {
+    DirtyRegions |= REGION_STATS | REGION_INVENTORY;
+  }
+  if (Network && from <= get_msg_area_bottom() && to >= get_msg_area_top()) {
+    DirtyRegions |= REGION_MESSAGES;
+  }
+}
+
+/* 
+ * Makes sure the per-row caches cover the whole screen; they are
+ * emptied (and all regions repainted) if the screen size changes.
+ */
+static void check_row_caches(void)
+{
+  int i;
+
+  if (CachedDepth == Depth) {
+    return;
+  }
+  for (i = 0; i < CachedDepth; i++) {
+    g_free(StatsRows[i].text);
+    g_free(InventoryRows[i].text);
+    g_free(MessageRows[i].text);
+  }
+  g_free(StatsRows);
+  g_free(InventoryRows);
+  g_free(MessageRows);
+  CachedDepth = Depth;
+  StatsRows = g_new0(ScreenRow, Depth);
+  InventoryRows = g_new0(ScreenRow, Depth);
+  MessageRows = g_new0(ScreenRow, Depth);
+  DirtyRegions = REGION_ALL;
+}
+
+/* 
+ * Draws "text" (with attributes "attr") at column "col" of screen row
+ * "row", blanking the rest of the "wid" characters of the region that
+ * starts at column "start". Nothing is drawn if "cache" shows that the
+ * row already looks like this, unless "force" is TRUE.
+ */
+static void paint_row(ScreenRow *cache, gboolean force, int row, int start,
+                      int wid, int col, const gchar *text, int attr)
+{
+  GString *str;
+  int len, avail;
+
+  if (row < 0 || row >= CachedDepth) {
+    return;
+  }
+  if (!text) {
+    text = "";
+  }
+  cache += row;
+  if (!force && cache->text && cache->attr == attr
+      && strcmp(cache->text, text) == 0) {
+    return;
+  }
+  g_free(cache->text);
+  cache->text = g_strdup(text);
+  cache->attr = attr;
+
+  avail = MAX(start + wid - col, 0);
+  str = g_string_new(text);
+  if (strcharlen(str->str) > avail) {
+    g_string_pad_or_truncate_to_charlen(str, avail);
+  }
+  len = strcharlen(str->str);
+  mvaddfixwidstr(row, start, col - start, NULL, StatsAttr);
+  attrset(attr);
+  mvaddstr(row, col, str->str);
+  mvaddfixwidstr(row, col + len, avail - len, NULL, StatsAttr);
+  g_string_free(str, TRUE);
+}
+
+/* 
+ * Sends everything drawn since the last call to the terminal in a
+ * single update, so that each batch of server messages costs one
+ * (minimal) repaint rather than one per message.
+ */
+void flush_screen(void)
+{
+  wnoutrefresh(stdscr);
+  doupdate();
+}
+
 /* 
  * Clears one whole line on the curses screen.
  */
@@ -1716,6 +2003,7 @@ void clear_line(int line)
 {
   int i;
 
+  invalidate_lines(line, line);
   move(line, 0);
   for (i = 0; i < Width; i++)
     addch(' ');
@@ -1865,6 +2153,7 @@ void display_message(const char *buf)
 {
   guint y, top, depth;
   guint wid;
+  gboolean force;
   static GList *msgs = NULL;
   static int num_msgs = 0;
 
@@ -1875,6 +2164,9 @@ void display_message(const char *buf)
   if (wid < 0 || depth < 0 || !Network) {
     return;
   }
+  check_row_caches();
+  force = (DirtyRegions & REGION_MESSAGES) != 0;
+  DirtyRegions &= ~REGION_MESSAGES;
 
   if (!buf) {
     GList *pt;
@@ -1888,7 +2180,7 @@ void display_message(const char *buf)
     /* Display a blank message area */
     if (Network) {
       for (y = 0; y < depth; y++) {
-        mvaddfixwidstr(y + top, 2, wid, NULL, StatsAttr);
+        paint_row(MessageRows, force, y + top, 2, wid, 2, NULL, StatsAttr);
       }
     }
   } else if (Network) {
@@ -1941,7 +2233,7 @@ void display_message(const char *buf)
     /* Display the relevant messages, line by line */
     y = 0;
     while (y < depth && pt) {
-      mvaddfixwidstr(y + top, 2, wid, data, StatsAttr);
+      paint_row(MessageRows, force, y + top, 2, wid, 2, data, StatsAttr);
       ++y;
       if (strlen(data) > wid) {
 	data += wid;
@@ -1955,9 +2247,8 @@ void display_message(const char *buf)
 
     /* Blank out any remaining lines in the message area */
     for (; y < depth; ++y) {
-      mvaddfixwidstr(y + top, 2, wid, NULL, StatsAttr);
+      paint_row(MessageRows, force, y + top, 2, wid, 2, NULL, StatsAttr);
     }
-    refresh();
   }
 }
 
@@ -1977,26 +2268,54 @@ void print_location(char *text)
     addch(' ');
   mvaddcentstr(0, text);
   attrset(TextAttr);
+  DirtyRegions |= REGION_HEADER;
 }
 
 /* 
- * Displays the status of player "Play" - i.e. the current turn, the
- * location, bitches, available space, cash, guns, health and bank
- * details. If "DispDrugs" is TRUE, displays the carried drugs on the
- * right hand side of the screen; if FALSE, displays the carried guns.
+ * Adds "str" to the line of text being built up for screen row "row" of
+ * a panel, starting "offset" characters in. Rows past "bottom" (the
+ * end of the panel) are ignored.
  */
-void print_status(Player *Play, gboolean DispDrug)
+static void add_panel_text(GString **rows, int bottom, int row, int offset,
+                           const gchar *str)
 {
-  int i, c;
-  char *p;
+  int len;
+
+  if (row > bottom) {
+    return;
+  }
+  if (!rows[row]) {
+    rows[row] = g_string_new(NULL);
+  }
+  len = strcharlen(rows[row]->str);
+  if (len < offset) {
+    g_string_pad(rows[row], offset - len);
+  }
+  g_string_append(rows[row], str);
+}
+
+/* 
+ * Adds one line of the "Stats" panel, with "label" on the left and
+ * "value" right-aligned.
+ */
+static void add_stats_line(GString **rows, int bottom, int row,
+                           const gchar *label, const gchar *value)
+{
+  add_panel_text(rows, bottom, row, 0, label);
+  add_panel_text(rows, bottom, row, MAX(22 - strcharlen(value),
+                                        strcharlen(label) + 1), value);
+}
+
+/* 
+ * Draws the borders and titles of the stats, inventory and (in network
+ * mode) message panels.
+ */
+static void print_frame(gboolean DispDrug)
+{
+  int i;
   GString *text;
 
   text = g_string_new(NULL);
-  attrset(TitleAttr);
-  clear_line(0);
-  GetDateString(text, Play);
-  mvaddstr(0, 3, text->str);
-
   attrset(StatsAttr);
   for (i = get_separator_line() - 1; i >= 2; i--) {
     mvaddch(i, 1, ACS_VLINE);
@@ -2008,13 +2327,8 @@ void print_status(Player *Play, gboolean DispDrug)
   addch(ACS_URCORNER);
 
   mvaddch(1, Width / 2, ACS_TTEE);
-  for (i = 2; i <= (Network ? 8 : 13); i++) {
-    move(i, 2);
-    for (c = 2; c < Width / 2; c++)
-      addch(' ');
-    addch(ACS_VLINE);
-    for (c = Width / 2 + 1; c < Width - 2; c++)
-      addch(' ');
+  for (i = 2; i <= get_stats_area_bottom(); i++) {
+    mvaddch(i, Width / 2, ACS_VLINE);
   }
   if (!Network) {
     mvaddch(get_separator_line(), 1, ACS_LLCORNER);
@@ -2042,43 +2356,61 @@ void print_status(Player *Play, gboolean DispDrug)
   /* Title of the "Stats" window in the curses client */
   mvaddstr(1, Width / 4 - 2, _("Stats"));
 
-  attrset(StatsAttr);
-
-  /* Display of the player's cash in the stats window */
-  mvaddstr(3, 9, _("Cash"));
-  p = FormatPrice(Play->Cash);
-  mvaddrightstr(3, 30, p);
-  g_free(p);
-
-  /* Display of the total number of guns carried (%Tde="Guns" by default) */
-  dpg_string_printf(text, _("%/Stats: Guns/%Tde"), Names.Guns);
-  mvaddstr(Network ? 4 : 5, 9, text->str);
-  dpg_string_printf(text, "%d", TotalGunsCarried(Play));
-  mvaddrightstr(Network ? 4 : 5, 30, text->str);
-
-  /* Display of the player's health */
-  mvaddstr(Network ? 5 : 7, 9, _("Health"));
-  dpg_string_printf(text, "%d", Play->Health);
-  mvaddrightstr(Network ? 5 : 7, 30, text->str);
+  if (DispDrug) {
+    /* Title of the "trenchcoat" window (antique mode only) */
+    if (WantAntique)
+      mvaddstr(1, Width * 3 / 4 - 5, _("Trenchcoat"));
+    else {
+      /* Title of the "drugs" window (the only important bit in this
+         string is the "%Tde" which is "Drugs" by default; the %/.../ part
+         is ignored, so you don't need to translate it; see doc/i18n.html)
+       */
+      dpg_string_printf(text, _("%/Stats: Drugs/%Tde"), Names.Drugs);
+      mvaddstr(1, Width * 3 / 4 - strcharlen(text->str) / 2, text->str);
+    }
+  } else {
+    /* Title of the "guns" window (the only important bit in this string
+       is the "%Tde" which is "Guns" by default) */
+    dpg_string_printf(text, _("%/Stats: Guns/%Tde"), Names.Guns);
+    mvaddstr(1, Width * 3 / 4 - strcharlen(text->str) / 2, text->str);
+  }
+  attrset(TextAttr);
+  g_string_free(text, TRUE);
+}
 
-  /* Display of the player's bank balance */
-  mvaddstr(Network ? 6 : 9, 9, _("Bank"));
-  p = FormatPrice(Play->Bank);
-  mvaddrightstr(Network ? 6 : 9, 30, p);
-  g_free(p);
+/* 
+ * Displays the status of player "Play" - i.e. the current turn, the
+ * location, bitches, available space, cash, guns, health and bank
+ * details. If "DispDrugs" is TRUE, displays the carried drugs on the
+ * right hand side of the screen; if FALSE, displays the carried guns.
+ * Only the parts of the display that have changed since the last call
+ * (or that have since been drawn over) are repainted.
+ */
+void print_status(Player *Play, gboolean DispDrug)
+{
+  int i, c, row, step, bottom, debtrow;
+  gboolean force;
+  char *p, prstr[PRICE_BUFLEN];
+  gchar *date, *space, *header;
+  GString *text, **stats, **inv;
+
+  check_row_caches();
+  if (FrameWidth != Width || FrameSeparator != get_separator_line()
+      || FrameNetwork != Network) {
+    /* The layout has changed, so nothing on screen can be trusted */
+    DirtyRegions = REGION_ALL;
+    FrameWidth = Width;
+    FrameSeparator = get_separator_line();
+    FrameNetwork = Network;
+  }
+  if (FrameDrugs != DispDrug) {
+    DirtyRegions |= REGION_FRAME;
+    FrameDrugs = DispDrug;
+  }
 
-  if (Play->Debt > 0)
-    attrset(DebtAttr);
-  /* Display of the player's debt */
-  g_string_assign(text, _("Debt"));
-  p = FormatPrice(Play->Debt);
-  /* Put in one big string otherwise the DebtAttr won't be applied to the
-     space between "Debt" and the price */
-  g_string_pad(text, 22 - strcharlen(text->str) - strcharlen(p));
-  g_string_append(text, p);
-  g_free(p);
-  mvaddstr(Network ? 7 : 11, 9, text->str);
-  attrset(TitleAttr);
+  text = g_string_new(NULL);
+  GetDateString(text, Play);
+  date = g_strdup(text->str);
 
   /* Display of the player's trenchcoat size (antique mode only) */
   if (WantAntique)
@@ -2089,25 +2421,68 @@ void print_status(Player *Play, gboolean DispDrug)
     dpg_string_printf(text, _("%Tde %3d  Space %6d"), Names.Bitches,
                        Play->Bitches.Carried, Play->CoatSize);
   }
-  mvaddrightstr(0, Width - 3, text->str);
+  space = g_strdup(text->str);
   dpg_string_printf(text, _("%/Current location/%tde"),
                      Location[Play->IsAt].Name);
-  print_location(text->str);
-  attrset(StatsAttr);
+  header = g_strjoin("\n", date, space, text->str, NULL);
+  if ((DirtyRegions & REGION_HEADER) || !HeaderText
+      || strcmp(HeaderText, header) != 0) {
+    mvaddfixwidstr(0, 0, Width, NULL, TitleAttr);
+    attrset(TitleAttr);
+    mvaddstr(0, 3, date);
+    mvaddrightstr(0, Width - 3, space);
+    print_location(text->str);
+    g_free(HeaderText);
+    HeaderText = header;
+    DirtyRegions &= ~REGION_HEADER;
+  } else {
+    g_free(header);
+  }
+  g_free(date);
+  g_free(space);
+
+  if (DirtyRegions & REGION_FRAME) {
+    print_frame(DispDrug);
+    DirtyRegions &= ~REGION_FRAME;
+  }
+
+  bottom = get_stats_area_bottom();
+  stats = g_new0(GString *, bottom + 1);
+  inv = g_new0(GString *, bottom + 1);
+
+  step = Network ? 1 : 2;
+  row = 3;
+
+  /* Display of the player's cash in the stats window */
+  add_stats_line(stats, bottom, row, _("Cash"),
+                 FormatPriceBuf(Play->Cash, prstr, sizeof(prstr)));
+  row += step;
+
+  /* Display of the total number of guns carried (%Tde="Guns" by default) */
+  dpg_string_printf(text, _("%/Stats: Guns/%Tde"), Names.Guns);
+  p = g_strdup_printf("%d", TotalGunsCarried(Play));
+  add_stats_line(stats, bottom, row, text->str, p);
+  g_free(p);
+  row += step;
+
+  /* Display of the player's health */
+  p = g_strdup_printf("%d", Play->Health);
+  add_stats_line(stats, bottom, row, _("Health"), p);
+  g_free(p);
+  row += step;
+
+  /* Display of the player's bank balance */
+  add_stats_line(stats, bottom, row, _("Bank"),
+                 FormatPriceBuf(Play->Bank, prstr, sizeof(prstr)));
+  row += step;
+
+  /* Display of the player's debt */
+  add_stats_line(stats, bottom, row, _("Debt"),
+                 FormatPriceBuf(Play->Debt, prstr, sizeof(prstr)));
+  debtrow = row;
 
   c = 0;
   if (DispDrug) {
-    /* Title of the "trenchcoat" window (antique mode only) */
-    if (WantAntique)
-      mvaddstr(1, Width * 3 / 4 - 5, _("Trenchcoat"));
-    else {
-      /* Title of the "drugs" window (the only important bit in this
-         string is the "%Tde" which is "Drugs" by default; the %/.../ part
-         is ignored, so you don't need to translate it; see doc/i18n.html)
-       */
-      dpg_string_printf(text, _("%/Stats: Drugs/%Tde"), Names.Drugs);
-      mvaddstr(1, Width * 3 / 4 - strcharlen(text->str) / 2, text->str);
-    }
     for (i = 0; i < NumDrug; i++) {
       if (Play->Drugs[i].Carried > 0) {
         /* Display of carried drugs with price (%tde="Opium", etc. by
@@ -2117,35 +2492,54 @@ void print_status(Player *Play, gboolean DispDrug)
                              Play->Drugs[i].Carried,
                              Play->Drugs[i].TotalValue /
                              Play->Drugs[i].Carried);
-          mvaddstr(3 + c, Width / 2 + 3, text->str);
+          add_panel_text(inv, bottom, 3 + c, 0, text->str);
         } else {
           /* Display of carried drugs (%tde="Opium", etc. by default) */
           dpg_string_printf(text, _("%-7tde  %3d"), Drug[i].Name,
                              Play->Drugs[i].Carried);
-          mvaddstr(3 + c / 2, Width / 2 + 3 + (c % 2) * 17, text->str);
+          add_panel_text(inv, bottom, 3 + c / 2, (c % 2) * 17, text->str);
         }
         c++;
       }
     }
   } else {
-    /* Title of the "guns" window (the only important bit in this string
-       is the "%Tde" which is "Guns" by default) */
-    dpg_string_printf(text, _("%/Stats: Guns/%Tde"), Names.Guns);
-    mvaddstr(1, Width * 3 / 4 - strcharlen(text->str) / 2, text->str);
     for (i = 0; i < NumGun; i++) {
       if (Play->Guns[i].Carried > 0) {
         /* Display of carried guns (%tde="Baretta", etc. by default) */
         dpg_string_printf(text, _("%-22tde %3d"), Gun[i].Name,
                            Play->Guns[i].Carried);
-        mvaddstr(3 + c, Width / 2 + 3, text->str);
+        add_panel_text(inv, bottom, 3 + c, 0, text->str);
         c++;
       }
     }
   }
+
+  force = (DirtyRegions & REGION_STATS) != 0;
+  for (row = 2; row <= bottom; row++) {
+    paint_row(StatsRows, force, row, 2, Width / 2 - 2, 9,
+              stats[row] ? stats[row]->str : NULL,
+              row == debtrow && Play->Debt > 0 ? DebtAttr : StatsAttr);
+  }
+  force = (DirtyRegions & REGION_INVENTORY) != 0;
+  for (row = 2; row <= bottom; row++) {
+    paint_row(InventoryRows, force, row, Width / 2 + 1,
+              Width - Width / 2 - 3, Width / 2 + 3,
+              inv[row] ? inv[row]->str : NULL, StatsAttr);
+  }
+  DirtyRegions &= ~(REGION_STATS | REGION_INVENTORY);
+
+  for (row = 0; row <= bottom; row++) {
+    if (stats[row])
+      g_string_free(stats[row], TRUE);
+    if (inv[row])
+      g_string_free(inv[row], TRUE);
+  }
+  g_free(stats);
+  g_free(inv);
+
   attrset(TextAttr);
   if (!Network)
     clear_line(get_separator_line() + 1);
-  refresh();
   g_string_free(text, TRUE);
 }
 
@@ -2181,7 +2575,6 @@ void DisplaySpyReports(char *Data, Player *From, Player *To)
   nice_wait();
 
   print_status(To, TRUE);
-  refresh();
 }
 
 /* 
@@ -2390,14 +2783,14 @@ static void DisplayDrugsHere(Player *Play)
   for (c = 0, i = GetNextDrugIndex(-1, Play);
        c < NumDrugsHere && i != -1;
        c++, i = GetNextDrugIndex(i, Play)) {
-    char *price = FormatPrice(Play->Drugs[i].Price);
+    char price[PRICE_BUFLEN];
     GString *str = g_string_new(NULL);
     /* List of individual drug names for selection (%tde="Opium" etc.
        by default) */
     dpg_string_printf(str, _("%/Drug Select/%c. %tde"), 'A' + c, Drug[i].Name);
+    FormatPriceBuf(Play->Drugs[i].Price, price, sizeof(price));
     g_string_pad_or_truncate_to_charlen(str, 22 - strcharlen(price));
     g_string_append(str, price);
-    g_free(price);
     names = g_slist_append(names, g_string_free(str, FALSE));
   }
   display_select_list(names);
@@ -2474,6 +2867,7 @@ static void Curses_DoGame(Player *Play)
   display_message("");
 
   InitAbilities(Play);
+  SetAbility(Play, A_RULESET, TRUE);
   SendAbilities(Play);
   StripTerminators(buf);
   SetPlayerName(Play, buf);
@@ -2561,7 +2955,9 @@ static void Curses_DoGame(Player *Play)
     case DM_NONE:
       break;
     }
-    refresh();
+    /* Everything drawn while handling the last batch of messages and
+       keypresses goes to the terminal in one go */
+    flush_screen();
 
     if (QuitRequest)
       return;
@@ -2809,6 +3205,7 @@ void CursesLoop(struct CMDLINE *cmdline)
 
   /* Set up message handlers */
   ClientMessageHandlerPt = HandleClientMessage;
+  ClientMessageDispatchPt = DispatchClientMessage;
 
   /* Make the GLib log messages display nicely */
   g_log_set_handler(NULL,
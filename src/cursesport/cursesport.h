@@ -70,6 +70,8 @@ typedef int SCREEN;
 SCREEN *newterm(void *, void *, void *);
 void refresh(void);
 #define wrefresh(win) refresh()
+#define wnoutrefresh(win)
+#define doupdate() refresh()
 void start_color(void);
 void init_pair(int index, WORD fg, WORD bg);
 void cbreak(void);
@@ -48,6 +48,7 @@
 #include "log.h"
 #include "message.h"
 #include "nls.h"
+#include "profiler.h"
 #include "serverside.h"
 #include "sound.h"
 #include "tstring.h"
@@ -67,7 +68,8 @@
 #include "gtkport/gtkport.h"
 #endif
 
-int ClientSock, ListenSock;
+int ClientSock;
+GArray *ListenSocks = NULL;
 gboolean Network, Client, Server, WantAntique = FALSE, UseSounds = TRUE;
 
 /* 
@@ -80,6 +82,7 @@ gboolean Network, Client, Server, WantAntique = FALSE, UseSounds = TRUE;
  */
 int Port = 7902;
 gboolean Sanitized, ConfigVerbose, DrugValue, Antique = FALSE;
+gboolean ReusePort = FALSE;
 gchar *HiScoreFile = NULL, *ServerName = NULL;
 gchar *ServerMOTD = NULL, *BindAddress = NULL, *PlayerName = NULL;
 
@@ -109,10 +112,37 @@ int DebtInterest = 10, BankInterest = 5;
 Player Noone;
 int LoanSharkLoc, BankLoc, GunShopLoc, RoughPubLoc;
 int DrugSortMethod = DS_ATOZ;
-int FightTimeout = 5, IdleTimeout = 14400, ConnectTimeout = 300;
+int FightTimeout = 5, FightTimeoutMsec = 0;
+int IdleTimeout = 14400, ConnectTimeout = 300;
 int MaxClients = 20, AITurnPause = 5;
 price_t StartCash = 2000, StartDebt = 5500;
-GSList *ServerList = NULL;
+GPtrArray *ServerList = NULL;
+
+/* Bumped whenever the configuration changes, so that anything cached
+ * from it (e.g. the ruleset sent to clients) can be rebuilt */
+guint RulesetVersion = 1;
+
+#ifdef DOPE_HOTPATH_STATS
+guint64 HotPathStats[HP_NUM];
+
+/* 
+ * Logs the hot path counters (see HotPathStat).
+ */
+void DumpHotPathStats(void)
+{
+  static const gchar *names[HP_NUM] = {
+    "msgin", "msgout", "bytesout", "convert", "localmsg", "fullupdate",
+    "deltaupdate", "fightshot", "pricefmt"
+  };
+  int i;
+
+  for (i = 0; i < HP_NUM; i++) {
+    dopelog(0, LF_SERVER, "hotpath %s %" G_GUINT64_FORMAT, names[i],
+            HotPathStats[i]);
+  }
+}
+#endif
+
 
 GScannerConfig ScannerConfig = {
   " \t\n",                      /* Ignore these characters */
@@ -219,6 +249,14 @@ struct METASERVER DefaultMetaServer = {
   "", "dopewars server"
 };
 
+struct WRITEQUEUE WriteQueue = {
+  16384, 65536, 120
+};
+
+struct CONNECTLIMIT ConnectLimit = {
+  30, 10, 128
+};
+
 SocksServer Socks = { NULL, 0, 0, FALSE, NULL, NULL, NULL };
 gboolean UseSocks;
 #endif
@@ -245,8 +283,11 @@ struct GLOBALS Globals[] = {
    N_("Server's welcome message of the day"), NULL, NULL, 0, "", NULL,
    NULL, FALSE, 0, 0},
   {NULL, NULL, NULL, &BindAddress, NULL, "BindAddress",
-   N_("Network address for the server to listen on"), NULL, NULL, 0, "",
+   N_("Network addresses for the server to listen on"), NULL, NULL, 0, "",
    NULL, NULL, FALSE, 0, 0},
+  {NULL, &ReusePort, NULL, NULL, NULL, "ReusePort",
+   N_("TRUE if several servers may share the same port"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, 0},
 #ifdef NETWORKING
   {NULL, &UseSocks, NULL, NULL, NULL, "Socks.Active",
    N_("TRUE if a SOCKS server should be used for networking"),
@@ -289,7 +330,31 @@ struct GLOBALS Globals[] = {
   {NULL, NULL, NULL, &MetaServer.Comment, NULL, "MetaServer.Comment",
    N_("Server description, reported to the metaserver"), NULL, NULL, 0, "",
    NULL, NULL, FALSE, 0, 0},
+  {&WriteQueue.SoftLimit, NULL, NULL, NULL, NULL, "WriteQueue.SoftLimit",
+   N_("Bytes queued for a client before superseded updates are dropped"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
+  {&WriteQueue.HardLimit, NULL, NULL, NULL, NULL, "WriteQueue.HardLimit",
+   N_("Bytes queued for a client before it is disconnected"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 1024, -1},
+  {&WriteQueue.Timeout, NULL, NULL, NULL, NULL, "WriteQueue.Timeout",
+   N_("Seconds a client may leave queued data unread (0 = no limit)"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
+  {&ConnectLimit.Rate, NULL, NULL, NULL, NULL, "ConnectLimit.Rate",
+   N_("New connections per minute allowed from each address (0 = no limit)"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
+  {&ConnectLimit.Burst, NULL, NULL, NULL, NULL, "ConnectLimit.Burst",
+   N_("New connections an address may make in a sudden burst"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 1, -1},
+  {&ConnectLimit.MaxPending, NULL, NULL, NULL, NULL, "ConnectLimit.MaxPending",
+   N_("Maximum number of connections that have not yet logged in"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 1, -1},
 #endif /* NETWORKING */
+  {NULL, &Profile.Active, NULL, NULL, NULL, "Profile.Active",
+   N_("TRUE if the server should time each stage of message handling"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, 0},
+  {NULL, NULL, NULL, &Profile.File, NULL, "Profile.File",
+   N_("File to write the server profile to, as folded stacks, on exit"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, 0},
 #ifdef CYGWIN
   {NULL, &MinToSysTray, NULL, NULL, NULL, "MinToSysTray",
    N_("If TRUE, the server minimizes to the System Tray"),
@@ -442,6 +507,9 @@ struct GLOBALS Globals[] = {
   {&FightTimeout, NULL, NULL, NULL, NULL, "FightTimeout",
    N_("No. of seconds in which to return fire"),
    NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
+  {&FightTimeoutMsec, NULL, NULL, NULL, NULL, "FightTimeoutMsec",
+   N_("If non-zero, no. of milliseconds in which to return fire"),
+   NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
   {&IdleTimeout, NULL, NULL, NULL, NULL, "IdleTimeout",
    N_("Players are disconnected after this many seconds"),
    NULL, NULL, 0, "", NULL, NULL, FALSE, 0, -1},
@@ -844,6 +912,7 @@ GSList *AddPlayer(int fd, Player *NewPlayer, GSList *First)
 {
   Player *tmp;
   GSList *list;
+  int i;
 
   list = First;
   NewPlayer->ID = 0;
@@ -864,12 +933,13 @@ GSList *AddPlayer(int fd, Player *NewPlayer, GSList *First)
   SetPlayerName(NewPlayer, NULL);
   NewPlayer->IsAt = 0;
   NewPlayer->EventNum = E_NONE;
-  NewPlayer->FightTimeout = NewPlayer->ConnectTimeout =
-      NewPlayer->IdleTimeout = 0;
+  NewPlayer->ConnectTimeout = NewPlayer->IdleTimeout = 0;
   NewPlayer->Guns = (Inventory *)g_malloc0(NumGun * sizeof(Inventory));
   NewPlayer->Drugs = (Inventory *)g_malloc0(NumDrug * sizeof(Inventory));
-  InitList(&(NewPlayer->SpyList));
-  InitList(&(NewPlayer->TipList));
+  g_queue_init(&NewPlayer->Outgoing);
+  for (i = 0; i < REL_NUM; i++) {
+    g_queue_init(&NewPlayer->Incoming[i]);
+  }
   NewPlayer->Turn = 1;
   NewPlayer->date = g_date_new_dmy(StartDate.day, StartDate.month,
                                    StartDate.year);
@@ -884,11 +954,21 @@ GSList *AddPlayer(int fd, Player *NewPlayer, GSList *First)
 #ifdef NETWORKING
   InitNetworkBuffer(&NewPlayer->NetBuf, '\n', '\r',
                     UseSocks ? &Socks : NULL);
-  if (Server)
-    BindNetworkBufferToSocket(&NewPlayer->NetBuf, fd);
+  NewPlayer->Conv = NULL;
+  if (Server) {
+    /* fd is -1 if the connection is to be handed over later (see
+     * MoveNetworkBuffer) */
+    if (fd >= 0) {
+      BindNetworkBufferToSocket(&NewPlayer->NetBuf, fd);
+    }
+    SetNetworkBufferLimits(&NewPlayer->NetBuf, WriteQueue.SoftLimit,
+                           WriteQueue.HardLimit);
+  }
 #endif
   InitAbilities(NewPlayer);
-  NewPlayer->FightArray = NULL;
+  NewPlayer->Sent = NULL;
+  NewPlayer->Combat = NULL;
+  NewPlayer->RulesetHash = NULL;
   NewPlayer->Attacking = NULL;
   return g_slist_append(First, (gpointer)NewPlayer);
 }
@@ -927,9 +1007,12 @@ GSList *RemovePlayer(Player *Play, GSList *First)
 #ifdef NETWORKING
   if (!IsCop(Play))
     ShutdownNetworkBuffer(&Play->NetBuf);
+  if (Play->Conv)
+    Conv_Free(Play->Conv);
 #endif
-  ClearList(&(Play->SpyList));
-  ClearList(&(Play->TipList));
+  RemovePlayerRelations(Play);
+  ForgetSentState(Play);
+  g_free(Play->RulesetHash);
   g_date_free(Play->date);
   g_free(Play->Name);
   g_free(Play->Guns);
@@ -1027,115 +1110,186 @@ Player *GetPlayerByName(char *Name, GSList *First)
  */
 price_t strtoprice(char *buf)
 {
-  guint i, buflen, FracNum;
-  gchar digit, suffix;
-  gboolean minus, InFrac;
+  if (!buf)
+    return 0;
+  return StrnToPrice(buf, strlen(buf));
+}
+
+/* 
+ * Forms a price from the first "buflen" characters of "buf", which need
+ * not be nul-terminated. A trailing "K" or "M" multiplies by a thousand
+ * or a million, and then up to 3 or 6 digits after a decimal separator
+ * are used; without such a suffix, parsing stops at the separator.
+ */
+price_t StrnToPrice(const gchar *buf, gsize buflen)
+{
+  const gchar *pt, *end;
+  guint FracNum;
+  gboolean minus = FALSE;
   price_t val = 0;
 
-  minus = FALSE;
-  if (!buf || !buf[0])
+  if (buflen == 0)
     return 0;
-
-  buflen = strlen(buf);
-  suffix = buf[buflen - 1];
-  suffix = toupper(suffix);
-  if (suffix == 'M')
+  end = buf + buflen;
+  switch (end[-1]) {
+  case 'M':
+  case 'm':
     FracNum = 6;
-  else if (suffix == 'K')
+    break;
+  case 'K':
+  case 'k':
     FracNum = 3;
-  else
+    break;
+  default:
     FracNum = 0;
+  }
 
-  for (i = 0, InFrac = FALSE; i < buflen && (!InFrac || FracNum > 0); i++) {
-    digit = buf[i];
-    if (digit == '.' || digit == ',') {
-      InFrac = TRUE;
-    } else if (digit >= '0' && digit <= '9') {
-      if (InFrac)
-        FracNum--;
-      val *= 10;
-      val += (digit - '0');
-    } else if (digit == '-')
+  for (pt = buf; pt < end && *pt != '.' && *pt != ','; pt++) {
+    if (*pt >= '0' && *pt <= '9') {
+      val = val * 10 + (*pt - '0');
+    } else if (*pt == '-') {
+      minus = TRUE;
+    }
+  }
+  for (; pt < end && FracNum > 0; pt++) {
+    if (*pt >= '0' && *pt <= '9') {
+      val = val * 10 + (*pt - '0');
+      FracNum--;
+    } else if (*pt == '-') {
       minus = TRUE;
+    }
   }
 
-  for (i = 0; i < FracNum; i++)
+  for (; FracNum > 0; FracNum--)
     val *= 10;
-  if (minus)
-    val = -val;
-  return val;
+  return minus ? -val : val;
+}
+
+static const gchar DigitPairs[] =
+    "00010203040506070809" "10111213141516171819"
+    "20212223242526272829" "30313233343536373839"
+    "40414243444546474849" "50515253545556575859"
+    "60616263646566676869" "70717273747576777879"
+    "80818283848586878889" "90919293949596979899";
+
+/* 
+ * Writes the digits of "val" (which must be non-negative) backwards
+ * from just before "end", two at a time, optionally with commas
+ * between each group of three. Returns a pointer to the first digit.
+ */
+static gchar *WriteDigits(price_t val, gchar *end, gboolean thousands)
+{
+  gchar *pt = end;
+  int rem;
+
+  if (thousands) {
+    while (val >= 1000) {
+      rem = (int)(val % 1000);
+      val /= 1000;
+      pt -= 2;
+      memcpy(pt, &DigitPairs[(rem % 100) * 2], 2);
+      *--pt = '0' + rem / 100;
+      *--pt = ',';
+    }
+  }
+  while (val >= 100) {
+    rem = (int)(val % 100);
+    val /= 100;
+    pt -= 2;
+    memcpy(pt, &DigitPairs[rem * 2], 2);
+  }
+  if (val >= 10) {
+    pt -= 2;
+    memcpy(pt, &DigitPairs[val * 2], 2);
+  } else {
+    *--pt = '0' + (int)val;
+  }
+  return pt;
 }
 
 /* 
- * Prints "price" directly into a dynamically-allocated string buffer
- * and returns a pointer to this buffer. It is the responsbility of
- * the user to g_free this buffer when it is finished with.
+ * Prints "price" into "buf", which must be at least PRICE_BUFLEN bytes
+ * long, and returns "buf". As with pricetostr, zero is written as an
+ * empty string.
+ */
+gchar *PriceToBuf(price_t price, gchar *buf)
+{
+  gchar *end = buf + PRICE_BUFLEN - 1, *start;
+
+  *end = '\0';
+  if (price == 0) {
+    buf[0] = '\0';
+    return buf;
+  }
+  start = WriteDigits(price < 0 ? -price : price, end, FALSE);
+  if (price < 0)
+    *--start = '-';
+  memmove(buf, start, end - start + 1);
+  return buf;
+}
+
+/* 
+ * Prints "price" into a dynamically-allocated string and returns a
+ * pointer to it. It is the responsbility of the user to g_free this
+ * buffer when it is finished with. Where possible, use PriceToBuf
+ * to avoid the allocation.
  */
 gchar *pricetostr(price_t price)
 {
-  GString *PriceStr;
-  gchar *NewBuffer;
-  price_t absprice;
+  gchar buf[PRICE_BUFLEN];
+
+  return g_strdup(PriceToBuf(price, buf));
+}
+
+/* 
+ * Prints "price" into "buf" (of size "buflen", which should be at
+ * least PRICE_BUFLEN) with commas to split up thousands and the
+ * currency symbol added. Returns "buf".
+ */
+gchar *FormatPriceBuf(price_t price, gchar *buf, gsize buflen)
+{
+  gchar digits[PRICE_BUFLEN], *start, *end = digits + PRICE_BUFLEN - 1;
+  gsize numlen, symlen;
+  const gchar *sym = Currency.Symbol ? Currency.Symbol : "";
+
+  HOTPATH_COUNT(HP_PRICEFMT, 1);
 
+  *end = '\0';
+  start = WriteDigits(price < 0 ? -price : price, end, TRUE);
   if (price < 0)
-    absprice = -price;
-  else
-    absprice = price;
-  PriceStr = g_string_new(NULL);
-  while (absprice != 0) {
-    g_string_prepend_c(PriceStr, '0' + (absprice % 10));
-    absprice /= 10;
-    if (absprice == 0) {
-      if (price < 0)
-        g_string_prepend_c(PriceStr, '-');
-    }
+    *--start = '-';
+  numlen = end - start;
+  symlen = strlen(sym);
+  if (numlen + symlen >= buflen)
+    symlen = 0;
+  if (numlen >= buflen)
+    numlen = buflen - 1;
+
+  if (Currency.Prefix) {
+    memcpy(buf, sym, symlen);
+    memcpy(buf + symlen, start, numlen);
+  } else {
+    memcpy(buf, start, numlen);
+    memcpy(buf + numlen, sym, symlen);
   }
-  NewBuffer = PriceStr->str;
-  /* Free the string structure, but not the actual char array */
-  g_string_free(PriceStr, FALSE);
-  return NewBuffer;
+  buf[numlen + symlen] = '\0';
+  return buf;
 }
 
 /* 
  * Takes the number in "price" and prints it into a dynamically-allocated
  * string, adding commas to split up thousands, and adding a currency
  * symbol to the start. Returns a pointer to the string, which must be
- * g_free'd by the user when it is finished with.
+ * g_free'd by the user when it is finished with. Where possible, use
+ * FormatPriceBuf to avoid the allocation.
  */
 gchar *FormatPrice(price_t price)
 {
-  GString *PriceStr;
-  gchar *NewBuffer;
-  char thou[10];
-  gboolean First = TRUE;
-  price_t absprice;
-
-  PriceStr = g_string_new(NULL);
-  if (price < 0)
-    absprice = -price;
-  else
-    absprice = price;
-  while (First || absprice > 0) {
-    if (absprice >= 1000)
-      sprintf(thou, "%03d", (int)(absprice % 1000l));
-    else
-      sprintf(thou, "%d", (int)(price % 1000l));
-    price /= 1000l;
-    absprice /= 1000l;
-    if (!First)
-      g_string_prepend_c(PriceStr, ',');
-    g_string_prepend(PriceStr, thou);
-    First = FALSE;
-  }
-  if (Currency.Prefix)
-    g_string_prepend(PriceStr, Currency.Symbol);
-  else
-    g_string_append(PriceStr, Currency.Symbol);
+  gsize buflen = PRICE_BUFLEN;
 
-  NewBuffer = PriceStr->str;
-  /* Free the string structure only, not the char data */
-  g_string_free(PriceStr, FALSE);
-  return NewBuffer;
+  if (Currency.Symbol)
+    buflen += strlen(Currency.Symbol);
+  return FormatPriceBuf(price, g_malloc(buflen), buflen);
 }
 
 /* 
@@ -1415,97 +1569,124 @@ int GetNextDrugIndex(int OldIndex, Player *Play)
 }
 
 /* 
- * A DopeList is akin to a Vector class; it is a list of DopeEntry
- * structures, which can be dynamically extended or compressed. This
- * function initializes the newly-created list pointed to by "List"
- * (A DopeEntry contains a Player pointer and a counter, and is used
- * by the server to keep track of tipoffs and spies.)
+ * Server-wide index of spy and tipoff relationships, keyed by
+ * (From, To, Kind). Each value is the oldest such relationship, with
+ * any duplicates chained from it via NextDup.
  */
-void InitList(DopeList *List)
-{
-  List->Data = NULL;
-  List->Number = 0;
-}
+static GHashTable *RelationIndex = NULL;
 
-/* 
- * Clears the list pointed to by "List".
- */
-void ClearList(DopeList *List)
+static guint RelationHash(gconstpointer key)
 {
-  g_free(List->Data);
-  InitList(List);
+  const DopeRelation *rel = (const DopeRelation *)key;
+
+  return g_direct_hash(rel->From) * 31 + g_direct_hash(rel->To) * 7
+         + rel->Kind;
 }
 
-/* 
- * Adds a new DopeEntry (pointed to by "NewEntry") to the list "List".
- * A copy of NewEntry is placed into the list, so the original
- * structure pointed to by NewEntry can be reused.
- */
-void AddListEntry(DopeList *List, DopeEntry *NewEntry)
+static gboolean RelationEqual(gconstpointer a, gconstpointer b)
 {
-  if (!NewEntry || !List)
-    return;
-  List->Number++;
-  List->Data = (DopeEntry *)g_realloc(List->Data, List->Number *
-                                      sizeof(DopeEntry));
-  memmove(&(List->Data[List->Number - 1]), NewEntry, sizeof(DopeEntry));
+  const DopeRelation *ra = (const DopeRelation *)a;
+  const DopeRelation *rb = (const DopeRelation *)b;
+
+  return ra->From == rb->From && ra->To == rb->To && ra->Kind == rb->Kind;
 }
 
 /* 
- * Removes the DopeEntry at index "Index" from list "List".
+ * Records that player "From" has a spy on (Kind=REL_SPY) or has tipped
+ * off the cops to (Kind=REL_TIPOFF) player "To", with the given initial
+ * turn counter. Returns the new relationship, which is owned by the index.
  */
-void RemoveListEntry(DopeList *List, int Index)
+DopeRelation *AddRelation(Player *From, Player *To, RelationKind Kind,
+                          int Turns)
 {
-  if (!List || Index < 0 || Index >= List->Number)
-    return;
+  DopeRelation *rel, *head;
 
-  if (Index < List->Number - 1) {
-    memmove(&(List->Data[Index]), &(List->Data[Index + 1]),
-              (List->Number - 1 - Index) * sizeof(DopeEntry));
+  g_assert(From && To && Kind < REL_NUM);
+  if (!RelationIndex) {
+    RelationIndex = g_hash_table_new(RelationHash, RelationEqual);
   }
-  List->Number--;
-  List->Data = (DopeEntry *)g_realloc(List->Data, List->Number *
-                                      sizeof(DopeEntry));
-  if (List->Number == 0)
-    List->Data = NULL;
+  rel = g_new0(DopeRelation, 1);
+  rel->From = From;
+  rel->To = To;
+  rel->Kind = Kind;
+  rel->Turns = Turns;
+
+  head = (DopeRelation *)g_hash_table_lookup(RelationIndex, rel);
+  if (head) {
+    while (head->NextDup)
+      head = head->NextDup;
+    head->NextDup = rel;
+  } else {
+    g_hash_table_insert(RelationIndex, rel, rel);
+  }
+  g_queue_push_tail(&From->Outgoing, rel);
+  rel->OutLink = g_queue_peek_tail_link(&From->Outgoing);
+  g_queue_push_tail(&To->Incoming[Kind], rel);
+  rel->InLink = g_queue_peek_tail_link(&To->Incoming[Kind]);
+  return rel;
 }
 
 /* 
- * Returns the index of the DopeEntry matching "Play" in list "List"
- * or -1 if this is not found.
+ * Returns the oldest relationship of type "Kind" from "From" to "To",
+ * or NULL if there is none.
  */
-int GetListEntry(DopeList *List, Player *Play)
+DopeRelation *GetRelation(Player *From, Player *To, RelationKind Kind)
 {
-  int i;
+  DopeRelation key;
 
-  for (i = List->Number - 1; i >= 0; i--) {
-    if (List->Data[i].Play == Play)
-      return i;
-  }
-  return -1;
+  if (!RelationIndex)
+    return NULL;
+  key.From = From;
+  key.To = To;
+  key.Kind = Kind;
+  return (DopeRelation *)g_hash_table_lookup(RelationIndex, &key);
 }
 
 /* 
- * Removes (if it exists) the DopeEntry in list "List" matching "Play".
+ * Unlinks the relationship "Rel" from the index and from both players,
+ * and frees it.
  */
-void RemoveListPlayer(DopeList *List, Player *Play)
+void RemoveRelation(DopeRelation *Rel)
 {
-  RemoveListEntry(List, GetListEntry(List, Play));
+  DopeRelation *head, *prev;
+
+  if (!Rel)
+    return;
+  head = (DopeRelation *)g_hash_table_lookup(RelationIndex, Rel);
+  if (head == Rel) {
+    /* The hash table key is the relationship itself, so replace it
+     * with the next duplicate (if any) rather than just the value */
+    g_hash_table_remove(RelationIndex, Rel);
+    if (Rel->NextDup) {
+      g_hash_table_insert(RelationIndex, Rel->NextDup, Rel->NextDup);
+    }
+  } else {
+    for (prev = head; prev && prev->NextDup != Rel; prev = prev->NextDup) {
+    }
+    if (prev)
+      prev->NextDup = Rel->NextDup;
+  }
+  g_queue_delete_link(&Rel->From->Outgoing, Rel->OutLink);
+  g_queue_delete_link(&Rel->To->Incoming[Rel->Kind], Rel->InLink);
+  g_free(Rel);
 }
 
 /* 
- * Similar to RemoveListPlayer, except that if the list contains "Play" more
- * than once, all the matching entries are removed, not just the first.
+ * Removes every relationship that player "Play" takes part in, at
+ * either end; this takes time proportional to the number of them.
  */
-void RemoveAllEntries(DopeList *List, Player *Play)
+void RemovePlayerRelations(Player *Play)
 {
   int i;
 
-  do {
-    i = GetListEntry(List, Play);
-    if (i >= 0)
-      RemoveListEntry(List, i);
-  } while (i >= 0);
+  while (!g_queue_is_empty(&Play->Outgoing)) {
+    RemoveRelation((DopeRelation *)g_queue_peek_head(&Play->Outgoing));
+  }
+  for (i = 0; i < REL_NUM; i++) {
+    while (!g_queue_is_empty(&Play->Incoming[i])) {
+      RemoveRelation((DopeRelation *)g_queue_peek_head(&Play->Incoming[i]));
+    }
+  }
 }
 
 void ResizeLocations(int NewNum)
@@ -1779,6 +1960,7 @@ void RestoreConfig(void)
 {
   gint i;
 
+  RulesetVersion++;
   Prices.Spy = BackupPrices.Spy;
   Prices.Tipoff = BackupPrices.Tipoff;
   CopyNames(&Names, &BackupNames);
@@ -2155,6 +2337,7 @@ static gboolean SetConfigValue(int GlobalIndex, int StructIndex,
 
   if (!CheckMaxIndex(scanner, GlobalIndex, StructIndex, IndexGiven))
     return FALSE;
+  RulesetVersion++;
   if (Globals[GlobalIndex].NameStruct[0]) {
     GlobalName =
         g_strdup_printf("%s[%d].%s", Globals[GlobalIndex].NameStruct,
@@ -2399,12 +2582,26 @@ gchar *GetLocalConfigFile(void)
 #endif
 }
 
+/*
+ * Returns the directory in which clients cache the rulesets sent by
+ * servers, as a dynamically-allocated string that must be later freed.
+ */
+gchar *GetRulesetCacheDir(void)
+{
+#ifdef CYGWIN
+  return g_strdup_printf("%s/rulesets", appdata_path ? appdata_path : ".");
+#else
+  return g_build_filename(g_get_user_cache_dir(), "dopewars", NULL);
+#endif
+}
+
 /* 
  * Sets up data - such as the location of the high score file - to
  * hard-coded internal values, and then processes the global and
  * user-specific configuration files.
  */
-static void SetupParameters(GSList *extraconfigs, gboolean antique)
+static void SetupParameters(GSList *extraconfigs, gboolean antique,
+                            gboolean noconfig)
 {
   gchar *conf;
   GSList *list;
@@ -2425,6 +2622,7 @@ static void SetupParameters(GSList *extraconfigs, gboolean antique)
   AssignName(&ServerName, "localhost");
   AssignName(&ServerMOTD, "");
   AssignName(&BindAddress, "");
+  AssignName(&Profile.File, "");
   AssignName(&OurWebBrowser, "/usr/bin/firefox");
 
   AssignName(&Sounds.FightHit, SNDPATH"colt.wav");
@@ -2505,14 +2703,14 @@ static void SetupParameters(GSList *extraconfigs, gboolean antique)
   }
 
   /* Now read in the global configuration file */
-  conf = GetGlobalConfigFile();
+  conf = noconfig ? NULL : GetGlobalConfigFile();
   if (conf) {
     ReadConfigFile(conf, NULL);
     g_free(conf);
   }
 
   /* Next, try the local configuration file */
-  conf = GetLocalConfigFile();
+  conf = noconfig ? NULL : GetLocalConfigFile();
   if (conf) {
     ReadConfigFile(conf, &LocalCfgEncoding);
     g_free(conf);
@@ -2814,7 +3012,7 @@ struct CMDLINE *GeneralStartup(int argc, char *argv[])
 void InitConfiguration(struct CMDLINE *cmdline)
 {
   ConfigErrors = 0;
-  SetupParameters(cmdline->configs, cmdline->antique);
+  SetupParameters(cmdline->configs, cmdline->antique, cmdline->noconfig);
 
   if (cmdline->scorefile) {
     AssignName(&HiScoreFile, cmdline->scorefile);
@@ -2942,8 +3140,10 @@ static void DefaultLogMessage(const gchar *log_domain,
   }
 }
 
+#ifndef NO_MAIN
 /* 
  * Standard program entry - Win32 uses WinMain() instead, in winmain.c
+ * (and the codec tests, which are built with NO_MAIN, have their own)
  */
 int main(int argc, char *argv[])
 {
@@ -3022,5 +3222,6 @@ int main(int argc, char *argv[])
   SoundClose();
   return 0;
 }
+#endif /* NO_MAIN */
 
 #endif /* CYGWIN */
@@ -55,6 +55,35 @@ typedef long price_t;
 typedef long long price_t;
 #endif
 
+/* Size of a buffer big enough to hold any price formatted by PriceToBuf
+ * or FormatPriceBuf (the latter drops the currency symbol if it is
+ * too long to fit) */
+#define PRICE_BUFLEN 48
+
+#ifdef DOPE_HOTPATH_STATS
+/* Counters of events on hot code paths, compiled in only for profiling
+ * builds (configure --enable-hotpath-stats) and logged when the server
+ * stops */
+typedef enum {
+  HP_MSGIN,                     /* Messages parsed by ProcessMessage */
+  HP_MSGOUT,                    /* Messages queued for the network */
+  HP_BYTESOUT,                  /* Bytes in those messages */
+  HP_CONVERT,                   /* Messages that needed codeset conversion */
+  HP_LOCALMSG,                  /* Messages dispatched within the process */
+  HP_FULLUPDATE,                /* Complete player updates sent */
+  HP_DELTAUPDATE,               /* Delta player updates sent */
+  HP_FIGHTSHOT,                 /* Shots fired in fights */
+  HP_PRICEFMT,                  /* Prices formatted */
+  HP_NUM
+} HotPathStat;
+
+extern guint64 HotPathStats[HP_NUM];
+void DumpHotPathStats(void);
+#define HOTPATH_COUNT(stat, n) (HotPathStats[stat] += (n))
+#else
+#define HOTPATH_COUNT(stat, n)
+#endif
+
 /* "Abilities" are protocol extensions, which are negotiated between the
  * client and server at connect-time. */
 typedef enum {
@@ -71,6 +100,12 @@ typedef enum {
                                  * UTF-8 (Unicode) encoding */
   A_DATE,                       /* We can understand "proper" dd-mm-yy dates
                                  * rather than just turn numbers */
+  A_DELTA,                      /* Player updates can be sent as deltas
+                                 * against the previous update */
+  A_HISCOREDATA,                /* High scores are sent as separate fields
+                                 * rather than as preformatted text */
+  A_RULESET,                    /* The ruleset (C_DATA) need not be sent if
+                                 * the client has it cached */
   A_NUM                         /* N.B. Must be last */
 } AbilType;
 
@@ -103,6 +138,14 @@ struct METASERVER {
   gchar *URL;
   gchar *LocalName, *Password, *Comment;
 };
+
+struct WRITEQUEUE {
+  int SoftLimit, HardLimit, Timeout;
+};
+
+struct CONNECTLIMIT {
+  int Rate, Burst, MaxPending;
+};
 #endif
 
 struct CURRENCY {
@@ -169,7 +212,9 @@ struct DATE {
 
 extern gboolean WantAntique;
 extern struct DATE StartDate;
-extern int ClientSock, ListenSock;
+extern int ClientSock;
+extern GArray *ListenSocks;
+extern gboolean ReusePort;
 extern gboolean Network, Client, Server, UseSounds;
 extern int Port;
 extern gboolean Sanitized, ConfigVerbose, DrugValue;
@@ -185,8 +230,10 @@ extern gboolean Daemonize;
 #endif
 extern gchar *OurWebBrowser;
 extern int LoanSharkLoc, BankLoc, GunShopLoc, RoughPubLoc;
-extern int DrugSortMethod, FightTimeout, IdleTimeout, ConnectTimeout;
+extern int DrugSortMethod, FightTimeout, FightTimeoutMsec;
+extern int IdleTimeout, ConnectTimeout;
 extern int MaxClients, AITurnPause;
+extern guint RulesetVersion;
 extern struct CURRENCY Currency;
 extern struct PRICES Prices;
 extern struct BITCH Bitch;
@@ -196,6 +243,8 @@ extern struct SOUNDS Sounds;
 
 #ifdef NETWORKING
 extern struct METASERVER MetaServer;
+extern struct WRITEQUEUE WriteQueue;
+extern struct CONNECTLIMIT ConnectLimit;
 extern SocksServer Socks;
 extern gboolean UseSocks;
 #endif
@@ -275,17 +324,73 @@ typedef struct INVENTORY Inventory;
 struct PLAYER_T;
 typedef struct PLAYER_T Player;
 
-struct TDopeEntry {
-  Player *Play;
-  int Turns;
+/* A copy of the player data last sent to its client, so that later
+ * updates need only contain the fields that have changed */
+struct SENTSTATE {
+  price_t Cash, Debt, Bank;
+  int Health, CoatSize, IsAt, Turn, Flags;
+  int Day, Month, Year;
+  int NumGun, NumDrug, Bitches;
+  int Deltas;                   /* Delta updates sent since the last
+                                 * full update */
+  Inventory *Guns, *Drugs;
+};
+typedef struct SENTSTATE SentState;
+
+typedef struct FIGHT_T Fight;
+typedef struct FIGHTER_T Fighter;
+
+/* 
+ * A player's place in a fight. The fight owns these handles and only
+ * frees them with itself, so code that may cause a player to be killed
+ * (and freed, in the case of cops) can hold onto the handle and then
+ * check in constant time whether the player is still fighting.
+ */
+struct FIGHTER_T {
+  Player *Play;                 /* NULL once the player has left */
+  Fight *Owner;
+  gint64 ReloadAt;              /* Time (msec, from GetTimeMsec) at which
+                                 * the player can next fire, or 0 */
+  guint Seq;                    /* Breaks ties between equal ReloadAt */
+  gint HeapPos;                 /* Index in Owner->Reloading, or -1 */
 };
-typedef struct TDopeEntry DopeEntry;
 
-struct TDopeList {
-  DopeEntry *Data;
-  int Number;
+/* 
+ * A fight between two or more players (any of which can be cops).
+ */
+struct FIGHT_T {
+  GPtrArray *Fighters;          /* Fighter handles of those still in the
+                                 * fight, in the order they joined */
+  GPtrArray *Reloading;         /* Binary heap of Fighters waiting to
+                                 * reload, soonest first */
+  GPtrArray *Left;              /* Handles of those that have left */
+  guint NextSeq;
+  gint NumCops;
+  guint RefCount;
+};
+
+typedef enum {
+  REL_SPY = 0,                  /* "From" has a spy working for "To" */
+  REL_TIPOFF,                   /* "From" has tipped off the cops to "To" */
+  REL_NUM
+} RelationKind;
+
+/* 
+ * A single spy or tipoff relationship between two players. Every
+ * relationship is linked into the server-wide index and into the
+ * Outgoing queue of "From" and the Incoming queue of "To", so that it
+ * can be found or unlinked in constant time from either end.
+ */
+typedef struct DOPE_RELATION DopeRelation;
+struct DOPE_RELATION {
+  Player *From, *To;
+  RelationKind Kind;
+  int Turns;
+  GList *OutLink, *InLink;
+  DopeRelation *NextDup;        /* Further relationships with the same
+                                 * From, To and Kind (spies and tipoffs
+                                 * can be bought more than once) */
 };
-typedef struct TDopeList DopeList;
 
 struct PLAYER_T {
   guint ID;
@@ -299,16 +404,22 @@ struct PLAYER_T {
   gchar *Name;
   Inventory *Guns, *Drugs, Bitches;
   EventCode EventNum, ResyncNum;
-  time_t FightTimeout, IdleTimeout, ConnectTimeout;
-  guint tiebreak;
+  gint64 IdleTimeout, ConnectTimeout;  /* msec, from GetTimeMsec, or 0 */
   price_t DocPrice;
-  DopeList SpyList, TipList;
+  GQueue Outgoing;              /* DopeRelations where we are "From" */
+  GQueue Incoming[REL_NUM];     /* DopeRelations where we are "To" */
   Player *OnBehalfOf;
+  SentState *Sent;              /* If non-NULL, the data last sent to
+                                 * this player's client (see A_DELTA) */
+  gchar *RulesetHash;           /* Hash of the ruleset that the client
+                                 * says it has cached (see A_RULESET) */
 #ifdef NETWORKING
   NetworkBuffer NetBuf;
+  Converter *Conv;              /* Codeset conversion for NetBuf; created
+                                 * on first use */
 #endif
   Abilities Abil;
-  GPtrArray *FightArray;        /* If non-NULL, a list of players
+  Fighter *Combat;              /* If non-NULL, this player's place
                                  * in a fight */
   Player *Attacking;            /* The player that this player
                                  * is attacking */
@@ -330,6 +441,8 @@ typedef struct tag_serverdata {
   unsigned Port;
   int MaxPlayers, CurPlayers;
   char *Comment, *Version, *Update, *UpSince;
+  int Latency;                  /* Round trip time in ms, or -1 if not
+                                 * known */
 } ServerData;
 
 struct GLOBALS {
@@ -353,6 +466,8 @@ struct CMDLINE {
   gboolean help, version, antique, color, network;
   gboolean convert, admin, ai, server, notifymeta;
   gboolean setport;
+  gboolean noconfig;            /* Don't read the global or user config
+                                 * files (for the codec tests) */
   gchar *scorefile, *servername, *pidfile, *logfile, *plugin, *convertfile;
   gchar *playername;
   unsigned port;
@@ -367,7 +482,7 @@ extern Player Noone;
 extern char **Playing;
 extern char **SubwaySaying;
 extern char **StoppedTo;
-extern GSList *ServerList;
+extern GPtrArray *ServerList;
 extern GScannerConfig ScannerConfig;
 extern struct LOG Log;
 extern gint ConfigErrors;
@@ -384,13 +499,11 @@ void ClearInventory(Inventory *Guns, Inventory *Drugs);
 int IsCarryingRandom(Player *Play, int amount);
 void ChangeSpaceForInventory(Inventory *Guns, Inventory *Drugs,
                              Player *Play);
-void InitList(DopeList *List);
-void AddListEntry(DopeList *List, DopeEntry *NewEntry);
-void RemoveListEntry(DopeList *List, int Entry);
-int GetListEntry(DopeList *List, Player *Play);
-void RemoveListPlayer(DopeList *List, Player *Play);
-void RemoveAllEntries(DopeList *List, Player *Play);
-void ClearList(DopeList *List);
+DopeRelation *AddRelation(Player *From, Player *To, RelationKind Kind,
+                          int Turns);
+DopeRelation *GetRelation(Player *From, Player *To, RelationKind Kind);
+void RemoveRelation(DopeRelation *Rel);
+void RemovePlayerRelations(Player *Play);
 int TotalGunsCarried(Player *Play);
 int read_string(FILE *fp, char **buf);
 int brandom(int bot, int top);
@@ -399,8 +512,11 @@ void AddInventory(Inventory *Cumul, Inventory *Add, int Length);
 void TruncateInventoryFor(Inventory *Guns, Inventory *Drugs, Player *Play);
 void PrintInventory(Inventory *Guns, Inventory *Drugs);
 price_t strtoprice(char *buf);
+price_t StrnToPrice(const gchar *buf, gsize buflen);
 gchar *pricetostr(price_t price);
+gchar *PriceToBuf(price_t price, gchar *buf);
 gchar *FormatPrice(price_t price);
+gchar *FormatPriceBuf(price_t price, gchar *buf, gsize buflen);
 char IsInventoryClear(Inventory *Guns, Inventory *Drugs);
 void ResizeLocations(int NewNum);
 void ResizeCops(int NewNum);
@@ -451,6 +567,7 @@ gchar *GetDocRoot(void);
 gchar *GetDocIndex(void);
 gchar *GetGlobalConfigFile(void);
 gchar *GetLocalConfigFile(void);
+gchar *GetRulesetCacheDir(void);
 
 #ifndef CURSES_CLIENT
 void CursesLoop(struct CMDLINE *cmdline);
@@ -31,7 +31,7 @@
 #include <winsock2.h>           /* For WSAxxx constants */
 #include <windows.h>            /* For FormatMessage() etc. */
 #else
-#include <netdb.h>              /* For h_errno error codes */
+#include <netdb.h>              /* For h_errno error codes, gai_strerror */
 #endif
 
 #include "error.h"
@@ -219,6 +219,17 @@ void HErrnoAppendError(GString *str, LastError *error)
 static ErrorType ETHErrno = { HErrnoAppendError, NULL };
 ErrorType *ET_HERRNO = &ETHErrno;
 
+#ifdef HAVE_GETADDRINFO
+/* getaddrinfo() error handling */
+static void GaiAppendError(GString *str, LastError *error)
+{
+  g_string_append(str, gai_strerror(error->code));
+}
+
+static ErrorType ETGai = { GaiAppendError, NULL };
+ErrorType *ET_GAI = &ETGai;
+#endif
+
 #endif /* CYGWIN */
 
 void g_string_assign_error(GString *str, LastError *error)
@@ -399,6 +399,10 @@ void gtk_list_store_set(GtkListStore *list_store, GtkTreeIter *iter, ...)
       HWND hWnd = widget->hWnd;
       if (new_row) {
         SendMessageW(hWnd, LB_INSERTSTRING, (WPARAM)*iter, 1);
+        /* The list box moves any selection down, so follow it */
+        if (list_store->view->selection) {
+          gtk_tree_view_update_selection(widget);
+        }
       } else {
         InvalidateRect(hWnd, NULL, FALSE);
       }
@@ -735,6 +739,10 @@ gboolean gtk_list_store_remove(GtkListStore *list_store, GtkTreeIter *iter)
       HWND hWnd = GTK_WIDGET(list_store->view)->hWnd;
 
       SendMessageW(hWnd, LB_DELETESTRING, (WPARAM)rowind, 0);
+      /* The list box moves any selection up, so follow it */
+      if (list_store->view->selection) {
+        gtk_tree_view_update_selection(GTK_WIDGET(list_store->view));
+      }
     }
     return TRUE;
   } else {
@@ -50,11 +50,28 @@
 #define ET_SPY    0
 #define ET_TIPOFF 1
 
+/* What was last displayed for one drug or gun in an inventory list,
+   so that rows are only reformatted and updated when they change */
+struct InventoryRow {
+  gboolean Shown, Changed;
+  gchar *Name, *NameText, *NumText;
+  price_t Price;
+  int Carried;
+  gboolean ShowValue;
+};
+
+/* Cached rows of an inventory list, indexed by drug/gun */
+struct InventoryRows {
+  struct InventoryRow *Row;
+  int Num;
+};
+
 struct InventoryWidgets {
   GtkWidget *HereList, *CarriedList;
   GtkWidget *HereFrame, *CarriedFrame;
   GtkWidget *BuyButton, *SellButton, *DropButton;
   GtkWidget *vbbox;
+  struct InventoryRows HereRows, CarriedRows;
 };
 
 struct StatusWidgets {
@@ -115,9 +132,13 @@ CurlConnection MetaConn;
 #endif /* NETWORKING */
 
 static void HandleClientMessage(char *buf, Player *Play);
+static void DispatchClientMessage(Player *From, AICode AI, MsgCode Code,
+                                  char *Data, Player *Play);
 static void PrepareHighScoreDialog(void);
 static void AddScoreToDialog(char *Data);
 static void CompleteHighScoreDialog(gboolean AtEnd);
+static void scroll_to_selection(GtkTreeModel *model, GtkTreePath *path,
+                                GtkTreeIter *iter, gpointer data);
 static void PrintMessage(char *Data, char *tagname);
 static void DisplayFightMessage(char *Data);
 static GtkWidget *CreateStatusWidgets(struct StatusWidgets *Status);
@@ -154,6 +175,7 @@ static void CreateInventory(GtkWidget *hbox, gchar *Objects,
                             gboolean CreateButtons, gboolean CreateHere,
                             struct InventoryWidgets *widgets,
                             GCallback CallBack);
+static void DestroyInventory(GtkWidget *widget, gpointer data);
 static void GetSpyReports(GtkWidget *widget, gpointer data);
 static void DisplaySpyReports(Player *Play);
 
@@ -343,6 +365,10 @@ void ListInventory(GtkWidget *widget, gpointer data)
                   &ClientData.InvenDrug, NULL);
   CreateInventory(hbox, Names.Guns, accel_group, FALSE, FALSE,
                   &ClientData.InvenGun, NULL);
+  g_signal_connect(G_OBJECT(window), "destroy",
+                   G_CALLBACK(DestroyInventory), &ClientData.InvenDrug);
+  g_signal_connect(G_OBJECT(window), "destroy",
+                   G_CALLBACK(DestroyInventory), &ClientData.InvenGun);
 
   gtk_box_pack_start(GTK_BOX(vbox), hbox, TRUE, TRUE, 0);
 
@@ -440,19 +466,30 @@ void SocketStatus(NetworkBuffer *NetBuf, gboolean Read, gboolean Write,
 void HandleClientMessage(char *pt, Player *Play)
 {
   char *Data;
-  DispMode DisplayMode;
   AICode AI;
   MsgCode Code;
-  Player *From, *tmp;
-  gchar *text;
-  gboolean Handled;
-  GtkWidget *MenuItem;
-  GSList *list;
+  Player *From;
 
   if (ProcessMessage(pt, Play, &From, &AI, &Code,
                      &Data, FirstClient) == -1) {
     return;
   }
+  DispatchClientMessage(From, AI, Code, Data, Play);
+}
+
+/* 
+ * Handles an already-decoded message from player "From" (as for
+ * HandleClientMessage). "Data" may be modified.
+ */
+void DispatchClientMessage(Player *From, AICode AI, MsgCode Code,
+                           char *Data, Player *Play)
+{
+  DispMode DisplayMode;
+  Player *tmp;
+  gchar *text;
+  gboolean Handled;
+  GtkWidget *MenuItem;
+  GSList *list;
 
   Handled =
       HandleGenericClientMessage(From, AI, Code, Play, Data, &DisplayMode);
@@ -604,18 +641,82 @@ void HandleClientMessage(char *pt, Player *Play)
   }
 }
 
+/* Columns in the high score list */
+enum {
+  HISCORE_COL_MONEY = 0,
+  HISCORE_COL_DATE,
+  HISCORE_COL_NAME,
+  HISCORE_COL_DEAD,
+  HISCORE_COL_WEIGHT,           /* Font weight (bold for "our" score) */
+  HISCORE_COL_INDEX,            /* Position in the server's table */
+  HISCORE_COL_VALUE,            /* Unformatted money, for sorting */
+  HISCORE_COL_DATEKEY,          /* Date as yyyymmdd, for sorting */
+  HISCORE_NUM_COLS
+};
+
 struct HiScoreDiaStruct {
-  GtkWidget *dialog, *grid, *vbox;
+  GtkWidget *dialog, *tv, *vbox;
+  GtkListStore *store;
   GtkAccelGroup *accel_group;
+  gint MaxIndex, BoldIndex;
+};
+static struct HiScoreDiaStruct HiScoreDialog = {
+  NULL, NULL, NULL, NULL, NULL, -1, -1
 };
-static struct HiScoreDiaStruct HiScoreDialog = { NULL, NULL, NULL, NULL };
+
+static gint HiScoreSortByMoney(GtkTreeModel *model, GtkTreeIter *a,
+                               GtkTreeIter *b, gpointer data)
+{
+  gchar *vala, *valb;
+  price_t diff;
+
+  gtk_tree_model_get(model, a, HISCORE_COL_VALUE, &vala, -1);
+  gtk_tree_model_get(model, b, HISCORE_COL_VALUE, &valb, -1);
+  diff = strtoprice(vala ? vala : "") - strtoprice(valb ? valb : "");
+  g_free(vala);
+  g_free(valb);
+  return diff == 0 ? 0 : diff < 0 ? -1 : 1;
+}
+
+static gint HiScoreSortByDate(GtkTreeModel *model, GtkTreeIter *a,
+                              GtkTreeIter *b, gpointer data)
+{
+  gint keya, keyb;
+
+  gtk_tree_model_get(model, a, HISCORE_COL_DATEKEY, &keya, -1);
+  gtk_tree_model_get(model, b, HISCORE_COL_DATEKEY, &keyb, -1);
+  return keya == keyb ? 0 : keya < keyb ? -1 : 1;
+}
+
+static gint HiScoreSortByName(GtkTreeModel *model, GtkTreeIter *a,
+                              GtkTreeIter *b, gpointer data)
+{
+  gchar *namea, *nameb;
+  gint retval;
+
+  gtk_tree_model_get(model, a, HISCORE_COL_NAME, &namea, -1);
+  gtk_tree_model_get(model, b, HISCORE_COL_NAME, &nameb, -1);
+  retval = g_utf8_collate(namea ? namea : "", nameb ? nameb : "");
+  g_free(namea);
+  g_free(nameb);
+  return retval;
+}
 
 /* 
  * Creates an empty dialog to display high scores.
  */
 void PrepareHighScoreDialog(void)
 {
-  GtkWidget *dialog, *vbox, *hsep, *grid;
+  GtkWidget *dialog, *vbox, *hsep, *tv, *scrollwin;
+  GtkTreeSortable *sortable;
+  GtkCellRenderer *renderer;
+  GtkTreeViewColumn *col;
+  gint i;
+  gchar *titles[4];
+  gfloat xalign[4] = { 1.0, 0.5, 0.0, 0.5 };
+  GtkTreeIterCompareFunc sortfunc[3] = {
+    HiScoreSortByMoney, HiScoreSortByDate, HiScoreSortByName
+  };
 
   /* Make sure the server doesn't fool us into creating multiple dialogs */
   if (HiScoreDialog.dialog)
@@ -628,6 +729,7 @@ void PrepareHighScoreDialog(void)
   /* Title of the GTK+ high score dialog */
   gtk_window_set_title(GTK_WINDOW(dialog), _("High Scores"));
   my_set_dialog_position(GTK_WINDOW(dialog));
+  gtk_window_set_default_size(GTK_WINDOW(dialog), 560, 420);
 
   gtk_container_set_border_width(GTK_CONTAINER(dialog), 7);
   gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
@@ -635,29 +737,146 @@ void PrepareHighScoreDialog(void)
                                GTK_WINDOW(ClientData.window));
 
   HiScoreDialog.vbox = vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 7);
-  HiScoreDialog.grid = grid = dp_gtk_grid_new(NUMHISCORE, 4, FALSE);
-  gtk_grid_set_row_spacing(GTK_GRID(grid), 5);
-  gtk_grid_set_column_spacing(GTK_GRID(grid), 30);
 
-  gtk_box_pack_start(GTK_BOX(vbox), grid, TRUE, TRUE, 0);
+  /* Column titles in the GTK+ high score dialog */
+  titles[0] = _("Score");
+  titles[1] = _("Date");
+  titles[2] = _("Name");
+  titles[3] = "";
+
+  /* The tree view only draws the rows that are visible, so this copes
+     with tables of any size, unlike a grid of labels */
+  HiScoreDialog.tv = tv = gtk_scrolled_tree_view_new(&scrollwin);
+  HiScoreDialog.store = gtk_list_store_new(HISCORE_NUM_COLS, G_TYPE_STRING,
+                                           G_TYPE_STRING, G_TYPE_STRING,
+                                           G_TYPE_STRING, G_TYPE_INT,
+                                           G_TYPE_INT, G_TYPE_STRING,
+                                           G_TYPE_INT);
+  gtk_tree_view_set_model(GTK_TREE_VIEW(tv),
+                          GTK_TREE_MODEL(HiScoreDialog.store));
+  g_object_unref(HiScoreDialog.store);  /* so it is freed with the view */
+
+  for (i = 0; i < 4; i++) {
+    renderer = gtk_cell_renderer_text_new();
+    g_object_set(G_OBJECT(renderer), "xalign", xalign[i], NULL);
+#ifdef CYGWIN
+    col = gtk_tree_view_column_new_with_attributes(titles[i], renderer,
+                                                   "text", i, NULL);
+#else
+    col = gtk_tree_view_column_new_with_attributes(titles[i], renderer,
+                                                   "text", i, "weight",
+                                                   HISCORE_COL_WEIGHT, NULL);
+#endif
+    gtk_tree_view_column_set_alignment(col, xalign[i]);
+    gtk_tree_view_column_set_resizable(col, TRUE);
+    gtk_tree_view_insert_column(GTK_TREE_VIEW(tv), col, -1);
+  }
+
+  /* Scores can be sorted by money, date or name by clicking on the
+     column headers */
+  sortable = GTK_TREE_SORTABLE(HiScoreDialog.store);
+  for (i = 0; i < 3; i++) {
+    gtk_tree_sortable_set_sort_func(sortable, i, sortfunc[i], NULL, NULL);
+    gtk_tree_view_column_set_sort_column_id(
+                gtk_tree_view_get_column(GTK_TREE_VIEW(tv), i), i);
+  }
+  gtk_tree_view_set_headers_clickable(GTK_TREE_VIEW(tv), TRUE);
+  gtk_tree_selection_set_mode(gtk_tree_view_get_selection(GTK_TREE_VIEW(tv)),
+                              GTK_SELECTION_SINGLE);
+  HiScoreDialog.MaxIndex = HiScoreDialog.BoldIndex = -1;
+
+  gtk_box_pack_start(GTK_BOX(vbox), scrollwin, TRUE, TRUE, 0);
   hsep = gtk_separator_new(GTK_ORIENTATION_HORIZONTAL);
   gtk_box_pack_start(GTK_BOX(vbox), hsep, FALSE, FALSE, 0);
   gtk_container_add(GTK_CONTAINER(dialog), vbox);
   gtk_widget_show_all(dialog);
 }
 
+/* 
+ * Converts a date in the high score table's dd-mm-yyyy format into a
+ * number that sorts chronologically, or 0 if it is in some other format.
+ */
+static gint HiScoreDateKey(const gchar *date)
+{
+  gint day, month, year;
+
+  if (date && sscanf(date, "%d-%d-%d", &day, &month, &year) == 3) {
+    return year * 10000 + month * 100 + day;
+  } else {
+    return 0;
+  }
+}
+
+/* 
+ * Splits an old-style preformatted high score line (as sent to clients
+ * without the A_HISCOREDATA ability) into its fields. Returns FALSE if
+ * it is malformed. The strings point into "cp", which is modified.
+ */
+static gboolean ParseHiScoreText(gchar *cp, gchar **Money, gchar **Date,
+                                 gchar **Name, gboolean *Dead)
+{
+  gchar *pt;
+  int slen;
+
+  /* Score, date and name are separated by runs of spaces */
+  *Money = g_strchug(cp);
+  pt = strchr(*Money, ' ');
+  if (!pt)
+    return FALSE;
+  *pt = '\0';
+  *Date = g_strchug(pt + 1);
+  pt = strchr(*Date, ' ');
+  if (!pt)
+    return FALSE;
+  *pt = '\0';
+  *Name = g_strchug(pt + 1);
+
+  /* Remove '<' suffix (marking the 'current' score) if present */
+  slen = strlen(*Name);
+  if (slen >= 1 && (*Name)[slen - 1] == '<') {
+    (*Name)[--slen] = '\0';
+  }
+  g_strchomp(*Name);
+  slen = strlen(*Name);
+
+  /* Check for (R.I.P.) suffix */
+  *Dead = (slen > 8 && (*Name)[slen - 1] == ')' && (*Name)[slen - 8] == '(');
+  if (*Dead) {
+    (*Name)[slen - 8] = '\0';
+    g_strchomp(*Name);
+  }
+  return TRUE;
+}
+
+/* 
+ * Extracts the numeric value from a price formatted by FormatPrice,
+ * for sorting.
+ */
+static gchar *UnformatPrice(const gchar *text)
+{
+  GString *digits = g_string_new(NULL);
+
+  for (; *text; text++) {
+    if (g_ascii_isdigit(*text) || (*text == '-' && digits->len == 0)) {
+      g_string_append_c(digits, *text);
+    }
+  }
+  return g_string_free(digits, FALSE);
+}
+
 /* 
  * Adds a single high score (coded in "Data", which is the information
  * received in the relevant network message) to the dialog created by
- * PrepareHighScoreDialog(), above.
+ * PrepareHighScoreDialog(), above. If the score's position has already
+ * been received, that row is updated in place.
  */
 void AddScoreToDialog(char *Data)
 {
-  GtkWidget *label;
-  char *cp;
-  gchar **spl1, **spl2;
-  int index, slen;
-  gboolean bold;
+  GtkTreeModel *model;
+  GtkTreeIter iter;
+  gchar *cp, *money, *date, *name, *value, *bold;
+  int index, rowind, i, nrows;
+  gboolean dead, found = FALSE;
 
   if (!HiScoreDialog.dialog)
     return;
@@ -667,72 +886,54 @@ void AddScoreToDialog(char *Data)
   if (!cp || strlen(cp) < 3)
     return;
 
-  bold = (*cp == 'B');          /* Is this score "our" score? (Currently
-                                 * ignored) */
-
-  /* Step past the 'bold' character, and the initial '>' (if present) */
-  cp += 2;
-  g_strchug(cp);
-
-  /* Get the first word - the score */
-  spl1 = g_strsplit(cp, " ", 2);
-  if (!spl1 || !spl1[0] || !spl1[1]) {
-    /* Error - the high score from the server is invalid */
-    g_warning(_("Corrupt high score!"));
-    g_strfreev(spl1);
-    return;
-  }
-  label = make_bold_label(spl1[0], bold);
-  set_label_alignment(label, 1.0, 0.5);
-  dp_gtk_grid_attach(GTK_GRID(HiScoreDialog.grid), label, 0, index, 1, 1, TRUE);
-  gtk_widget_show(label);
-
-  /* Remove any leading whitespace from the remainder, since g_strsplit
-   * will split at every space character, not at a run of them */
-  g_strchug(spl1[1]);
-
-  /* Get the second word - the date */
-  spl2 = g_strsplit(spl1[1], " ", 2);
-  if (!spl2 || !spl2[0] || !spl2[1]) {
-    g_warning(_("Corrupt high score!"));
-    g_strfreev(spl2);
-    return;
+  /* Go by the format of the message rather than our own abilities, as
+   * a server in this process may not use A_HISCOREDATA even though we
+   * asked for it; the old format never has '^' after the bold flag */
+  if (cp[1] == '^') {
+    bold = GetNextWord(&cp, "N");
+    value = g_strdup(GetNextWord(&cp, "0"));
+    date = GetNextWord(&cp, "");
+    dead = (GetNextInt(&cp, 0) != 0);
+    name = cp ? cp : "";
+    money = FormatPrice(strtoprice(value));
+  } else {
+    bold = cp;
+    /* Step past the 'bold' character, and the initial '>' (if present) */
+    if (!ParseHiScoreText(cp + 2, &money, &date, &name, &dead)) {
+      /* Error - the high score from the server is invalid */
+      g_warning(_("Corrupt high score!"));
+      return;
+    }
+    value = UnformatPrice(money);
+    money = g_strdup(money);
+  }
+
+  model = GTK_TREE_MODEL(HiScoreDialog.store);
+  if (index <= HiScoreDialog.MaxIndex) {
+    /* Only repeated positions need a search; new ones are appended */
+    nrows = gtk_tree_model_iter_n_children(model, NULL);
+    for (i = 0; i < nrows && !found; i++) {
+      gtk_tree_model_iter_nth_child(model, &iter, NULL, i);
+      gtk_tree_model_get(model, &iter, HISCORE_COL_INDEX, &rowind, -1);
+      found = (rowind == index);
+    }
   }
-  label = make_bold_label(spl2[0], bold);
-  set_label_alignment(label, 0.5, 0.5);
-  dp_gtk_grid_attach(GTK_GRID(HiScoreDialog.grid), label, 1, index, 1, 1, TRUE);
-  gtk_widget_show(label);
-
-  /* The remainder is the name, terminated with (R.I.P.) if the player
-   * died, and '<' for the 'current' score */
-  g_strchug(spl2[1]);
-
-  /* Remove '<' suffix if present */
-  slen = strlen(spl2[1]);
-  if (slen >= 1 && spl2[1][slen - 1] == '<') {
-    spl2[1][slen - 1] = '\0';
+  if (!found) {
+    gtk_list_store_append(HiScoreDialog.store, &iter);
   }
-  slen--;
-
-  /* Check for (R.I.P.) suffix, and add it to the 4th column if found */
-  if (slen > 8 && spl2[1][slen - 1] == ')' && spl2[1][slen - 8] == '(') {
-    label = make_bold_label(&spl2[1][slen - 8], bold);
-    set_label_alignment(label, 0.5, 0.5);
-    dp_gtk_grid_attach(GTK_GRID(HiScoreDialog.grid), label, 3, index, 1, 1,
-                       TRUE);
-    gtk_widget_show(label);
-    spl2[1][slen - 8] = '\0';   /* Remove suffix from the player name */
+  gtk_list_store_set(HiScoreDialog.store, &iter,
+                     HISCORE_COL_MONEY, money, HISCORE_COL_DATE, date,
+                     HISCORE_COL_NAME, name,
+                     HISCORE_COL_DEAD, dead ? _("(R.I.P.)") : "",
+                     HISCORE_COL_WEIGHT, *bold == 'B' ? 700 : 400,
+                     HISCORE_COL_INDEX, index, HISCORE_COL_VALUE, value,
+                     HISCORE_COL_DATEKEY, HiScoreDateKey(date), -1);
+  HiScoreDialog.MaxIndex = MAX(HiScoreDialog.MaxIndex, index);
+  if (*bold == 'B') {
+    HiScoreDialog.BoldIndex = index;
   }
-
-  /* Finally, add in what's left of the player name */
-  g_strchomp(spl2[1]);
-  label = make_bold_label(spl2[1], bold);
-  set_label_alignment(label, 0, 0.5);
-  dp_gtk_grid_attach(GTK_GRID(HiScoreDialog.grid), label, 2, index, 1, 1, TRUE);
-  gtk_widget_show(label);
-
-  g_strfreev(spl1);
-  g_strfreev(spl2);
+  g_free(money);
+  g_free(value);
 }
 
 /* 
@@ -753,6 +954,10 @@ static void EndHighScore(GtkWidget *widget)
 void CompleteHighScoreDialog(gboolean AtEnd)
 {
   GtkWidget *button, *dialog, *hbbox;
+  GtkTreeModel *model;
+  GtkTreeSelection *treesel;
+  GtkTreeIter iter;
+  gint i, nrows, rowind;
 
   dialog = HiScoreDialog.dialog;
 
@@ -760,6 +965,28 @@ void CompleteHighScoreDialog(gboolean AtEnd)
     return;
   }
 
+#ifdef CYGWIN
+  /* Our Win32 GtkTreeView implementation doesn't auto-sort, so force it */
+  gtk_tree_view_sort(GTK_TREE_VIEW(HiScoreDialog.tv));
+#endif
+
+  /* Select (and show) "our" score, if we have one */
+  if (HiScoreDialog.BoldIndex >= 0) {
+    model = GTK_TREE_MODEL(HiScoreDialog.store);
+    treesel = gtk_tree_view_get_selection(GTK_TREE_VIEW(HiScoreDialog.tv));
+    nrows = gtk_tree_model_iter_n_children(model, NULL);
+    for (i = 0; i < nrows; i++) {
+      gtk_tree_model_iter_nth_child(model, &iter, NULL, i);
+      gtk_tree_model_get(model, &iter, HISCORE_COL_INDEX, &rowind, -1);
+      if (rowind == HiScoreDialog.BoldIndex) {
+        gtk_tree_selection_select_iter(treesel, &iter);
+        gtk_tree_selection_selected_foreach(treesel, scroll_to_selection,
+                                            HiScoreDialog.tv);
+        break;
+      }
+    }
+  }
+
   hbbox = my_hbbox_new();
   button = gtk_button_new_with_mnemonic(_("_Close"));
   g_signal_connect_swapped(G_OBJECT(button), "clicked",
@@ -1193,7 +1420,7 @@ void DisplayFightMessage(char *Data)
  */
 void DisplayStats(Player *Play, struct StatusWidgets *Status)
 {
-  gchar *prstr;
+  gchar prstr[PRICE_BUFLEN];
   GString *text;
 
   text = g_string_new(NULL);
@@ -1208,17 +1435,14 @@ void DisplayStats(Player *Play, struct StatusWidgets *Status)
   g_string_printf(text, "%d", Play->CoatSize);
   gtk_label_set_text(GTK_LABEL(Status->SpaceValue), text->str);
 
-  prstr = FormatPrice(Play->Cash);
-  gtk_label_set_text(GTK_LABEL(Status->CashValue), prstr);
-  g_free(prstr);
+  gtk_label_set_text(GTK_LABEL(Status->CashValue),
+                     FormatPriceBuf(Play->Cash, prstr, sizeof(prstr)));
 
-  prstr = FormatPrice(Play->Bank);
-  gtk_label_set_text(GTK_LABEL(Status->BankValue), prstr);
-  g_free(prstr);
+  gtk_label_set_text(GTK_LABEL(Status->BankValue),
+                     FormatPriceBuf(Play->Bank, prstr, sizeof(prstr)));
 
-  prstr = FormatPrice(Play->Debt);
-  gtk_label_set_text(GTK_LABEL(Status->DebtValue), prstr);
-  g_free(prstr);
+  gtk_label_set_text(GTK_LABEL(Status->DebtValue),
+                     FormatPriceBuf(Play->Debt, prstr, sizeof(prstr)));
 
   /* Display of the total number of guns carried (%Tde="Guns" by default) */
   dpg_string_printf(text, _("%/Stats: Guns/%Tde"), Names.Guns);
@@ -1300,96 +1524,217 @@ static void scroll_to_selection(GtkTreeModel *model, GtkTreePath *path,
   gtk_tree_view_scroll_to_cell(tv, path, NULL, FALSE, 0., 0.);
 }
 
+/* 
+ * Discards all of the cached inventory rows in "rows".
+ */
+static void FreeInventoryRows(struct InventoryRows *rows)
+{
+  int i;
+
+  for (i = 0; i < rows->Num; i++) {
+    g_free(rows->Row[i].Name);
+    g_free(rows->Row[i].NameText);
+    g_free(rows->Row[i].NumText);
+  }
+  g_free(rows->Row);
+  rows->Row = NULL;
+  rows->Num = 0;
+}
+
+/* 
+ * Makes sure "rows" has an entry for each of "NumObjects" drugs/guns,
+ * discarding the cache if the number has changed (new ruleset).
+ */
+static void ResizeInventoryRows(struct InventoryRows *rows, int NumObjects)
+{
+  if (rows->Num == NumObjects) {
+    return;
+  }
+  FreeInventoryRows(rows);
+  rows->Row = g_new0(struct InventoryRow, NumObjects);
+  rows->Num = NumObjects;
+}
+
+/* 
+ * Frees the cached rows of the inventory widgets "data" when the
+ * window (or page) containing them, "widget", is destroyed.
+ */
+static void DestroyInventory(GtkWidget *widget, gpointer data)
+{
+  struct InventoryWidgets *widgets = (struct InventoryWidgets *)data;
+
+  FreeInventoryRows(&widgets->HereRows);
+  FreeInventoryRows(&widgets->CarriedRows);
+}
+
+/* 
+ * Updates the cached name of inventory row "row" to that of the
+ * drug/gun called "Name", only reformatting it if it has changed.
+ */
+static void SetInventoryRowName(struct InventoryRow *row, const gchar *Name,
+                                gboolean AreDrugs)
+{
+  if (row->Name && strcmp(row->Name, Name) == 0) {
+    return;
+  }
+  g_free(row->Name);
+  g_free(row->NameText);
+  row->Name = g_strdup(Name);
+  if (AreDrugs) {
+    row->NameText = dpg_strdup_printf(_("%/Inventory drug name/%tde"), Name);
+  } else {
+    row->NameText = dpg_strdup_printf(_("%/Inventory gun name/%tde"), Name);
+  }
+  row->Changed = TRUE;
+}
+
+/* 
+ * Updates the cached number (price, or number carried) of inventory
+ * row "row", only reformatting it if the underlying values changed.
+ */
+static void SetInventoryRowNum(struct InventoryRow *row, price_t Price,
+                               int Carried, gboolean ShowValue)
+{
+  if (row->NumText && row->Price == Price && row->Carried == Carried
+      && row->ShowValue == ShowValue) {
+    return;
+  }
+  g_free(row->NumText);
+  row->Price = Price;
+  row->Carried = Carried;
+  row->ShowValue = ShowValue;
+  if (Carried < 0) {
+    row->NumText = FormatPrice(Price);
+  } else if (ShowValue) {
+    row->NumText = dpg_strdup_printf("%d @ %P", Carried, Price);
+  } else {
+    row->NumText = g_strdup_printf("%d", Carried);
+  }
+  row->Changed = TRUE;
+}
+
+/* 
+ * Brings the list store "store" into line with the cached "rows",
+ * without clearing it: rows no longer shown are removed, changed rows
+ * are updated in place, and new rows are inserted in index order. Rows
+ * that survive keep their selection.
+ */
+static void SyncInventoryStore(GtkListStore *store,
+                               struct InventoryRows *rows)
+{
+  GtkTreeModel *model = GTK_TREE_MODEL(store);
+  GtkTreeIter *iters, iter;
+  gboolean *instore;
+  gint i, nrows, ind, pos;
+
+  nrows = gtk_tree_model_iter_n_children(model, NULL);
+  iters = g_new(GtkTreeIter, MAX(nrows, 1));
+  for (i = 0; i < nrows; i++) {
+    gtk_tree_model_iter_nth_child(model, &iters[i], NULL, i);
+  }
+  instore = g_new0(gboolean, MAX(rows->Num, 1));
+
+  /* Work backwards, so that removing a row never moves one we have yet
+     to look at (on Win32, iterators are just row numbers) */
+  for (i = nrows - 1; i >= 0; i--) {
+    gtk_tree_model_get(model, &iters[i], INVEN_COL_INDEX, &ind, -1);
+    if (ind < 0 || ind >= rows->Num || !rows->Row[ind].Shown
+        || instore[ind]) {
+      gtk_list_store_remove(store, &iters[i]);
+    } else {
+      instore[ind] = TRUE;
+      if (rows->Row[ind].Changed) {
+        gtk_list_store_set(store, &iters[i],
+                           INVEN_COL_NAME, rows->Row[ind].NameText,
+                           INVEN_COL_NUM, rows->Row[ind].NumText, -1);
+      }
+    }
+  }
+
+  for (ind = pos = 0; ind < rows->Num; ind++) {
+    struct InventoryRow *row = &rows->Row[ind];
+
+    if (row->Shown) {
+      if (!instore[ind]) {
+        gtk_list_store_insert(store, &iter, pos);
+        gtk_list_store_set(store, &iter, INVEN_COL_NAME, row->NameText,
+                           INVEN_COL_NUM, row->NumText,
+                           INVEN_COL_INDEX, ind, -1);
+      }
+      pos++;
+    }
+    row->Changed = FALSE;
+  }
+  g_free(instore);
+  g_free(iters);
+}
+
 void UpdateInventory(struct InventoryWidgets *Inven,
                      Inventory *Objects, int NumObjects, gboolean AreDrugs)
 {
   GtkWidget *herelist, *carrylist;
   gint i;
   price_t price;
-  gchar *titles[2];
+  const gchar *name;
   gboolean CanBuy = FALSE, CanSell = FALSE, CanDrop = FALSE;
-  GtkTreeIter iter;
+  gboolean ShowValue;
   GtkTreeView *tv[2];
-  GtkListStore *carrystore, *herestore;
-  int numlist, selectrow[2];
+  int numlist;
 
   herelist = Inven->HereList;
   carrylist = Inven->CarriedList;
 
   numlist = (herelist ? 2 : 1);
-
-  /* Get current selections */
   tv[0] = GTK_TREE_VIEW(carrylist);
-  carrystore = GTK_LIST_STORE(gtk_tree_view_get_model(tv[0]));
-  if (herelist) {
-    tv[1] = GTK_TREE_VIEW(herelist);
-    herestore = GTK_LIST_STORE(gtk_tree_view_get_model(tv[1]));
-  } else {
-    tv[1] = NULL;
-    herestore = NULL;
-  }
+  tv[1] = herelist ? GTK_TREE_VIEW(herelist) : NULL;
 
-  for (i = 0; i < numlist; i++) {
-    selectrow[i] = get_selected_inventory(gtk_tree_view_get_selection(tv[i]));
-  }
-
-  gtk_list_store_clear(carrystore);
-
-  if (herelist) {
-    gtk_list_store_clear(herestore);
-  }
+  ResizeInventoryRows(&Inven->CarriedRows, NumObjects);
+  ResizeInventoryRows(&Inven->HereRows, NumObjects);
+  ShowValue = AreDrugs && HaveAbility(ClientData.Play, A_DRUGVALUE);
 
   for (i = 0; i < NumObjects; i++) {
+    struct InventoryRow *hererow = &Inven->HereRows.Row[i];
+    struct InventoryRow *carryrow = &Inven->CarriedRows.Row[i];
+
     if (AreDrugs) {
-      titles[0] = dpg_strdup_printf(_("%/Inventory drug name/%tde"),
-                                    Drug[i].Name);
+      name = Drug[i].Name;
       price = Objects[i].Price;
     } else {
-      titles[0] = dpg_strdup_printf(_("%/Inventory gun name/%tde"),
-                                    Gun[i].Name);
+      name = Gun[i].Name;
       price = Gun[i].Price;
     }
 
-    if (herelist && price > 0) {
+    hererow->Shown = (herelist && price > 0);
+    if (hererow->Shown) {
       CanBuy = TRUE;
-      titles[1] = FormatPrice(price);
-      gtk_list_store_append(herestore, &iter);
-      gtk_list_store_set(herestore, &iter, INVEN_COL_NAME, titles[0],
-                         INVEN_COL_NUM, titles[1], INVEN_COL_INDEX, i, -1);
-      g_free(titles[1]);
-      if (i == selectrow[1]) {
-        gtk_tree_selection_select_iter(gtk_tree_view_get_selection(tv[1]),
-                                       &iter);
-      }
+      SetInventoryRowName(hererow, name, AreDrugs);
+      SetInventoryRowNum(hererow, price, -1, FALSE);
     }
 
-    if (Objects[i].Carried > 0) {
+    carryrow->Shown = (Objects[i].Carried > 0);
+    if (carryrow->Shown) {
       if (price > 0) {
         CanSell = TRUE;
       } else {
         CanDrop = TRUE;
       }
-      if (HaveAbility(ClientData.Play, A_DRUGVALUE) && AreDrugs) {
-        titles[1] = dpg_strdup_printf("%d @ %P", Objects[i].Carried,
-                                      Objects[i].TotalValue /
-                                      Objects[i].Carried);
-      } else {
-        titles[1] = g_strdup_printf("%d", Objects[i].Carried);
-      }
-      gtk_list_store_append(carrystore, &iter);
-      gtk_list_store_set(carrystore, &iter, INVEN_COL_NAME, titles[0],
-                         INVEN_COL_NUM, titles[1], INVEN_COL_INDEX, i, -1);
-      g_free(titles[1]);
-      if (i == selectrow[0]) {
-        gtk_tree_selection_select_iter(gtk_tree_view_get_selection(tv[0]),
-                                       &iter);
-      }
+      SetInventoryRowName(carryrow, name, AreDrugs);
+      SetInventoryRowNum(carryrow, ShowValue ? Objects[i].TotalValue /
+                                   Objects[i].Carried : 0,
+                         Objects[i].Carried, ShowValue);
     }
-    g_free(titles[0]);
+  }
+
+  SyncInventoryStore(GTK_LIST_STORE(gtk_tree_view_get_model(tv[0])),
+                     &Inven->CarriedRows);
+  if (herelist) {
+    SyncInventoryStore(GTK_LIST_STORE(gtk_tree_view_get_model(tv[1])),
+                       &Inven->HereRows);
   }
 
 #ifdef CYGWIN
-  /* Our Win32 GtkTreeView implementation doesn't auto-sort, so force it */
+  /* Our Win32 GtkTreeView implementation doesn't auto-sort, so force it
+     (this does nothing if no rows were changed) */
   if (herelist) {
     gtk_tree_view_sort(GTK_TREE_VIEW(herelist));
   }
@@ -1971,6 +2316,9 @@ void GuiStartGame(void)
   }
   StripTerminators(GetPlayerName(Play));
   InitAbilities(Play);
+  /* We format and sort high scores ourselves */
+  SetAbility(Play, A_HISCOREDATA, TRUE);
+  SetAbility(Play, A_RULESET, TRUE);
   SendAbilities(Play);
   SendNullClientMessage(Play, C_NONE, C_NAME, NULL, GetPlayerName(Play));
   InGame = TRUE;
@@ -2209,6 +2557,7 @@ gboolean GtkLoop(int *argc, char **argv[],
 
   /* Set up message handlers */
   ClientMessageHandlerPt = HandleClientMessage;
+  ClientMessageDispatchPt = DispatchClientMessage;
 
   if (!CheckHighScoreFileConfig()) {
     return TRUE;
@@ -2852,31 +3201,74 @@ GtkWidget *CreatePlayerList(void)
   return view;
 }
 
+/* 
+ * Brings the list of players in "clist" up to date. This is done in
+ * place rather than by rebuilding the list, so that the selection
+ * survives: players who have left are removed, renamed players are
+ * updated, and new players are inserted in the order they joined.
+ */
 void UpdatePlayerList(GtkWidget *clist, gboolean IncludeSelf)
 {
   GtkListStore *store;
+  GtkTreeModel *model;
   GSList *list;
-  GtkTreeIter iter;
+  GtkTreeIter iter, *iters;
+  GHashTable *wanted;
   Player *Play;
+  gchar *name;
+  gint i, nrows, pos;
 
-  store = GTK_LIST_STORE(gtk_tree_view_get_model(GTK_TREE_VIEW(clist)));
+  /* Values in "wanted": 1 = not yet in the list, 2 = already listed */
+  wanted = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (list = FirstClient; list; list = g_slist_next(list)) {
+    Play = (Player *)list->data;
+    if (IncludeSelf || Play != ClientData.Play) {
+      g_hash_table_insert(wanted, Play, GINT_TO_POINTER(1));
+    }
+  }
+
+  model = gtk_tree_view_get_model(GTK_TREE_VIEW(clist));
+  store = GTK_LIST_STORE(model);
+  nrows = gtk_tree_model_iter_n_children(model, NULL);
+  iters = g_new(GtkTreeIter, MAX(nrows, 1));
+  for (i = 0; i < nrows; i++) {
+    gtk_tree_model_iter_nth_child(model, &iters[i], NULL, i);
+  }
 
-  /* Don't update the widget until we're done */
-  g_object_ref(store);
-  gtk_tree_view_set_model(GTK_TREE_VIEW(clist), NULL);
+  /* Work backwards, so that removing a row never moves one we have yet
+     to look at (on Win32, iterators are just row numbers) */
+  for (i = nrows - 1; i >= 0; i--) {
+    gtk_tree_model_get(model, &iters[i], PLAYER_COL_PT, &Play,
+                       PLAYER_COL_NAME, &name, -1);
+    if (GPOINTER_TO_INT(g_hash_table_lookup(wanted, Play)) != 1) {
+      gtk_list_store_remove(store, &iters[i]);
+    } else {
+      g_hash_table_insert(wanted, Play, GINT_TO_POINTER(2));
+      if (!name || strcmp(name, GetPlayerName(Play)) != 0) {
+        gtk_list_store_set(store, &iters[i],
+                           PLAYER_COL_NAME, GetPlayerName(Play), -1);
+      }
+    }
+    g_free(name);
+  }
+  g_free(iters);
 
-  gtk_list_store_clear(store);
+  pos = 0;
   for (list = FirstClient; list; list = g_slist_next(list)) {
     Play = (Player *)list->data;
-    if (IncludeSelf || Play != ClientData.Play) {
-      gtk_list_store_append(store, &iter);
+    switch (GPOINTER_TO_INT(g_hash_table_lookup(wanted, Play))) {
+    case 1:
+      gtk_list_store_insert(store, &iter, pos);
       gtk_list_store_set(store, &iter, PLAYER_COL_NAME, GetPlayerName(Play),
                          PLAYER_COL_PT, Play, -1);
+      pos++;
+      break;
+    case 2:
+      pos++;
+      break;
     }
   }
-
-  gtk_tree_view_set_model(GTK_TREE_VIEW(clist), GTK_TREE_MODEL(store));
-  g_object_unref(store);
+  g_hash_table_destroy(wanted);
 }
 
 static void ErrandOK(GtkWidget *widget, GtkWidget *clist)
@@ -3069,6 +3461,8 @@ void CreateInventory(GtkWidget *hbox, gchar *Objects,
   widgets->CarriedFrame = frame[1] = gtk_frame_new(text->str);
 
   widgets->HereList = widgets->CarriedList = NULL;
+  widgets->HereRows.Num = widgets->CarriedRows.Num = 0;
+  widgets->HereRows.Row = widgets->CarriedRows.Row = NULL;
   mini = (CreateHere ? 0 : 1);
   for (i = mini; i < 2; i++) {
     GtkWidget *hbox2 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
@@ -3257,6 +3651,8 @@ void GunShopDialog(void)
   hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 7);
   CreateInventory(hbox, Names.Guns, accel_group, TRUE, TRUE,
                   &ClientData.Gun, G_CALLBACK(DealGuns));
+  g_signal_connect(G_OBJECT(window), "destroy",
+                   G_CALLBACK(DestroyInventory), &ClientData.Gun);
 
   gtk_box_pack_start(GTK_BOX(vbox), hbox, TRUE, TRUE, 0);
 
@@ -3335,12 +3731,18 @@ static void CreateSpyReports(void)
   gtk_widget_show_all(window);
 }
 
+static void DestroySpyInventory(GtkWidget *widget, gpointer data)
+{
+  DestroyInventory(widget, data);
+  g_free(data);
+}
+
 void DisplaySpyReports(Player *Play)
 {
   GtkWidget *dialog, *notebook, *vbox, *hbox, *frame, *label, *grid;
   GtkAccelGroup *accel_group;
   struct StatusWidgets Status;
-  struct InventoryWidgets SpyDrugs, SpyGuns;
+  struct InventoryWidgets *SpyDrugs, *SpyGuns;
 
   if (!SpyReportsDialog)
     CreateSpyReports();
@@ -3355,18 +3757,27 @@ void DisplaySpyReports(Player *Play)
   gtk_container_add(GTK_CONTAINER(frame), grid);
   gtk_box_pack_start(GTK_BOX(vbox), frame, FALSE, FALSE, 0);
 
+  /* The page outlives this function, so its inventory widgets (and
+     their cached rows) are freed when the page is destroyed */
+  SpyDrugs = g_new(struct InventoryWidgets, 1);
+  SpyGuns = g_new(struct InventoryWidgets, 1);
+  g_signal_connect(G_OBJECT(vbox), "destroy",
+                   G_CALLBACK(DestroySpyInventory), SpyDrugs);
+  g_signal_connect(G_OBJECT(vbox), "destroy",
+                   G_CALLBACK(DestroySpyInventory), SpyGuns);
+
   hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
-  CreateInventory(hbox, Names.Drugs, accel_group, FALSE, FALSE, &SpyDrugs,
+  CreateInventory(hbox, Names.Drugs, accel_group, FALSE, FALSE, SpyDrugs,
                   NULL);
-  CreateInventory(hbox, Names.Guns, accel_group, FALSE, FALSE, &SpyGuns,
+  CreateInventory(hbox, Names.Guns, accel_group, FALSE, FALSE, SpyGuns,
                   NULL);
 
   gtk_box_pack_start(GTK_BOX(vbox), hbox, TRUE, TRUE, 0);
   label = gtk_label_new(GetPlayerName(Play));
 
   DisplayStats(Play, &Status);
-  UpdateInventory(&SpyDrugs, Play->Drugs, NumDrug, TRUE);
-  UpdateInventory(&SpyGuns, Play->Guns, NumGun, FALSE);
+  UpdateInventory(SpyDrugs, Play->Drugs, NumDrug, TRUE);
+  UpdateInventory(SpyGuns, Play->Guns, NumGun, FALSE);
 
   gtk_notebook_append_page(GTK_NOTEBOOK(notebook), vbox, label);
 
@@ -32,6 +32,7 @@
 #include "network.h"
 #include "message.h"
 #include "nls.h"
+#include "serverprobe.h"
 #include "gtkport/gtkport.h"
 #include "gtk_client.h"
 #include "newgamedia.h"
@@ -42,7 +43,10 @@ struct StartGameStruct {
   Player *play;
 #ifdef NETWORKING
   CurlConnection *MetaConn;
-  GSList *NewMetaList;
+  MetaListParser MetaParser;
+  GPtrArray *NewMetaList;
+  ProbeSet *Probes;
+  guint ProbeTimer;
   NBCallBack sockstat;
 #endif
 };
@@ -51,10 +55,12 @@ static struct StartGameStruct stgam;
 
 #ifdef NETWORKING
 static void SocksAuthDialog(NetworkBuffer *netbuf, gpointer data);
-static void FillMetaServerList(gboolean UseNewList);
+static void FillMetaServerList(void);
+static void AddMetaServer(ServerData *NewServer, gpointer data);
+static void StopMetaServerProbes(void);
 
 /* List of servers on the metaserver */
-static GSList *MetaList = NULL;
+static GPtrArray *MetaList = NULL;
 
 #endif /* NETWORKING */
 
@@ -111,8 +117,8 @@ static gboolean glib_socket(GIOChannel *ch, GIOCondition condition,
       dp_g_source_remove(g->timer_event);
       g->timer_event = 0;
     }
-    if (!err)
-      HandleWaitingMetaServerData(stgam.MetaConn, &stgam.NewMetaList, &err);
+    FinishMetaListParser(&stgam.MetaParser, err ? NULL : stgam.MetaConn,
+                         err ? NULL : &err);
     if (err) {
       ReportMetaConnectError(err);
       g_error_free(err);
@@ -121,7 +127,6 @@ static gboolean glib_socket(GIOChannel *ch, GIOCondition condition,
     }
 
     CloseCurlConnection(stgam.MetaConn);
-    FillMetaServerList(TRUE);
     return FALSE;
   }
 }
@@ -133,6 +138,7 @@ static gboolean glib_timeout(gpointer userp)
   int still_running;
   if (!CurlConnectionSocketAction(g, CURL_SOCKET_TIMEOUT, 0, &still_running,
                                   &err)) {
+    FinishMetaListParser(&stgam.MetaParser, NULL, NULL);
     ReportMetaConnectError(err);
     g_error_free(err);
   }
@@ -140,6 +146,18 @@ static gboolean glib_timeout(gpointer userp)
   return G_SOURCE_REMOVE;
 }
 
+/* 
+ * Stops any metaserver list request that is in progress.
+ */
+static void AbandonMetaServerList(void)
+{
+  StopMetaServerProbes();
+  if (stgam.MetaConn && stgam.MetaConn->running) {
+    FinishMetaListParser(&stgam.MetaParser, NULL, NULL);
+    CloseCurlConnection(stgam.MetaConn);
+  }
+}
+
 static void ConnectError(void)
 {
   GString *neterr;
@@ -192,9 +210,7 @@ static void DoConnect(void)
 
   /* Terminate any existing connection attempts */
   ShutdownNetworkBuffer(NetBuf);
-  if (stgam.MetaConn->running) {
-    CloseCurlConnection(stgam.MetaConn);
-  }
+  AbandonMetaServerList();
 
   oldstatus = NetBuf->status;
   oldsocks = NetBuf->sockstat;
@@ -227,58 +243,166 @@ static void ConnectToServer(GtkWidget *widget, gpointer data)
 enum {
   META_COL_SERVER = 0,
   META_COL_PORT,
+  META_COL_PING,
   META_COL_VERSION,
   META_COL_PLAYERS,
   META_COL_COMMENT,
   META_NUM_COLS
 };
 
-static void FillMetaServerList(gboolean UseNewList)
+static void AppendMetaServer(GtkListStore *store, ServerData *ThisServer)
 {
-  GtkWidget *metaserv;
-  GtkListStore *store;
-  ServerData *ThisServer;
   GtkTreeIter iter;
-  GSList *ListPt;
+  char *players, *latency;
 
-  if (UseNewList && !stgam.NewMetaList)
-    return;
+  if (ThisServer->CurPlayers == -1) {
+    /* Displayed if we don't know how many players are logged on to a
+       server */
+    players = _("Unknown");
+  } else {
+    /* e.g. "5 of 20" means 5 players are logged on to a server, out of
+       a maximum of 20 */
+    players = g_strdup_printf(_("%d of %d"), ThisServer->CurPlayers,
+                                ThisServer->MaxPlayers);
+  }
+  latency = FormatServerLatency(ThisServer);
+  gtk_list_store_append(store, &iter);
+  gtk_list_store_set(store, &iter, META_COL_SERVER, ThisServer->Name,
+                     META_COL_PORT, ThisServer->Port,
+                     META_COL_PING, latency,
+                     META_COL_VERSION, ThisServer->Version,
+                     META_COL_PLAYERS, players,
+                     META_COL_COMMENT, ThisServer->Comment, -1);
+  g_free(latency);
+  if (ThisServer->CurPlayers != -1)
+    g_free(players);
+}
+
+static GtkListStore *GetMetaServerStore(void)
+{
+  return GTK_LIST_STORE(gtk_tree_view_get_model(
+                                GTK_TREE_VIEW(stgam.metaserv)));
+}
 
-  metaserv = stgam.metaserv;
-  store = GTK_LIST_STORE(gtk_tree_view_get_model(GTK_TREE_VIEW(metaserv)));
+/* 
+ * Displays the servers already received from the metaserver.
+ */
+static void FillMetaServerList(void)
+{
+  GtkListStore *store;
+  guint i;
 
+  store = GetMetaServerStore();
   gtk_list_store_clear(store);
+  for (i = 0; MetaList && i < MetaList->len; i++) {
+    AppendMetaServer(store, (ServerData *)g_ptr_array_index(MetaList, i));
+  }
+}
+
+/* 
+ * Called as each server arrives from the metaserver. The old list is
+ * kept on display until the first server of the new list arrives.
+ */
+static void AddMetaServer(ServerData *NewServer, gpointer data)
+{
+  GtkListStore *store;
+  gchar *text;
 
-  if (UseNewList) {
-    ClearServerList(&MetaList);
+  store = GetMetaServerStore();
+  if (stgam.NewMetaList) {
+    if (MetaList) {
+      g_ptr_array_unref(MetaList);
+    }
+    /* The parser keeps adding to this list, now under its new name */
     MetaList = stgam.NewMetaList;
     stgam.NewMetaList = NULL;
+    gtk_list_store_clear(store);
   }
+  AppendMetaServer(store, NewServer);
 
-  for (ListPt = MetaList; ListPt; ListPt = g_slist_next(ListPt)) {
-    char *players;
-    ThisServer = (ServerData *)(ListPt->data);
-    if (ThisServer->CurPlayers == -1) {
-      /* Displayed if we don't know how many players are logged on to a
-         server */
-      players = _("Unknown");
-    } else {
-      /* e.g. "5 of 20" means 5 players are logged on to a server, out of
-         a maximum of 20 */
-      players = g_strdup_printf(_("%d of %d"), ThisServer->CurPlayers,
-                                  ThisServer->MaxPlayers);
-    }
-    gtk_list_store_append(store, &iter);
-    gtk_list_store_set(store, &iter, META_COL_SERVER, ThisServer->Name,
-		       META_COL_PORT, ThisServer->Port,
-		       META_COL_VERSION, ThisServer->Version,
-		       META_COL_PLAYERS, players,
-		       META_COL_COMMENT, ThisServer->Comment, -1);
-    if (ThisServer->CurPlayers != -1)
-      g_free(players);
+  /* Status displayed while the list of servers is arriving */
+  text = g_strdup_printf(_("Status: Received %u servers..."),
+                         MetaList->len);
+  SetStartGameStatus(text);
+  g_free(text);
+}
+
+/* 
+ * Called when a server has been pinged; shows its latency.
+ */
+static void MetaServerProbed(ServerData *Server, guint index, gpointer data)
+{
+  GtkListStore *store;
+  GtkTreeIter iter;
+  gchar *latency;
+
+  store = GetMetaServerStore();
+  if (gtk_tree_model_iter_nth_child(GTK_TREE_MODEL(store), &iter, NULL,
+                                    index)) {
+    latency = FormatServerLatency(Server);
+    gtk_list_store_set(store, &iter, META_COL_PING, latency, -1);
+    g_free(latency);
   }
 }
 
+/* 
+ * Called periodically while servers are being pinged. Once they have
+ * all been done (and the whole list has arrived), sorts the list so that
+ * the best servers come first.
+ */
+static gboolean MetaProbeTimeout(gpointer data)
+{
+  UpdateServerProbes(stgam.Probes);
+  if (stgam.MetaConn->running || !ServerProbesFinished(stgam.Probes)) {
+    return TRUE;
+  }
+  stgam.ProbeTimer = 0;
+  FreeServerProbes(stgam.Probes);
+  stgam.Probes = NULL;
+  if (MetaList && !stgam.NewMetaList) {
+    RankServerList(MetaList);
+    FillMetaServerList();
+  }
+  return FALSE;
+}
+
+static void StopMetaServerProbes(void)
+{
+  if (stgam.ProbeTimer) {
+    dp_g_source_remove(stgam.ProbeTimer);
+    stgam.ProbeTimer = 0;
+  }
+  FreeServerProbes(stgam.Probes);
+  stgam.Probes = NULL;
+}
+
+static gboolean ProbeSocketHandler(GIOChannel *source,
+                                   GIOCondition condition, gpointer data)
+{
+  HandleServerProbe((ServerProbe *)data, condition & G_IO_IN,
+                    condition & G_IO_OUT, condition & G_IO_ERR);
+  return TRUE;
+}
+
+static void ProbeSocketStatus(NetworkBuffer *NetBuf, gboolean Read,
+                              gboolean Write, gboolean Exception,
+                              gboolean CallNow)
+{
+  if (NetBuf->InputTag)
+    dp_g_source_remove(NetBuf->InputTag);
+  NetBuf->InputTag = 0;
+  if (Read || Write) {
+    NetBuf->InputTag = dp_g_io_add_watch(NetBuf->ioch,
+                                     (Read ? G_IO_IN : 0) |
+                                     (Write ? G_IO_OUT : 0) |
+                                     (Exception ? G_IO_ERR : 0),
+                                     ProbeSocketHandler,
+                                     NetBuf->CallBackData);
+  }
+  if (CallNow)
+    ProbeSocketHandler(NetBuf->ioch, 0, NetBuf->CallBackData);
+}
+
 void DisplayConnectStatus(NBStatus oldstatus, NBSocksStatus oldsocks)
 {
   NBStatus status;
@@ -332,11 +456,13 @@ static void UpdateMetaServerList(GtkWidget *widget)
 
   /* Terminate any existing connection attempts */
   ShutdownNetworkBuffer(&stgam.play->NetBuf);
-  if (stgam.MetaConn->running) {
-    CloseCurlConnection(stgam.MetaConn);
-  }
+  AbandonMetaServerList();
 
-  ClearServerList(&stgam.NewMetaList);
+  if (stgam.NewMetaList) {
+    ClearServerList(stgam.NewMetaList);
+  } else {
+    stgam.NewMetaList = NewServerList();
+  }
 
   /* Message displayed during the attempted connect to the metaserver */
   text = g_strdup_printf(_("Status: Attempting to contact %s..."),
@@ -344,7 +470,16 @@ static void UpdateMetaServerList(GtkWidget *widget)
   SetStartGameStatus(text);
   g_free(text);
 
-  if (!OpenMetaHttpConnection(stgam.MetaConn, &tmp_error)) {
+  if (OpenMetaHttpConnection(stgam.MetaConn, &stgam.MetaParser,
+                             stgam.NewMetaList, AddMetaServer, NULL,
+                             &tmp_error)) {
+    /* Ping each server as it arrives */
+    stgam.Probes = StartServerProbes(stgam.NewMetaList, ProbeSocketStatus,
+                                     MetaServerProbed, NULL);
+    if (stgam.Probes) {
+      stgam.ProbeTimer = dp_g_timeout_add(250, MetaProbeTimeout, NULL);
+    }
+  } else {
     text = g_strdup_printf(_("Status: ERROR: %s"), tmp_error->message);
     g_error_free(tmp_error);
     SetStartGameStatus(text);
@@ -392,10 +527,13 @@ static void CloseNewGameDia(GtkWidget *widget, gpointer data)
     ShutdownNetworkBuffer(&stgam.play->NetBuf);
   }
   if (stgam.MetaConn) {
-    CloseCurlConnection(stgam.MetaConn);
+    AbandonMetaServerList();
     stgam.MetaConn = NULL;
   }
-  ClearServerList(&stgam.NewMetaList);
+  if (stgam.NewMetaList) {
+    g_ptr_array_unref(stgam.NewMetaList);
+    stgam.NewMetaList = NULL;
+  }
 #endif
 
   /* Remember which tab we chose for the next time we use this dialog */
@@ -416,7 +554,8 @@ static GtkTreeModel *create_metaserver_model(void)
   GtkListStore *store;
 
   store = gtk_list_store_new(META_NUM_COLS, G_TYPE_STRING, G_TYPE_UINT,
-                             G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+                             G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
+                             G_TYPE_STRING);
   return GTK_TREE_MODEL(store);
 }
 
@@ -433,9 +572,10 @@ static GtkWidget *create_metaserver_view(GtkWidget **pack_widg)
   /* Column titles of metaserver information */
   server_titles[0] = _("Server");  expand[0] = TRUE;
   server_titles[1] = _("Port");    expand[1] = FALSE;
-  server_titles[2] = _("Version"); expand[2] = FALSE;
-  server_titles[3] = _("Players"); expand[3] = FALSE;
-  server_titles[4] = _("Comment"); expand[4] = TRUE;
+  server_titles[2] = _("Ping");    expand[2] = FALSE;
+  server_titles[3] = _("Version"); expand[3] = FALSE;
+  server_titles[4] = _("Players"); expand[4] = FALSE;
+  server_titles[5] = _("Comment"); expand[5] = TRUE;
 
   view = gtk_scrolled_tree_view_new(pack_widg);
   renderer = gtk_cell_renderer_text_new();
@@ -496,6 +636,8 @@ void NewGameDialog(Player *play)
 
   stgam.MetaConn = MetaConn;
   stgam.NewMetaList = NULL;
+  stgam.Probes = NULL;
+  stgam.ProbeTimer = 0;
   stgam.sockstat = sockstat;
 
 #endif /* NETWORKING */
@@ -669,7 +811,7 @@ void NewGameDialog(Player *play)
   if (UpdateMeta) {
     UpdateMetaServerList(NULL);
   } else {
-    FillMetaServerList(FALSE);
+    FillMetaServerList();
   }
 #endif
 
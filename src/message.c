@@ -33,6 +33,7 @@
 #include <sys/socket.h>
 #endif
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <glib.h>
@@ -42,6 +43,7 @@
 #include "message.h"
 #include "network.h"
 #include "nls.h"
+#include "profiler.h"
 #include "serverside.h"
 #include "sound.h"
 #include "tstring.h"
@@ -52,6 +54,12 @@
 #define MAXREADBUF   (32768)
 #define MAXWRITEBUF  (65536)
 
+/* Largest number of locations, drugs or guns accepted from a server */
+#define MAXITEMS     (10000)
+
+/* Number of delta updates sent to a client between full updates */
+#define MAXDELTAS    (16)
+
 /* *INDENT-OFF* */
 /* dopewars is built around a client-server model. Each client handles the
    user interface, but all the important calculation and processing is
@@ -102,10 +110,13 @@
 
 GSList *FirstClient = NULL;
 
-static Converter *netconv = NULL;
-
 void (*ClientMessageHandlerPt)(char *, Player *) = NULL;
 
+/* If set, used instead of ClientMessageHandlerPt in single-player mode,
+ * to pass messages to the client without formatting them as text */
+void (*ClientMessageDispatchPt)(Player *, AICode, MsgCode, char *,
+                                Player *) = NULL;
+
 /* 
  * Sends a message from player "From" to player "To" via. the server.
  * AI, Code and Data define the message.
@@ -139,9 +150,39 @@ void DoSendClientMessage(Player *From, AICode AI, MsgCode Code,
                          Player *To, char *Data, Player *BufOwn)
 {
   GString *text;
-  Player *ServerFrom;
+  Player *ServerFrom, *ServerTo;
+  gchar *DataCopy;
 
   g_assert(BufOwn != NULL);
+#ifdef NETWORKING
+  if (!Network) {
+#endif
+    if (From)
+      ServerFrom = GetPlayerByName(GetPlayerName(From), FirstServer);
+    else if (FirstServer)
+      ServerFrom = (Player *)(FirstServer->data);
+    else {
+      ServerFrom = g_new(Player, 1);
+      FirstServer = AddPlayer(0, ServerFrom, FirstServer);
+    }
+    if (HaveAbility(BufOwn, A_PLAYERID)) {
+      /* The server is in this process, so just hand it the message,
+       * identifying players by ID just as HandleServerMessage would */
+      ServerTo = To ? GetPlayerByID(To->ID, FirstServer) : &Noone;
+      if (!ServerFrom || !ServerTo) {
+        g_warning("Bad message");
+        return;
+      }
+      HOTPATH_COUNT(HP_LOCALMSG, 1);
+      DataCopy = g_strdup(Data ? Data : "");
+      DispatchServerMessage(ServerFrom, AI, Code, ServerTo, DataCopy);
+      g_free(DataCopy);
+      return;
+    }
+#ifdef NETWORKING
+  }
+#endif
+
   text = g_string_new(NULL);
   if (HaveAbility(BufOwn, A_PLAYERID)) {
     if (To)
@@ -155,14 +196,6 @@ void DoSendClientMessage(Player *From, AICode AI, MsgCode Code,
 #ifdef NETWORKING
   if (!Network) {
 #endif
-    if (From)
-      ServerFrom = GetPlayerByName(GetPlayerName(From), FirstServer);
-    else if (FirstServer)
-      ServerFrom = (Player *)(FirstServer->data);
-    else {
-      ServerFrom = g_new(Player, 1);
-      FirstServer = AddPlayer(0, ServerFrom, FirstServer);
-    }
     HandleServerMessage(text->str, ServerFrom);
 #ifdef NETWORKING
   } else {
@@ -191,6 +224,29 @@ void SendQuestion(Player *From, AICode AI, Player *To, char *Data)
   SendServerMessage(From, AI, C_QUESTION, To, Data);
 }
 
+#ifdef NETWORKING
+/* 
+ * Returns the write queue tag for a server message with the given code,
+ * claiming to be from "From". Messages that carry complete state (so
+ * that a later message makes an earlier one redundant) get a non-zero
+ * tag, which allows them to be coalesced for slow clients.
+ */
+static guint GetMessageTag(Player *From, MsgCode Code, char *Data)
+{
+  switch (Code) {
+  case C_UPDATE:
+    /* Delta updates (see SendPlayerDelta) depend on those before them */
+    if (Data && Data[0] == '*')
+      return 0;
+    /* fall through */
+  case C_DRUGHERE:
+    return ((guint)(From ? From->ID + 1 : 0) << 8) | (guint)Code;
+  default:
+    return 0;
+  }
+}
+#endif /* NETWORKING */
+
 /* 
  * Sends a message from the server to client player "To" with computer
  * code "AI", human-readable code "Code" and data "Data", claiming
@@ -200,9 +256,30 @@ void SendServerMessage(Player *From, AICode AI, MsgCode Code,
                        Player *To, char *Data)
 {
   GString *text;
+  Player *ClientFrom;
+  gchar *DataCopy;
 
   if (IsCop(To))
     return;
+#ifdef NETWORKING
+  if (!Network) {
+#endif
+    if (ClientMessageDispatchPt && HaveAbility(To, A_PLAYERID)) {
+      /* Hand the message straight to the client in this process */
+      ClientFrom = From ? GetPlayerByID(From->ID, FirstClient) : &Noone;
+      if (ClientFrom) {
+        HOTPATH_COUNT(HP_LOCALMSG, 1);
+        DataCopy = g_strdup(Data ? Data : "");
+        (*ClientMessageDispatchPt)(ClientFrom, AI, Code, DataCopy,
+                                   (Player *)(FirstClient->data));
+        g_free(DataCopy);
+      }
+      return;
+    }
+#ifdef NETWORKING
+  }
+#endif
+  PROFILE_ENTER(PS_FORMAT, Code);
   text = g_string_new(NULL);
   if (HaveAbility(To, A_PLAYERID)) {
     if (From)
@@ -220,10 +297,12 @@ void SendServerMessage(Player *From, AICode AI, MsgCode Code,
       (*ClientMessageHandlerPt)(text->str, (Player *)(FirstClient->data));
 #ifdef NETWORKING
   } else {
-    QueuePlayerMessageForSend(To, text->str);
+    QueueTaggedPlayerMessageForSend(To, text->str,
+                                    GetMessageTag(From, Code, Data));
   }
 #endif
   g_string_free(text, TRUE);
+  PROFILE_LEAVE();
 }
 
 /* 
@@ -253,6 +332,11 @@ void InitAbilities(Player *Play)
   Play->Abil.Local[A_DONEFIGHT] = TRUE;
   Play->Abil.Local[A_UTF8] = TRUE;
   Play->Abil.Local[A_DATE] = TRUE;
+  Play->Abil.Local[A_DELTA] = TRUE;
+
+  /* Server-side extensions that clients must ask for explicitly */
+  Play->Abil.Local[A_HISCOREDATA] = Server;
+  Play->Abil.Local[A_RULESET] = Server;
 
   if (!Network) {
     for (i = 0; i < A_NUM; i++) {
@@ -262,14 +346,255 @@ void InitAbilities(Player *Play)
   }
 }
 
+#ifdef NETWORKING
+/* 
+ * Client-side cache of the rulesets sent by servers (see SendMiscData).
+ * Each ruleset is kept in a file named by its hash, and an index file
+ * records the hash last sent by each server, so that it can be offered
+ * to that server the next time we connect.
+ */
+#define RULESET_INDEX "servers"
+
+static GString *RulesetRecv = NULL;     /* The ruleset being received */
+static GMappedFile *RulesetMap = NULL;  /* The ruleset offered to the server */
+static gchar *RulesetOffered = NULL;    /* Hash of the offered ruleset */
+
+/* 
+ * Returns TRUE if "hash" looks like a ruleset hash (it is used as a
+ * filename, so mustn't contain anything else).
+ */
+static gboolean IsRulesetHash(const gchar *hash)
+{
+  const gchar *pt;
+
+  for (pt = hash; *pt; pt++) {
+    if (!g_ascii_isxdigit(*pt))
+      return FALSE;
+  }
+  return (pt > hash && pt - hash <= 128);
+}
+
+/* 
+ * If "line" of the index file is for the server "key", returns the
+ * hash on that line, otherwise NULL.
+ */
+static gchar *GetIndexHash(gchar *line, const gchar *key)
+{
+  gsize keylen = strlen(key);
+
+  if (strncmp(line, key, keylen) == 0 && line[keylen] == ' ')
+    return &line[keylen + 1];
+  else
+    return NULL;
+}
+
+/* 
+ * Returns the hash of the ruleset last sent by the server we are
+ * connecting to, or NULL if we have none.
+ */
+static gchar *LookupRulesetHash(const gchar *dir)
+{
+  gchar *path, *contents, *key, *line, *next, *hash = NULL;
+
+  path = g_build_filename(dir, RULESET_INDEX, NULL);
+  if (g_file_get_contents(path, &contents, NULL, NULL)) {
+    key = g_strdup_printf("%s:%d", ServerName, Port);
+    for (line = contents; line && !hash; line = next) {
+      next = strchr(line, '\n');
+      if (next)
+        *next++ = '\0';
+      hash = g_strdup(GetIndexHash(line, key));
+    }
+    g_free(key);
+    g_free(contents);
+  }
+  g_free(path);
+  return hash;
+}
+
+/* 
+ * Records "hash" as the ruleset of the server we are connected to. The
+ * server's previous ruleset is removed if no other server uses it.
+ */
+static void StoreRulesetHash(const gchar *dir, const gchar *hash)
+{
+  gchar *path, *contents, *key, *line, *next, *oldhash = NULL;
+  GString *text;
+
+  path = g_build_filename(dir, RULESET_INDEX, NULL);
+  key = g_strdup_printf("%s:%d", ServerName, Port);
+  text = g_string_new("");
+  g_string_printf(text, "%s %s\n", key, hash);
+  if (g_file_get_contents(path, &contents, NULL, NULL)) {
+    for (line = contents; line; line = next) {
+      next = strchr(line, '\n');
+      if (next)
+        *next++ = '\0';
+      if (GetIndexHash(line, key)) {
+        g_free(oldhash);
+        oldhash = g_strdup(GetIndexHash(line, key));
+      } else if (line[0]) {
+        g_string_append_printf(text, "%s\n", line);
+      }
+    }
+    g_free(contents);
+  }
+  g_file_set_contents(path, text->str, text->len, NULL);
+  g_free(path);
+
+  if (oldhash && strcmp(oldhash, hash) != 0 && IsRulesetHash(oldhash)) {
+    line = g_strdup_printf(" %s\n", oldhash);
+    if (!strstr(text->str, line)) {
+      path = g_build_filename(dir, oldhash, NULL);
+      remove(path);
+      g_free(path);
+    }
+    g_free(line);
+  }
+  g_free(oldhash);
+  g_free(key);
+  g_string_free(text, TRUE);
+}
+
+/* 
+ * Returns TRUE if "len" bytes of ruleset "data" have the given hash, so
+ * that a truncated or corrupted ruleset is never cached or replayed.
+ */
+static gboolean CheckRulesetHash(const gchar *data, gsize len,
+                                 const gchar *hash)
+{
+  gchar *sum;
+  gboolean match;
+
+  sum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, (const guchar *)data,
+                                    len);
+  match = (g_ascii_strcasecmp(sum, hash) == 0);
+  g_free(sum);
+  return match;
+}
+
+static void ForgetRuleset(void)
+{
+  if (RulesetRecv)
+    g_string_free(RulesetRecv, TRUE);
+  if (RulesetMap)
+    g_mapped_file_unref(RulesetMap);
+  g_free(RulesetOffered);
+  RulesetRecv = NULL;
+  RulesetMap = NULL;
+  RulesetOffered = NULL;
+}
+
+/* 
+ * Maps the ruleset last sent by the server we are connecting to (if we
+ * have one) and returns its hash, so that it can be offered to the
+ * server.
+ */
+static gchar *OfferCachedRuleset(void)
+{
+  gchar *dir, *path;
+
+  ForgetRuleset();
+  dir = GetRulesetCacheDir();
+  RulesetOffered = LookupRulesetHash(dir);
+  if (RulesetOffered && IsRulesetHash(RulesetOffered)) {
+    path = g_build_filename(dir, RulesetOffered, NULL);
+    RulesetMap = g_mapped_file_new(path, TRUE, NULL);
+    g_free(path);
+  }
+  if (RulesetMap && g_mapped_file_get_length(RulesetMap) == 0) {
+    g_mapped_file_unref(RulesetMap);
+    RulesetMap = NULL;
+  }
+  if (!RulesetMap) {
+    g_free(RulesetOffered);
+    RulesetOffered = NULL;
+  }
+  g_free(dir);
+  return RulesetOffered;
+}
+
+/* 
+ * Starts recording the C_DATA messages that the server sends, so that
+ * the ruleset can be cached when its hash arrives. The server sends
+ * these right after C_INIT, and only then, so recording stops at the
+ * first message that is not C_DATA.
+ */
+static void RecordRuleset(Player *Play)
+{
+  if (RulesetRecv)
+    g_string_free(RulesetRecv, TRUE);
+  RulesetRecv = HaveAbility(Play, A_RULESET) ? g_string_new("") : NULL;
+}
+
+/* 
+ * Handles the hash that the server sends after its ruleset. If the
+ * ruleset was "sent", it is saved in the cache; otherwise the server
+ * agreed that we have it already, so it is read back from the cache.
+ * Either way, the ruleset is only used if it matches the hash. Returns
+ * FALSE if the cached copy did not match, in which case the server
+ * needs to send the ruleset after all.
+ */
+static gboolean ReceiveRuleset(gchar *hash, gboolean sent)
+{
+  gchar *dir, *path, *line, *next, *end;
+  gboolean retval = TRUE;
+
+  if (!RulesetRecv || !IsRulesetHash(hash))
+    return TRUE;
+  if (sent) {
+    dir = GetRulesetCacheDir();
+    path = g_build_filename(dir, hash, NULL);
+    if (RulesetRecv->len > 0
+        && CheckRulesetHash(RulesetRecv->str, RulesetRecv->len, hash)
+        && g_mkdir_with_parents(dir, 0700) == 0
+        && g_file_set_contents(path, RulesetRecv->str, RulesetRecv->len,
+                               NULL)) {
+      StoreRulesetHash(dir, hash);
+    }
+    g_free(path);
+    g_free(dir);
+  } else if (RulesetMap && strcmp(hash, RulesetOffered) == 0) {
+    line = g_mapped_file_get_contents(RulesetMap);
+    end = line + g_mapped_file_get_length(RulesetMap);
+    if (CheckRulesetHash(line, end - line, hash)) {
+      /* Stop recording, and parse the (private, writable) mapping in
+       * place one C_DATA message per line */
+      g_string_free(RulesetRecv, TRUE);
+      RulesetRecv = NULL;
+      while (line < end && (next = memchr(line, '\n', end - line))) {
+        *next = '\0';
+        ReceiveMiscData(line);
+        line = next + 1;
+      }
+    } else {
+      /* The cached copy is damaged; remove it, so that we don't offer
+       * it again */
+      dir = GetRulesetCacheDir();
+      path = g_build_filename(dir, hash, NULL);
+      remove(path);
+      g_free(path);
+      g_free(dir);
+      retval = FALSE;
+    }
+  }
+  ForgetRuleset();
+  return retval;
+}
+#endif /* NETWORKING */
+
 /* 
  * Sends abilities of player "Play" to the other end of the client-server
- * connection.
+ * connection. Clients that cache rulesets also offer the hash of the
+ * ruleset they last got from this server.
  */
 void SendAbilities(Player *Play)
 {
   int i;
   gchar Data[A_NUM + 1];
+#ifdef NETWORKING
+  gchar *hash = NULL, *text;
+#endif
 
   if (!Network)
     return;
@@ -280,6 +605,16 @@ void SendAbilities(Player *Play)
   if (Server) {
     SendServerMessage(NULL, C_NONE, C_ABILITIES, Play, Data);
   } else {
+#ifdef NETWORKING
+    if (Play->Abil.Local[A_RULESET])
+      hash = OfferCachedRuleset();
+    if (hash) {
+      text = g_strdup_printf("%s^%s", Data, hash);
+      SendClientMessage(Play, C_NONE, C_ABILITIES, NULL, text);
+      g_free(text);
+      return;
+    }
+#endif
     SendClientMessage(Play, C_NONE, C_ABILITIES, NULL, Data);
   }
 }
@@ -287,22 +622,42 @@ void SendAbilities(Player *Play)
 /* 
  * Fills in the "remote" abilities of player "Play" using the message data
  * in "Data". These are the abilities of the server/client at the other
- * end of the connection.
+ * end of the connection. Clients may follow these with '^' and the hash
+ * of a ruleset that they have cached (see SendMiscData).
  */
 void ReceiveAbilities(Player *Play, gchar *Data)
 {
   int i, Length;
+  gchar *hash;
 
   InitAbilities(Play);
   if (!Network)
     return;
-  Play->Abil.RemoteNum = strlen(Data);
+  hash = strchr(Data, '^');
+  g_free(Play->RulesetHash);
+  Play->RulesetHash = hash ? g_strdup(hash + 1) : NULL;
+  Play->Abil.RemoteNum = hash ? hash - Data : strlen(Data);
   Length = MIN(Play->Abil.RemoteNum, A_NUM);
   for (i = 0; i < Length; i++) {
     Play->Abil.Remote[i] = (Data[i] == '1' ? TRUE : FALSE);
   }
 }
 
+#ifdef NETWORKING
+/* 
+ * Returns the converter used for the text sent to and received from
+ * "Play" over the network. Each connection has its own, so that one
+ * client speaking UTF-8 does not change the codeset used for the others.
+ */
+static Converter *GetPlayerConverter(Player *Play)
+{
+  if (!Play->Conv) {
+    Play->Conv = Conv_New();
+  }
+  return Play->Conv;
+}
+#endif
+
 /* 
  * Combines the local and remote abilities of player "Play". The resulting
  * shared abilities are used to determine when protocol extensions can be
@@ -316,9 +671,11 @@ void CombineAbilities(Player *Play)
     Play->Abil.Shared[i] = (Play->Abil.Remote[i] && Play->Abil.Local[i]);
   }
 
+#ifdef NETWORKING
   if (HaveAbility(Play, A_UTF8)) {
-    Conv_SetCodeset(netconv, "UTF-8");
+    Conv_SetCodeset(GetPlayerConverter(Play), "UTF-8");
   }
+#endif
 }
 
 /* 
@@ -374,14 +731,19 @@ gboolean PlayerHandleNetwork(Player *Play, gboolean ReadReady,
 gchar *GetWaitingPlayerMessage(Player *Play)
 {
   gchar *unconv, *conv;
+  Converter *netconv;
 
   unconv = GetWaitingMessage(&Play->NetBuf);
-  if (unconv && Conv_Needed(netconv)) {
+  if (!unconv) {
+    return NULL;
+  }
+  netconv = GetPlayerConverter(Play);
+  if (Conv_IsVerbatim(netconv, unconv, -1)) {
+    return unconv;
+  } else {
     conv = Conv_ToInternal(netconv, unconv, -1);
     g_free(unconv);
     return conv;
-  } else {
-    return unconv;
   }
 }
 
@@ -392,12 +754,28 @@ gboolean ReadPlayerDataFromWire(Player *Play)
 
 void QueuePlayerMessageForSend(Player *Play, gchar *data)
 {
-  if (Conv_Needed(netconv)) {
-    gchar *conv = Conv_ToExternal(netconv, data, -1);
-    QueueMessageForSend(&Play->NetBuf, conv);
-    g_free(conv);
+  QueueTaggedPlayerMessageForSend(Play, data, 0);
+}
+
+void QueueTaggedPlayerMessageForSend(Player *Play, gchar *data, guint tag)
+{
+  static GString *convbuf = NULL;
+  Converter *netconv = GetPlayerConverter(Play);
+
+  HOTPATH_COUNT(HP_MSGOUT, 1);
+  HOTPATH_COUNT(HP_BYTESOUT, strlen(data) + 1);
+  if (Conv_IsVerbatim(netconv, data, -1)) {
+    QueueTaggedMessageForSend(&Play->NetBuf, data, tag);
   } else {
-    QueueMessageForSend(&Play->NetBuf, data);
+    /* QueueTaggedMessageForSend copies the data, so the conversion
+     * buffer can be reused for the next message */
+    if (!convbuf) {
+      convbuf = g_string_new("");
+    }
+    g_string_truncate(convbuf, 0);
+    Conv_ToExternalBuf(netconv, data, -1, convbuf);
+    HOTPATH_COUNT(HP_CONVERT, 1);
+    QueueTaggedMessageForSend(&Play->NetBuf, convbuf->str, tag);
   }
 }
 
@@ -406,69 +784,170 @@ gboolean WritePlayerDataToWire(Player *Play)
   return WriteDataToWire(&Play->NetBuf);
 }
 
-gboolean OpenMetaHttpConnection(CurlConnection *conn, GError **err)
+GQuark dope_meta_error_quark(void)
+{
+  return g_quark_from_static_string("dope-meta-error-quark");
+}
+
+/* Number of lines in each server record in the metaserver's reply */
+#define METARECORDLINES 8
+
+static void FreeServerData(gpointer data)
+{
+  ServerData *ThisServer = (ServerData *)data;
+
+  if (ThisServer) {
+    g_free(ThisServer->Name);
+    g_free(ThisServer->Comment);
+    g_free(ThisServer->Version);
+    g_free(ThisServer->Update);
+    g_free(ThisServer->UpSince);
+    g_free(ThisServer);
+  }
+}
+
+/* 
+ * Handles a single line of the metaserver's reply to a list request.
+ * Each server is described by METARECORDLINES lines; once all of these
+ * have arrived, the server is added to the list.
+ */
+static void MetaListLine(CurlConnection *conn, char *line, gpointer data)
+{
+  MetaListParser *parser = (MetaListParser *)data;
+  ServerData *NewServer;
+
+  if (parser->error) {
+    return;
+  }
+
+  if (parser->Field < 0) {
+    /* This should be the first line of the body, the "MetaServer:" line */
+    if (strlen(line) >= 14 && strncmp(line, "FATAL ERROR:", 12) == 0) {
+      g_set_error(&parser->error, DOPE_META_ERROR, DOPE_META_ERROR_INTERNAL,
+                  _("Internal metaserver error \"%s\""), &line[13]);
+    } else if (strncmp(line, "MetaServer:", 11) != 0) {
+      g_set_error(&parser->error, DOPE_META_ERROR, DOPE_META_ERROR_BAD_REPLY,
+                  _("Bad metaserver reply \"%s\""), line);
+    }
+    parser->Field = 0;
+    return;
+  }
+
+  if (!parser->Current) {
+    parser->Current = g_new0(ServerData, 1);
+    parser->Current->Latency = -1;
+  }
+  NewServer = parser->Current;
+  switch (parser->Field++) {
+  case 0:
+    NewServer->Name = g_strdup(line);
+    break;
+  case 1:
+    NewServer->Port = atoi(line);
+    break;
+  case 2:
+    NewServer->Version = g_strdup(line);
+    break;
+  case 3:
+    NewServer->CurPlayers = line[0] ? atoi(line) : -1;
+    break;
+  case 4:
+    NewServer->MaxPlayers = atoi(line);
+    break;
+  case 5:
+    NewServer->Update = g_strdup(line);
+    break;
+  case 6:
+    NewServer->Comment = g_strdup(line);
+    break;
+  case 7:
+    NewServer->UpSince = g_strdup(line);
+    break;
+  }
+
+  if (parser->Field == METARECORDLINES) {
+    parser->Current = NULL;
+    parser->Field = 0;
+    parser->Count++;
+    g_ptr_array_add(parser->Servers, NewServer);
+    if (parser->NewServerFunc) {
+      parser->NewServerFunc(NewServer, parser->NewServerData);
+    }
+  }
+}
+
+/* 
+ * Starts a request to the metaserver for the list of servers. Each
+ * server is added to "servers" as soon as its details have been
+ * received, and "func" (if non-NULL) is then called. Call
+ * FinishMetaListParser() when the request completes.
+ */
+gboolean OpenMetaHttpConnection(CurlConnection *conn,
+                                MetaListParser *parser,
+                                GPtrArray *servers,
+                                MetaServerFunc func, gpointer data,
+                                GError **err)
 {
   gboolean ret;
   gchar *url;
 
+  g_assert(conn && parser && servers);
+
+  /* Break any connection that is still active before we start a new one,
+   * as this would otherwise remove our line callback */
+  CloseCurlConnection(conn);
+
+  parser->Servers = servers;
+  parser->Current = NULL;
+  parser->Field = -1;
+  parser->Count = 0;
+  parser->error = NULL;
+  parser->NewServerFunc = func;
+  parser->NewServerData = data;
+  SetCurlLineCallback(conn, MetaListLine, parser);
+
   url = g_strdup_printf("%s?output=text&getlist=%d",
                         MetaServer.URL, METAVERSION);
   ret = OpenCurlConnection(conn, url, NULL, err);
   g_free(url);
+  if (!ret) {
+    SetCurlLineCallback(conn, NULL, NULL);
+  }
   return ret;
 }
 
-GQuark dope_meta_error_quark(void)
-{
-  return g_quark_from_static_string("dope-meta-error-quark");
-}
-
-gboolean HandleWaitingMetaServerData(CurlConnection *conn, GSList **listpt,
-                                     GError **err)
+/* 
+ * Completes the reading of the metaserver list started by
+ * OpenMetaHttpConnection(), and frees any partially-read record. "conn"
+ * should be the (still open) connection, or NULL if the request was
+ * abandoned. Returns FALSE and sets "err" if the reply was bad or listed
+ * no servers.
+ */
+gboolean FinishMetaListParser(MetaListParser *parser, CurlConnection *conn,
+                              GError **err)
 {
-  char *msg;
+  if (conn && conn->LineFunc == MetaListLine && conn->data_size > 0
+      && parser->Field < 0) {
+    /* The header need not end with a newline */
+    MetaListLine(conn, conn->data, parser);
+  }
+  if (conn && conn->LineFunc == MetaListLine) {
+    SetCurlLineCallback(conn, NULL, NULL);
+  }
 
-  g_assert(conn && listpt);
+  FreeServerData(parser->Current);
+  parser->Current = NULL;
 
-  msg = conn->data;
-  /* This should be the first line of the body, the "MetaServer:" line */
-  if (msg && strlen(msg) >= 14 && strncmp(msg, "FATAL ERROR:", 12) == 0) {
-    g_set_error(err, DOPE_META_ERROR, DOPE_META_ERROR_INTERNAL,
-                _("Internal metaserver error \"%s\""), &msg[13]);
+  if (parser->error) {
+    g_propagate_error(err, parser->error);
+    parser->error = NULL;
     return FALSE;
-  } else if (msg && strncmp(msg, "MetaServer:", 11) != 0) {
-    g_set_error(err, DOPE_META_ERROR, DOPE_META_ERROR_BAD_REPLY,
-                _("Bad metaserver reply \"%s\""), msg);
+  } else if (conn && parser->Field < 0) {
+    /* Any partial header line was handled above, so the reply was empty */
+    g_set_error_literal(err, DOPE_META_ERROR, DOPE_META_ERROR_BAD_REPLY,
+                        _("Empty metaserver reply"));
     return FALSE;
-  }
-
-  msg = CurlNextLine(conn, msg);
-  while (msg) {
-    char *name, *port, *version, *curplayers, *maxplayers, *update,
-	 *comment, *upsince;
-    name = msg;
-    port = CurlNextLine(conn, name);
-    version = CurlNextLine(conn, port);
-    curplayers = CurlNextLine(conn, version);
-    maxplayers = CurlNextLine(conn, curplayers);
-    update = CurlNextLine(conn, maxplayers);
-    comment = CurlNextLine(conn, update);
-    upsince = CurlNextLine(conn, comment);
-    msg = CurlNextLine(conn, upsince);
-    if (msg) {
-      ServerData *NewServer = g_new0(ServerData, 1);
-      NewServer->Name = g_strdup(name);
-      NewServer->Port = atoi(port);
-      NewServer->Version = g_strdup(version);
-      NewServer->CurPlayers = curplayers[0] ? atoi(curplayers) : -1;
-      NewServer->MaxPlayers = atoi(maxplayers);
-      NewServer->Update = g_strdup(update);
-      NewServer->Comment = g_strdup(comment);
-      NewServer->UpSince = g_strdup(upsince);
-      *listpt = g_slist_append(*listpt, NewServer);
-    }
-  }
-  if (!*listpt) {
+  } else if (parser->Count == 0) {
     g_set_error_literal(err, DOPE_META_ERROR, DOPE_META_ERROR_EMPTY,
                         _("No servers listed on metaserver"));
     return FALSE;
@@ -476,19 +955,21 @@ gboolean HandleWaitingMetaServerData(CurlConnection *conn, GSList **listpt,
   return TRUE;
 }
 
-void ClearServerList(GSList **listpt)
+/* 
+ * Returns a new, empty, list of servers.
+ */
+GPtrArray *NewServerList(void)
 {
-  ServerData *ThisServer;
+  return g_ptr_array_new_with_free_func(FreeServerData);
+}
 
-  while (*listpt) {
-    ThisServer = (ServerData *)((*listpt)->data);
-    g_free(ThisServer->Name);
-    g_free(ThisServer->Comment);
-    g_free(ThisServer->Version);
-    g_free(ThisServer->Update);
-    g_free(ThisServer->UpSince);
-    g_free(ThisServer);
-    *listpt = g_slist_remove(*listpt, ThisServer);
+/* 
+ * Removes (and frees) all servers from "list", if it exists.
+ */
+void ClearServerList(GPtrArray *list)
+{
+  if (list) {
+    g_ptr_array_set_size(list, 0);
   }
 }
 #endif /* NETWORKING */
@@ -592,13 +1073,176 @@ void ReceiveInventory(char *Data, Inventory *Guns, Inventory *Drugs)
   }
 }
 
+/* 
+ * Frees the copy of the data last sent to player "Play", so that the
+ * next update is sent in full.
+ */
+void ForgetSentState(Player *Play)
+{
+  if (Play->Sent) {
+    g_free(Play->Sent->Guns);
+    g_free(Play->Sent->Drugs);
+    g_free(Play->Sent);
+    Play->Sent = NULL;
+  }
+}
+
+/* 
+ * Records the current data of player "Play" as having been sent to its
+ * client.
+ */
+static void RememberSentState(Player *Play)
+{
+  SentState *sent;
+  int i;
+
+  sent = Play->Sent;
+  if (!sent) {
+    sent = Play->Sent = g_new0(SentState, 1);
+  }
+  if (sent->NumGun != NumGun) {
+    sent->Guns = g_renew(Inventory, sent->Guns, NumGun);
+    sent->NumGun = NumGun;
+  }
+  if (sent->NumDrug != NumDrug) {
+    sent->Drugs = g_renew(Inventory, sent->Drugs, NumDrug);
+    sent->NumDrug = NumDrug;
+  }
+  sent->Cash = Play->Cash;
+  sent->Debt = Play->Debt;
+  sent->Bank = Play->Bank;
+  sent->Health = Play->Health;
+  sent->CoatSize = Play->CoatSize;
+  sent->IsAt = Play->IsAt;
+  sent->Turn = Play->Turn;
+  sent->Flags = Play->Flags;
+  sent->Day = g_date_get_day(Play->date);
+  sent->Month = g_date_get_month(Play->date);
+  sent->Year = g_date_get_year(Play->date);
+  sent->Bitches = Play->Bitches.Carried;
+  for (i = 0; i < NumGun; i++) {
+    sent->Guns[i] = Play->Guns[i];
+  }
+  for (i = 0; i < NumDrug; i++) {
+    sent->Drugs[i] = Play->Drugs[i];
+  }
+}
+
+/* 
+ * Adds a "key[index]=value" field to a delta update, if "value" differs
+ * from "old". If "index" is negative, it is omitted.
+ */
+static void AddDeltaInt(GString *text, gchar key, int index, int old,
+                        int value)
+{
+  if (old == value)
+    return;
+  g_string_append_c(text, key);
+  if (index >= 0)
+    g_string_append_printf(text, "%d", index);
+  g_string_append_printf(text, "=%d^", value);
+}
+
+/* 
+ * As AddDeltaInt, but for prices.
+ */
+static void AddDeltaPrice(GString *text, gchar key, int index,
+                          price_t old, price_t value)
+{
+  gchar prstr[PRICE_BUFLEN];
+
+  if (old == value)
+    return;
+  g_string_append_c(text, key);
+  if (index >= 0)
+    g_string_append_printf(text, "%d", index);
+  g_string_append_c(text, '=');
+  g_string_append(text, PriceToBuf(value, prstr));
+  g_string_append_c(text, '^');
+}
+
+/* 
+ * Sends player "To" only those parts of its data that have changed
+ * since the last update. The message is distinguished from a full
+ * update by a leading '*', and consists of "key=value" fields; see
+ * ReceivePlayerDelta() for the keys.
+ */
+static void SendPlayerDelta(Player *To)
+{
+  SentState *sent = To->Sent;
+  GString *text;
+  int i;
+
+  text = g_string_new("*");
+  AddDeltaPrice(text, 'c', -1, sent->Cash, To->Cash);
+  AddDeltaPrice(text, 'd', -1, sent->Debt, To->Debt);
+  AddDeltaPrice(text, 'b', -1, sent->Bank, To->Bank);
+  AddDeltaInt(text, 'h', -1, sent->Health, To->Health);
+  AddDeltaInt(text, 's', -1, sent->CoatSize, To->CoatSize);
+  AddDeltaInt(text, 'l', -1, sent->IsAt, To->IsAt);
+  AddDeltaInt(text, 't', -1, sent->Turn, To->Turn);
+  AddDeltaInt(text, 'f', -1, sent->Flags, To->Flags);
+  if (HaveAbility(To, A_DATE)) {
+    AddDeltaInt(text, 'D', -1, sent->Day, g_date_get_day(To->date));
+    AddDeltaInt(text, 'M', -1, sent->Month, g_date_get_month(To->date));
+    AddDeltaInt(text, 'Y', -1, sent->Year, g_date_get_year(To->date));
+  }
+  for (i = 0; i < NumGun; i++) {
+    AddDeltaInt(text, 'g', i, sent->Guns[i].Carried, To->Guns[i].Carried);
+  }
+  for (i = 0; i < NumDrug; i++) {
+    AddDeltaInt(text, 'r', i, sent->Drugs[i].Carried,
+                To->Drugs[i].Carried);
+  }
+  if (HaveAbility(To, A_DRUGVALUE)) {
+    for (i = 0; i < NumDrug; i++) {
+      AddDeltaPrice(text, 'v', i, sent->Drugs[i].TotalValue,
+                    To->Drugs[i].TotalValue);
+    }
+  }
+  AddDeltaInt(text, 'p', -1, sent->Bitches, To->Bitches.Carried);
+  /* Don't bother the client if nothing has changed */
+  if (text->len > 1)
+    SendServerMessage(NULL, C_NONE, C_UPDATE, To, text->str);
+  g_string_free(text, TRUE);
+}
+
 /* 
  * Sends all pertinent data about player "To" from the server
- * to player "To".
+ * to player "To". If the client supports it, only the changes since
+ * the last such update are sent, although every MAXDELTAS updates the
+ * full data are sent anyway, so that any client-side drift is undone.
  */
 void SendPlayerData(Player *To)
 {
-  SendSpyReport(To, To);
+  if (!HaveAbility(To, A_DELTA)) {
+    SendSpyReport(To, To);
+    return;
+  }
+  if (To->Sent && To->Sent->NumGun == NumGun
+      && To->Sent->NumDrug == NumDrug && To->Sent->Deltas < MAXDELTAS) {
+    HOTPATH_COUNT(HP_DELTAUPDATE, 1);
+    SendPlayerDelta(To);
+    To->Sent->Deltas++;
+  } else {
+    HOTPATH_COUNT(HP_FULLUPDATE, 1);
+    SendSpyReport(To, To);
+    if (To->Sent)
+      To->Sent->Deltas = 0;
+  }
+  RememberSentState(To);
+}
+
+/* 
+ * Sends the complete data of player "To" to its client, regardless of
+ * what was sent before. Clients change some of their data (e.g. cash
+ * and guns) before the server has agreed to an action, so this is used
+ * when the server refuses one, to put the client straight.
+ */
+void SendFullPlayerData(Player *To)
+{
+  ForgetSentState(To);
+  SendPlayerData(To);
 }
 
 /* 
@@ -607,20 +1251,17 @@ void SendPlayerData(Player *To)
  */
 void SendSpyReport(Player *To, Player *SpiedOn)
 {
-  gchar *cashstr, *debtstr, *bankstr;
+  gchar cashstr[PRICE_BUFLEN], debtstr[PRICE_BUFLEN], bankstr[PRICE_BUFLEN];
   GString *text;
   int i;
 
   text = g_string_new(NULL);
   g_string_printf(text, "%s^%s^%s^%d^%d^%d^%d^%d^",
-                   (cashstr = pricetostr(SpiedOn->Cash)),
-                   (debtstr = pricetostr(SpiedOn->Debt)),
-                   (bankstr = pricetostr(SpiedOn->Bank)),
+                   PriceToBuf(SpiedOn->Cash, cashstr),
+                   PriceToBuf(SpiedOn->Debt, debtstr),
+                   PriceToBuf(SpiedOn->Bank, bankstr),
                    SpiedOn->Health, SpiedOn->CoatSize,
                    SpiedOn->IsAt, SpiedOn->Turn, SpiedOn->Flags);
-  g_free(cashstr);
-  g_free(debtstr);
-  g_free(bankstr);
   if (HaveAbility(SpiedOn, A_DATE)) {
     g_string_append_printf(text, "%d^%d^%d^", g_date_get_day(SpiedOn->date),
                       g_date_get_month(SpiedOn->date),
@@ -634,10 +1275,9 @@ void SendSpyReport(Player *To, Player *SpiedOn)
   }
   if (HaveAbility(To, A_DRUGVALUE))
     for (i = 0; i < NumDrug; i++) {
-      g_string_append_printf(text, "%s^",
-                        (cashstr =
-                         pricetostr(SpiedOn->Drugs[i].TotalValue)));
-      g_free(cashstr);
+      g_string_append(text, PriceToBuf(SpiedOn->Drugs[i].TotalValue,
+                                       cashstr));
+      g_string_append_c(text, '^');
     }
   g_string_append_printf(text, "%d", SpiedOn->Bitches.Carried);
   if (To != SpiedOn)
@@ -649,7 +1289,66 @@ void SendSpyReport(Player *To, Player *SpiedOn)
 
 #define NUMNAMES 11
 
-void SendInitialData(Player *To)
+/* 
+ * The parts of the C_INIT and C_DATA messages that describe the game's
+ * ruleset. These are the same for every client with the same abilities,
+ * so are built only once for each version of the configuration.
+ */
+typedef struct _RulesetCache {
+  guint Version;                /* RulesetVersion this was built from */
+  gchar *InitHead[2];           /* C_INIT data up to the player ID,
+                                 * without and with A_DATE */
+  gchar *InitTail;              /* The rest of the C_INIT data */
+  GPtrArray *Data;              /* Data of each C_DATA message */
+  GString *Block;               /* The C_DATA messages, as sent to
+                                 * A_PLAYERID clients */
+  gchar *Hash;                  /* Checksum of the C_DATA messages */
+} RulesetCache;
+
+/* Rulesets for clients without and with A_TSTRING */
+static RulesetCache Rulesets[2];
+
+static void ClearRulesetCache(RulesetCache *rules)
+{
+  guint i;
+
+  g_free(rules->InitHead[0]);
+  g_free(rules->InitHead[1]);
+  g_free(rules->InitTail);
+  if (rules->Data) {
+    for (i = 0; i < rules->Data->len; i++) {
+      g_free(g_ptr_array_index(rules->Data, i));
+    }
+    g_ptr_array_free(rules->Data, TRUE);
+  }
+  if (rules->Block) {
+    g_string_free(rules->Block, TRUE);
+  }
+  g_free(rules->Hash);
+  memset(rules, 0, sizeof(RulesetCache));
+}
+
+static void AddRulesetData(RulesetCache *rules, GChecksum *sum, gchar *data)
+{
+  g_ptr_array_add(rules->Data, data);
+  if (rules->Block->len > 0) {
+    g_string_append_c(rules->Block, '\n');
+  }
+  g_string_append_printf(rules->Block, "^%c%c%s", C_NONE, C_DATA, data);
+  g_checksum_update(sum, (const guchar *)data, -1);
+  g_checksum_update(sum, (const guchar *)"\n", 1);
+}
+
+static gchar *GetNameFor(gchar *Name, gboolean TString)
+{
+  return TString ? g_strdup(Name) : GetDefaultTString(Name);
+}
+
+/* 
+ * Returns the ruleset as sent to clients with (or without) the A_TSTRING
+ * ability, building it first if the configuration has changed.
+ */
+static RulesetCache *GetRuleset(gboolean TString)
 {
   gchar *LocalNames[NUMNAMES] = { Names.Bitch, Names.Bitches, Names.Gun,
     Names.Guns, Names.Drug, Names.Drugs,
@@ -657,15 +1356,20 @@ void SendInitialData(Player *To)
     Names.BankName, Names.GunShopName,
     Names.RoughPubName
   };
-  gint i;
+  gchar prstr[2][PRICE_BUFLEN], *LocalName;
+  RulesetCache *rules = &Rulesets[TString ? 1 : 0];
+  GChecksum *sum;
   GString *text;
+  gint i;
 
-  if (!Network)
-    return;
-  if (!HaveAbility(To, A_TSTRING))
-    for (i = 0; i < NUMNAMES; i++) {
-      LocalNames[i] = GetDefaultTString(LocalNames[i]);
-    }
+  if (rules->Version == RulesetVersion)
+    return rules;
+  ClearRulesetCache(rules);
+  rules->Version = RulesetVersion;
+
+  for (i = 0; i < NUMNAMES; i++) {
+    LocalNames[i] = GetNameFor(LocalNames[i], TString);
+  }
   text = g_string_new("");
   g_string_printf(text, "%s^%d^%d^%d^", VERSION, NumLocation, NumGun,
                    NumDrug);
@@ -673,34 +1377,86 @@ void SendInitialData(Player *To)
     g_string_append(text, LocalNames[i]);
     g_string_append_c(text, '^');
   }
+  rules->InitHead[0] = g_strdup_printf("%s%d-^-%d^", text->str,
+                                       StartDate.month, StartDate.year);
+  rules->InitHead[1] = g_strdup_printf("%s%s^", text->str, LocalNames[6]);
 
-  if (HaveAbility(To, A_DATE)) {
-    g_string_append(text, LocalNames[6]);
-    g_string_append_c(text, '^');
-  } else {
-    g_string_append_printf(text, "%d-^-%d^", StartDate.month, StartDate.year);
-  }
-
-  if (HaveAbility(To, A_PLAYERID))
-    g_string_append_printf(text, "%d^", To->ID);
-
-  /* Player ID is expected after the first 7 names, so send the rest now */
+  /* Player ID is expected after the first 7 names, so send the rest after
+   * that */
+  g_string_truncate(text, 0);
   for (i = 7; i < NUMNAMES; i++) {
     g_string_append(text, LocalNames[i]);
     g_string_append_c(text, '^');
   }
-
-  if (!HaveAbility(To, A_TSTRING))
-    for (i = 0; i < NUMNAMES; i++) {
-      g_free(LocalNames[i]);
-    }
-
   g_string_append_printf(text, "%c%s^", Currency.Prefix ? '1' : '0',
                     Currency.Symbol);
+  rules->InitTail = g_string_free(text, FALSE);
+  for (i = 0; i < NUMNAMES; i++) {
+    g_free(LocalNames[i]);
+  }
+
+  rules->Data = g_ptr_array_new();
+  rules->Block = g_string_new("");
+  sum = g_checksum_new(G_CHECKSUM_SHA1);
+  AddRulesetData(rules, sum,
+                 g_strdup_printf("0^%c%s^%s^", DT_PRICES,
+                                 PriceToBuf(Prices.Spy, prstr[0]),
+                                 PriceToBuf(Prices.Tipoff, prstr[1])));
+  for (i = 0; i < NumGun; i++) {
+    LocalName = GetNameFor(Gun[i].Name, TString);
+    AddRulesetData(rules, sum,
+                   g_strdup_printf("%d^%c%s^%s^%d^%d^", i, DT_GUN,
+                                   LocalName,
+                                   PriceToBuf(Gun[i].Price, prstr[0]),
+                                   Gun[i].Space, Gun[i].Damage));
+    g_free(LocalName);
+  }
+  for (i = 0; i < NumDrug; i++) {
+    LocalName = GetNameFor(Drug[i].Name, TString);
+    AddRulesetData(rules, sum,
+                   g_strdup_printf("%d^%c%s^%s^%s^", i, DT_DRUG, LocalName,
+                                   PriceToBuf(Drug[i].MinPrice, prstr[0]),
+                                   PriceToBuf(Drug[i].MaxPrice, prstr[1])));
+    g_free(LocalName);
+  }
+  for (i = 0; i < NumLocation; i++) {
+    LocalName = GetNameFor(Location[i].Name, TString);
+    AddRulesetData(rules, sum,
+                   g_strdup_printf("%d^%c%s^", i, DT_LOCATION, LocalName));
+    g_free(LocalName);
+  }
+  rules->Hash = g_strdup(g_checksum_get_string(sum));
+  g_checksum_free(sum);
+  return rules;
+}
+
+void SendInitialData(Player *To)
+{
+  RulesetCache *rules;
+  GString *text;
+
+  if (!Network)
+    return;
+  rules = GetRuleset(HaveAbility(To, A_TSTRING));
+  text = g_string_new(rules->InitHead[HaveAbility(To, A_DATE) ? 1 : 0]);
+  if (HaveAbility(To, A_PLAYERID))
+    g_string_append_printf(text, "%d^", To->ID);
+  g_string_append(text, rules->InitTail);
   SendServerMessage(NULL, C_NONE, C_INIT, To, text->str);
   g_string_free(text, TRUE);
 }
 
+/* 
+ * Parses the next word in "*Data" as the number of some game item, which
+ * should be between "Min" and MAXITEMS; bogus values give "Default".
+ */
+static int GetNextCount(gchar **Data, int Default, int Min)
+{
+  int num = GetNextInt(Data, Default);
+
+  return (num >= Min && num <= MAXITEMS ? num : Default);
+}
+
 void ReceiveInitialData(Player *Play, char *Data)
 {
   char *pt, *curr;
@@ -708,9 +1464,9 @@ void ReceiveInitialData(Player *Play, char *Data)
 
   pt = Data;
   GetNextWord(&pt, "(unknown)"); /* server version */
-  ResizeLocations(GetNextInt(&pt, NumLocation));
-  ResizeGuns(GetNextInt(&pt, NumGun));
-  ResizeDrugs(GetNextInt(&pt, NumDrug));
+  ResizeLocations(GetNextCount(&pt, NumLocation, 1));
+  ResizeGuns(GetNextCount(&pt, NumGun, 0));
+  ResizeDrugs(GetNextCount(&pt, NumDrug, 1));
   for (list = FirstClient; list; list = g_slist_next(list)) {
     UpdatePlayer((Player *)list->data);
   }
@@ -749,71 +1505,68 @@ void ReceiveInitialData(Player *Play, char *Data)
   }
 }
 
+/* 
+ * Sends the game's ruleset (prices, guns, drugs and locations) to player
+ * "To". Clients with A_RULESET are then sent the ruleset's hash, and if
+ * they already have a copy with that hash cached, the ruleset itself
+ * is not sent at all.
+ */
 void SendMiscData(Player *To)
 {
-  gchar *text, *prstr[2], *LocalName;
-  int i;
-  gboolean HaveTString;
+  RulesetCache *rules;
+  gboolean Cached;
+  gchar *text;
+  guint i;
 
   if (!Network)
     return;
-  HaveTString = HaveAbility(To, A_TSTRING);
-  text = g_strdup_printf("0^%c%s^%s^", DT_PRICES,
-                         (prstr[0] = pricetostr(Prices.Spy)),
-                         (prstr[1] = pricetostr(Prices.Tipoff)));
-  SendServerMessage(NULL, C_NONE, C_DATA, To, text);
-  g_free(prstr[0]);
-  g_free(prstr[1]);
-  g_free(text);
-  for (i = 0; i < NumGun; i++) {
-    if (HaveTString)
-      LocalName = Gun[i].Name;
-    else
-      LocalName = GetDefaultTString(Gun[i].Name);
-    text = g_strdup_printf("%d^%c%s^%s^%d^%d^", i, DT_GUN, LocalName,
-                           (prstr[0] = pricetostr(Gun[i].Price)),
-                           Gun[i].Space, Gun[i].Damage);
-    if (!HaveTString)
-      g_free(LocalName);
-    SendServerMessage(NULL, C_NONE, C_DATA, To, text);
-    g_free(prstr[0]);
-    g_free(text);
-  }
-  for (i = 0; i < NumDrug; i++) {
-    if (HaveTString)
-      LocalName = Drug[i].Name;
-    else
-      LocalName = GetDefaultTString(Drug[i].Name);
-    text = g_strdup_printf("%d^%c%s^%s^%s^", i, DT_DRUG, LocalName,
-                           (prstr[0] = pricetostr(Drug[i].MinPrice)),
-                           (prstr[1] = pricetostr(Drug[i].MaxPrice)));
-    if (!HaveTString)
-      g_free(LocalName);
-    SendServerMessage(NULL, C_NONE, C_DATA, To, text);
-    g_free(prstr[0]);
-    g_free(prstr[1]);
-    g_free(text);
+  rules = GetRuleset(HaveAbility(To, A_TSTRING));
+  Cached = (HaveAbility(To, A_RULESET) && To->RulesetHash
+            && strcmp(To->RulesetHash, rules->Hash) == 0);
+  if (!Cached) {
+#ifdef NETWORKING
+    if (HaveAbility(To, A_PLAYERID) && !IsCop(To)) {
+      /* These messages don't depend on the recipient, so can be queued
+       * in one go */
+      QueuePlayerMessageForSend(To, rules->Block->str);
+    } else
+#endif
+    {
+      for (i = 0; i < rules->Data->len; i++) {
+        SendServerMessage(NULL, C_NONE, C_DATA, To,
+                          g_ptr_array_index(rules->Data, i));
+      }
+    }
   }
-  for (i = 0; i < NumLocation; i++) {
-    if (HaveTString)
-      LocalName = Location[i].Name;
-    else
-      LocalName = GetDefaultTString(Location[i].Name);
-    text = g_strdup_printf("%d^%c%s^", i, DT_LOCATION, LocalName);
-    if (!HaveTString)
-      g_free(LocalName);
+  if (HaveAbility(To, A_RULESET)) {
+    text = g_strdup_printf("0^%c%s^%c^", DT_RULESET, rules->Hash,
+                           Cached ? '0' : '1');
     SendServerMessage(NULL, C_NONE, C_DATA, To, text);
     g_free(text);
   }
 }
 
 /* 
- * Decodes information about locations, drugs, prices, etc. in "Data"
+ * Decodes information about locations, drugs, prices, etc. in "Data".
+ * Returns FALSE if the ruleset could not be read from the cache (see
+ * SendMiscData), so must be requested from the server.
  */
-void ReceiveMiscData(char *Data)
+gboolean ReceiveMiscData(char *Data)
 {
   char *pt, *Name, Type;
   int i;
+  gboolean retval = TRUE;
+
+#ifdef NETWORKING
+  /* Record the ruleset as sent, so that it can be cached */
+  if (RulesetRecv) {
+    pt = strchr(Data, '^');
+    if (!pt || pt[1] != DT_RULESET) {
+      g_string_append(RulesetRecv, Data);
+      g_string_append_c(RulesetRecv, '\n');
+    }
+  }
+#endif
 
   pt = Data;
   i = GetNextInt(&pt, 0);
@@ -848,6 +1601,114 @@ void ReceiveMiscData(char *Data)
       Prices.Spy = strtoprice(&Name[1]);
       Prices.Tipoff = GetNextPrice(&pt, (price_t)0);
       break;
+#ifdef NETWORKING
+    case DT_RULESET:
+      retval = ReceiveRuleset(&Name[1], GetNextInt(&pt, 1) != 0);
+      break;
+#endif
+    }
+  }
+  return retval;
+}
+
+/* 
+ * Sets fields of "date" sent by the server, ignoring invalid values
+ * (which would otherwise leave the date in an invalid state).
+ */
+static void SetDateDay(GDate *date, int day)
+{
+  if (g_date_valid_day(day))
+    g_date_set_day(date, day);
+}
+
+static void SetDateMonth(GDate *date, int month)
+{
+  if (g_date_valid_month(month))
+    g_date_set_month(date, month);
+}
+
+static void SetDateYear(GDate *date, int year)
+{
+  if (g_date_valid_year(year))
+    g_date_set_year(date, year);
+}
+
+/* 
+ * Returns "loc" if it is a valid location index, or 0 otherwise (clients
+ * use IsAt to index the Location array directly).
+ */
+static int CheckLocation(int loc)
+{
+  return (loc >= 0 && loc < NumLocation ? loc : 0);
+}
+
+/* 
+ * Applies a delta update (as sent by SendPlayerDelta) in "text" to the
+ * data of player "From". Each field is "key=value", where the key is a
+ * single character, followed by an index for guns ('g'), drug counts
+ * ('r') and drug values ('v'). Unknown keys and out-of-range indices
+ * are ignored.
+ */
+static void ReceivePlayerDelta(char *text, Player *From)
+{
+  gchar *word, *value;
+  int index;
+
+  while ((word = GetNextWord(&text, NULL)) != NULL) {
+    value = strchr(word, '=');
+    if (!value)
+      continue;
+    *value++ = '\0';
+    index = atoi(&word[1]);
+    switch (word[0]) {
+    case 'c':
+      From->Cash = strtoprice(value);
+      break;
+    case 'd':
+      From->Debt = strtoprice(value);
+      break;
+    case 'b':
+      From->Bank = strtoprice(value);
+      break;
+    case 'h':
+      From->Health = atoi(value);
+      break;
+    case 's':
+      From->CoatSize = atoi(value);
+      break;
+    case 'l':
+      From->IsAt = CheckLocation(atoi(value));
+      break;
+    case 't':
+      From->Turn = atoi(value);
+      break;
+    case 'f':
+      From->Flags = atoi(value);
+      break;
+    case 'D':
+      SetDateDay(From->date, atoi(value));
+      break;
+    case 'M':
+      SetDateMonth(From->date, atoi(value));
+      break;
+    case 'Y':
+      SetDateYear(From->date, atoi(value));
+      break;
+    case 'g':
+      if (index >= 0 && index < NumGun)
+        From->Guns[index].Carried = atoi(value);
+      break;
+    case 'r':
+      if (index >= 0 && index < NumDrug)
+        From->Drugs[index].Carried = atoi(value);
+      break;
+    case 'v':
+      if (index >= 0 && index < NumDrug)
+        From->Drugs[index].TotalValue = strtoprice(value);
+      break;
+    case 'p':
+      From->Bitches.Carried = atoi(value);
+      break;
     }
   }
 }
@@ -862,18 +1723,22 @@ void ReceivePlayerData(Player *Play, char *text, Player *From)
   int i;
 
   cp = text;
+  if (*cp == '*') {
+    ReceivePlayerDelta(cp + 1, From);
+    return;
+  }
   From->Cash = GetNextPrice(&cp, (price_t)0);
   From->Debt = GetNextPrice(&cp, (price_t)0);
   From->Bank = GetNextPrice(&cp, (price_t)0);
   From->Health = GetNextInt(&cp, 100);
   From->CoatSize = GetNextInt(&cp, 0);
-  From->IsAt = GetNextInt(&cp, 0);
+  From->IsAt = CheckLocation(GetNextInt(&cp, 0));
   From->Turn = GetNextInt(&cp, 0);
   From->Flags = GetNextInt(&cp, 0);
   if (HaveAbility(Play, A_DATE)) {
-    g_date_set_day(From->date, GetNextInt(&cp, 1));
-    g_date_set_month(From->date, GetNextInt(&cp, 1));
-    g_date_set_year(From->date, GetNextInt(&cp, 1980));
+    SetDateDay(From->date, GetNextInt(&cp, 1));
+    SetDateMonth(From->date, GetNextInt(&cp, 1));
+    SetDateYear(From->date, GetNextInt(&cp, 1980));
   }
   for (i = 0; i < NumGun; i++) {
     From->Guns[i].Carried = GetNextInt(&cp, 0);
@@ -923,14 +1788,21 @@ int GetNextInt(gchar **Data, int Default)
     return Default;
 }
 
+/* 
+ * Parses the next '^'-separated word in "*Data" as a price, without
+ * copying or modifying it.
+ */
 price_t GetNextPrice(gchar **Data, price_t Default)
 {
-  gchar *Word = GetNextWord(Data, NULL);
+  gchar *Word, *end;
 
-  if (Word)
-    return strtoprice(Word);
-  else
+  if (*Data == NULL || **Data == '\0')
     return Default;
+  Word = end = *Data;
+  while (*end != '\0' && *end != '^')
+    end++;
+  *Data = (*end == '\0' ? end : end + 1);
+  return StrnToPrice(Word, end - Word);
 }
 
 /* 
@@ -959,7 +1831,6 @@ void SwitchToSinglePlayer(Player *Play)
 
 void InitNetwork(void)
 {
-  netconv = Conv_New();
 #ifdef NETWORKING
   StartNetworking();
 #endif
@@ -1004,6 +1875,7 @@ int ProcessMessage(char *Msg, Player *Play, Player **Other, AICode *AI,
   if (!First || !Play)
     return -1;
 
+  HOTPATH_COUNT(HP_MSGIN, 1);
   *AI = C_NONE;
   *Code = C_PRINTMESSAGE;
   *Other = &Noone;
@@ -1061,6 +1933,12 @@ gboolean HandleGenericClientMessage(Player *From, AICode AI, MsgCode Code,
   Player *tmp;
   gchar *pt;
 
+#ifdef NETWORKING
+  /* The ruleset is sent as an unbroken run of C_DATA messages */
+  if (RulesetRecv && Code != C_DATA)
+    ForgetRuleset();
+#endif
+
   switch (Code) {
   case C_LIST:
   case C_JOIN:
@@ -1073,14 +1951,27 @@ gboolean HandleGenericClientMessage(Player *From, AICode AI, MsgCode Code,
       tmp->ID = GetNextInt(&pt, 0);
     break;
   case C_DATA:
-    ReceiveMiscData(Data);
+    if (!ReceiveMiscData(Data)) {
+      g_warning(_("The cached game data for this server is damaged, "
+                  "and has been discarded; asking the server for it "
+                  "again."));
+      SendClientMessage(To, C_NONE, C_DATA, NULL, NULL);
+    }
     break;
   case C_INIT:
     ReceiveInitialData(To, Data);
+#ifdef NETWORKING
+    RecordRuleset(To);
+#endif
     break;
   case C_ABILITIES:
     ReceiveAbilities(To, Data);
     CombineAbilities(To);
+#ifdef NETWORKING
+    /* Servers without A_RULESET never use the ruleset we offered */
+    if (!HaveAbility(To, A_RULESET))
+      ForgetRuleset();
+#endif
     break;
   case C_LEAVE:
     if (From != &Noone)
@@ -1234,11 +2125,13 @@ void SendFightMessage(Player *Attacker, Player *Defender,
   guint ArrayInd;
   int ArmPercent, Damage, MaxDamage, i;
   Player *To;
+  GPtrArray *Fighters;
   GString *text;
   gchar *BitchName;
 
-  if (!Attacker->FightArray)
+  if (!Attacker->Combat)
     return;
+  Fighters = Attacker->Combat->Owner->Fighters;
 
   MaxDamage = Damage = 0;
   for (i = 0; i < NumGun; i++) {
@@ -1251,8 +2144,8 @@ void SendFightMessage(Player *Attacker, Player *Defender,
 
   text = g_string_new("");
 
-  for (ArrayInd = 0; ArrayInd < Attacker->FightArray->len; ArrayInd++) {
-    To = (Player *)g_ptr_array_index(Attacker->FightArray, ArrayInd);
+  for (ArrayInd = 0; ArrayInd < Fighters->len; ArrayInd++) {
+    To = ((Fighter *)g_ptr_array_index(Fighters, ArrayInd))->Play;
     if (!Broadcast && To != Attacker)
       continue;
     g_string_truncate(text, 0);
@@ -42,7 +42,7 @@ typedef enum {
   C_RENAME, C_NAME, C_SACKBITCH, C_TIPOFF, C_SPYON, C_WANTQUIT,
   C_CONTACTSPY, C_KILL, C_REQUESTSCORE, C_INIT, C_DATA,
   C_FIGHTPRINT, C_FIGHTACT, C_TRADE, C_CHANGEDISP,
-  C_NETMESSAGE, C_ABILITIES
+  C_NETMESSAGE, C_ABILITIES, C_PING
 } MsgCode;
 
 typedef enum {
@@ -57,6 +57,7 @@ typedef enum {
 #define DT_DRUG        'B'
 #define DT_GUN         'C'
 #define DT_PRICES      'D'
+#define DT_RULESET     'E'
 
 typedef enum {
   F_ARRIVED = 'A', F_STAND = 'S', F_HIT = 'H',
@@ -91,18 +92,41 @@ gboolean PlayerHandleNetwork(Player *Play, gboolean ReadReady,
                              gboolean *DoneOK);
 gboolean ReadPlayerDataFromWire(Player *Play);
 void QueuePlayerMessageForSend(Player *Play, gchar *data);
+void QueueTaggedPlayerMessageForSend(Player *Play, gchar *data, guint tag);
 gboolean WritePlayerDataToWire(Player *Play);
 gchar *GetWaitingPlayerMessage(Player *Play);
 
-gboolean OpenMetaHttpConnection(CurlConnection *conn, GError **err);
-gboolean HandleWaitingMetaServerData(CurlConnection *conn, GSList **listpt,
-                                     GError **err);
-void ClearServerList(GSList **listpt);
+/* Called for each server as it is read from the metaserver */
+typedef void (*MetaServerFunc) (ServerData *NewServer, gpointer data);
+
+/* State of a metaserver list that is being received */
+typedef struct _MetaListParser {
+  GPtrArray *Servers;           /* ServerData for each complete record */
+  ServerData *Current;          /* Record currently being read */
+  gint Field;                   /* Next line of the current record, or -1
+                                 * if the reply header hasn't been seen */
+  guint Count;                  /* Number of servers read so far */
+  GError *error;                /* Set if the reply is bad */
+  MetaServerFunc NewServerFunc;
+  gpointer NewServerData;
+} MetaListParser;
+
+gboolean OpenMetaHttpConnection(CurlConnection *conn,
+                                MetaListParser *parser,
+                                GPtrArray *servers,
+                                MetaServerFunc func, gpointer data,
+                                GError **err);
+gboolean FinishMetaListParser(MetaListParser *parser, CurlConnection *conn,
+                              GError **err);
+GPtrArray *NewServerList(void);
+void ClearServerList(GPtrArray *list);
 #endif /* NETWORKING */
 
 extern GSList *FirstClient;
 
 extern void (*ClientMessageHandlerPt) (char *, Player *);
+extern void (*ClientMessageDispatchPt) (Player *, AICode, MsgCode, char *,
+                                        Player *);
 
 void InitNetwork(void);
 void AddURLEnc(GString *str, gchar *unenc);
@@ -113,12 +137,14 @@ void SendInventory(Player *From, AICode AI, MsgCode Code, Player *To,
                    Inventory *Guns, Inventory *Drugs);
 void ReceiveInventory(char *Data, Inventory *Guns, Inventory *Drugs);
 void SendPlayerData(Player *To);
+void ForgetSentState(Player *Play);
+void SendFullPlayerData(Player *To);
 void SendSpyReport(Player *To, Player *SpiedOn);
 void ReceivePlayerData(Player *Play, char *text, Player *From);
 void SendInitialData(Player *To);
 void ReceiveInitialData(Player *Play, char *data);
 void SendMiscData(Player *To);
-void ReceiveMiscData(char *Data);
+gboolean ReceiveMiscData(char *Data);
 gchar *GetNextWord(gchar **Data, gchar *Default);
 void AssignNextWord(gchar **Data, gchar **Dest);
 int GetNextInt(gchar **Data, int Default);
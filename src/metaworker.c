@@ -0,0 +1,614 @@
+/************************************************************************
+ * metaworker.c   dopewars - metaserver registration worker             *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef NETWORKING
+
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef CYGWIN
+#include <winsock2.h>           /* For select() */
+#else
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>           /* For struct timeval */
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>             /* For pipe(), read(), write() */
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>              /* For fcntl() */
+#endif
+#endif
+
+#include <glib.h>
+#include <curl/curl.h>
+
+#include "log.h"
+#include "metaworker.h"
+#include "network.h"
+#include "nls.h"
+
+/* Don't report players logging in/out to the metaserver more frequently
+ * than once every minute (so as not to overload the metaserver) */
+#define METAMINTIME (60)
+
+/* If we haven't talked to the metaserver for 3 hours, then remind it that
+ * we still exist, so we don't get wiped from the list of active servers */
+#define METAUPDATETIME (10800)
+
+/* After a failed update, wait this many seconds before trying again,
+ * doubling the wait after each further failure up to METARETRYMAX */
+#define METARETRYMIN (30)
+#define METARETRYMAX (1800)
+
+/* How often the worker checks whether it has been asked to stop while
+ * waiting for the metaserver, in milliseconds */
+#define METAPOLLTIME (1000)
+
+#define USEC (G_GINT64_CONSTANT(1000000))
+
+/* 
+ * The server's state, as it should be reported to the metaserver. The
+ * server posts one of these whenever anything changes, and the worker
+ * coalesces them so that only the newest is actually sent.
+ */
+typedef struct _MetaSnapshot {
+  gchar *URL;                   /* Metaserver to send to */
+  gchar *body;                  /* URL-encoded server details */
+  gchar *scores;                /* URL-encoded high scores, or NULL */
+  gboolean Up;                  /* FALSE if the server is going down */
+  gboolean RespectTimeout;      /* FALSE to send without waiting for
+                                 * METAMINTIME to elapse */
+} MetaSnapshot;
+
+/* A message to be logged by the main thread */
+typedef struct _MetaLogMsg {
+  int level;
+  gchar *text;
+} MetaLogMsg;
+
+/* Statistics shown by the "metastats" server command */
+typedef struct _MetaStats {
+  gulong Posted;                /* Snapshots posted by the server */
+  gulong Coalesced;             /* Snapshots superseded before sending */
+  gulong Sent;                  /* Successful updates */
+  gulong Failed;                /* Failed updates */
+  gulong Reminders;             /* Updates sent only to stay listed */
+  gint64 LastLatency;           /* Round trip of the last update (usec) */
+  gint64 MaxLatency;
+  gint64 TotalLatency;
+  time_t LastSuccess;           /* Wall-clock time of the last success */
+  gint RetryDelay;              /* Current backoff, or 0 (seconds) */
+} MetaStats;
+
+static GThread *Worker = NULL;
+static gint QuitWorker = 0;
+static GAsyncQueue *SnapshotQueue = NULL, *LogQueue = NULL;
+static CurlConnection MetaConn;
+
+/* Posted to SnapshotQueue to ask the worker to exit */
+static MetaSnapshot QuitSnapshot;
+
+/* Pipe used to wake up the main thread when there are messages to log
+ * (not available on Win32, which polls instead) */
+static int NotifyPipe[2] = { -1, -1 };
+
+/* Protects Stats, WorkerBusy and Unsent */
+static GMutex StatsLock;
+static MetaStats Stats;
+static gboolean WorkerBusy = FALSE;
+
+/* The number of posted snapshots that have not yet been sent (or given
+ * up on); counted when they are posted, so that there is no window in
+ * which a snapshot is neither queued nor known to the worker */
+static gint Unsent = 0;
+
+static void FreeSnapshot(MetaSnapshot *snap)
+{
+  if (snap && snap != &QuitSnapshot) {
+    g_free(snap->URL);
+    g_free(snap->body);
+    g_free(snap->scores);
+    g_free(snap);
+  }
+}
+
+/* 
+ * Wakes up the main thread, so that it calls HandleMetaWorkerNotify().
+ */
+static void WakeMainThread(void)
+{
+#ifndef CYGWIN
+  char wake = 1;
+
+  if (NotifyPipe[1] >= 0 && write(NotifyPipe[1], &wake, 1) != 1) {
+    /* The pipe is full, so the main thread will wake up anyway */
+  }
+#endif
+}
+
+/* 
+ * Queues a message for the main thread to log (the worker must not call
+ * dopelog() directly, since that may update the GUI).
+ */
+static void MetaLog(int level, const gchar *format, ...)
+{
+  MetaLogMsg *msg;
+  va_list args;
+
+  msg = g_new(MetaLogMsg, 1);
+  msg->level = level;
+  va_start(args, format);
+  msg->text = g_strdup_vprintf(format, args);
+  va_end(args);
+  g_async_queue_push(LogQueue, msg);
+  WakeMainThread();
+}
+
+static void SetWorkerBusy(gboolean busy)
+{
+  gboolean wasbusy;
+
+  g_mutex_lock(&StatsLock);
+  wasbusy = WorkerBusy;
+  WorkerBusy = busy;
+  g_mutex_unlock(&StatsLock);
+
+  /* Let the main thread know, in case it is waiting for us to finish */
+  if (wasbusy && !busy) {
+    WakeMainThread();
+  }
+}
+
+/* 
+ * Notes that "count" posted snapshots have now been sent or abandoned.
+ */
+static void FinishSnapshots(gint count)
+{
+  gboolean done;
+
+  if (count == 0) {
+    return;
+  }
+  g_mutex_lock(&StatsLock);
+  Unsent -= count;
+  done = (Unsent == 0);
+  g_mutex_unlock(&StatsLock);
+
+  if (done) {
+    WakeMainThread();
+  }
+}
+
+/* 
+ * Folds a newly-posted snapshot into the one waiting to be sent (if any),
+ * returning the result. The newer server details always win, but high
+ * scores are kept from the older snapshot if the newer one has none.
+ */
+static MetaSnapshot *MergeSnapshot(MetaSnapshot *pending, MetaSnapshot *snap)
+{
+  if (!pending) {
+    return snap;
+  }
+  if (!snap->scores) {
+    snap->scores = pending->scores;
+    pending->scores = NULL;
+  }
+  snap->RespectTimeout = snap->RespectTimeout && pending->RespectTimeout;
+  FreeSnapshot(pending);
+
+  g_mutex_lock(&StatsLock);
+  Stats.Coalesced++;
+  g_mutex_unlock(&StatsLock);
+  return snap;
+}
+
+static void LogMetaReply(CurlConnection *conn)
+{
+  char *ch, *nextch;
+  guint i;
+
+  for (i = 0; i < conn->headers->len; i++) {
+    ch = (char *)g_ptr_array_index(conn->headers, i);
+    if (*ch) {
+      MetaLog(4, _("MetaServer: %s"), ch);
+    }
+  }
+  ch = conn->data;
+  while (ch && *ch) {
+    nextch = CurlNextLine(conn, ch);
+    if (*ch) {
+      MetaLog(2, _("MetaServer: %s"), ch);
+    }
+    ch = nextch;
+  }
+  MetaLog(4, _("MetaServer: (closed)"));
+}
+
+/* 
+ * Runs the metaserver transfer on MetaConn to completion (or until the
+ * worker is asked to quit). Returns TRUE on success.
+ */
+static gboolean RunTransfer(GError **err)
+{
+  int still_running = 1, maxfd;
+  long timeout;
+  fd_set readfs, writefs, errorfs;
+  struct timeval tv;
+
+  while (still_running) {
+    if (g_atomic_int_get(&QuitWorker)) {
+      g_set_error_literal(err, DOPE_CURLM_ERROR, 0, _("Server shut down"));
+      CloseCurlConnection(&MetaConn);
+      return FALSE;
+    }
+    FD_ZERO(&readfs);
+    FD_ZERO(&writefs);
+    FD_ZERO(&errorfs);
+    maxfd = -1;
+    curl_multi_fdset(MetaConn.multi, &readfs, &writefs, &errorfs, &maxfd);
+    curl_multi_timeout(MetaConn.multi, &timeout);
+    if (timeout < 0 || timeout > METAPOLLTIME) {
+      timeout = METAPOLLTIME;
+    }
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    if (maxfd >= 0) {
+      if (select(maxfd + 1, &readfs, &writefs, &errorfs, &tv) == -1
+          && errno != EINTR) {
+        g_set_error_literal(err, DOPE_CURLM_ERROR, 0, g_strerror(errno));
+        CloseCurlConnection(&MetaConn);
+        return FALSE;
+      }
+    } else {
+      g_usleep(MIN(timeout, 100) * 1000);
+    }
+    if (!CurlConnectionPerform(&MetaConn, &still_running, err)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/* 
+ * Sends a snapshot to the metaserver, and logs the reply. Returns TRUE
+ * on success.
+ */
+static gboolean SendSnapshot(MetaSnapshot *snap)
+{
+  GString *body;
+  GError *err = NULL;
+  gint64 start, latency;
+  long status = 0;
+  gboolean ok;
+
+  body = g_string_new(snap->body);
+  if (snap->scores) {
+    g_string_append(body, snap->scores);
+  }
+
+  MetaLog(2, _("Waiting for connect to metaserver at %s..."), snap->URL);
+  start = g_get_monotonic_time();
+  ok = OpenCurlConnection(&MetaConn, snap->URL, body->str, &err)
+       && RunTransfer(&err);
+  g_string_free(body, TRUE);
+  latency = g_get_monotonic_time() - start;
+
+  if (ok) {
+    curl_easy_getinfo(MetaConn.h, CURLINFO_RESPONSE_CODE, &status);
+    LogMetaReply(&MetaConn);
+    CloseCurlConnection(&MetaConn);
+    if (status >= 400) {
+      MetaLog(1, _("Metaserver at %s returned HTTP status %ld"),
+              snap->URL, status);
+      ok = FALSE;
+    }
+  } else {
+    MetaLog(1, _("Failed to connect to metaserver at %s (%s)"), snap->URL,
+            err ? err->message : "?");
+    if (err) {
+      g_error_free(err);
+    }
+  }
+
+  g_mutex_lock(&StatsLock);
+  if (ok) {
+    Stats.Sent++;
+    Stats.LastSuccess = time(NULL);
+    Stats.LastLatency = latency;
+    Stats.MaxLatency = MAX(Stats.MaxLatency, latency);
+    Stats.TotalLatency += latency;
+  } else {
+    Stats.Failed++;
+  }
+  g_mutex_unlock(&StatsLock);
+  return ok;
+}
+
+/* 
+ * The worker thread. It waits for snapshots from the server, and sends
+ * the newest one to the metaserver, no more often than every
+ * METAMINTIME seconds (unless asked to hurry). Failed updates are
+ * retried with exponential backoff, and if nothing changes for
+ * METAUPDATETIME seconds the last update is repeated.
+ */
+static gpointer MetaWorkerThread(gpointer data)
+{
+  MetaSnapshot *pending = NULL, *last = NULL, *snap;
+  gint64 now, due, nextsend = 0, retryat = 0, lastok;
+  gint retrydelay = 0, merged = 0;
+
+  lastok = g_get_monotonic_time();
+  while (TRUE) {
+    now = g_get_monotonic_time();
+    if (pending) {
+      due = pending->RespectTimeout ? MAX(nextsend, retryat) : now;
+      if (!pending->Up) {
+        due = now;              /* Say goodbye immediately */
+      }
+    } else if (last && last->Up) {
+      due = MAX(lastok + METAUPDATETIME * USEC, retryat);
+    } else {
+      due = -1;
+    }
+
+    if (due == -1) {
+      snap = g_async_queue_pop(SnapshotQueue);
+    } else if (due > now) {
+      snap = g_async_queue_timeout_pop(SnapshotQueue, due - now);
+    } else {
+      snap = g_async_queue_try_pop(SnapshotQueue);
+    }
+
+    if (snap == &QuitSnapshot || g_atomic_int_get(&QuitWorker)) {
+      if (snap != &QuitSnapshot) {
+        FreeSnapshot(snap);
+        FinishSnapshots(snap ? 1 : 0);
+        continue;               /* Drain the queue up to the marker */
+      }
+      break;
+    } else if (snap) {
+      pending = MergeSnapshot(pending, snap);
+      merged++;
+      continue;
+    } else if (!pending && last) {
+      /* Nothing has changed for a while, so send a reminder */
+      MetaLog(3, _("Sending reminder message to the metaserver..."));
+      pending = g_new0(MetaSnapshot, 1);
+      pending->URL = g_strdup(last->URL);
+      pending->body = g_strdup(last->body);
+      pending->Up = TRUE;
+      pending->RespectTimeout = TRUE;
+      g_mutex_lock(&StatsLock);
+      Stats.Reminders++;
+      g_mutex_unlock(&StatsLock);
+    }
+    if (!pending) {
+      continue;
+    }
+
+    SetWorkerBusy(TRUE);
+    nextsend = g_get_monotonic_time() + METAMINTIME * USEC;
+    if (SendSnapshot(pending) || !pending->Up) {
+      retrydelay = 0;
+      retryat = 0;
+      lastok = g_get_monotonic_time();
+      FreeSnapshot(last);
+      last = pending;
+      pending = NULL;
+      FinishSnapshots(merged);
+      merged = 0;
+    } else {
+      /* Keep the snapshot, and try again later (unless something newer
+       * arrives in the meantime, in which case we'll send that) */
+      retrydelay = retrydelay ? MIN(retrydelay * 2, METARETRYMAX)
+                              : METARETRYMIN;
+      retryat = g_get_monotonic_time() + retrydelay * USEC;
+      pending->RespectTimeout = TRUE;
+      MetaLog(3, _("Will retry metaserver update in %d seconds"),
+              retrydelay);
+    }
+    g_mutex_lock(&StatsLock);
+    Stats.RetryDelay = retrydelay;
+    g_mutex_unlock(&StatsLock);
+    SetWorkerBusy(FALSE);
+  }
+
+  FreeSnapshot(pending);
+  FreeSnapshot(last);
+  FinishSnapshots(merged);
+  return NULL;
+}
+
+/* 
+ * Starts the worker thread that talks to the metaserver.
+ */
+void StartMetaWorker(void)
+{
+  if (Worker) {
+    return;
+  }
+  SnapshotQueue = g_async_queue_new();
+  LogQueue = g_async_queue_new();
+  memset(&Stats, 0, sizeof(Stats));
+  WorkerBusy = FALSE;
+  Unsent = 0;
+#ifndef CYGWIN
+  if (pipe(NotifyPipe) == 0) {
+    fcntl(NotifyPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(NotifyPipe[1], F_SETFL, O_NONBLOCK);
+  } else {
+    NotifyPipe[0] = NotifyPipe[1] = -1;
+  }
+#endif
+  /* Set up curl here, since curl_global_init() is not thread safe */
+  CurlInit(&MetaConn);
+  Worker = g_thread_new("metaserver", MetaWorkerThread, NULL);
+}
+
+/* 
+ * Stops the worker thread, abandoning any update that is in progress
+ * or waiting to be sent.
+ */
+void StopMetaWorker(void)
+{
+  if (!Worker) {
+    return;
+  }
+  g_atomic_int_set(&QuitWorker, 1);
+  g_async_queue_push(SnapshotQueue, &QuitSnapshot);
+  g_thread_join(Worker);
+  Worker = NULL;
+  g_atomic_int_set(&QuitWorker, 0);
+
+  HandleMetaWorkerNotify();
+  CurlCleanup(&MetaConn);
+  g_async_queue_unref(SnapshotQueue);
+  g_async_queue_unref(LogQueue);
+  SnapshotQueue = LogQueue = NULL;
+#ifndef CYGWIN
+  if (NotifyPipe[0] >= 0) {
+    close(NotifyPipe[0]);
+    close(NotifyPipe[1]);
+  }
+  NotifyPipe[0] = NotifyPipe[1] = -1;
+#endif
+}
+
+/* 
+ * Asks the worker to send the given server details (and, if non-NULL,
+ * high scores) to the metaserver at "URL". If "RespectTimeout" is TRUE,
+ * the update may be delayed (and merged with later ones) so that the
+ * metaserver isn't contacted too frequently.
+ */
+void PostMetaSnapshot(const gchar *URL, const gchar *body,
+                      const gchar *scores, gboolean Up,
+                      gboolean RespectTimeout)
+{
+  MetaSnapshot *snap;
+
+  if (!Worker) {
+    return;
+  }
+  snap = g_new(MetaSnapshot, 1);
+  snap->URL = g_strdup(URL);
+  snap->body = g_strdup(body);
+  snap->scores = g_strdup(scores);
+  snap->Up = Up;
+  snap->RespectTimeout = RespectTimeout;
+
+  g_mutex_lock(&StatsLock);
+  Stats.Posted++;
+  Unsent++;
+  g_mutex_unlock(&StatsLock);
+  g_async_queue_push(SnapshotQueue, snap);
+}
+
+/* 
+ * Returns a descriptor that becomes readable when the worker has
+ * messages to log (see HandleMetaWorkerNotify), or -1 if this isn't
+ * supported, in which case the main loop should poll periodically.
+ */
+int GetMetaWorkerNotifyFD(void)
+{
+  return NotifyPipe[0];
+}
+
+/* 
+ * Logs any messages from the worker. Must be called from the main thread.
+ */
+void HandleMetaWorkerNotify(void)
+{
+  MetaLogMsg *msg;
+#ifndef CYGWIN
+  char buf[64];
+
+  if (NotifyPipe[0] >= 0) {
+    while (read(NotifyPipe[0], buf, sizeof(buf)) > 0) {
+    }
+  }
+#endif
+  if (!LogQueue) {
+    return;
+  }
+  while ((msg = g_async_queue_try_pop(LogQueue)) != NULL) {
+    dopelog(msg->level, LF_SERVER, "%s", msg->text);
+    g_free(msg->text);
+    g_free(msg);
+  }
+}
+
+/* 
+ * Returns TRUE if the worker has an update in progress or waiting to be
+ * sent (or messages waiting to be logged).
+ */
+gboolean IsMetaWorkerBusy(void)
+{
+  gboolean busy;
+
+  if (!Worker) {
+    return FALSE;
+  }
+  g_mutex_lock(&StatsLock);
+  busy = (WorkerBusy || Unsent > 0);
+  g_mutex_unlock(&StatsLock);
+  return (busy || g_async_queue_length(LogQueue) > 0);
+}
+
+/* 
+ * Displays statistics on metaserver updates.
+ */
+void ShowMetaWorkerStats(void)
+{
+  MetaStats s;
+  gchar *last;
+
+  g_mutex_lock(&StatsLock);
+  s = Stats;
+  g_mutex_unlock(&StatsLock);
+
+  g_print(_("Metaserver updates: %lu posted, %lu coalesced, %lu sent, "
+            "%lu failed, %lu reminders\n"),
+          s.Posted, s.Coalesced, s.Sent, s.Failed, s.Reminders);
+  if (s.Sent > 0) {
+    last = g_strdup(ctime(&s.LastSuccess));
+    g_strchomp(last);
+    g_print(_("Round trip: last %ld ms, average %ld ms, maximum %ld ms; "
+              "last success %s\n"),
+            (long)(s.LastLatency / 1000),
+            (long)(s.TotalLatency / s.Sent / 1000),
+            (long)(s.MaxLatency / 1000), last);
+    g_free(last);
+  }
+  if (s.RetryDelay > 0) {
+    g_print(_("Retrying failed update every %d seconds\n"), s.RetryDelay);
+  }
+}
+
+#endif /* NETWORKING */
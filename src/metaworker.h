@@ -0,0 +1,44 @@
+/************************************************************************
+ * metaworker.h   Metaserver registration worker                        *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifndef __DP_METAWORKER_H__
+#define __DP_METAWORKER_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#ifdef NETWORKING
+void StartMetaWorker(void);
+void StopMetaWorker(void);
+void PostMetaSnapshot(const gchar *URL, const gchar *body,
+                      const gchar *scores, gboolean Up,
+                      gboolean RespectTimeout);
+int GetMetaWorkerNotifyFD(void);
+void HandleMetaWorkerNotify(void);
+gboolean IsMetaWorkerBusy(void);
+void ShowMetaWorkerStats(void);
+#endif
+
+#endif /* __DP_METAWORKER_H__ */
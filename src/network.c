@@ -55,12 +55,24 @@
 #include "error.h"
 #include "network.h"
 #include "nls.h"
+#include "util.h"
 
-/* Maximum sizes (in bytes) of read and write buffers - connections should
- * be dropped if either buffer is filled */
+/* Where getaddrinfo() is available, hostname lookups and connects are
+ * done by a worker thread so that the caller's main loop never blocks
+ * on a slow name server; otherwise we fall back to gethostbyname() */
+#if !defined(CYGWIN) && defined(HAVE_GETADDRINFO)
+#define ASYNC_CONNECT
+#endif
+
+/* Maximum sizes (in bytes) of read and write buffers. The write buffer
+ * limit is only the default; see SetNetworkBufferLimits() */
 #define MAXREADBUF   (32768)
 #define MAXWRITEBUF  (65536)
 
+/* Maximum number of connections that may be waiting for accept() on
+ * each listening socket */
+#define LISTENBACKLOG SOMAXCONN
+
 /* SOCKS5 authentication method codes */
 typedef enum {
   SM_NOAUTH = 0,                /* No authentication required */
@@ -70,10 +82,20 @@ typedef enum {
 
 static gboolean StartSocksNegotiation(NetworkBuffer *NetBuf,
                                       gchar *RemoteHost,
-                                      unsigned RemotePort);
+                                      unsigned RemotePort,
+                                      const struct in_addr *socks4addr);
+#ifdef ASYNC_CONNECT
+static gboolean StartAsyncConnect(NetworkBuffer *NetBuf,
+                                  const gchar *bindaddr,
+                                  gchar *realhost, unsigned realport,
+                                  gchar *RemoteHost, unsigned RemotePort);
+static gboolean FinishAsyncConnect(NetworkBuffer *NetBuf);
+static void AbandonConnectJob(NBConnectJob *job);
+#else
 static gboolean StartConnect(int *fd, const gchar *bindaddr, gchar *RemoteHost,
                              unsigned RemotePort, gboolean *doneOK,
                              LastError **error);
+#endif
 
 #ifdef CYGWIN
 
@@ -111,6 +133,12 @@ void SetReuse(SOCKET sock)
   }
 }
 
+void SetReusePort(SOCKET sock)
+{
+  g_warning(_("Sharing a port between servers is not supported "
+              "on this system"));
+}
+
 void SetBlocking(SOCKET sock, gboolean blocking)
 {
   unsigned long param;
@@ -139,6 +167,25 @@ void SetReuse(int sock)
   }
 }
 
+/* 
+ * Allows other sockets (typically in other server processes) to bind
+ * to the same address and port, with the kernel distributing incoming
+ * connections between them.
+ */
+void SetReusePort(int sock)
+{
+#ifdef SO_REUSEPORT
+  int i = 1;
+
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &i, sizeof(i)) == -1) {
+    perror("setsockopt");
+  }
+#else
+  g_warning(_("Sharing a port between servers is not supported "
+              "on this system"));
+#endif
+}
+
 void SetBlocking(int sock, gboolean blocking)
 {
   fcntl(sock, F_SETFL, blocking ? 0 : O_NONBLOCK);
@@ -148,10 +195,16 @@ void SetBlocking(int sock, gboolean blocking)
 
 static gboolean FinishConnect(int fd, LastError **error);
 
+/* Nesting depth of BeginWriteBatch() calls, and the buffers that have
+ * had data queued for them since the outermost one */
+static gint WriteBatchDepth = 0;
+static GPtrArray *WriteBatchBufs = NULL;
+
 static void NetBufCallBack(NetworkBuffer *NetBuf, gboolean CallNow)
 {
   if (NetBuf && NetBuf->CallBack) {
-    (*NetBuf->CallBack) (NetBuf, NetBuf->status != NBS_PRECONNECT,
+    (*NetBuf->CallBack) (NetBuf, NetBuf->status != NBS_PRECONNECT
+                         || NetBuf->connjob,
                          (NetBuf->status == NBS_CONNECTED
                           && NetBuf->WriteBuf.DataPresent)
                          || (NetBuf->status == NBS_SOCKSCONNECT
@@ -180,6 +233,27 @@ static void FreeConnBuf(ConnBuf *buf)
   InitConnBuf(buf);
 }
 
+static void InitFlowControl(NBFlowControl *flow)
+{
+  flow->SoftLimit = flow->HardLimit = MAXWRITEBUF;
+  flow->Msgs = NULL;
+  flow->HeadSent = 0;
+  flow->PeakDepth = 0;
+  flow->PeakBytes = 0;
+  flow->MsgsQueued = flow->MsgsSent = flow->MsgsCoalesced = 0;
+  flow->BytesSent = 0;
+}
+
+static void FreeFlowControl(NBFlowControl *flow)
+{
+  if (flow->Msgs) {
+    g_queue_foreach(flow->Msgs, (GFunc)g_free, NULL);
+    g_queue_free(flow->Msgs);
+  }
+  flow->Msgs = NULL;
+  flow->HeadSent = 0;
+}
+
 /* 
  * Initializes the passed network buffer, ready for use. Messages sent
  * or received on the buffered connection will be terminated by the
@@ -200,11 +274,15 @@ void InitNetworkBuffer(NetworkBuffer *NetBuf, char Terminator,
   InitConnBuf(&NetBuf->WriteBuf);
   InitConnBuf(&NetBuf->negbuf);
   NetBuf->WaitConnect = FALSE;
+  NetBuf->connjob = NULL;
   NetBuf->status = NBS_PRECONNECT;
   NetBuf->socks = socks;
   NetBuf->host = NULL;
   NetBuf->userpasswd = NULL;
   NetBuf->error = NULL;
+  InitFlowControl(&NetBuf->flow);
+  NetBuf->Batched = FALSE;
+  NetBuf->ConnectStarted = 0;
 }
 
 void SetNetworkBufferCallBack(NetworkBuffer *NetBuf, NBCallBack CallBack,
@@ -216,6 +294,44 @@ void SetNetworkBufferCallBack(NetworkBuffer *NetBuf, NBCallBack CallBack,
   NetBufCallBack(NetBuf, FALSE);
 }
 
+/* 
+ * Sets the outbound flow control limits for the network buffer. Once
+ * more than "SoftLimit" bytes are waiting to be written, tagged messages
+ * replace any unsent earlier message with the same tag (see
+ * QueueTaggedMessageForSend). If more than "HardLimit" bytes would be
+ * waiting, the connection is instead marked as failed, so that the
+ * owner can drop it.
+ */
+void SetNetworkBufferLimits(NetworkBuffer *NetBuf, gint SoftLimit,
+                            gint HardLimit)
+{
+  NetBuf->flow.HardLimit = HardLimit;
+  NetBuf->flow.SoftLimit = MIN(SoftLimit, HardLimit);
+}
+
+/* 
+ * Returns the number of messages waiting to be written to the wire.
+ */
+gint GetWriteQueueDepth(NetworkBuffer *NetBuf)
+{
+  return NetBuf->flow.Msgs ? g_queue_get_length(NetBuf->flow.Msgs) : 0;
+}
+
+/* 
+ * Returns the time (in milliseconds, relative to "timenow", as returned
+ * by GetTimeMsec) that the oldest message has been waiting to be written
+ * to the wire, or 0 if the write queue is empty.
+ */
+gint64 GetWriteQueueAge(NetworkBuffer *NetBuf, gint64 timenow)
+{
+  NBQueuedMsg *msg;
+
+  if (!NetBuf->flow.Msgs)
+    return 0;
+  msg = (NBQueuedMsg *)g_queue_peek_head(NetBuf->flow.Msgs);
+  return msg ? timenow - msg->Queued : 0;
+}
+
 /* 
  * Sets the function used to obtain a username and password for SOCKS5
  * username/password authentication.
@@ -253,15 +369,26 @@ gboolean IsNetworkBufferActive(NetworkBuffer *NetBuf)
   return (NetBuf && NetBuf->fd >= 0);
 }
 
+/* 
+ * Starts connecting the given network buffer to RemoteHost:RemotePort
+ * (via. the SOCKS server, if one is configured). Where possible the
+ * lookup and connect proceed in the background, so on return the
+ * owner should simply wait (via. select or the callback) for the
+ * status to change from NBS_PRECONNECT. Returns FALSE on immediate
+ * failure, in which case NetBuf->error is set.
+ */
 gboolean StartNetworkBufferConnect(NetworkBuffer *NetBuf,
                                    const gchar *bindaddr,
                                    gchar *RemoteHost, unsigned RemotePort)
 {
   gchar *realhost;
   unsigned realport;
+#ifndef ASYNC_CONNECT
   gboolean doneOK;
+#endif
 
   ShutdownNetworkBuffer(NetBuf);
+  NetBuf->ConnectStarted = 0;
 
   if (NetBuf->socks) {
     realhost = NetBuf->socks->name;
@@ -271,6 +398,11 @@ gboolean StartNetworkBufferConnect(NetworkBuffer *NetBuf,
     realport = RemotePort;
   }
 
+#ifdef ASYNC_CONNECT
+  return StartAsyncConnect(NetBuf, bindaddr, realhost, realport,
+                           RemoteHost, RemotePort);
+#else
+  NetBuf->ConnectStarted = GetTimeMsec();
   if (StartConnect(&NetBuf->fd, bindaddr, realhost, realport, &doneOK,
                    &NetBuf->error)) {
 #ifdef CYGIN
@@ -288,7 +420,7 @@ gboolean StartNetworkBufferConnect(NetworkBuffer *NetBuf,
     }
 
     if (NetBuf->socks
-        && !StartSocksNegotiation(NetBuf, RemoteHost, RemotePort)) {
+        && !StartSocksNegotiation(NetBuf, RemoteHost, RemotePort, NULL)) {
       return FALSE;
     }
 
@@ -300,6 +432,7 @@ gboolean StartNetworkBufferConnect(NetworkBuffer *NetBuf,
   } else {
     return FALSE;
   }
+#endif /* ASYNC_CONNECT */
 }
 
 /* 
@@ -310,6 +443,13 @@ void ShutdownNetworkBuffer(NetworkBuffer *NetBuf)
 {
   NetBufCallBackStop(NetBuf);
 
+#ifdef ASYNC_CONNECT
+  if (NetBuf->connjob) {
+    AbandonConnectJob(NetBuf->connjob);
+    NetBuf->connjob = NULL;
+  }
+#endif
+
   if (NetBuf->fd >= 0) {
     CloseSocket(NetBuf->fd);
     g_io_channel_unref(NetBuf->ioch);
@@ -319,16 +459,43 @@ void ShutdownNetworkBuffer(NetworkBuffer *NetBuf)
   FreeConnBuf(&NetBuf->ReadBuf);
   FreeConnBuf(&NetBuf->WriteBuf);
   FreeConnBuf(&NetBuf->negbuf);
+  FreeFlowControl(&NetBuf->flow);
 
   FreeError(NetBuf->error);
   NetBuf->error = NULL;
 
   g_free(NetBuf->host);
 
+  if (NetBuf->Batched)
+    g_ptr_array_remove_fast(WriteBatchBufs, NetBuf);
+
   InitNetworkBuffer(NetBuf, NetBuf->Terminator, NetBuf->StripChar,
                     NetBuf->socks);
 }
 
+/* 
+ * Hands over the connection (socket, buffered data, write queue and
+ * all) from network buffer "src" to "dest", which is first shut down.
+ * "src" is left in the initialized, unconnected state, and the owner
+ * of "dest" must set up its own callback, if needed.
+ */
+void MoveNetworkBuffer(NetworkBuffer *dest, NetworkBuffer *src)
+{
+  NetBufCallBackStop(src);
+  ShutdownNetworkBuffer(dest);
+
+  *dest = *src;
+  dest->CallBack = NULL;
+  dest->CallBackData = NULL;
+  dest->InputTag = 0;
+  if (src->Batched) {
+    g_ptr_array_remove_fast(WriteBatchBufs, src);
+    g_ptr_array_add(WriteBatchBufs, dest);
+  }
+
+  InitNetworkBuffer(src, src->Terminator, src->StripChar, src->socks);
+}
+
 /* 
  * Updates the sets of read and write file descriptors to monitor
  * input to/output from the given network buffer. MaxSock is updated
@@ -597,6 +764,14 @@ static gboolean DoNetworkBufferStuff(NetworkBuffer *NetBuf,
 
   if (ErrorReady || NetBuf->error)
     *ErrorOK = FALSE;
+#ifdef ASYNC_CONNECT
+  else if (NetBuf->connjob) {
+    if (ReadReady) {
+      *WriteOK = FinishAsyncConnect(NetBuf);
+      ConnectDone = (NetBuf->connjob == NULL);
+    }
+  }
+#endif
   else if (NetBuf->WaitConnect) {
     if (WriteReady) {
       retval = FinishConnect(NetBuf->fd, &NetBuf->error);
@@ -638,8 +813,18 @@ static gboolean DoNetworkBufferStuff(NetworkBuffer *NetBuf,
   if (!(*ErrorOK && *WriteOK && *ReadOK)) {
     /* We don't want to check the socket any more */
     NetBufCallBackStop(NetBuf);
+#ifdef ASYNC_CONNECT
+    if (NetBuf->connjob) {
+      AbandonConnectJob(NetBuf->connjob);
+      NetBuf->connjob = NULL;
+    }
+#endif
     /* If there were errors, then the socket is now useless - so close it */
-    CloseSocket(NetBuf->fd);
+    if (NetBuf->fd >= 0) {
+      CloseSocket(NetBuf->fd);
+      g_io_channel_unref(NetBuf->ioch);
+      NetBuf->ioch = NULL;
+    }
     NetBuf->fd = -1;
   } else if (ConnectDone) {
     /* If we just connected, then no need to listen for write-ready status
@@ -790,10 +975,46 @@ gchar *GetWaitingMessage(NetworkBuffer *NetBuf)
   return NewMessage;
 }
 
+/* 
+ * Returns a copy of the "index"th complete message (counting from zero)
+ * waiting in the network buffer, without removing it, or NULL if fewer
+ * messages are waiting. The string must be g_free'd by the caller.
+ */
+gchar *PeekWaitingMessage(NetworkBuffer *NetBuf, gint index)
+{
+  ConnBuf *conn;
+  char *StartPt, *SepPt, *EndPt;
+  int MessageLen;
+
+  conn = &NetBuf->ReadBuf;
+  if (!conn->Data || !conn->DataPresent || NetBuf->status != NBS_CONNECTED) {
+    return NULL;
+  }
+  StartPt = conn->Data;
+  EndPt = conn->Data + conn->DataPresent;
+  while (TRUE) {
+    SepPt = memchr(StartPt, NetBuf->Terminator, EndPt - StartPt);
+    if (!SepPt) {
+      return NULL;
+    } else if (index-- == 0) {
+      break;
+    }
+    StartPt = SepPt + 1;
+  }
+  MessageLen = SepPt - StartPt;
+  if (MessageLen > 0 && NetBuf->StripChar
+      && StartPt[MessageLen - 1] == NetBuf->StripChar) {
+    MessageLen--;
+  }
+  return g_strndup(StartPt, MessageLen);
+}
+
 /* 
  * Reads any waiting data on the given network buffer's TCP/IP connection
  * into the read buffer. Returns FALSE if the connection was closed, or
- * if the read buffer's maximum size was reached.
+ * if the read buffer's maximum size was reached without a complete
+ * message. (If the buffer is full but complete messages are waiting,
+ * reading simply stops until the application has processed them.)
  */
 gboolean ReadDataFromWire(NetworkBuffer *NetBuf)
 {
@@ -805,6 +1026,8 @@ gboolean ReadDataFromWire(NetworkBuffer *NetBuf)
   while (1) {
     if (CurrentPosition >= conn->Length) {
       if (conn->Length == MAXREADBUF) {
+        if (memchr(conn->Data, NetBuf->Terminator, conn->DataPresent))
+          break;                /* leave the rest in the kernel for now */
         SetError(&NetBuf->error, ET_CUSTOM, E_FULLBUF, NULL);
         return FALSE;           /* drop connection */
       }
@@ -846,7 +1069,13 @@ gboolean ReadDataFromWire(NetworkBuffer *NetBuf)
   return TRUE;
 }
 
-gchar *ExpandWriteBuffer(ConnBuf *conn, int numbytes, LastError **error)
+/* 
+ * Makes room for "numbytes" more bytes in the given buffer, which is
+ * not allowed to grow beyond "maxlen" bytes. Returns a pointer to the
+ * new space, or NULL (setting "error") if the limit would be exceeded.
+ */
+static gchar *ExpandConnBuf(ConnBuf *conn, int numbytes, int maxlen,
+                            LastError **error)
 {
   int newlen;
 
@@ -854,8 +1083,8 @@ gchar *ExpandWriteBuffer(ConnBuf *conn, int numbytes, LastError **error)
   if (newlen > conn->Length) {
     conn->Length *= 2;
     conn->Length = MAX(conn->Length, newlen);
-    if (conn->Length > MAXWRITEBUF)
-      conn->Length = MAXWRITEBUF;
+    if (conn->Length > maxlen)
+      conn->Length = maxlen;
     if (newlen > conn->Length) {
       if (error)
         SetError(error, ET_CUSTOM, E_FULLBUF, NULL);
@@ -867,25 +1096,177 @@ gchar *ExpandWriteBuffer(ConnBuf *conn, int numbytes, LastError **error)
   return (&conn->Data[conn->DataPresent]);
 }
 
-void CommitWriteBuffer(NetworkBuffer *NetBuf, ConnBuf *conn,
-                       gchar *addpt, guint addlen)
+gchar *ExpandWriteBuffer(ConnBuf *conn, int numbytes, LastError **error)
+{
+  return ExpandConnBuf(conn, numbytes, MAXWRITEBUF, error);
+}
+
+/* 
+ * Discards any messages in the write queue with the given tag, provided
+ * that none of the message has yet been written to the wire.
+ */
+static void RemoveSupersededMessages(NetworkBuffer *NetBuf, guint tag)
+{
+  NBFlowControl *flow = &NetBuf->flow;
+  ConnBuf *conn = &NetBuf->WriteBuf;
+  GList *list, *nextlist;
+  NBQueuedMsg *msg;
+  gint offset;
+
+  if (!flow->Msgs)
+    return;
+
+  /* The first message in the queue may have been partially written */
+  offset = -flow->HeadSent;
+  for (list = flow->Msgs->head; list; list = nextlist) {
+    nextlist = g_list_next(list);
+    msg = (NBQueuedMsg *)list->data;
+    if (msg->Tag == tag && offset >= 0) {
+      memmove(&conn->Data[offset], &conn->Data[offset + msg->Length],
+              conn->DataPresent - offset - msg->Length);
+      conn->DataPresent -= msg->Length;
+      g_queue_delete_link(flow->Msgs, list);
+      g_free(msg);
+      flow->MsgsCoalesced++;
+    } else {
+      offset += msg->Length;
+    }
+  }
+}
+
+/* 
+ * Records a newly-added message of "addlen" bytes in the write queue.
+ */
+static void AddQueuedMessage(NBFlowControl *flow, ConnBuf *conn,
+                             guint addlen, guint tag)
+{
+  NBQueuedMsg *msg;
+
+  if (!flow->Msgs)
+    flow->Msgs = g_queue_new();
+  msg = g_new(NBQueuedMsg, 1);
+  msg->Length = addlen;
+  msg->Tag = tag;
+  msg->Queued = GetTimeMsec();
+  g_queue_push_tail(flow->Msgs, msg);
+
+  flow->MsgsQueued++;
+  flow->PeakDepth = MAX(flow->PeakDepth, g_queue_get_length(flow->Msgs));
+  flow->PeakBytes = MAX(flow->PeakBytes, conn->DataPresent);
+}
+
+/* 
+ * Removes from the write queue the records of any messages that have
+ * been completely written, given that "numbytes" were just sent.
+ */
+static void RemoveSentMessages(NBFlowControl *flow, gint numbytes)
+{
+  NBQueuedMsg *msg;
+
+  flow->BytesSent += numbytes;
+  if (!flow->Msgs)
+    return;
+  numbytes += flow->HeadSent;
+  while ((msg = (NBQueuedMsg *)g_queue_peek_head(flow->Msgs))
+         && msg->Length <= numbytes) {
+    numbytes -= msg->Length;
+    g_free(g_queue_pop_head(flow->Msgs));
+    flow->MsgsSent++;
+  }
+  flow->HeadSent = msg ? numbytes : 0;
+}
+
+static void CommitTaggedWriteBuffer(NetworkBuffer *NetBuf, ConnBuf *conn,
+                                    gchar *addpt, guint addlen, guint tag)
 {
   conn->DataPresent += addlen;
 
+  if (NetBuf && conn == &NetBuf->WriteBuf)
+    AddQueuedMessage(&NetBuf->flow, conn, addlen, tag);
+
+  /* Within a write batch, the data are written out (and the owner told
+   * about anything left over) once the batch ends */
+  if (WriteBatchDepth > 0 && NetBuf && conn == &NetBuf->WriteBuf
+      && NetBuf->status == NBS_CONNECTED && NetBuf->fd >= 0) {
+    if (!NetBuf->Batched) {
+      NetBuf->Batched = TRUE;
+      g_ptr_array_add(WriteBatchBufs, NetBuf);
+    }
+    return;
+  }
+
   /* If the buffer was empty before, we may need to tell the owner to
    * check the socket for write-ready status */
   if (NetBuf && addpt == conn->Data)
     NetBufCallBack(NetBuf, FALSE);
 }
 
+/* 
+ * Starts a write batch. Messages queued for connected network buffers
+ * until the matching EndWriteBatch() call are gathered up, and each
+ * buffer is then written to the wire with a single send(), rather than
+ * the socket being handed back to select() or the GLib main loop after
+ * each message. Batches can be nested; only the outermost one flushes.
+ */
+void BeginWriteBatch(void)
+{
+  if (!WriteBatchBufs)
+    WriteBatchBufs = g_ptr_array_new();
+  WriteBatchDepth++;
+}
+
+/* 
+ * Ends a write batch (see BeginWriteBatch). Each buffer written to during
+ * the batch is flushed; if the socket could not take all of the data, or
+ * the write failed, the owner is told to check the socket as usual.
+ */
+void EndWriteBatch(void)
+{
+  NetworkBuffer *NetBuf;
+  guint i;
+
+  g_assert(WriteBatchDepth > 0);
+  if (--WriteBatchDepth > 0)
+    return;
+
+  for (i = 0; i < WriteBatchBufs->len; i++) {
+    NetBuf = (NetworkBuffer *)g_ptr_array_index(WriteBatchBufs, i);
+    NetBuf->Batched = FALSE;
+    if (NetBuf->fd >= 0 && (!WriteDataToWire(NetBuf)
+                            || NetBuf->WriteBuf.DataPresent > 0)) {
+      NetBufCallBack(NetBuf, FALSE);
+    }
+  }
+  g_ptr_array_set_size(WriteBatchBufs, 0);
+}
+
+void CommitWriteBuffer(NetworkBuffer *NetBuf, ConnBuf *conn,
+                       gchar *addpt, guint addlen)
+{
+  CommitTaggedWriteBuffer(NetBuf, conn, addpt, addlen, 0);
+}
+
 /* 
  * Writes the null-terminated string "data" to the network buffer, ready
  * to be sent to the wire when the network connection becomes free. The
- * message is automatically terminated. Fails to write the message without
- * error if the buffer reaches its maximum size (although this error will
- * be detected when an attempt is made to write the buffer to the wire).
+ * message is automatically terminated. If the buffer's hard limit would
+ * be exceeded, the message is not written, and the buffer's error is set
+ * instead (so that the connection will be dropped at the next opportunity).
  */
 void QueueMessageForSend(NetworkBuffer *NetBuf, gchar *data)
+{
+  QueueTaggedMessageForSend(NetBuf, data, 0);
+}
+
+/* 
+ * As QueueMessageForSend, but if "tag" is non-zero, and the write queue
+ * is above its soft limit, any earlier unsent messages with the same
+ * tag are discarded, as this message supersedes them. This is used to
+ * stop complete state updates piling up for clients that are slow to
+ * read them.
+ */
+void QueueTaggedMessageForSend(NetworkBuffer *NetBuf, gchar *data,
+                               guint tag)
 {
   gchar *addpt;
   guint addlen;
@@ -896,14 +1277,17 @@ void QueueMessageForSend(NetworkBuffer *NetBuf, gchar *data)
   if (!data)
     return;
   addlen = strlen(data) + 1;
-  addpt = ExpandWriteBuffer(conn, addlen, NULL);
+  if (tag && conn->DataPresent + addlen > NetBuf->flow.SoftLimit)
+    RemoveSupersededMessages(NetBuf, tag);
+  addpt = ExpandConnBuf(conn, addlen, NetBuf->flow.HardLimit,
+                        &NetBuf->error);
   if (!addpt)
     return;
 
   memcpy(addpt, data, addlen);
   addpt[addlen - 1] = NetBuf->Terminator;
 
-  CommitWriteBuffer(NetBuf, conn, addpt, addlen);
+  CommitTaggedWriteBuffer(NetBuf, conn, addpt, addlen, tag);
 }
 
 static void SetNetworkError(LastError **error) {
@@ -924,15 +1308,22 @@ static struct hostent *LookupHostname(const gchar *host, LastError **error)
   return he;
 }
 
+/* 
+ * Queues the opening SOCKS request for the connection to
+ * RemoteHost:RemotePort. SOCKS4 needs the numeric IPv4 address of the
+ * target; if this was already resolved in the background, it is passed
+ * as "socks4addr", otherwise it is looked up here.
+ */
 gboolean StartSocksNegotiation(NetworkBuffer *NetBuf, gchar *RemoteHost,
-                               unsigned RemotePort)
+                               unsigned RemotePort,
+                               const struct in_addr *socks4addr)
 {
   guint num_methods;
   ConnBuf *conn;
   struct hostent *he;
   gchar *addpt;
   guint addlen, i;
-  struct in_addr *haddr;
+  const struct in_addr *haddr;
   unsigned short int netport;
   gchar *username = NULL;
 
@@ -968,9 +1359,14 @@ gboolean StartSocksNegotiation(NetworkBuffer *NetBuf, gchar *RemoteHost,
     return TRUE;
   }
 
-  he = LookupHostname(RemoteHost, &NetBuf->error);
-  if (!he)
-    return FALSE;
+  if (socks4addr) {
+    haddr = socks4addr;
+  } else {
+    he = LookupHostname(RemoteHost, &NetBuf->error);
+    if (!he)
+      return FALSE;
+    haddr = (struct in_addr *)he->h_addr;
+  }
 
   if (NetBuf->socks->user && NetBuf->socks->user[0]) {
     username = g_strdup(NetBuf->socks->user);
@@ -1001,7 +1397,6 @@ gboolean StartSocksNegotiation(NetworkBuffer *NetBuf, gchar *RemoteHost,
   }
   addlen = 9 + strlen(username);
 
-  haddr = (struct in_addr *)he->h_addr;
   g_assert(sizeof(struct in_addr) == 4);
 
   netport = htons(RemotePort);
@@ -1028,12 +1423,10 @@ static gboolean WriteBufToWire(NetworkBuffer *NetBuf, ConnBuf *conn)
 {
   int CurrentPosition, BytesSent;
 
+  if (NetBuf->error)
+    return FALSE;
   if (!conn->Data || !conn->DataPresent)
     return TRUE;
-  if (conn->Length == MAXWRITEBUF) {
-    SetError(&NetBuf->error, ET_CUSTOM, E_FULLBUF, NULL);
-    return FALSE;
-  }
   CurrentPosition = 0;
   while (CurrentPosition < conn->DataPresent) {
     BytesSent = send(NetBuf->fd, &conn->Data[CurrentPosition],
@@ -1065,6 +1458,8 @@ static gboolean WriteBufToWire(NetworkBuffer *NetBuf, ConnBuf *conn)
             conn->DataPresent - CurrentPosition);
   }
   conn->DataPresent -= CurrentPosition;
+  if (conn == &NetBuf->WriteBuf)
+    RemoveSentMessages(&NetBuf->flow, CurrentPosition);
   return TRUE;
 }
 
@@ -1085,13 +1480,37 @@ gboolean WriteDataToWire(NetworkBuffer *NetBuf)
 static size_t MetaConnWriteFunc(void *contents, size_t size, size_t nmemb,
                                 void *userp)
 {
-  size_t realsize = size * nmemb;
+  size_t realsize = size * nmemb, oldsize;
   CurlConnection *conn = (CurlConnection *)userp;
+  char *line, *sep, *end;
  
+  oldsize = conn->data_size;
   conn->data = g_realloc(conn->data, conn->data_size + realsize + 1);
   memcpy(&(conn->data[conn->data_size]), contents, realsize);
   conn->data_size += realsize;
   conn->data[conn->data_size] = 0;
+
+  if (conn->LineFunc) {
+    /* Hand over each complete line as soon as it arrives; only the new
+     * data needs to be searched, since any older partial line cannot
+     * contain a terminator */
+    line = conn->data;
+    end = conn->data + conn->data_size;
+    sep = memchr(conn->data + oldsize, conn->Terminator, realsize);
+    while (sep) {
+      *sep = '\0';
+      if (sep > line && sep[-1] == conn->StripChar) {
+        sep[-1] = '\0';
+      }
+      conn->LineFunc(conn, line, conn->LineData);
+      line = sep + 1;
+      sep = memchr(line, conn->Terminator, end - line);
+    }
+    if (line > conn->data) {
+      conn->data_size = end - line;
+      memmove(conn->data, line, conn->data_size + 1);
+    }
+  }
  
   return realsize;
 }
@@ -1117,6 +1536,8 @@ void CurlInit(CurlConnection *conn)
   conn->StripChar = '\r';
   conn->data_size = 0;
   conn->headers = NULL;
+  conn->LineFunc = NULL;
+  conn->LineData = NULL;
   conn->timer_cb = NULL;
   conn->socket_cb = NULL;
 }
@@ -1131,6 +1552,8 @@ void CloseCurlConnection(CurlConnection *conn)
     g_ptr_array_free(conn->headers, TRUE);
     conn->headers = NULL;
   }
+  conn->LineFunc = NULL;
+  conn->LineData = NULL;
 }
 
 void CurlCleanup(CurlConnection *conn)
@@ -1383,6 +1806,18 @@ void SetCurlCallback(CurlConnection *conn, GSourceFunc timer_cb,
   curl_multi_setopt(conn->multi, CURLMOPT_SOCKETDATA, conn);
 }
 
+/* 
+ * Arranges for "func" to be called with each line of the reply to the
+ * next request on "conn" as it is received, rather than buffering the
+ * whole reply. The callback is removed when the connection is closed.
+ */
+void SetCurlLineCallback(CurlConnection *conn, CurlLineFunc func,
+                         gpointer data)
+{
+  conn->LineFunc = func;
+  conn->LineData = data;
+}
+
 int CreateTCPSocket(LastError **error)
 {
   int fd;
@@ -1426,6 +1861,364 @@ gboolean BindTCPSocket(int sock, const gchar *addr, unsigned port,
   return (retval != SOCKET_ERROR);
 }
 
+/* 
+ * Returns a printable representation of the given socket address
+ * (numeric host, plus the port if "withport" is TRUE). The string must
+ * be g_free'd by the caller.
+ */
+static gchar *FormatSockAddr(const struct sockaddr *addr, int addrlen,
+                             gboolean withport)
+{
+#ifdef HAVE_GETADDRINFO
+  char host[NI_MAXHOST], serv[NI_MAXSERV];
+
+  if (getnameinfo(addr, addrlen, host, sizeof(host), serv, sizeof(serv),
+                  NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+    return g_strdup("?");
+  } else if (!withport) {
+    return g_strdup(host);
+  } else if (addr->sa_family == AF_INET6) {
+    return g_strdup_printf("[%s]:%s", host, serv);
+  } else {
+    return g_strdup_printf("%s:%s", host, serv);
+  }
+#else
+  const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+
+  if (addr->sa_family != AF_INET) {
+    return g_strdup("?");
+  } else if (!withport) {
+    return g_strdup(inet_ntoa(sin->sin_addr));
+  } else {
+    return g_strdup_printf("%s:%u", inet_ntoa(sin->sin_addr),
+                           ntohs(sin->sin_port));
+  }
+#endif
+}
+
+/* 
+ * Returns the local address that the given socket is bound to, as a
+ * string that must be g_free'd by the caller.
+ */
+gchar *GetSocketAddress(int sock)
+{
+  struct sockaddr_storage addr;
+#ifdef HAVE_SOCKLEN_T
+  socklen_t addrlen;
+#else
+  int addrlen;
+#endif
+
+  addrlen = sizeof(addr);
+  if (getsockname(sock, (struct sockaddr *)&addr, &addrlen) == SOCKET_ERROR) {
+    return g_strdup("?");
+  }
+  return FormatSockAddr((struct sockaddr *)&addr, addrlen, TRUE);
+}
+
+/* 
+ * Accepts a new connection on the listening socket "sock". Returns the
+ * new (non-blocking) socket, or SOCKET_ERROR on failure, in which case
+ * "error" is set. If "peer" is non-NULL, it is set to the numeric
+ * address of the remote host, as a newly allocated string.
+ */
+int AcceptTCPConnection(int sock, gchar **peer, LastError **error)
+{
+  struct sockaddr_storage addr;
+#ifdef HAVE_SOCKLEN_T
+  socklen_t addrlen;
+#else
+  int addrlen;
+#endif
+  int fd;
+
+  addrlen = sizeof(addr);
+#ifdef HAVE_ACCEPT4
+  fd = accept4(sock, (struct sockaddr *)&addr, &addrlen,
+               SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  fd = accept(sock, (struct sockaddr *)&addr, &addrlen);
+  if (fd != SOCKET_ERROR) {
+    SetBlocking(fd, FALSE);
+  }
+#endif
+  if (fd == SOCKET_ERROR) {
+#ifdef CYGWIN
+    SetError(error, ET_WINSOCK, WSAGetLastError(), NULL);
+#else
+    SetError(error, ET_ERRNO, errno, NULL);
+#endif
+  } else if (peer) {
+    *peer = FormatSockAddr((struct sockaddr *)&addr, addrlen, FALSE);
+  }
+  return fd;
+}
+
+/* 
+ * Returns TRUE if the given error from AcceptTCPConnection() just means
+ * that there are no more connections waiting.
+ */
+gboolean IsAcceptDone(LastError *error)
+{
+#ifdef CYGWIN
+  return (error->type == ET_WINSOCK && error->code == WSAEWOULDBLOCK);
+#else
+  return (error->type == ET_ERRNO
+          && (error->code == EAGAIN || error->code == EWOULDBLOCK
+              || error->code == EINTR || error->code == ECONNABORTED));
+#endif
+}
+
+/* 
+ * Returns TRUE if the given error from AcceptTCPConnection() was caused
+ * by running out of file descriptors (or other system resources).
+ */
+gboolean IsAcceptExhausted(LastError *error)
+{
+#ifdef CYGWIN
+  return (error->type == ET_WINSOCK && (error->code == WSAEMFILE
+                                        || error->code == WSAENOBUFS));
+#else
+  return (error->type == ET_ERRNO
+          && (error->code == EMFILE || error->code == ENFILE
+              || error->code == ENOBUFS || error->code == ENOMEM));
+#endif
+}
+
+/* 
+ * Splits one entry from a BindAddress list into a host (NULL for the
+ * wildcard address) and port. Entries can be "host", "host:port",
+ * "[IPv6 address]:port", ":port", or a bare IPv6 address.
+ */
+static void ParseListenAddress(const gchar *entry, unsigned defport,
+                               gchar **host, unsigned *port)
+{
+  const gchar *colon, *close;
+
+  *port = defport;
+  colon = strrchr(entry, ':');
+  if (entry[0] == '[' && (close = strchr(entry, ']'))) {
+    *host = g_strndup(entry + 1, close - entry - 1);
+    if (close[1] == ':') {
+      *port = atoi(close + 2);
+    }
+  } else if (colon && colon == strchr(entry, ':')) {
+    *host = g_strndup(entry, colon - entry);
+    *port = atoi(colon + 1);
+  } else {
+    *host = g_strdup(entry);
+  }
+  if (!(*host)[0]) {
+    g_free(*host);
+    *host = NULL;
+  }
+}
+
+/* 
+ * Sets up a single listening socket on the given local address.
+ */
+/* 
+ * Records the error from the last failed socket call in "error".
+ */
+static void SetSocketError(LastError **error)
+{
+#ifdef CYGWIN
+  SetError(error, ET_WINSOCK, WSAGetLastError(), NULL);
+#else
+  SetError(error, ET_ERRNO, errno, NULL);
+#endif
+}
+
+/* 
+ * Returns TRUE if the given error from ListenOnAddress() just means that
+ * the address family is not supported (e.g. IPv6 is not available).
+ */
+static gboolean IsNoAddressFamily(LastError *error)
+{
+#ifdef CYGWIN
+  return (error->type == ET_WINSOCK && error->code == WSAEAFNOSUPPORT);
+#else
+  return (error->type == ET_ERRNO && error->code == EAFNOSUPPORT);
+#endif
+}
+
+static int ListenOnAddress(const struct sockaddr *addr, int addrlen,
+                           gboolean reuseport, LastError **error)
+{
+  int sock;
+
+  sock = socket(addr->sa_family, SOCK_STREAM, 0);
+  if (sock == SOCKET_ERROR) {
+    SetSocketError(error);
+    return SOCKET_ERROR;
+  }
+
+  /* This doesn't seem to work properly under Win32 */
+#ifndef CYGWIN
+  SetReuse(sock);
+#endif
+  if (reuseport) {
+    SetReusePort(sock);
+  }
+#if defined(AF_INET6) && defined(IPV6_V6ONLY)
+  if (addr->sa_family == AF_INET6) {
+    int i = 1;
+
+    /* IPv4 gets its own socket, so don't also claim the IPv4 port via.
+     * mapped addresses */
+    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&i, sizeof(i));
+  }
+#endif
+  SetBlocking(sock, FALSE);
+
+  if (bind(sock, addr, addrlen) == SOCKET_ERROR
+      || listen(sock, LISTENBACKLOG) == SOCKET_ERROR) {
+    SetSocketError(error);
+    CloseSocket(sock);
+    return SOCKET_ERROR;
+  }
+  return sock;
+}
+
+/* 
+ * Listens on all local addresses matching a single BindAddress entry,
+ * adding the new sockets to "socks".
+ */
+static gboolean ListenOnEntry(GArray *socks, const gchar *entry,
+                              unsigned defport, gboolean reuseport,
+                              LastError **error)
+{
+  gchar *host;
+  unsigned port;
+  int sock;
+  gboolean ok = TRUE;
+#ifdef HAVE_GETADDRINFO
+  struct addrinfo hints, *res, *ai;
+  gchar *portstr;
+  int gaierr;
+  LastError *sockerr;
+#else
+  struct sockaddr_in addr;
+  struct hostent *he;
+#endif
+
+  ParseListenAddress(entry, defport, &host, &port);
+
+#ifdef HAVE_GETADDRINFO
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  portstr = g_strdup_printf("%u", port);
+  gaierr = getaddrinfo(host, portstr, &hints, &res);
+  g_free(portstr);
+  if (gaierr != 0) {
+    SetError(error, ET_GAI, gaierr, NULL);
+    ok = FALSE;
+  } else {
+    for (ai = res; ok && ai; ai = ai->ai_next) {
+      sockerr = NULL;
+      sock = ListenOnAddress(ai->ai_addr, ai->ai_addrlen, reuseport,
+                             &sockerr);
+      if (sock != SOCKET_ERROR) {
+        g_array_append_val(socks, sock);
+      } else if (!host && IsNoAddressFamily(sockerr)) {
+        /* It's OK for the wildcard address to find no IPv6 support */
+        FreeError(sockerr);
+      } else {
+        if (error) {
+          FreeError(*error);
+          *error = sockerr;
+        } else {
+          FreeError(sockerr);
+        }
+        ok = FALSE;
+      }
+    }
+    freeaddrinfo(res);
+  }
+#else
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = INADDR_ANY;
+  if (host) {
+    he = LookupHostname(host, error);
+    if (he) {
+      addr.sin_addr = *((struct in_addr *)he->h_addr);
+    } else {
+      ok = FALSE;
+    }
+  }
+  if (ok) {
+    sock = ListenOnAddress((struct sockaddr *)&addr, sizeof(addr),
+                           reuseport, error);
+    if (sock != SOCKET_ERROR) {
+      g_array_append_val(socks, sock);
+    } else {
+      ok = FALSE;
+    }
+  }
+#endif
+
+  g_free(host);
+  return ok;
+}
+
+/* 
+ * Creates, binds and listens on server sockets for every address in
+ * "addrlist", which is a comma- or space-separated list in the format
+ * described for ParseListenAddress(); an empty list means all local
+ * IPv4 and IPv6 addresses. Entries without an explicit port use
+ * "defport". If "reuseport" is TRUE, other processes may bind the
+ * same addresses and the kernel balances connections between them.
+ * Returns an array of the listening sockets, or NULL on failure.
+ */
+GArray *StartListening(const gchar *addrlist, unsigned defport,
+                       gboolean reuseport, LastError **error)
+{
+  GArray *socks;
+  gchar **entries;
+  int i, numentries = 0;
+  gboolean ok = TRUE;
+
+  socks = g_array_new(FALSE, FALSE, sizeof(int));
+  entries = g_strsplit_set(addrlist ? addrlist : "", ", ", -1);
+  for (i = 0; ok && entries[i]; i++) {
+    if (entries[i][0]) {
+      ok = ListenOnEntry(socks, entries[i], defport, reuseport, error);
+      numentries++;
+    }
+  }
+  g_strfreev(entries);
+  if (ok && numentries == 0) {
+    ok = ListenOnEntry(socks, "", defport, reuseport, error);
+  }
+
+  if (!ok) {
+    StopListening(socks);
+    return NULL;
+  }
+  return socks;
+}
+
+/* 
+ * Closes and frees all of the listening sockets from StartListening().
+ */
+void StopListening(GArray *socks)
+{
+  guint i;
+
+  if (!socks) {
+    return;
+  }
+  for (i = 0; i < socks->len; i++) {
+    CloseSocket(g_array_index(socks, int, i));
+  }
+  g_array_free(socks, TRUE);
+}
+
+#ifndef ASYNC_CONNECT
 gboolean StartConnect(int *fd, const gchar *bindaddr, gchar *RemoteHost,
                       unsigned RemotePort, gboolean *doneOK, LastError **error)
 {
@@ -1477,6 +2270,7 @@ gboolean StartConnect(int *fd, const gchar *bindaddr, gchar *RemoteHost,
   }
   return TRUE;
 }
+#endif /* !ASYNC_CONNECT */
 
 gboolean FinishConnect(int fd, LastError **error)
 {
@@ -1514,6 +2308,479 @@ gboolean FinishConnect(int fd, LastError **error)
 #endif /* CYGWIN */
 }
 
+#ifdef ASYNC_CONNECT
+
+/* Maximum number of lookups/connects that run at once (serverprobe.c
+ * keeps its MAXPROBES below this) */
+#define MAXCONNECTTHREADS 4
+
+/* Time (in milliseconds) to wait for a connection attempt to complete
+ * before racing it against the next address, as recommended by
+ * RFC 8305 ("Happy Eyeballs") */
+#define CONNECTDELAY 250
+
+/* Time (in milliseconds) after which a background connect gives up on
+ * any attempts still pending, so that a black-holed address doesn't tie
+ * up a pool thread until the kernel's own timeout */
+#define CONNECTJOBTIMEOUT 30000
+
+struct _NBConnectJob {
+  gchar *host;                  /* Host and port to connect to */
+  unsigned port;
+  gchar *bindaddr;              /* If non-NULL, the local address to bind */
+  gchar *socks4host;            /* If non-NULL, the target of a SOCKS4
+                                 * connection, which must be resolved
+                                 * to an IPv4 address */
+  struct in_addr socks4addr;    /* Address of socks4host */
+  int notify[2];                /* Pipe; a byte is written to notify[1]
+                                 * when the job completes */
+  int fd;                       /* Connected socket, or -1 on failure */
+  LastError *error;             /* Why the job failed, if fd is -1 */
+  gboolean done;                /* TRUE once the worker has finished */
+  gboolean abandoned;           /* TRUE if the owner no longer wants the
+                                 * result */
+  gint64 started;               /* When the first connect() was made (ms),
+                                 * or 0 if not yet */
+};
+
+/* Protects the "done", "abandoned" and "started" fields of all jobs */
+static GMutex ConnectLock;
+static GThreadPool *ConnectPool = NULL;
+
+static void FreeConnectJob(NBConnectJob *job)
+{
+  if (job->fd >= 0) {
+    CloseSocket(job->fd);
+  }
+  close(job->notify[1]);
+  g_free(job->host);
+  g_free(job->bindaddr);
+  g_free(job->socks4host);
+  FreeError(job->error);
+  g_free(job);
+}
+
+/* 
+ * Records a getaddrinfo() failure as the job's error.
+ */
+static void SetJobGaiError(NBConnectJob *job, int gaierr)
+{
+#ifdef EAI_SYSTEM
+  if (gaierr == EAI_SYSTEM) {
+    SetError(&job->error, ET_ERRNO, errno, NULL);
+    return;
+  }
+#endif
+  SetError(&job->error, ET_GAI, gaierr, NULL);
+}
+
+/* 
+ * Binds the socket "fd", of the given address family, to the local
+ * address "addr".
+ */
+static gboolean BindJobSocket(NBConnectJob *job, int fd, int family)
+{
+  struct addrinfo hints, *res;
+  int gaierr;
+  gboolean retval;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  gaierr = getaddrinfo(job->bindaddr, NULL, &hints, &res);
+  if (gaierr != 0) {
+    SetJobGaiError(job, gaierr);
+    return FALSE;
+  }
+  retval = (bind(fd, res->ai_addr, res->ai_addrlen) == 0);
+  if (!retval) {
+    SetError(&job->error, ET_ERRNO, errno, NULL);
+  }
+  freeaddrinfo(res);
+  return retval;
+}
+
+/* 
+ * Starts a non-blocking connect to the given address. Returns the new
+ * socket, or -1 on failure. "connected" is set TRUE if the connection
+ * completed immediately.
+ */
+static int StartAddrConnect(NBConnectJob *job, struct addrinfo *ai,
+                            gboolean *connected)
+{
+  int fd;
+
+  *connected = FALSE;
+  fd = socket(ai->ai_family, SOCK_STREAM, 0);
+  if (fd == -1) {
+    SetError(&job->error, ET_ERRNO, errno, NULL);
+    return -1;
+  }
+  if (fd >= FD_SETSIZE) {
+    SetError(&job->error, ET_ERRNO, EMFILE, NULL);
+    CloseSocket(fd);
+    return -1;
+  }
+  if (job->bindaddr && !BindJobSocket(job, fd, ai->ai_family)) {
+    CloseSocket(fd);
+    return -1;
+  }
+  SetBlocking(fd, FALSE);
+  if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+    *connected = TRUE;
+  } else if (errno != EINPROGRESS) {
+    SetError(&job->error, ET_ERRNO, errno, NULL);
+    CloseSocket(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* 
+ * Returns the addresses in the list "res" in the order in which they
+ * should be tried: alternating between address families, starting
+ * with the family of the resolver's first preference (RFC 8305).
+ */
+static GPtrArray *SortAddresses(struct addrinfo *res)
+{
+  GPtrArray *sorted;
+  GSList *first = NULL, *other = NULL, *fpt, *opt;
+  struct addrinfo *ai;
+
+  for (ai = res; ai; ai = ai->ai_next) {
+    if (ai->ai_family == res->ai_family) {
+      first = g_slist_prepend(first, ai);
+    } else {
+      other = g_slist_prepend(other, ai);
+    }
+  }
+  first = g_slist_reverse(first);
+  other = g_slist_reverse(other);
+
+  sorted = g_ptr_array_new();
+  for (fpt = first, opt = other; fpt || opt;) {
+    if (fpt) {
+      g_ptr_array_add(sorted, fpt->data);
+      fpt = g_slist_next(fpt);
+    }
+    if (opt) {
+      g_ptr_array_add(sorted, opt->data);
+      opt = g_slist_next(opt);
+    }
+  }
+  g_slist_free(first);
+  g_slist_free(other);
+  return sorted;
+}
+
+/* 
+ * Returns TRUE if the owner of the job has lost interest in it.
+ */
+static gboolean IsJobAbandoned(NBConnectJob *job)
+{
+  gboolean abandoned;
+
+  g_mutex_lock(&ConnectLock);
+  abandoned = job->abandoned;
+  g_mutex_unlock(&ConnectLock);
+  return abandoned;
+}
+
+/* 
+ * Resolves job->host and connects to it, returning the connected
+ * (non-blocking) socket, or -1 on failure. If the host has several
+ * addresses, a new attempt is started every CONNECTDELAY milliseconds
+ * while earlier attempts are still pending, and the first to succeed
+ * wins; this avoids long stalls when (for example) IPv6 is advertised
+ * but not actually routable. All attempts are given up after
+ * CONNECTJOBTIMEOUT milliseconds, or as soon as the job is abandoned.
+ */
+static int HappyEyeballsConnect(NBConnectJob *job)
+{
+  struct addrinfo hints, *res;
+  GPtrArray *addrs;
+  gchar *portstr;
+  int *pending, npending = 0, fd = -1, maxfd, gaierr, i;
+  guint next = 0;
+  gboolean connected;
+  fd_set writefds;
+  struct timeval tv;
+  gint64 deadline, wait;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+#ifdef AI_ADDRCONFIG
+  hints.ai_flags = AI_ADDRCONFIG;
+#endif
+  portstr = g_strdup_printf("%u", job->port);
+  gaierr = getaddrinfo(job->host, portstr, &hints, &res);
+  g_free(portstr);
+  if (gaierr != 0) {
+    SetJobGaiError(job, gaierr);
+    return -1;
+  }
+
+  addrs = SortAddresses(res);
+  pending = g_new(int, addrs->len);
+  g_mutex_lock(&ConnectLock);
+  job->started = GetTimeMsec();
+  deadline = job->started + CONNECTJOBTIMEOUT;
+  g_mutex_unlock(&ConnectLock);
+
+  while (fd == -1 && (next < addrs->len || npending > 0)) {
+    wait = deadline - GetTimeMsec();
+    if (wait <= 0) {
+      SetError(&job->error, ET_ERRNO, ETIMEDOUT, NULL);
+      break;
+    } else if (IsJobAbandoned(job)) {
+      break;
+    }
+    if (next < addrs->len) {
+      i = StartAddrConnect(job, g_ptr_array_index(addrs, next++),
+                           &connected);
+      if (connected) {
+        fd = i;
+        break;
+      } else if (i >= 0) {
+        pending[npending++] = i;
+      }
+      if (npending == 0) {
+        continue;
+      }
+    }
+
+    FD_ZERO(&writefds);
+    maxfd = 0;
+    for (i = 0; i < npending; i++) {
+      FD_SET(pending[i], &writefds);
+      maxfd = MAX(maxfd, pending[i]);
+    }
+    /* Wake up at least every CONNECTDELAY, to start the next attempt
+     * or to notice that we have been abandoned */
+    wait = MIN(wait, CONNECTDELAY);
+    tv.tv_sec = wait / 1000;
+    tv.tv_usec = (wait % 1000) * 1000;
+    if (select(maxfd + 1, NULL, &writefds, NULL, &tv) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      SetError(&job->error, ET_ERRNO, errno, NULL);
+      break;
+    }
+
+    for (i = 0; i < npending; i++) {
+      if (!FD_ISSET(pending[i], &writefds)) {
+        continue;
+      }
+      if (fd == -1 && FinishConnect(pending[i], &job->error)) {
+        fd = pending[i];
+      } else {
+        CloseSocket(pending[i]);
+      }
+      pending[i--] = pending[--npending];
+    }
+  }
+
+  for (i = 0; i < npending; i++) {
+    CloseSocket(pending[i]);
+  }
+  g_free(pending);
+  g_ptr_array_free(addrs, TRUE);
+  freeaddrinfo(res);
+  return fd;
+}
+
+/* 
+ * Resolves job->socks4host to an IPv4 address, as required by the
+ * SOCKS4 protocol.
+ */
+static gboolean LookupSocks4Target(NBConnectJob *job)
+{
+  struct addrinfo hints, *res;
+  int gaierr;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  gaierr = getaddrinfo(job->socks4host, NULL, &hints, &res);
+  if (gaierr != 0) {
+    SetJobGaiError(job, gaierr);
+    return FALSE;
+  }
+  job->socks4addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+  freeaddrinfo(res);
+  return TRUE;
+}
+
+/* 
+ * Thread pool function: does all the potentially slow work of a
+ * connect and then notifies the owner via. the job's pipe. If the
+ * owner gave up in the meantime, the job is instead freed here.
+ */
+static void ConnectWorker(gpointer data, gpointer user_data)
+{
+  NBConnectJob *job = (NBConnectJob *)data;
+  char done = 1;
+
+  job->fd = HappyEyeballsConnect(job);
+  if (job->fd >= 0 && job->socks4host && !LookupSocks4Target(job)) {
+    CloseSocket(job->fd);
+    job->fd = -1;
+  }
+
+  g_mutex_lock(&ConnectLock);
+  if (job->abandoned) {
+    g_mutex_unlock(&ConnectLock);
+    FreeConnectJob(job);
+  } else {
+    job->done = TRUE;
+    if (write(job->notify[1], &done, 1) != 1) {
+      g_warning("Cannot notify owner of completed connect");
+    }
+    g_mutex_unlock(&ConnectLock);
+  }
+}
+
+/* 
+ * Starts resolving and connecting to realhost:realport in the
+ * background. Until this completes, the network buffer's descriptor
+ * is the read end of a pipe, so owners can wait on it exactly as they
+ * would on a socket; see FinishAsyncConnect().
+ */
+static gboolean StartAsyncConnect(NetworkBuffer *NetBuf,
+                                  const gchar *bindaddr,
+                                  gchar *realhost, unsigned realport,
+                                  gchar *RemoteHost, unsigned RemotePort)
+{
+  NBConnectJob *job;
+
+  if (!ConnectPool) {
+    ConnectPool = g_thread_pool_new(ConnectWorker, NULL, MAXCONNECTTHREADS,
+                                    FALSE, NULL);
+  }
+
+  job = g_new0(NBConnectJob, 1);
+  if (pipe(job->notify) == -1) {
+    SetError(&NetBuf->error, ET_ERRNO, errno, NULL);
+    g_free(job);
+    return FALSE;
+  }
+  job->host = g_strdup(realhost);
+  job->port = realport;
+  job->fd = -1;
+  if (bindaddr && bindaddr[0]) {
+    job->bindaddr = g_strdup(bindaddr);
+  }
+  if (NetBuf->socks && NetBuf->socks->version != 5) {
+    job->socks4host = g_strdup(RemoteHost);
+  }
+
+  NetBuf->host = g_strdup(RemoteHost);
+  NetBuf->port = RemotePort;
+  NetBuf->connjob = job;
+  NetBuf->fd = job->notify[0];
+  NetBuf->ioch = g_io_channel_unix_new(NetBuf->fd);
+
+  g_thread_pool_push(ConnectPool, job, NULL);
+
+  /* Notify the owner to watch for the lookup completing */
+  NetBufCallBack(NetBuf, FALSE);
+  return TRUE;
+}
+
+/* 
+ * Called when the notification pipe of a background connect becomes
+ * readable; replaces the pipe with the newly-connected socket, and
+ * starts SOCKS negotiation if necessary. Returns FALSE on failure.
+ */
+static gboolean FinishAsyncConnect(NetworkBuffer *NetBuf)
+{
+  NBConnectJob *job = NetBuf->connjob;
+  gchar *host;
+  char done;
+  gboolean retval = TRUE;
+
+  if (read(NetBuf->fd, &done, 1) != 1) {
+    return TRUE;                /* Spurious wakeup; keep waiting */
+  }
+
+  /* The old descriptor is going away, so stop watching it */
+  NetBufCallBackStop(NetBuf);
+  NetBuf->connjob = NULL;
+  CloseSocket(NetBuf->fd);
+  g_io_channel_unref(NetBuf->ioch);
+
+  NetBuf->fd = job->fd;
+  NetBuf->ConnectStarted = job->started;
+  job->fd = -1;
+  if (NetBuf->fd >= 0) {
+    NetBuf->ioch = g_io_channel_unix_new(NetBuf->fd);
+    if (NetBuf->socks) {
+      NetBuf->status = NBS_SOCKSCONNECT;
+      NetBuf->sockstat = NBSS_METHODS;
+      host = g_strdup(NetBuf->host);
+      retval = StartSocksNegotiation(NetBuf, host, NetBuf->port,
+                                     job->socks4host ? &job->socks4addr
+                                     : NULL);
+      g_free(host);
+    } else {
+      NetBuf->status = NBS_CONNECTED;
+    }
+  } else {
+    NetBuf->ioch = NULL;
+    FreeError(NetBuf->error);
+    NetBuf->error = job->error;
+    job->error = NULL;
+    retval = FALSE;
+  }
+
+  FreeConnectJob(job);
+  return retval;
+}
+
+/* 
+ * Tells a background connect that its owner is no longer interested.
+ * The caller remains responsible for closing the read end of the
+ * notification pipe.
+ */
+static void AbandonConnectJob(NBConnectJob *job)
+{
+  g_mutex_lock(&ConnectLock);
+  if (job->done) {
+    g_mutex_unlock(&ConnectLock);
+    FreeConnectJob(job);
+  } else {
+    job->abandoned = TRUE;
+    g_mutex_unlock(&ConnectLock);
+  }
+}
+
+#endif /* ASYNC_CONNECT */
+
+/* 
+ * Returns the time (in ms; see GetTimeMsec) at which the network
+ * buffer's connect actually started, or 0 if it is still waiting for
+ * a free connect thread (or for the hostname lookup). This excludes
+ * any time the connect spent queued, so is a better basis for
+ * measuring how long a server takes to answer.
+ */
+gint64 GetConnectStartTime(NetworkBuffer *NetBuf)
+{
+#ifdef ASYNC_CONNECT
+  gint64 started;
+
+  if (NetBuf->connjob) {
+    g_mutex_lock(&ConnectLock);
+    started = NetBuf->connjob->started;
+    g_mutex_unlock(&ConnectLock);
+    return started;
+  }
+#endif
+  return NetBuf->ConnectStarted;
+}
+
 static void AddB64char(GString *str, int c)
 {
   if (c < 0)
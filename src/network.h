@@ -71,7 +71,13 @@
 #define dp_g_timeout_add g_timeout_add
 #endif
 
-typedef struct _CurlConnection {
+typedef struct _CurlConnection CurlConnection;
+
+/* Called for each complete line of a reply, as it arrives */
+typedef void (*CurlLineFunc) (CurlConnection *conn, char *line,
+                              gpointer data);
+
+struct _CurlConnection {
   CURLM *multi;
   CURL *h;
   gboolean running;
@@ -81,11 +87,15 @@ typedef struct _CurlConnection {
   char StripChar;               /* Char that should be removed
                                  * from messages */
   GPtrArray *headers;
+  CurlLineFunc LineFunc;        /* If set, complete lines are passed to
+                                 * this function, and "data" holds only
+                                 * any trailing partial line */
+  gpointer LineData;
 
   guint timer_event;
   GSourceFunc timer_cb;
   GIOFunc socket_cb;
-} CurlConnection;
+};
 
 typedef struct _ConnBuf {
   gchar *Data;                  /* bytes waiting to be read/written */
@@ -93,8 +103,40 @@ typedef struct _ConnBuf {
   gint DataPresent;             /* number of bytes currently in "Data" */
 } ConnBuf;
 
+/* A single message waiting in a network buffer's write queue */
+typedef struct _NBQueuedMsg {
+  gint Length;                  /* Size in bytes, including terminator */
+  guint Tag;                    /* If non-zero, a later message with the
+                                 * same tag supersedes this one */
+  gint64 Queued;                /* Time (msec, from GetTimeMsec) at which
+                                 * the message was queued */
+} NBQueuedMsg;
+
+/* Outbound flow control limits and statistics for a network buffer */
+typedef struct _NBFlowControl {
+  gint SoftLimit;               /* Once this many bytes are waiting,
+                                 * superseded messages are coalesced */
+  gint HardLimit;               /* The connection is dropped if more than
+                                 * this many bytes are waiting */
+  GQueue *Msgs;                 /* NBQueuedMsg for each message in
+                                 * WriteBuf, oldest first */
+  gint HeadSent;                /* Bytes of the oldest message that have
+                                 * already been written */
+  guint PeakDepth;              /* Most messages ever waiting at once */
+  gint PeakBytes;               /* Most bytes ever waiting at once */
+  gulong MsgsQueued;            /* Total messages queued */
+  gulong MsgsSent;              /* Total messages completely written */
+  gulong MsgsCoalesced;         /* Total messages discarded because they
+                                 * were superseded */
+  gulong BytesSent;             /* Total bytes written to the wire */
+} NBFlowControl;
+
 typedef struct _NetworkBuffer NetworkBuffer;
 
+/* A hostname lookup and connection attempt in progress in the
+ * background (opaque; see network.c) */
+typedef struct _NBConnectJob NBConnectJob;
+
 typedef void (*NBCallBack) (NetworkBuffer *NetBuf, gboolean Read,
                             gboolean Write, gboolean Exception,
                             gboolean CallNow);
@@ -148,6 +190,10 @@ struct _NetworkBuffer {
                                  * (e.g. SOCKS) */
   gboolean WaitConnect;         /* TRUE if a non-blocking connect is in
                                  * progress */
+  NBConnectJob *connjob;        /* If non-NULL, the hostname is still being
+                                 * resolved and connected to in the
+                                 * background; fd is then a pipe that
+                                 * becomes readable when this completes */
   NBStatus status;              /* Status of the connection (if any) */
   NBSocksStatus sockstat;       /* Status of SOCKS negotiation (if any) */
   SocksServer *socks;           /* If non-NULL, a SOCKS server to use */
@@ -157,6 +203,11 @@ struct _NetworkBuffer {
   gchar *host;                  /* If non-NULL, the host to connect to */
   unsigned port;                /* If non-NULL, the port to connect to */
   LastError *error;             /* Any error from the last operation */
+  NBFlowControl flow;           /* Write queue limits and statistics */
+  gboolean Batched;             /* TRUE if data were queued for this
+                                 * buffer during the current write batch */
+  gint64 ConnectStarted;        /* When connect() was first called (ms; see
+                                 * GetTimeMsec), or 0 if not yet */
 };
 
 void InitNetworkBuffer(NetworkBuffer *NetBuf, char Terminator,
@@ -168,10 +219,12 @@ void SetNetworkBufferUserPasswdFunc(NetworkBuffer *NetBuf,
                                     gpointer data);
 gboolean IsNetworkBufferActive(NetworkBuffer *NetBuf);
 void BindNetworkBufferToSocket(NetworkBuffer *NetBuf, int fd);
+gint64 GetConnectStartTime(NetworkBuffer *NetBuf);
 gboolean StartNetworkBufferConnect(NetworkBuffer *NetBuf,
                                    const gchar *bindaddr,
                                    gchar *RemoteHost, unsigned RemotePort);
 void ShutdownNetworkBuffer(NetworkBuffer *NetBuf);
+void MoveNetworkBuffer(NetworkBuffer *dest, NetworkBuffer *src);
 void SetSelectForNetworkBuffer(NetworkBuffer *NetBuf, fd_set *readfds,
                                fd_set *writefds, fd_set *errorfds,
                                int *MaxSock);
@@ -184,8 +237,17 @@ gboolean NetBufHandleNetwork(NetworkBuffer *NetBuf, gboolean ReadReady,
 gboolean ReadDataFromWire(NetworkBuffer *NetBuf);
 gboolean WriteDataToWire(NetworkBuffer *NetBuf);
 void QueueMessageForSend(NetworkBuffer *NetBuf, gchar *data);
+void BeginWriteBatch(void);
+void EndWriteBatch(void);
+void QueueTaggedMessageForSend(NetworkBuffer *NetBuf, gchar *data,
+                               guint tag);
+void SetNetworkBufferLimits(NetworkBuffer *NetBuf, gint SoftLimit,
+                            gint HardLimit);
+gint GetWriteQueueDepth(NetworkBuffer *NetBuf);
+gint64 GetWriteQueueAge(NetworkBuffer *NetBuf, gint64 timenow);
 gint CountWaitingMessages(NetworkBuffer *NetBuf);
 gchar *GetWaitingMessage(NetworkBuffer *NetBuf);
+gchar *PeekWaitingMessage(NetworkBuffer *NetBuf, gint index);
 void SendSocks5UserPasswd(NetworkBuffer *NetBuf, gchar *user,
                           gchar *password);
 gchar *GetWaitingData(NetworkBuffer *NetBuf, int numbytes);
@@ -213,20 +275,31 @@ gboolean CurlConnectionSocketAction(CurlConnection *conn, curl_socket_t fd,
 char *CurlNextLine(CurlConnection *conn, char *ch);
 void SetCurlCallback(CurlConnection *conn, GSourceFunc timer_cb,
                      GIOFunc socket_cb);
+void SetCurlLineCallback(CurlConnection *conn, CurlLineFunc func,
+                         gpointer data);
 
 int CreateTCPSocket(LastError **error);
 gboolean BindTCPSocket(int sock, const gchar *addr, unsigned port,
                        LastError **error);
+GArray *StartListening(const gchar *addrlist, unsigned defport,
+                       gboolean reuseport, LastError **error);
+void StopListening(GArray *socks);
+int AcceptTCPConnection(int sock, gchar **peer, LastError **error);
+gboolean IsAcceptDone(LastError *error);
+gboolean IsAcceptExhausted(LastError *error);
+gchar *GetSocketAddress(int sock);
 void StartNetworking(void);
 void StopNetworking(void);
 
 #ifdef CYGWIN
 #define CloseSocket(sock) closesocket(sock)
 void SetReuse(SOCKET sock);
+void SetReusePort(SOCKET sock);
 void SetBlocking(SOCKET sock, gboolean blocking);
 #else
 #define CloseSocket(sock) close(sock)
 void SetReuse(int sock);
+void SetReusePort(int sock);
 void SetBlocking(int sock, gboolean blocking);
 #endif
 
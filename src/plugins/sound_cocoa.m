@@ -69,6 +69,8 @@ SoundDriver *sound_cocoa_init(void)
   driver.open = SoundOpen_Cocoa;
   driver.close = SoundClose_Cocoa;
   driver.play = SoundPlay_Cocoa;
+  /* NSSound must only be used from the main thread */
+  driver.threadsafe = FALSE;
   return &driver;
 }
 #endif
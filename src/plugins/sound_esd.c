@@ -96,6 +96,7 @@ SoundDriver *sound_esd_init(void)
   driver.open = SoundOpen_ESD;
   driver.close = SoundClose_ESD;
   driver.play = SoundPlay_ESD;
+  driver.threadsafe = TRUE;
   return &driver;
 }
 
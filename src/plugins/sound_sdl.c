@@ -32,17 +32,72 @@
 #include <glib.h>
 #include "../sound.h"
 
-struct ChannelStruct {
+/*
+ * Bank of decoded sounds, keyed by filename. Sounds are decoded by a
+ * background thread so that playing a sound never touches the disk;
+ * "chunk" stays NULL until the sound is loaded (or if it can't be).
+ */
+typedef struct _SoundBankEntry {
   Mix_Chunk *chunk;
+} SoundBankEntry;
+
+static GHashTable *bank = NULL;
+static GMutex bank_lock;
+static GThread *loader = NULL;
+static GAsyncQueue *load_queue = NULL;
+
+/* Pushed onto the load queue to stop the loader thread */
+static gchar quit_loader[] = "";
+
+static gpointer SoundLoader_SDL(gpointer data)
+{
+  gchar *snd;
+  SoundBankEntry *entry;
+  Mix_Chunk *chunk;
+
+  while ((snd = g_async_queue_pop(load_queue)) != quit_loader) {
+    chunk = Mix_LoadWAV(snd);
+    g_mutex_lock(&bank_lock);
+    entry = g_hash_table_lookup(bank, snd);
+    entry->chunk = chunk;
+    g_mutex_unlock(&bank_lock);
+  }
+  return NULL;
+}
+
+/*
+ * Adds "snd" to the bank (if it isn't there already) and asks the loader
+ * thread to decode it. Must be called with bank_lock held.
+ */
+static void QueueLoad(const gchar *snd)
+{
+  SoundBankEntry *entry;
   gchar *name;
-} channel[MIX_CHANNELS];
-  
+
+  if (g_hash_table_lookup(bank, snd)) {
+    return;
+  }
+  entry = g_new0(SoundBankEntry, 1);
+  name = g_strdup(snd);
+  g_hash_table_insert(bank, name, entry);
+  g_async_queue_push(load_queue, name);
+}
+
+static void FreeBankEntry(gpointer data)
+{
+  SoundBankEntry *entry = data;
+
+  if (entry->chunk) {
+    Mix_FreeChunk(entry->chunk);
+  }
+  g_free(entry);
+}
+
 static gboolean SoundOpen_SDL(void)
 {
   const int audio_rate = MIX_DEFAULT_FREQUENCY;
   const int audio_format = MIX_DEFAULT_FORMAT;
   const int audio_channels = 2;
-  int i;
 
   if (SDL_Init(SDL_INIT_AUDIO) < 0) {
     return FALSE;
@@ -54,57 +109,60 @@ static gboolean SoundOpen_SDL(void)
   }
   Mix_AllocateChannels(MIX_CHANNELS);
 
-  for (i = 0; i < MIX_CHANNELS; i++) {
-    channel[i].chunk = NULL;
-    channel[i].name = NULL;
-  }
+  bank = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                               FreeBankEntry);
+  load_queue = g_async_queue_new();
+  loader = g_thread_new("sound_sdl", SoundLoader_SDL, NULL);
   return TRUE;
 }
 
 static void SoundClose_SDL(void)
 {
-  int i;
+  if (loader) {
+    g_async_queue_push(load_queue, quit_loader);
+    g_thread_join(loader);
+    g_async_queue_unref(load_queue);
+    loader = NULL;
+    load_queue = NULL;
+  }
 
-  for (i = 0; i < MIX_CHANNELS; i++) {
-    g_free(channel[i].name);
-    if (channel[i].chunk) {
-      Mix_FreeChunk(channel[i].chunk);
-    }
+  if (bank) {
+    /* Make sure no channel is still playing a chunk before it's freed */
+    Mix_HaltChannel(-1);
+    g_hash_table_destroy(bank);
+    bank = NULL;
   }
   Mix_CloseAudio();
   SDL_Quit();
 }
 
-static void SoundPlay_SDL(const gchar *snd)
+static void SoundPreload_SDL(const gchar *snd)
 {
-  int i, chan_num;
-  Mix_Chunk *chunk;
-
-  for (i = 0; i < MIX_CHANNELS; i++) {
-    if (channel[i].name && strcmp(channel[i].name, snd) == 0) {
-      Mix_PlayChannel(-1, channel[i].chunk, 0);
-      return;
-    }
-  }
-
-  chunk = Mix_LoadWAV(snd);
-  if (!chunk) {
+  if (!bank) {
     return;
   }
+  g_mutex_lock(&bank_lock);
+  QueueLoad(snd);
+  g_mutex_unlock(&bank_lock);
+}
+
+static void SoundPlay_SDL(const gchar *snd)
+{
+  SoundBankEntry *entry;
 
-  chan_num = Mix_PlayChannel(-1, chunk, 0);
-  if (chan_num < 0) {
-    Mix_FreeChunk(chunk);
+  if (!bank) {
     return;
   }
-
-  if (channel[chan_num].chunk) {
-    Mix_FreeChunk(channel[chan_num].chunk);
-    g_free(channel[chan_num].name);
+  g_mutex_lock(&bank_lock);
+  entry = g_hash_table_lookup(bank, snd);
+  if (!entry) {
+    /* Not preloaded (e.g. the sound was changed in the config since);
+     * load it for next time rather than stall here */
+    QueueLoad(snd);
+  } else if (entry->chunk) {
+    Mix_PlayChannel(-1, entry->chunk, 0);
   }
-
-  channel[chan_num].chunk = chunk;
-  channel[chan_num].name = g_strdup(snd);
+  g_mutex_unlock(&bank_lock);
 }
 
 SoundDriver *sound_sdl_init(void)
@@ -115,6 +173,8 @@ SoundDriver *sound_sdl_init(void)
   driver.open = SoundOpen_SDL;
   driver.close = SoundClose_SDL;
   driver.play = SoundPlay_SDL;
+  driver.threadsafe = TRUE;
+  driver.preload = SoundPreload_SDL;
   return &driver;
 }
 
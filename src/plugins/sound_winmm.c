@@ -53,6 +53,7 @@ SoundDriver *sound_winmm_init(void)
   driver.open = SoundOpen_WinMM;
   driver.close = SoundClose_WinMM;
   driver.play = SoundPlay_WinMM;
+  driver.threadsafe = TRUE;
   return &driver;
 }
 
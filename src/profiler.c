@@ -0,0 +1,260 @@
+/************************************************************************
+ * profiler.c     Server turn-processing profiler                       *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "nls.h"
+#include "profiler.h"
+
+/* 
+ * Each stage entered while the profiler is active is timed, and the
+ * time charged to its "path" - the names of the stages it is nested in,
+ * separated by semicolons (e.g. "dispatch:U;event:5;drugs"), which is
+ * the folded-stack format understood by flame graph tools. For each
+ * path we keep the number of calls, the total time spent in the stage
+ * (including the stages nested in it), the time spent in the stage
+ * itself, and a histogram of the time per call.
+ */
+
+/* Histogram buckets; bucket i counts calls that took under 2^i usec */
+#define PROFILE_BUCKETS  (24)
+
+/* Deeper stages than this are not timed separately */
+#define PROFILE_MAXDEPTH (32)
+
+typedef struct _ProfileNode {
+  gchar *Path;
+  guint64 Calls, TotalUsec, SelfUsec, MaxUsec;
+  guint64 Hist[PROFILE_BUCKETS];
+} ProfileNode;
+
+typedef struct _ProfileFrame {
+  gint64 Start;                 /* Monotonic time (usec) at entry */
+  gint64 ChildUsec;             /* Time spent in nested stages */
+  gsize PathLen;                /* Length of Path outside this stage */
+} ProfileFrame;
+
+static const struct {
+  const gchar *Name;
+  gboolean CodeIsChar;          /* TRUE if the code is a MsgCode */
+} StageInfo[PS_NUM] = {
+  { "parse", FALSE }, { "dispatch", TRUE }, { "event", FALSE },
+  { "drugs", FALSE }, { "fight", FALSE }, { "format", TRUE }
+};
+
+struct PROFILE Profile = { FALSE, NULL };
+gint ProfileDepth = 0;
+
+static ProfileFrame Frames[PROFILE_MAXDEPTH];
+static GString *Path = NULL;
+static GHashTable *Nodes = NULL;
+
+/* 
+ * Starts timing stage "stage" (nested in any stages that have been
+ * entered but not yet left). "code" identifies the message or event
+ * being handled, or is -1 if there is none.
+ */
+void ProfileEnter(ProfileStage stage, gint code)
+{
+  ProfileFrame *frame;
+
+  if (ProfileDepth++ >= PROFILE_MAXDEPTH)
+    return;
+  if (!Path)
+    Path = g_string_new("");
+  frame = &Frames[ProfileDepth - 1];
+  frame->PathLen = Path->len;
+  frame->ChildUsec = 0;
+  if (Path->len > 0)
+    g_string_append_c(Path, ';');
+  g_string_append(Path, StageInfo[stage].Name);
+  if (code >= 0) {
+    g_string_append_printf(Path, StageInfo[stage].CodeIsChar ? ":%c" : ":%d",
+                           code);
+  }
+  frame->Start = g_get_monotonic_time();
+}
+
+/* 
+ * Stops timing the most recently entered stage, and adds its time to
+ * the statistics.
+ */
+void ProfileLeave(void)
+{
+  ProfileFrame *frame;
+  ProfileNode *node;
+  guint64 elapsed;
+  gint bucket;
+
+  if (ProfileDepth-- > PROFILE_MAXDEPTH)
+    return;
+  frame = &Frames[ProfileDepth];
+  elapsed = g_get_monotonic_time() - frame->Start;
+
+  if (!Nodes)
+    Nodes = g_hash_table_new(g_str_hash, g_str_equal);
+  node = g_hash_table_lookup(Nodes, Path->str);
+  if (!node) {
+    node = g_new0(ProfileNode, 1);
+    node->Path = g_strdup(Path->str);
+    g_hash_table_insert(Nodes, node->Path, node);
+  }
+  node->Calls++;
+  node->TotalUsec += elapsed;
+  node->SelfUsec += MAX((gint64)elapsed - frame->ChildUsec, 0);
+  node->MaxUsec = MAX(node->MaxUsec, elapsed);
+  bucket = 0;
+  while (bucket < PROFILE_BUCKETS - 1 && elapsed >= ((guint64)1 << bucket))
+    bucket++;
+  node->Hist[bucket]++;
+
+  g_string_truncate(Path, frame->PathLen);
+  if (ProfileDepth > 0)
+    Frames[ProfileDepth - 1].ChildUsec += elapsed;
+}
+
+static gint ComparePaths(gconstpointer a, gconstpointer b)
+{
+  const ProfileNode *na = *(const ProfileNode **)a;
+  const ProfileNode *nb = *(const ProfileNode **)b;
+
+  return strcmp(na->Path, nb->Path);
+}
+
+static void AddNode(gpointer key, gpointer value, gpointer data)
+{
+  g_ptr_array_add((GPtrArray *)data, value);
+}
+
+/* 
+ * Returns all of the statistics gathered so far, sorted by path (so
+ * that each stage is followed by the stages nested in it).
+ */
+static GPtrArray *GetSortedNodes(void)
+{
+  GPtrArray *sorted = g_ptr_array_new();
+
+  if (Nodes)
+    g_hash_table_foreach(Nodes, AddNode, sorted);
+  g_ptr_array_sort(sorted, ComparePaths);
+  return sorted;
+}
+
+/* 
+ * Returns an upper bound on the time (in usec) taken by the fraction
+ * "frac" of the fastest calls in "node", from its histogram.
+ */
+static guint64 GetPercentile(ProfileNode *node, gdouble frac)
+{
+  guint64 seen = 0;
+  gint bucket;
+
+  for (bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+    seen += node->Hist[bucket];
+    if (seen >= frac * node->Calls)
+      return MIN((guint64)1 << bucket, node->MaxUsec);
+  }
+  return node->MaxUsec;
+}
+
+/* 
+ * Displays the time taken by each profiled stage.
+ */
+void ShowProfile(void)
+{
+  GPtrArray *sorted;
+  ProfileNode *node;
+  guint i;
+
+  sorted = GetSortedNodes();
+  if (sorted->len == 0) {
+    g_print(_("No profile data (set Profile.Active=TRUE to collect it)\n"));
+  } else {
+    g_print(_("     Calls   Total ms    Self ms  Mean us   p50 us   p99 us"
+              "   Max us  Stage\n"));
+  }
+  for (i = 0; i < sorted->len; i++) {
+    node = (ProfileNode *)g_ptr_array_index(sorted, i);
+    g_print("%10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+            " %10" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT
+            " %8" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT
+            " %8" G_GUINT64_FORMAT "  %s\n",
+            node->Calls, node->TotalUsec / 1000, node->SelfUsec / 1000,
+            node->TotalUsec / node->Calls, GetPercentile(node, 0.5),
+            GetPercentile(node, 0.99), node->MaxUsec, node->Path);
+  }
+  g_ptr_array_free(sorted, TRUE);
+}
+
+static gboolean FreeNode(gpointer key, gpointer value, gpointer data)
+{
+  ProfileNode *node = (ProfileNode *)value;
+
+  g_free(node->Path);
+  g_free(node);
+  return TRUE;
+}
+
+/* 
+ * Discards all of the statistics gathered so far.
+ */
+void ResetProfile(void)
+{
+  if (Nodes)
+    g_hash_table_foreach_remove(Nodes, FreeNode, NULL);
+}
+
+/* 
+ * Writes the time spent in each stage (in usec, excluding nested stages)
+ * to the named file as folded stacks, suitable for flamegraph.pl and
+ * similar tools. Returns FALSE (with errno set) if the file could not
+ * be written.
+ */
+gboolean WriteProfile(const gchar *filename)
+{
+  FILE *fp;
+  GPtrArray *sorted;
+  ProfileNode *node;
+  guint i;
+  gboolean retval;
+
+  fp = fopen(filename, "w");
+  if (!fp)
+    return FALSE;
+  sorted = GetSortedNodes();
+  for (i = 0; i < sorted->len; i++) {
+    node = (ProfileNode *)g_ptr_array_index(sorted, i);
+    if (node->SelfUsec > 0)
+      fprintf(fp, "%s %" G_GUINT64_FORMAT "\n", node->Path, node->SelfUsec);
+  }
+  g_ptr_array_free(sorted, TRUE);
+  retval = !ferror(fp);
+  if (fclose(fp) != 0)
+    retval = FALSE;
+  return retval;
+}
@@ -0,0 +1,65 @@
+/************************************************************************
+ * profiler.h     Server turn-processing profiler                       *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifndef __DP_PROFILER_H__
+#define __DP_PROFILER_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+/* The stages of message handling that the profiler times */
+typedef enum {
+  PS_PARSE,                     /* Decoding an inbound message */
+  PS_DISPATCH,                  /* Handling it, by MsgCode */
+  PS_EVENT,                     /* SendEvent, by starting EventCode */
+  PS_DRUGS,                     /* Generating the drugs at a location */
+  PS_FIGHT,                     /* Resolving one shot in a fight */
+  PS_FORMAT,                    /* Formatting an outbound message */
+  PS_NUM
+} ProfileStage;
+
+struct PROFILE {
+  gboolean Active;              /* TRUE if stages are being timed */
+  gchar *File;                  /* If set, folded stacks are written
+                                 * here when the server stops */
+};
+
+extern struct PROFILE Profile;
+extern gint ProfileDepth;
+
+void ProfileEnter(ProfileStage stage, gint code);
+void ProfileLeave(void);
+void ShowProfile(void);
+void ResetProfile(void);
+gboolean WriteProfile(const gchar *filename);
+
+/* Stages are only timed while the profiler is active; a stage that was
+ * entered is always left, even if the profiler is switched off inside it */
+#define PROFILE_ENTER(stage, code) \
+  do { if (Profile.Active) ProfileEnter(stage, code); } while (0)
+#define PROFILE_LEAVE() \
+  do { if (ProfileDepth > 0) ProfileLeave(); } while (0)
+
+#endif /* __DP_PROFILER_H__ */
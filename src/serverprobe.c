@@ -0,0 +1,394 @@
+/************************************************************************
+ * serverprobe.c  dopewars - server latency probing                     *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef NETWORKING
+
+#include <string.h>
+#include <glib.h>
+
+#include "dopewars.h"
+#include "message.h"
+#include "network.h"
+#include "nls.h"
+#include "serverprobe.h"
+
+/* Maximum number of servers to probe at once. This must be less than
+ * the number of background connect threads (see network.c), so that
+ * probes never hold up the player's own connection to a server */
+#define MAXPROBES 3
+
+/* Time (in ms) to wait for each stage of a probe (connect or ping); the
+ * connect stage is only timed once connect() has actually been called */
+#define PROBETIMEOUT 5000
+
+/* Time (in ms) to wait for a probe's hostname lookup, and for a connect
+ * thread to become free, before giving up */
+#define PROBEQUEUETIMEOUT 30000
+
+/* A set of probes, one for each server in a list */
+struct _ProbeSet {
+  GPtrArray *Servers;           /* The servers being probed; this may grow
+                                 * while probing is in progress */
+  GPtrArray *Probes;            /* ServerProbe for each started probe */
+  guint Active;                 /* Number of probes in progress */
+  NBCallBack CallBack;          /* If set, used to watch each probe's
+                                 * network buffer */
+  ProbeDoneFunc DoneFunc;
+  gpointer DoneData;
+};
+
+/* 
+ * Ends the probe of a server. If "Ponged" is FALSE, the server didn't
+ * answer our ping (perhaps because it is too old to understand it), so
+ * use the connect time (if any) as an estimate of its latency.
+ */
+static void FinishProbe(ServerProbe *probe, gboolean Ponged)
+{
+  ProbeSet *set = probe->Set;
+  ServerData *Server;
+
+  Server = (ServerData *)g_ptr_array_index(set->Servers, probe->Index);
+  if (Ponged) {
+    Server->Latency = (g_get_monotonic_time() - probe->Started) / 1000;
+  } else {
+    Server->Latency = probe->ConnectTime;
+  }
+  ShutdownNetworkBuffer(&probe->NetBuf);
+  probe->Status = PS_DONE;
+  set->Active--;
+  if (set->DoneFunc) {
+    set->DoneFunc(Server, probe->Index, set->DoneData);
+  }
+}
+
+/* 
+ * Starts probing more servers, if there are any left, without going
+ * over MAXPROBES at once.
+ */
+static void StartMoreProbes(ProbeSet *set)
+{
+  ServerProbe *probe;
+  ServerData *Server;
+
+  while (set->Active < MAXPROBES && set->Probes->len < set->Servers->len) {
+    probe = g_new0(ServerProbe, 1);
+    probe->Set = set;
+    probe->Index = set->Probes->len;
+    probe->ConnectTime = -1;
+    probe->Started = g_get_monotonic_time();
+    probe->Status = PS_CONNECTING;
+    g_ptr_array_add(set->Probes, probe);
+    set->Active++;
+
+    Server = (ServerData *)g_ptr_array_index(set->Servers, probe->Index);
+    InitNetworkBuffer(&probe->NetBuf, '\n', '\r', NULL);
+    if (StartNetworkBufferConnect(&probe->NetBuf, NULL, Server->Name,
+                                  Server->Port)) {
+      if (set->CallBack) {
+        SetNetworkBufferCallBack(&probe->NetBuf, set->CallBack, probe);
+      }
+    } else {
+      FinishProbe(probe, FALSE);
+    }
+  }
+}
+
+/* 
+ * Handles the outcome of network activity on a probe.
+ */
+static void ProbeProgress(ServerProbe *probe, gboolean DoneOK)
+{
+  gchar *msg, *pt, *text;
+  gboolean Ponged = FALSE;
+  gint64 now, connstart;
+
+  if (probe->Status == PS_DONE) {
+    return;
+  }
+  now = g_get_monotonic_time();
+  if (probe->Status == PS_CONNECTING && DoneOK
+      && probe->NetBuf.status == NBS_CONNECTED) {
+    connstart = GetConnectStartTime(&probe->NetBuf);
+    probe->ConnectTime = connstart ? now / 1000 - connstart
+                                   : (now - probe->Started) / 1000;
+    probe->Started = now;
+    probe->Status = PS_PINGING;
+
+    /* We aren't logged in, so the message has the (empty) sender and
+     * recipient names rather than player IDs */
+    text = g_strdup_printf("^^%c%c", C_NONE, C_PING);
+    QueueMessageForSend(&probe->NetBuf, text);
+    g_free(text);
+  }
+  while (probe->Status == PS_PINGING
+         && (msg = GetWaitingMessage(&probe->NetBuf)) != NULL) {
+    pt = msg;
+    GetNextWord(&pt, NULL);
+    GetNextWord(&pt, NULL);
+    if (strlen(pt) >= 2 && pt[1] == C_PING) {
+      Ponged = TRUE;
+    }
+    g_free(msg);
+    if (Ponged) {
+      break;
+    }
+  }
+  if (Ponged || !DoneOK) {
+    FinishProbe(probe, Ponged);
+  }
+  StartMoreProbes(probe->Set);
+}
+
+/* 
+ * Starts measuring the latency of each server in "servers", by timing
+ * how long it takes to connect and then answer a C_PING. Servers that
+ * are added to the list later are also probed (see UpdateServerProbes).
+ * If "CallBack" is non-NULL, it is used to watch each probe's network
+ * buffer (otherwise use SetSelectForServerProbes). "func" is called as
+ * each server is finished. Returns NULL if servers cannot be probed
+ * directly, because connections are going via a SOCKS server.
+ */
+ProbeSet *StartServerProbes(GPtrArray *servers, NBCallBack CallBack,
+                            ProbeDoneFunc func, gpointer data)
+{
+  ProbeSet *set;
+
+  if (UseSocks) {
+    return NULL;
+  }
+  set = g_new0(ProbeSet, 1);
+  set->Servers = g_ptr_array_ref(servers);
+  set->Probes = g_ptr_array_new();
+  set->CallBack = CallBack;
+  set->DoneFunc = func;
+  set->DoneData = data;
+  StartMoreProbes(set);
+  return set;
+}
+
+/* 
+ * Gives up on any probes that have taken too long, and starts probing
+ * any servers that were added since the last call.
+ */
+void UpdateServerProbes(ProbeSet *set)
+{
+  ServerProbe *probe;
+  gint64 now, connstart;
+  guint i;
+
+  if (!set) {
+    return;
+  }
+  now = g_get_monotonic_time();
+  for (i = 0; i < set->Probes->len; i++) {
+    probe = (ServerProbe *)g_ptr_array_index(set->Probes, i);
+    if (probe->Status == PS_CONNECTING) {
+      /* Don't count time spent waiting for a free connect thread */
+      connstart = GetConnectStartTime(&probe->NetBuf);
+      if (connstart ? now / 1000 - connstart >= PROBETIMEOUT
+          : now - probe->Started >= PROBEQUEUETIMEOUT * 1000) {
+        FinishProbe(probe, FALSE);
+      }
+    } else if (probe->Status == PS_PINGING
+               && now - probe->Started >= PROBETIMEOUT * 1000) {
+      FinishProbe(probe, FALSE);
+    }
+  }
+  StartMoreProbes(set);
+}
+
+/* 
+ * Stops all probes, and frees the set.
+ */
+void FreeServerProbes(ProbeSet *set)
+{
+  ServerProbe *probe;
+  guint i;
+
+  if (!set) {
+    return;
+  }
+  for (i = 0; i < set->Probes->len; i++) {
+    probe = (ServerProbe *)g_ptr_array_index(set->Probes, i);
+    if (probe->Status != PS_DONE) {
+      ShutdownNetworkBuffer(&probe->NetBuf);
+    }
+    g_free(probe);
+  }
+  g_ptr_array_free(set->Probes, TRUE);
+  g_ptr_array_unref(set->Servers);
+  g_free(set);
+}
+
+/* 
+ * Returns TRUE if every server currently in the list has been probed.
+ */
+gboolean ServerProbesFinished(ProbeSet *set)
+{
+  return (!set || (set->Active == 0
+                   && set->Probes->len >= set->Servers->len));
+}
+
+/* 
+ * Returns the number of servers that have been completely probed.
+ */
+guint CountServerProbes(ProbeSet *set)
+{
+  return set ? set->Probes->len - set->Active : 0;
+}
+
+/* 
+ * Returns the time in ms until UpdateServerProbes() should next be
+ * called, or -1 if no probes are in progress.
+ */
+long GetServerProbeTimeout(ProbeSet *set)
+{
+  ServerProbe *probe;
+  gint64 now, left, mintime = -1;
+  guint i;
+
+  if (!set || set->Active == 0) {
+    return -1;
+  }
+  now = g_get_monotonic_time();
+  for (i = 0; i < set->Probes->len; i++) {
+    probe = (ServerProbe *)g_ptr_array_index(set->Probes, i);
+    if (probe->Status != PS_DONE) {
+      left = MAX(probe->Started + PROBETIMEOUT * 1000 - now, 0) / 1000;
+      if (mintime == -1 || left < mintime) {
+        mintime = left;
+      }
+    }
+  }
+  return (long)mintime;
+}
+
+void SetSelectForServerProbes(ProbeSet *set, fd_set *readfds,
+                              fd_set *writefds, fd_set *errorfds,
+                              int *MaxSock)
+{
+  ServerProbe *probe;
+  guint i;
+
+  for (i = 0; set && i < set->Probes->len; i++) {
+    probe = (ServerProbe *)g_ptr_array_index(set->Probes, i);
+    if (probe->Status != PS_DONE) {
+      SetSelectForNetworkBuffer(&probe->NetBuf, readfds, writefds,
+                                errorfds, MaxSock);
+    }
+  }
+}
+
+void RespondToServerProbes(ProbeSet *set, fd_set *readfds,
+                           fd_set *writefds, fd_set *errorfds)
+{
+  ServerProbe *probe;
+  gboolean DoneOK;
+  guint i, len;
+
+  /* Don't look at any probes started along the way, since the select()
+   * results don't apply to them */
+  len = set ? set->Probes->len : 0;
+  for (i = 0; i < len; i++) {
+    probe = (ServerProbe *)g_ptr_array_index(set->Probes, i);
+    if (probe->Status != PS_DONE) {
+      RespondToSelect(&probe->NetBuf, readfds, writefds, errorfds, &DoneOK);
+      ProbeProgress(probe, DoneOK);
+    }
+  }
+}
+
+/* 
+ * Handles network activity on a probe that is being watched by the
+ * callback passed to StartServerProbes().
+ */
+void HandleServerProbe(ServerProbe *probe, gboolean ReadReady,
+                       gboolean WriteReady, gboolean ErrorReady)
+{
+  gboolean DoneOK;
+
+  if (probe->Status != PS_DONE) {
+    NetBufHandleNetwork(&probe->NetBuf, ReadReady, WriteReady, ErrorReady,
+                        &DoneOK);
+    ProbeProgress(probe, DoneOK);
+  }
+}
+
+/* 
+ * Returns a score for a server; lower is better. Latency is weighted by
+ * how busy the server is, full servers come after any with free slots,
+ * and servers that couldn't be reached come last.
+ */
+static double ServerRank(const ServerData *Server)
+{
+  double load;
+
+  if (Server->Latency < 0) {
+    return G_MAXDOUBLE;
+  }
+  if (Server->CurPlayers >= 0 && Server->MaxPlayers > 0) {
+    load = (double)Server->CurPlayers / Server->MaxPlayers;
+  } else {
+    load = 0.5;                 /* Unknown, so assume half full */
+  }
+  if (load >= 1.0) {
+    return 1.0e9 + Server->Latency;
+  }
+  return Server->Latency * (1.0 + load);
+}
+
+static gint CompareServers(gconstpointer a, gconstpointer b)
+{
+  double ra = ServerRank(*(const ServerData **)a);
+  double rb = ServerRank(*(const ServerData **)b);
+
+  return ra < rb ? -1 : ra > rb ? 1 : 0;
+}
+
+/* 
+ * Sorts a list of probed servers so that the best are first. This must
+ * not be done while probes of the list are still in progress.
+ */
+void RankServerList(GPtrArray *servers)
+{
+  g_ptr_array_sort(servers, CompareServers);
+}
+
+/* 
+ * Returns a newly-allocated description of the server's latency.
+ */
+gchar *FormatServerLatency(const ServerData *Server)
+{
+  if (Server->Latency < 0) {
+    /* Displayed if a server's latency isn't known */
+    return g_strdup(_("?"));
+  } else {
+    /* Latency of a server, in milliseconds */
+    return g_strdup_printf(_("%d ms"), Server->Latency);
+  }
+}
+
+#endif /* NETWORKING */
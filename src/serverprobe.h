@@ -0,0 +1,77 @@
+/************************************************************************
+ * serverprobe.h  dopewars - server latency probing                     *
+ * Copyright (C)  1998-2022  Ben Webb                                   *
+ *                Email: benwebb@users.sf.net                           *
+ *                WWW: https://dopewars.sourceforge.io/                 *
+ *                                                                      *
+ * This program is free software; you can redistribute it and/or        *
+ * modify it under the terms of the GNU General Public License          *
+ * as published by the Free Software Foundation; either version 2       *
+ * of the License, or (at your option) any later version.               *
+ *                                                                      *
+ * This program is distributed in the hope that it will be useful,      *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of       *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the        *
+ * GNU General Public License for more details.                         *
+ *                                                                      *
+ * You should have received a copy of the GNU General Public License    *
+ * along with this program; if not, write to the Free Software          *
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,               *
+ *                   MA  02111-1307, USA.                               *
+ ************************************************************************/
+
+#ifndef __DP_SERVERPROBE_H__
+#define __DP_SERVERPROBE_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include "dopewars.h"
+#include "network.h"
+
+#ifdef NETWORKING
+
+typedef struct _ProbeSet ProbeSet;
+
+/* Progress of the probe of a single server */
+typedef enum {
+  PS_CONNECTING,                /* Connecting to the server */
+  PS_PINGING,                   /* Waiting for the reply to a C_PING */
+  PS_DONE                       /* Finished (successfully or not) */
+} ProbeStatus;
+
+typedef struct _ServerProbe {
+  ProbeSet *Set;
+  guint Index;                  /* Position of the server in the list */
+  NetworkBuffer NetBuf;
+  ProbeStatus Status;
+  gint64 Started;               /* Start of the current stage (usec) */
+  gint ConnectTime;             /* Time taken to connect (ms) */
+} ServerProbe;
+
+/* Called when a server has been probed; its Latency field is set */
+typedef void (*ProbeDoneFunc) (ServerData *Server, guint index,
+                               gpointer data);
+
+ProbeSet *StartServerProbes(GPtrArray *servers, NBCallBack CallBack,
+                            ProbeDoneFunc func, gpointer data);
+void UpdateServerProbes(ProbeSet *set);
+void FreeServerProbes(ProbeSet *set);
+gboolean ServerProbesFinished(ProbeSet *set);
+guint CountServerProbes(ProbeSet *set);
+long GetServerProbeTimeout(ProbeSet *set);
+void SetSelectForServerProbes(ProbeSet *set, fd_set *readfds,
+                              fd_set *writefds, fd_set *errorfds,
+                              int *MaxSock);
+void RespondToServerProbes(ProbeSet *set, fd_set *readfds,
+                           fd_set *writefds, fd_set *errorfds);
+void HandleServerProbe(ServerProbe *probe, gboolean ReadReady,
+                       gboolean WriteReady, gboolean ErrorReady);
+void RankServerList(GPtrArray *servers);
+gchar *FormatServerLatency(const ServerData *Server);
+
+#endif /* NETWORKING */
+
+#endif /* __DP_SERVERPROBE_H__ */
@@ -38,6 +38,9 @@
 #include <netinet/in.h>         /* For struct sockaddr_in etc. */
 #include <sys/un.h>             /* For struct sockaddr_un */
 #include <arpa/inet.h>          /* For socklen_t */
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>              /* For open() */
+#endif
 #endif /* CYGWIN */
 
 #ifdef HAVE_UNISTD_H
@@ -51,8 +54,10 @@
 #include "dopewars.h"
 #include "log.h"
 #include "message.h"
+#include "metaworker.h"
 #include "network.h"
 #include "nls.h"
+#include "profiler.h"
 #include "serverside.h"
 #include "tstring.h"
 #include "util.h"
@@ -78,44 +83,67 @@ char *Discover[NUMDISCOVER] = {
    You will also need to translate the answers given by the clients. */
 static char *attackquestiontr = N_("AE");
 
-/* If we haven't talked to the metaserver for 3 hours, then remind it that
- * we still exist, so we don't get wiped from the list of active servers */
-#define METAUPDATETIME  (10800)
-
-/* Don't report players logging in/out to the metaserver more frequently
- * than once every minute (so as not to overload the metaserver, or slow
- * down our own server). */
-#define METAMINTIME (60)
-
 int TerminateRequest, ReregisterRequest, RelogRequest;
 
-int MetaUpdateTimeout;
-long MetaMinTimeout;
 gboolean WantQuit = FALSE;
 
 #ifdef CYGWIN
 static SERVICE_STATUS_HANDLE scHandle;
 #endif
 
-#ifdef GUI_SERVER
-static gboolean glib_timeout(gpointer userp);
-static gboolean glib_socket(GIOChannel *ch, GIOCondition condition,
-                            gpointer data);
-#endif
-
-
-/* Do we want to update the player details on the metaserver when the
- * timeout expires? */
-gboolean MetaPlayerPending = FALSE;
-
 GSList *FirstServer = NULL;
 
 #ifdef NETWORKING
-/* Data waiting to be sent to/read from the metaserver */
-static CurlConnection MetaConn;
+/* The high scores, URL-encoded ready to send to the metaserver, or NULL
+ * if they need to be read again from the high score file */
+static gchar *MetaScores = NULL;
 
 static GScanner *Scanner;
 
+/* Maximum number of connections to accept() in one go, before going
+ * back to service existing players */
+#define ACCEPTBATCH 16
+
+/* Maximum number of messages a client may send before logging in */
+#define MAXPRELOGINMSGS 8
+
+/* Maximum number of addresses to keep connection rate records for */
+#define MAXRATEBUCKETS 4096
+
+/* 
+ * A client connection that has not yet logged in (sent a valid C_NAME).
+ * These cost only a network buffer, and are kept apart from the list
+ * of players; once the client logs in, the connection is handed over
+ * to a newly-created Player.
+ */
+typedef struct _PendingConn {
+  NetworkBuffer NetBuf;
+  gchar *Peer;                  /* Remote address, for logging */
+  gint64 ConnectTimeout;        /* When to give up on the client (msec,
+                                 * from GetTimeMsec), or 0 */
+  gint Pings;                   /* Number of C_PING latency probes
+                                 * answered */
+} PendingConn;
+
+static GSList *PendingConns = NULL;
+static void RemovePendingConn(PendingConn *conn);
+
+/* Token bucket limiting the rate of new connections from one address */
+typedef struct _RateBucket {
+  gdouble Tokens;
+  gint64 Updated;               /* GetTimeMsec() at the last refill */
+} RateBucket;
+
+static GHashTable *RateBuckets = NULL;
+
+/* Descriptor held in reserve, so that connections can still be accepted
+ * (and dropped) when we run out */
+static int SpareFD = -1;
+
+/* Callbacks to watch the sockets of pending connections and players, if
+ * we're not using our own select() loop (i.e. in the GUI server) */
+static NBCallBack PendingCallBack = NULL, PlayerCallBack = NULL;
+
 #endif
 
 /* Handle to the high score file */
@@ -129,6 +157,12 @@ static char HelpText[] = {
   N_("dopewars server version %s commands and settings\n\n"
      "help                     Displays this help screen\n"
      "list                     Lists all players logged on\n"
+     "netstats                 Shows the network write queue of each player\n"
+     "metastats                Shows statistics on metaserver updates\n"
+     "profile                  Shows the time taken by each stage of message\n"
+     "                         handling (see Profile.Active)\n"
+     "profile save <file>      Saves the profile as folded stacks to a file\n"
+     "profile reset            Discards the profile gathered so far\n"
      "push <player>            Politely asks the named player to leave\n"
      "kill <player>            Abruptly breaks the connection with the "
      "named player\n"
@@ -151,21 +185,51 @@ int SendSingleHighScore(Player *Play, struct HISCORE *Score,
                         int ind, gboolean Bold);
 static int SendCopOffer(Player *To, OfferForce Force);
 static int OfferObject(Player *To, gboolean ForceBitch);
+static gint64 GetFightTimeout(void);
+static long GetReloadTimeout(void);
+static void HandleFightTimeouts(void);
 static gboolean HighScoreWrite(FILE *fp, struct HISCORE *MultiScore,
                                struct HISCORE *AntiqueScore);
 
 #ifdef NETWORKING
-static void MetaConnectError(CurlConnection *conn, GError *err)
+/* 
+ * Returns the high scores, URL-encoded for the metaserver. These are
+ * only read from the high score file when it has changed.
+ */
+static const gchar *GetMetaScores(void)
 {
-  dopelog(1, LF_SERVER, _("Failed to connect to metaserver at %s (%s)"),
-          MetaServer.URL, err->message);
-}
+  struct HISCORE MultiScore[NUMHISCORE], AntiqueScore[NUMHISCORE];
+  GString *text;
+  gchar prstr[PRICE_BUFLEN];
+  int i;
 
-void log_meta_headers(gpointer data, gpointer user_data)
-{
-  char *header = data;
-  if (*header)
-    dopelog(4, LF_SERVER, _("MetaServer: %s"), header);
+  if (MetaScores) {
+    return MetaScores;
+  }
+  if (!HighScoreRead(ScoreFP, MultiScore, AntiqueScore, TRUE)) {
+    return NULL;
+  }
+  text = g_string_new("");
+  for (i = 0; i < NUMHISCORE; i++) {
+    if (MultiScore[i].Name && MultiScore[i].Name[0]) {
+      g_string_append_printf(text, "&nm[%d]=", i);
+      AddURLEnc(text, MultiScore[i].Name);
+      g_string_append_printf(text, "&dt[%d]=", i);
+      AddURLEnc(text, MultiScore[i].Time);
+      g_string_append_printf(text, "&st[%d]=%s&sc[%d]=", i,
+                             MultiScore[i].Dead ? "dead" : "alive", i);
+      AddURLEnc(text, FormatPriceBuf(MultiScore[i].Money, prstr,
+                                     sizeof(prstr)));
+    }
+  }
+  for (i = 0; i < NUMHISCORE; i++) {
+    g_free(MultiScore[i].Name);
+    g_free(MultiScore[i].Time);
+    g_free(AntiqueScore[i].Name);
+    g_free(AntiqueScore[i].Time);
+  }
+  MetaScores = g_string_free(text, FALSE);
+  return MetaScores;
 }
 #endif
 
@@ -176,30 +240,21 @@ void log_meta_headers(gpointer data, gpointer user_data)
  * about to go down. If "SendData" is TRUE, then also sends game
  * data (e.g. scores) to the metaserver. If "RespectTimeout" is TRUE
  * then the update is delayed if a previous update happened too
- * recently. If networking is disabled, this function does nothing.
+ * recently. The update is sent by the metaserver worker thread, so this
+ * function never blocks. If networking is disabled, it does nothing.
  */
 void RegisterWithMetaServer(gboolean Up, gboolean SendData,
                             gboolean RespectTimeout)
 {
 #ifdef NETWORKING
-  struct HISCORE MultiScore[NUMHISCORE], AntiqueScore[NUMHISCORE];
   GString *body;
-  gchar *prstr;
-  gboolean ret;
-  GError *tmp_error = NULL;
-  int i;
 
   if (!MetaServer.Active || WantQuit || !Server) {
     return;
   }
 
-  if (MetaMinTimeout > time(NULL) && RespectTimeout) {
-    dopelog(3, LF_SERVER,
-            _("Attempt to connect to metaserver too frequently "
-              "- waiting for next timeout"));
-    MetaPlayerPending = TRUE;
-    return;
-  }
+  /* MetaServer.Active may have been turned on since the server started */
+  StartMetaWorker();
 
   body = g_string_new("");
 
@@ -220,34 +275,9 @@ void RegisterWithMetaServer(gboolean Up, gboolean SendData,
     AddURLEnc(body, MetaServer.Password);
   }
 
-  if (SendData && HighScoreRead(ScoreFP, MultiScore, AntiqueScore, TRUE)) {
-    for (i = 0; i < NUMHISCORE; i++) {
-      if (MultiScore[i].Name && MultiScore[i].Name[0]) {
-        g_string_append_printf(body, "&nm[%d]=", i);
-        AddURLEnc(body, MultiScore[i].Name);
-        g_string_append_printf(body, "&dt[%d]=", i);
-        AddURLEnc(body, MultiScore[i].Time);
-        g_string_append_printf(body, "&st[%d]=%s&sc[%d]=", i,
-                          MultiScore[i].Dead ? "dead" : "alive", i);
-        AddURLEnc(body, prstr = FormatPrice(MultiScore[i].Money));
-        g_free(prstr);
-      }
-    }
-  }
-
-  ret = OpenCurlConnection(&MetaConn, MetaServer.URL, body->str, &tmp_error);
-
-  dopelog(2, LF_SERVER, _("Waiting for connect to metaserver at %s..."),
-          MetaServer.URL);
+  PostMetaSnapshot(MetaServer.URL, body->str,
+                   SendData ? GetMetaScores() : NULL, Up, RespectTimeout);
   g_string_free(body, TRUE);
-  if (!ret) {
-    MetaConnectError(&MetaConn, tmp_error);
-    g_error_free(tmp_error);
-  }
-  MetaPlayerPending = FALSE;
-
-  MetaUpdateTimeout = time(NULL) + METAUPDATETIME;
-  MetaMinTimeout = time(NULL) + METAMINTIME;
 #endif /* NETWORKING */
 }
 
@@ -257,14 +287,17 @@ void HandleServerPlayer(Player *Play)
   gchar *buf;
   gboolean MessageRead = FALSE;
 
+  /* Send everything that our replies generate in one go */
+  BeginWriteBatch();
   while ((buf = GetWaitingPlayerMessage(Play)) != NULL) {
     MessageRead = TRUE;
     HandleServerMessage(buf, Play);
     g_free(buf);
   }
+  EndWriteBatch();
   /* Reset the idle timeout (if necessary) */
   if (MessageRead && IdleTimeout) {
-    Play->IdleTimeout = time(NULL) + (time_t) IdleTimeout;
+    Play->IdleTimeout = GetTimeMsec() + (gint64)IdleTimeout * 1000;
   }
 }
 #endif /* NETWORKING */
@@ -320,20 +353,38 @@ void RemoteVersionCheck(Player *Play)
  */
 void HandleServerMessage(gchar *buf, Player *Play)
 {
-  Player *To, *tmp, *pt;
-  GSList *list;
+  Player *To;
   char *Data;
   AICode AI;
   MsgCode Code;
-  gchar *text;
-  DopeEntry NewEntry;
-  int i;
-  price_t money;
+  int retval;
 
-  if (ProcessMessage(buf, Play, &To, &AI, &Code, &Data, FirstServer) == -1) {
+  PROFILE_ENTER(PS_PARSE, -1);
+  retval = ProcessMessage(buf, Play, &To, &AI, &Code, &Data, FirstServer);
+  PROFILE_LEAVE();
+  if (retval == -1) {
     g_warning("Bad message");
     return;
   }
+  DispatchServerMessage(Play, AI, Code, To, Data);
+}
+
+/* 
+ * Handles an already-decoded message from player "Play" (as for
+ * HandleServerMessage). "Data" may be modified.
+ */
+void DispatchServerMessage(Player *Play, AICode AI, MsgCode Code,
+                           Player *To, char *Data)
+{
+  Player *pt;
+  GSList *list;
+  gchar *text;
+  GList *rlist;
+  DopeRelation *rel;
+  int i;
+  price_t money;
+
+  PROFILE_ENTER(PS_DISPATCH, Code);
   switch (Code) {
   case C_MSGTO:
     if (Network) {
@@ -345,12 +396,24 @@ void HandleServerMessage(gchar *buf, Player *Play)
   case C_ABILITIES:
     ReceiveAbilities(Play, Data);
     break;
+  case C_DATA:
+    /* The client's cached copy of our ruleset was damaged, so send the
+     * full ruleset (but only once per offered ruleset) */
+    if (Play->RulesetHash) {
+      g_free(Play->RulesetHash);
+      Play->RulesetHash = NULL;
+      SendMiscData(Play);
+    }
+    break;
+  case C_PING:
+    SendServerMessage(NULL, C_NONE, C_PING, Play, Data);
+    break;
   case C_NAME:
     StripTerminators(Data);
     pt = GetPlayerByName(Data, FirstServer);
     if (pt && pt != Play) {
       if (ConnectTimeout) {
-        Play->ConnectTimeout = time(NULL) + (time_t) ConnectTimeout;
+        Play->ConnectTimeout = GetTimeMsec() + (gint64)ConnectTimeout * 1000;
       }
       SendServerMessage(NULL, C_NONE, C_NEWNAME, Play, NULL);
     } else if (strlen(GetPlayerName(Play)) == 0 && Data[0]) {
@@ -412,7 +475,7 @@ void HandleServerMessage(gchar *buf, Player *Play)
         g_free(text);
         /* Make sure they do actually disconnect, eventually! */
         if (ConnectTimeout) {
-          Play->ConnectTimeout = time(NULL) + (time_t) ConnectTimeout;
+          Play->ConnectTimeout = GetTimeMsec() + (gint64)ConnectTimeout * 1000;
         }
       }
     } else {
@@ -436,6 +499,7 @@ void HandleServerMessage(gchar *buf, Player *Play)
     if (i < 0 || i >= NumLocation) {
       dopelog(3, LF_SERVER, _("%s: DENIED jet to invalid location %s"),
               GetPlayerName(Play), Data);
+      SendFullPlayerData(Play);
       break;
     }
     if (Play->EventNum == E_FIGHT || Play->EventNum == E_FIGHTASK) {
@@ -474,17 +538,22 @@ void HandleServerMessage(gchar *buf, Player *Play)
          supposed to be dead) */
       dopelog(3, LF_SERVER, _("%s: DENIED jet to %s"),
               GetPlayerName(Play), Location[i].Name);
+      SendFullPlayerData(Play);
     }
     break;
   case C_REQUESTSCORE:
     SendHighScores(Play, FALSE, NULL);
     break;
   case C_CONTACTSPY:
-    for (list = FirstServer; list; list = g_slist_next(list)) {
-      tmp = (Player *)list->data;
-      i = GetListEntry(&(tmp->SpyList), Play);
-      if (tmp != Play && i >= 0 && tmp->SpyList.Data[i].Turns >= 0) {
-        SendSpyReport(Play, tmp);
+    for (rlist = Play->Outgoing.head; rlist; rlist = g_list_next(rlist)) {
+      rel = (DopeRelation *)rlist->data;
+      /* Only report once per target, from its oldest spy */
+      if (rel->Kind == REL_SPY && rel->To != Play
+          && GetRelation(Play, rel->To, REL_SPY) == rel) {
+        for (; rel && rel->Turns < 0; rel = rel->NextDup) {
+        }
+        if (rel)
+          SendSpyReport(Play, rel->To);
       }
     }
     break;
@@ -495,6 +564,8 @@ void HandleServerMessage(gchar *buf, Player *Play)
       Play->Bank += money;
       Play->Cash -= money;
       SendPlayerData(Play);
+    } else {
+      SendFullPlayerData(Play);
     }
     break;
   case C_PAYLOAN:
@@ -504,6 +575,8 @@ void HandleServerMessage(gchar *buf, Player *Play)
       Play->Debt -= money;
       Play->Cash -= money;
       SendPlayerData(Play);
+    } else {
+      SendFullPlayerData(Play);
     }
     break;
   case C_BUYOBJECT:
@@ -533,13 +606,12 @@ void HandleServerMessage(gchar *buf, Player *Play)
               GetPlayerName(To));
       Play->Cash -= Prices.Spy;
       LoseBitch(Play, NULL, NULL);
-      NewEntry.Play = Play;
-      NewEntry.Turns = -1;
-      AddListEntry(&(To->SpyList), &NewEntry);
+      AddRelation(Play, To, REL_SPY, -1);
       SendPlayerData(Play);
     } else {
       dopelog(2, LF_SERVER, _("%s spy on %s: DENIED"), GetPlayerName(Play),
                 GetPlayerName(To));
+      SendFullPlayerData(Play);
     }
     break;
   case C_TIPOFF:
@@ -548,19 +620,20 @@ void HandleServerMessage(gchar *buf, Player *Play)
               GetPlayerName(Play), GetPlayerName(To));
       Play->Cash -= Prices.Tipoff;
       LoseBitch(Play, NULL, NULL);
-      NewEntry.Play = Play;
-      NewEntry.Turns = 0;
-      AddListEntry(&(To->TipList), &NewEntry);
+      AddRelation(Play, To, REL_TIPOFF, 0);
       SendPlayerData(Play);
     } else {
       g_warning(_("%s tipoff about %s: DENIED"), GetPlayerName(Play),
                 GetPlayerName(To));
+      SendFullPlayerData(Play);
     }
     break;
   case C_SACKBITCH:
     if (Play->Bitches.Carried > 0) {
       LoseBitch(Play, NULL, NULL);
       SendPlayerData(Play);
+    } else {
+      SendFullPlayerData(Play);
     }
     break;
   case C_MSG:
@@ -573,6 +646,7 @@ void HandleServerMessage(gchar *buf, Player *Play)
             GetPlayerName(Play), Code, GetPlayerName(To), Data);
     break;
   }
+  PROFILE_LEAVE();
 }
 
 /* 
@@ -581,22 +655,13 @@ void HandleServerMessage(gchar *buf, Player *Play)
  */
 void ClientLeftServer(Player *Play)
 {
-  Player *tmp;
-  GSList *list;
-
   if (!IsConnectedPlayer(Play))
     return;
 
   if (Play->EventNum == E_FIGHT || Play->EventNum == E_FIGHTASK) {
     WithdrawFromCombat(Play);
   }
-  for (list = FirstServer; list; list = g_slist_next(list)) {
-    tmp = (Player *)list->data;
-    if (tmp != Play) {
-      RemoveAllEntries(&(tmp->TipList), Play);
-      RemoveAllEntries(&(tmp->SpyList), Play);
-    }
-  }
+  RemovePlayerRelations(Play);
   BroadcastToClients(C_NONE, C_LEAVE, GetPlayerName(Play), Play, Play);
 }
 
@@ -609,8 +674,23 @@ void CleanUpServer()
     FirstServer = RemovePlayer((Player *)FirstServer->data, FirstServer);
   }
 #ifdef NETWORKING
-  if (Server)
-    CloseSocket(ListenSock);
+  while (PendingConns) {
+    RemovePendingConn((PendingConn *)PendingConns->data);
+  }
+  if (RateBuckets) {
+    g_hash_table_destroy(RateBuckets);
+    RateBuckets = NULL;
+  }
+  if (Server) {
+    StopListening(ListenSocks);
+    ListenSocks = NULL;
+  }
+#ifndef CYGWIN
+  if (SpareFD >= 0) {
+    close(SpareFD);
+    SpareFD = -1;
+  }
+#endif
 #endif
 }
 
@@ -755,6 +835,7 @@ static gboolean StartServer(void)
 {
   LastError *sockerr = NULL;
   GString *errstr;
+  guint i;
 
 #ifndef CYGWIN
   struct sigaction sact;
@@ -780,48 +861,34 @@ static gboolean StartServer(void)
   Network = Server = TRUE;
   FirstServer = NULL;
   ClientMessageHandlerPt = NULL;
-  ListenSock = CreateTCPSocket(&sockerr);
-  if (ListenSock == SOCKET_ERROR) {
+  ClientMessageDispatchPt = NULL;
+  ListenSocks = StartListening(BindAddress, Port, ReusePort, &sockerr);
+  if (!ListenSocks) {
     errstr = g_string_new("");
     g_string_assign_error(errstr, sockerr);
     g_log(NULL, G_LOG_LEVEL_CRITICAL,
-          _("Cannot create server (listening) socket (%s) Aborting."),
-          errstr->str);
+          _("Cannot bind to port %u (%s) Aborting."), Port, errstr->str);
     g_string_free(errstr, TRUE);
     FreeError(sockerr);
     exit(EXIT_FAILURE);
   }
 
-  /* This doesn't seem to work properly under Win32 */
-#ifndef CYGWIN
-  SetReuse(ListenSock);
-#endif
-
-  SetBlocking(ListenSock, FALSE);
+  for (i = 0; i < ListenSocks->len; i++) {
+    gchar *addr = GetSocketAddress(g_array_index(ListenSocks, int, i));
 
-  if (!BindTCPSocket(ListenSock, BindAddress, Port, &sockerr)) {
-    errstr = g_string_new("");
-    g_string_assign_error(errstr, sockerr);
-    g_log(NULL, G_LOG_LEVEL_CRITICAL,
-          _("Cannot bind to port %u (%s) Aborting."), Port, errstr->str);
-    g_string_free(errstr, TRUE);
-    FreeError(sockerr);
-    exit(EXIT_FAILURE);
+    dopelog(1, LF_SERVER, _("Listening for connections on %s"), addr);
+    g_free(addr);
   }
 
-  if (listen(ListenSock, 10) == SOCKET_ERROR) {
-    g_log(NULL, G_LOG_LEVEL_CRITICAL,
-          _("Cannot listen to network socket. Aborting."));
-    exit(EXIT_FAILURE);
-  }
+#ifndef CYGWIN
+  SpareFD = open("/dev/null", O_RDONLY);
+#endif
 
   /* Initial startup message for the server */
   dopelog(0, LF_SERVER, 
           _("dopewars server version %s ready and waiting for "
             "connections on port %d."), VERSION, Port);
 
-  MetaUpdateTimeout = MetaMinTimeout = 0;
-
   TerminateRequest = ReregisterRequest = RelogRequest = 0;
 
 #if !CYGWIN
@@ -858,10 +925,9 @@ static gboolean StartServer(void)
 
 static void InitMetaServer()
 {
-  CurlInit(&MetaConn);
-#ifdef GUI_SERVER
-  SetCurlCallback(&MetaConn, glib_timeout, glib_socket);
-#endif
+  if (MetaServer.Active) {
+    StartMetaWorker();
+  }
   RegisterWithMetaServer(TRUE, TRUE, FALSE);
 }
 
@@ -870,7 +936,7 @@ static void InitMetaServer()
  * we need to log out all of the currently connected players, and tell
  * the metaserver that we're shutting down. We only shut down properly
  * once all of these messages have been completely sent and
- * acknowledged. (Of course, this can be overridden by a SIGINT or
+ * acknowledged (or the metaserver update has failed). (Of course, this can be overridden by a SIGINT or
  * similar in the case of unresponsive players.)
  */
 void RequestServerShutdown(void)
@@ -887,7 +953,7 @@ void RequestServerShutdown(void)
  */
 gboolean IsServerShutdown(void)
 {
-  return (WantQuit && !FirstServer && !MetaConn.running);
+  return (WantQuit && !FirstServer && !IsMetaWorkerBusy());
 }
 
 static GPrintFunc StartServerReply(NetworkBuffer *netbuf)
@@ -919,6 +985,34 @@ static void ServerSaveConfigFile(const char *string)
   g_free(file);
 }
 
+/* 
+ * Displays the state of each player's outgoing message queue, plus
+ * counters of the messages sent and coalesced so far.
+ */
+static void ShowNetworkStats(void)
+{
+  GSList *list;
+  Player *tmp;
+  NBFlowControl *flow;
+  gint64 timenow;
+
+  timenow = GetTimeMsec();
+  g_print(_("Player                 Queued    Bytes  Age  PeakBytes"
+            "       Sent  Coalesced\n"));
+  for (list = FirstServer; list; list = g_slist_next(list)) {
+    tmp = (Player *)list->data;
+    if (IsCop(tmp) || !IsNetworkBufferActive(&tmp->NetBuf))
+      continue;
+    flow = &tmp->NetBuf.flow;
+    g_print("%-20s %8d %8d %4ld %10d %10lu %10lu\n",
+            IsConnectedPlayer(tmp) ? GetPlayerName(tmp) : "-",
+            GetWriteQueueDepth(&tmp->NetBuf),
+            tmp->NetBuf.WriteBuf.DataPresent,
+            (long)(GetWriteQueueAge(&tmp->NetBuf, timenow) / 1000),
+            flow->PeakBytes, flow->MsgsSent, flow->MsgsCoalesced);
+  }
+}
+
 static void HandleServerCommand(char *string, NetworkBuffer *netbuf,
                                 gboolean ForceUTF8)
 {
@@ -957,6 +1051,21 @@ static void HandleServerCommand(char *string, NetworkBuffer *netbuf,
         }
       } else
         g_print(_("No users currently logged on!\n"));
+    } else if (g_ascii_strncasecmp(string, "netstats", 8) == 0) {
+      ShowNetworkStats();
+    } else if (g_ascii_strncasecmp(string, "metastats", 9) == 0) {
+      ShowMetaWorkerStats();
+    } else if (g_ascii_strncasecmp(string, "profile save ", 13) == 0) {
+      if (WriteProfile(string + 13)) {
+        g_print(_("Profile saved to %s\n"), string + 13);
+      } else {
+        g_print(_("Cannot write profile to %s: %s\n"), string + 13,
+                strerror(errno));
+      }
+    } else if (g_ascii_strncasecmp(string, "profile reset", 13) == 0) {
+      ResetProfile();
+    } else if (g_ascii_strncasecmp(string, "profile", 7) == 0) {
+      ShowProfile();
     } else if (g_ascii_strncasecmp(string, "push ", 5) == 0) {
       tmp = GetPlayerByName(string + 5, FirstServer);
       if (tmp) {
@@ -983,32 +1092,298 @@ static void HandleServerCommand(char *string, NetworkBuffer *netbuf,
   FinishServerReply(oldprint);
 }
 
-Player *HandleNewConnection(void)
+/* 
+ * Returns TRUE if the rate limit record for an address says that it
+ * hasn't connected recently (so the record can be discarded).
+ */
+static gboolean ForgetFullBucket(gpointer key, gpointer value,
+                                 gpointer data)
 {
-  socklen_t cadsize;
-  int ClientSock;
-  struct sockaddr_in ClientAddr;
-  Player *tmp;
-  cadsize = sizeof(struct sockaddr);
-  if ((ClientSock = accept(ListenSock, (struct sockaddr *)&ClientAddr,
-                            &cadsize)) == -1) {
-    perror("accept socket");
-    exit(EXIT_FAILURE);
+  RateBucket *bucket = (RateBucket *)value;
+  gint64 timenow = *(gint64 *)data;
+
+  return (bucket->Tokens + (timenow - bucket->Updated)
+          * ConnectLimit.Rate / 60000.0 >= ConnectLimit.Burst);
+}
+
+/* 
+ * Returns TRUE if a new connection from "peer" is allowed under the
+ * per-address rate limit (a token bucket, refilled at ConnectLimit.Rate
+ * tokens per minute up to a maximum of ConnectLimit.Burst).
+ */
+static gboolean AllowConnection(const gchar *peer, gint64 timenow)
+{
+  RateBucket *bucket;
+
+  if (ConnectLimit.Rate <= 0) {
+    return TRUE;
+  }
+  if (!RateBuckets) {
+    RateBuckets = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                        g_free, g_free);
   }
-  dopelog(2, LF_SERVER, _("got connection from %s"),
-          inet_ntoa(ClientAddr.sin_addr));
-  tmp = g_new(Player, 1);
 
-  FirstServer = AddPlayer(ClientSock, tmp, FirstServer);
+  bucket = g_hash_table_lookup(RateBuckets, peer);
+  if (bucket) {
+    bucket->Tokens = MIN(ConnectLimit.Burst,
+                         bucket->Tokens + (timenow - bucket->Updated)
+                         * ConnectLimit.Rate / 60000.0);
+    bucket->Updated = timenow;
+  } else {
+    /* Addresses that have gone quiet don't need a record any more */
+    if (g_hash_table_size(RateBuckets) >= MAXRATEBUCKETS) {
+      g_hash_table_foreach_remove(RateBuckets, ForgetFullBucket, &timenow);
+      if (g_hash_table_size(RateBuckets) >= MAXRATEBUCKETS) {
+        return TRUE;
+      }
+    }
+    bucket = g_new(RateBucket, 1);
+    bucket->Tokens = ConnectLimit.Burst;
+    bucket->Updated = timenow;
+    g_hash_table_insert(RateBuckets, g_strdup(peer), bucket);
+  }
+
+  if (bucket->Tokens < 1.0) {
+    return FALSE;
+  }
+  bucket->Tokens -= 1.0;
+  return TRUE;
+}
+
+static void RemovePendingConn(PendingConn *conn)
+{
+  PendingConns = g_slist_remove(PendingConns, conn);
+  ShutdownNetworkBuffer(&conn->NetBuf);
+  g_free(conn->Peer);
+  g_free(conn);
+}
+
+static void AddPendingConn(int fd, gchar *peer, gint64 timenow)
+{
+  PendingConn *conn;
+
+  conn = g_new(PendingConn, 1);
+  InitNetworkBuffer(&conn->NetBuf, '\n', '\r', NULL);
+  BindNetworkBufferToSocket(&conn->NetBuf, fd);
+  SetNetworkBufferLimits(&conn->NetBuf, WriteQueue.SoftLimit,
+                         WriteQueue.HardLimit);
+  conn->Peer = peer;
+  conn->ConnectTimeout = ConnectTimeout
+                         ? timenow + (gint64)ConnectTimeout * 1000 : 0;
+  conn->Pings = 0;
+  PendingConns = g_slist_prepend(PendingConns, conn);
+  if (PendingCallBack) {
+    SetNetworkBufferCallBack(&conn->NetBuf, PendingCallBack, conn);
+  }
+}
+
+/* 
+ * Turns a pending connection into a full player, once the client has
+ * sent its name; its waiting messages (including C_ABILITIES and
+ * C_NAME) are still in the network buffer, ready to be handled by
+ * HandleServerPlayer().
+ */
+static Player *PromotePendingConn(PendingConn *conn)
+{
+  Player *Play;
+
+  Play = g_new(Player, 1);
+  FirstServer = AddPlayer(-1, Play, FirstServer);
+  MoveNetworkBuffer(&Play->NetBuf, &conn->NetBuf);
   if (ConnectTimeout) {
-    tmp->ConnectTimeout = time(NULL) + (time_t) ConnectTimeout;
+    Play->ConnectTimeout = GetTimeMsec() + (gint64)ConnectTimeout * 1000;
+  }
+  if (PlayerCallBack) {
+    SetNetworkBufferCallBack(&Play->NetBuf, PlayerCallBack, Play);
+  }
+  RemovePendingConn(conn);
+  return Play;
+}
+
+/* 
+ * If the first message waiting from a client that has not yet logged in
+ * is a C_PING (a latency probe from a client's server browser), removes
+ * it and echoes it straight back. Returns TRUE if a ping was answered.
+ */
+static gboolean AnswerPendingPing(PendingConn *conn)
+{
+  gchar *msg, *pt, *reply;
+  gboolean IsPing;
+
+  msg = PeekWaitingMessage(&conn->NetBuf, 0);
+  if (!msg) {
+    return FALSE;
+  }
+  pt = msg;
+  GetNextWord(&pt, NULL);
+  GetNextWord(&pt, NULL);
+  IsPing = (strlen(pt) >= 2 && pt[1] == C_PING);
+  if (IsPing) {
+    g_free(GetWaitingMessage(&conn->NetBuf));
+    reply = g_strdup_printf("^^%c%c%s", C_NONE, C_PING, &pt[2]);
+    QueueMessageForSend(&conn->NetBuf, reply);
+    g_free(reply);
+    conn->Pings++;
+  }
+  g_free(msg);
+  return IsPing;
+}
+
+/* 
+ * Checks the messages sent so far by a client that has not yet logged
+ * in. Returns 1 if it has now sent a valid name, 0 if we should keep
+ * waiting, or -1 if the client should be dropped.
+ */
+static int CheckPendingLogin(PendingConn *conn)
+{
+  gchar *msg, *pt;
+  int i, retval = 0;
+
+  while (AnswerPendingPing(conn)) {
+    if (conn->Pings > MAXPRELOGINMSGS) {
+      return -1;
+    }
+  }
+  for (i = 0; retval == 0
+       && (msg = PeekWaitingMessage(&conn->NetBuf, i)) != NULL; i++) {
+    if (i >= MAXPRELOGINMSGS) {
+      retval = -1;
+    } else {
+      /* Logging-in clients don't yet use player IDs, so messages start
+       * with the (empty) sender and recipient names */
+      pt = msg;
+      GetNextWord(&pt, NULL);
+      GetNextWord(&pt, NULL);
+      if (strlen(pt) > 2 && pt[1] == C_NAME) {
+        retval = 1;
+      }
+    }
+    g_free(msg);
+  }
+  return retval;
+}
+
+/* 
+ * Deals with the outcome of network activity on a pending connection.
+ * Returns the new player if the client logged in, otherwise NULL.
+ */
+static Player *HandlePendingConn(PendingConn *conn, gboolean DataWaiting,
+                                 gboolean DoneOK)
+{
+  int login = 0;
+
+  if (DoneOK && DataWaiting) {
+    login = CheckPendingLogin(conn);
+  }
+  if (login == 1) {
+    return PromotePendingConn(conn);
+  } else if (!DoneOK || login == -1) {
+    if (conn->Pings > 0 && login == 0) {
+      dopelog(4, LF_SERVER, _("Latency probe from %s"), conn->Peer);
+    } else {
+      dopelog(2, LF_SERVER, _("Connection from %s closed before login"),
+              conn->Peer);
+    }
+    RemovePendingConn(conn);
+  }
+  return NULL;
+}
+
+/* 
+ * Called when accept() fails because we have run out of descriptors.
+ * The waiting connection would otherwise keep the listening socket
+ * readable, so release our spare descriptor to accept and immediately
+ * close it.
+ */
+static void DropWhenExhausted(int sock, LastError *sockerr)
+{
+  GString *errstr;
+#ifndef CYGWIN
+  int fd;
+#endif
+
+  errstr = g_string_new("");
+  g_string_assign_error(errstr, sockerr);
+  dopelog(1, LF_SERVER, _("Cannot accept connection (%s) - dropping it"),
+          errstr->str);
+  g_string_free(errstr, TRUE);
+
+#ifndef CYGWIN
+  if (SpareFD >= 0) {
+    close(SpareFD);
+    fd = accept(sock, NULL, NULL);
+    if (fd >= 0) {
+      close(fd);
+    }
+    SpareFD = open("/dev/null", O_RDONLY);
+  }
+#endif
+}
+
+/* 
+ * Accepts new client connections waiting on the listening socket
+ * "sock", up to ACCEPTBATCH at a time. Each is held as a pending
+ * connection until the client logs in.
+ */
+void HandleNewConnection(int sock)
+{
+  int i, ClientSock;
+  gchar *peer;
+  LastError *sockerr;
+  GString *errstr;
+  gint64 timenow;
+
+  timenow = GetTimeMsec();
+  for (i = 0; i < ACCEPTBATCH; i++) {
+    sockerr = NULL;
+    peer = NULL;
+    ClientSock = AcceptTCPConnection(sock, &peer, &sockerr);
+    if (ClientSock == SOCKET_ERROR) {
+      if (IsAcceptExhausted(sockerr)) {
+        DropWhenExhausted(sock, sockerr);
+      } else if (!IsAcceptDone(sockerr)) {
+        errstr = g_string_new("");
+        g_string_assign_error(errstr, sockerr);
+        dopelog(1, LF_SERVER, _("Cannot accept connection (%s)"),
+                errstr->str);
+        g_string_free(errstr, TRUE);
+      }
+      FreeError(sockerr);
+      break;
+    }
+
+    if (!AllowConnection(peer, timenow)) {
+      dopelog(3, LF_SERVER,
+              _("Connection from %s refused - too many connections "
+                "from this address"), peer);
+      CloseSocket(ClientSock);
+      g_free(peer);
+    } else if (g_slist_length(PendingConns) >= ConnectLimit.MaxPending) {
+      dopelog(2, LF_SERVER,
+              _("Connection from %s refused - too many clients are "
+                "logging in"), peer);
+      CloseSocket(ClientSock);
+      g_free(peer);
+    } else {
+      dopelog(2, LF_SERVER, _("got connection from %s"), peer);
+      AddPendingConn(ClientSock, peer, timenow);
+    }
   }
-  return tmp;
 }
 
 void StopServer()
 {
   dopelog(0, LF_SERVER, _("dopewars server terminating."));
+#ifdef DOPE_HOTPATH_STATS
+  DumpHotPathStats();
+#endif
+  if (Profile.File && Profile.File[0] && !WriteProfile(Profile.File)) {
+    dopelog(0, LF_SERVER, _("Cannot write profile to %s: %s"),
+            Profile.File, strerror(errno));
+  }
+  StopMetaWorker();
+  g_free(MetaScores);
+  MetaScores = NULL;
   g_scanner_destroy(Scanner);
   CleanUpServer();
   RemovePidFile();
@@ -1092,71 +1467,32 @@ static int SetupLocalSocket(void)
 }
 #endif
 
-static void LogMetaReply(CurlConnection *conn)
-{
-  g_ptr_array_foreach(conn->headers, log_meta_headers, NULL);
-  char *ch = conn->data;
-  while(ch && *ch) {
-    char *nextch = CurlNextLine(conn, ch);
-    if (*ch)
-      dopelog(2, LF_SERVER, _("MetaServer: %s"), ch);
-    ch = nextch;
-  }
-  dopelog(4, LF_SERVER, _("MetaServer: (closed)"));
-}
-
 #ifdef GUI_SERVER
-static gboolean glib_timeout(gpointer userp)
-{
-  CurlConnection *g = userp;
-  int still_running;
-  GError *err = NULL;
-  if (!CurlConnectionSocketAction(g, CURL_SOCKET_TIMEOUT, 0, &still_running,
-                                  &err)) {
-    MetaConnectError(g, err);
-    g_error_free(err);
-  }
-  g->timer_event = 0;
-  return G_SOURCE_REMOVE;
-}
-
 static void GuiQuitServer()
 {
   gtk_main_quit();
   StopServer();
 }
 
-/* Called by glib when we get action on a multi socket */
-static gboolean glib_socket(GIOChannel *ch, GIOCondition condition,
-                            gpointer data)
+/* 
+ * Called by glib when the metaserver worker has something to log (or,
+ * if it cannot notify us directly, every second).
+ */
+static gboolean GuiMetaWorkerNotify(gpointer data)
 {
-  CurlConnection *g = (CurlConnection*) data;
-  int still_running;
-  GError *err = NULL;
-  int fd = g_io_channel_unix_get_fd(ch);
-  int action =
-    ((condition & G_IO_IN) ? CURL_CSELECT_IN : 0) |
-    ((condition & G_IO_OUT) ? CURL_CSELECT_OUT : 0);
-
-  if (!CurlConnectionSocketAction(g, fd, action, &still_running, &err)) {
-    MetaConnectError(g, err);
-    g_error_free(err);
-  }
-  if (still_running) {
-    return TRUE;
-  } else {
-    if (g->timer_event) {
-      dp_g_source_remove(g->timer_event);
-      g->timer_event = 0;
-    }
-    LogMetaReply(g);
-    CloseCurlConnection(g);
-    if (IsServerShutdown())
-      GuiQuitServer();
+  HandleMetaWorkerNotify();
+  if (IsServerShutdown()) {
+    GuiQuitServer();
     return FALSE;
   }
+  return TRUE;
 }
 
+static gboolean GuiMetaWorkerSocket(GIOChannel *ch, GIOCondition condition,
+                                    gpointer data)
+{
+  return GuiMetaWorkerNotify(data);
+}
 #endif
 
 /* 
@@ -1168,9 +1504,10 @@ void ServerLoop(struct CMDLINE *cmdline)
   Player *tmp;
   GSList *list, *listcp;
   fd_set readfs, writefs, errorfs;
-  int topsock;
+  int topsock, notifyfd;
   struct timeval timeout;
-  int MinTimeout;
+  long MinTimeout;
+  guint i;
   GString *LineBuf;
 
   gboolean DoneOK;
@@ -1211,10 +1548,19 @@ void ServerLoop(struct CMDLINE *cmdline)
     FD_ZERO(&readfs);
     FD_ZERO(&writefs);
     FD_ZERO(&errorfs);
-    curl_multi_fdset(MetaConn.multi, &readfs, &writefs, &errorfs, &topsock);
-    FD_SET(ListenSock, &readfs);
-    FD_SET(ListenSock, &errorfs);
-    topsock = MAX(topsock + 1, ListenSock + 1);
+    topsock = 0;
+    notifyfd = GetMetaWorkerNotifyFD();
+    if (notifyfd >= 0) {
+      FD_SET(notifyfd, &readfs);
+      topsock = notifyfd + 1;
+    }
+    for (i = 0; i < ListenSocks->len; i++) {
+      int sock = g_array_index(ListenSocks, int, i);
+
+      FD_SET(sock, &readfs);
+      FD_SET(sock, &errorfs);
+      topsock = MAX(topsock, sock + 1);
+    }
 #ifndef CYGWIN
     if (localsock >= 0) {
       FD_SET(localsock, &readfs);
@@ -1235,10 +1581,18 @@ void ServerLoop(struct CMDLINE *cmdline)
                                   &errorfs, &topsock);
       }
     }
+    for (list = PendingConns; list; list = g_slist_next(list)) {
+      SetSelectForNetworkBuffer(&((PendingConn *)list->data)->NetBuf,
+                                &readfs, &writefs, &errorfs, &topsock);
+    }
     MinTimeout = GetMinimumTimeout(FirstServer);
+    if (notifyfd < 0 && IsMetaWorkerBusy()
+        && (MinTimeout == -1 || MinTimeout > 1000)) {
+      MinTimeout = 1000;        /* Poll for messages from the worker */
+    }
     if (MinTimeout != -1) {
-      timeout.tv_sec = MinTimeout;
-      timeout.tv_usec = 0;
+      timeout.tv_sec = MinTimeout / 1000;
+      timeout.tv_usec = (MinTimeout % 1000) * 1000;
     }
     if (select(topsock, &readfs, &writefs, &errorfs,
                MinTimeout == -1 ? NULL : &timeout) == -1) {
@@ -1266,8 +1620,14 @@ void ServerLoop(struct CMDLINE *cmdline)
       break;
     }
     FirstServer = HandleTimeouts(FirstServer);
-    if (FD_ISSET(ListenSock, &readfs)) {
-      HandleNewConnection();
+    HandleFightTimeouts();
+    HandleMetaWorkerNotify();
+    if (IsServerShutdown())
+      break;
+    for (i = 0; i < ListenSocks->len; i++) {
+      if (FD_ISSET(g_array_index(ListenSocks, int, i), &readfs)) {
+        HandleNewConnection(g_array_index(ListenSocks, int, i));
+      }
     }
 #ifndef CYGWIN
     if (localsock >= 0 && FD_ISSET(localsock, &readfs)) {
@@ -1312,22 +1672,6 @@ void ServerLoop(struct CMDLINE *cmdline)
     if (IsServerShutdown())
       break;
 #endif
-    if (MetaConn.running) {
-      GError *tmp_error = NULL;
-      int still_running;
-      if (!CurlConnectionPerform(&MetaConn, &still_running, &tmp_error)) {
-        MetaConnectError(&MetaConn, tmp_error);
-	g_error_free(tmp_error);
-        if (IsServerShutdown())
-          break;
-      } else if (still_running == 0) {
-        LogMetaReply(&MetaConn);
-        CloseCurlConnection(&MetaConn);
-        if (IsServerShutdown())
-          break;
-      }
-    }
-
     /* Check all players for data; iterate over a copy of the player list,
      * as HandleServerPlayer may remove players from this list! */
     listcp = g_slist_copy(FirstServer);
@@ -1353,23 +1697,35 @@ void ServerLoop(struct CMDLINE *cmdline)
     if (IsServerShutdown()) {
       break;
     }
+
+    /* Check for clients that have finished logging in */
+    listcp = g_slist_copy(PendingConns);
+    for (list = listcp; list; list = g_slist_next(list)) {
+      PendingConn *conn = (PendingConn *)list->data;
+      gboolean DataWaiting;
+
+      DataWaiting = RespondToSelect(&conn->NetBuf, &readfs, &writefs,
+                                    &errorfs, &DoneOK);
+      tmp = HandlePendingConn(conn, DataWaiting, DoneOK);
+      if (tmp) {
+        HandleServerPlayer(tmp);
+      }
+    }
+    g_slist_free(listcp);
   }
 #ifndef CYGWIN
   CloseLocalSocket(localsock);
 #endif
   StopServer();
   g_string_free(LineBuf, TRUE);
-
-  CurlCleanup(&MetaConn);
 }
 
 #ifdef GUI_SERVER
 static GtkWidget *TextOutput;
-static gint ListenTag = 0;
 static void SocketStatus(NetworkBuffer *NetBuf, gboolean Read,
                          gboolean Write, gboolean Exception, gboolean CallNow);
 static void GuiSetTimeouts(void);
-static time_t NextTimeout = 0;
+static gint64 NextTimeout = 0;
 static guint TimeoutTag = 0;
 
 static gboolean GuiDoTimeouts(gpointer data)
@@ -1380,23 +1736,24 @@ static gboolean GuiDoTimeouts(gpointer data)
   NextTimeout = 0;
 
   FirstServer = HandleTimeouts(FirstServer);
+  HandleFightTimeouts();
   GuiSetTimeouts();
   return FALSE;
 }
 
 void GuiSetTimeouts(void)
 {
-  int MinTimeout;
-  time_t TimeNow;
+  long MinTimeout;
+  gint64 TimeNow;
 
-  TimeNow = time(NULL);
+  TimeNow = GetTimeMsec();
   MinTimeout = GetMinimumTimeout(FirstServer);
   if (TimeNow + MinTimeout < NextTimeout || NextTimeout < TimeNow) {
     if (TimeoutTag > 0)
       dp_g_source_remove(TimeoutTag);
     TimeoutTag = 0;
     if (MinTimeout > 0) {
-      TimeoutTag = dp_g_timeout_add(MinTimeout * 1000, GuiDoTimeouts, NULL);
+      TimeoutTag = dp_g_timeout_add(MinTimeout, GuiDoTimeouts, NULL);
       NextTimeout = TimeNow + MinTimeout;
     }
   }
@@ -1494,14 +1851,55 @@ void SocketStatus(NetworkBuffer *NetBuf, gboolean Read, gboolean Write,
     GuiHandleSocket(NetBuf->ioch, 0, NetBuf->CallBackData);
 }
 
-static gboolean GuiNewConnect(GIOChannel *source, GIOCondition condition,
-                              gpointer data)
+static gboolean GuiHandlePending(GIOChannel *source,
+                                 GIOCondition condition, gpointer data)
 {
+  PendingConn *conn;
   Player *Play;
+  gboolean DataWaiting, DoneOK;
+
+  conn = (PendingConn *)data;
+
+  /* Sanity check - is the connection still around? */
+  if (!g_slist_find(PendingConns, (gpointer)conn))
+    return TRUE;
+
+  DataWaiting = NetBufHandleNetwork(&conn->NetBuf, condition & G_IO_IN,
+                                    condition & G_IO_OUT,
+                                    condition & G_IO_ERR, &DoneOK);
+  Play = HandlePendingConn(conn, DataWaiting, DoneOK);
+  if (Play) {
+    HandleServerPlayer(Play);
+  }
+  GuiSetTimeouts();
+  return TRUE;
+}
+
+static void PendingSocketStatus(NetworkBuffer *NetBuf, gboolean Read,
+                                gboolean Write, gboolean Exception,
+                                gboolean CallNow)
+{
+  if (NetBuf->InputTag)
+    dp_g_source_remove(NetBuf->InputTag);
+  NetBuf->InputTag = 0;
+  if (Read || Write) {
+    NetBuf->InputTag = dp_g_io_add_watch(NetBuf->ioch,
+                                     (Read ? G_IO_IN : 0) |
+                                     (Write ? G_IO_OUT : 0) |
+                                     (Exception ? G_IO_ERR : 0),
+                                     GuiHandlePending,
+                                     NetBuf->CallBackData);
+  }
+  if (CallNow)
+    GuiHandlePending(NetBuf->ioch, 0, NetBuf->CallBackData);
+}
 
+static gboolean GuiNewConnect(GIOChannel *source, GIOCondition condition,
+                              gpointer data)
+{
   if (condition & G_IO_IN) {
-    Play = HandleNewConnection();
-    SetNetworkBufferCallBack(&Play->NetBuf, SocketStatus, (gpointer)Play);
+    HandleNewConnection(GPOINTER_TO_INT(data));
+    GuiSetTimeouts();
   }
   return TRUE;
 }
@@ -1648,6 +2046,7 @@ void GuiServerLoop(struct CMDLINE *cmdline, gboolean is_service)
 {
   GtkWidget *window, *text, *hbox, *vbox, *entry, *label;
   GIOChannel *listench;
+  guint i;
 
   /* GTK+2 (and the GTK emulation code on WinNT systems) expects all
    * strings to be UTF-8, so we force gettext to return all translations
@@ -1699,16 +2098,30 @@ void GuiServerLoop(struct CMDLINE *cmdline, gboolean is_service)
                       LogMask() | G_LOG_LEVEL_MESSAGE |
                       G_LOG_LEVEL_WARNING, GuiServerLogMessage, NULL);
   }
+  PendingCallBack = PendingSocketStatus;
+  PlayerCallBack = SocketStatus;
   if (!StartServer())
     return;
   InitMetaServer();
+  if (GetMetaWorkerNotifyFD() >= 0) {
+    GIOChannel *notifych = g_io_channel_unix_new(GetMetaWorkerNotifyFD());
+
+    dp_g_io_add_watch(notifych, G_IO_IN, GuiMetaWorkerSocket, NULL);
+  } else {
+    dp_g_timeout_add(1000, GuiMetaWorkerNotify, NULL);
+  }
+
+  for (i = 0; i < ListenSocks->len; i++) {
+    int sock = g_array_index(ListenSocks, int, i);
 
 #ifdef CYGIN
-  listench = g_io_channel_win32_new_socket(ListenSock);
+    listench = g_io_channel_win32_new_socket(sock);
 #else
-  listench = g_io_channel_unix_new(ListenSock);
+    listench = g_io_channel_unix_new(sock);
 #endif
-  ListenTag = dp_g_io_add_watch(listench, G_IO_IN, GuiNewConnect, NULL);
+    dp_g_io_add_watch(listench, G_IO_IN, GuiNewConnect,
+                      GINT_TO_POINTER(sock));
+  }
 #ifdef CYGWIN
   mainhwnd = window->hWnd;
   SetupTaskBarIcon(window);
@@ -1741,7 +2154,7 @@ void FinishGame(Player *Play, char *Message)
 
   /* Make sure they do actually disconnect, eventually! */
   if (ConnectTimeout) {
-    Play->ConnectTimeout = time(NULL) + (time_t) ConnectTimeout;
+    Play->ConnectTimeout = GetTimeMsec() + (gint64)ConnectTimeout * 1000;
   }
 }
 
@@ -1770,7 +2183,7 @@ void HighScoreTypeRead(struct HISCORE *HiScore, FILE *fp)
 void HighScoreTypeWrite(struct HISCORE *HiScore, FILE *fp)
 {
   int i;
-  gchar *text;
+  gchar text[PRICE_BUFLEN];
 
   for (i = 0; i < NUMHISCORE; i++) {
     if (HiScore[i].Name) {
@@ -1781,9 +2194,8 @@ void HighScoreTypeWrite(struct HISCORE *HiScore, FILE *fp)
       fwrite(HiScore[i].Time, strlen(HiScore[i].Time) + 1, 1, fp);
     } else
       fputc(0, fp);
-    text = pricetostr(HiScore[i].Money);
+    PriceToBuf(HiScore[i].Money, text);
     fwrite(text, strlen(text) + 1, 1, fp);
-    g_free(text);
     fputc(HiScore[i].Dead ? 1 : 0, fp);
   }
 }
@@ -2196,6 +2608,13 @@ void SendHighScores(Player *Play, gboolean EndGame, char *Message)
   if (EndGame && !HighScoreWrite(ScoreFP, MultiScore, AntiqueScore)) {
     g_warning(_("Unable to write high score file %s"), HiScoreFile);
   }
+#ifdef NETWORKING
+  if (EndGame) {
+    /* Pick up the new scores next time we talk to the metaserver */
+    g_free(MetaScores);
+    MetaScores = NULL;
+  }
+#endif
   for (i = 0; i < NUMHISCORE; i++) {
     g_free(MultiScore[i].Name);
     g_free(MultiScore[i].Time);
@@ -2208,23 +2627,32 @@ void SendHighScores(Player *Play, gboolean EndGame, char *Message)
 /* 
  * Sends a single high score in "Score" with position "ind" to player
  * "Play". If Bold is TRUE, instructs the client to display the score in
- * bold text.
+ * bold text. Clients with the A_HISCOREDATA ability get the individual
+ * fields; others get a preformatted line of text.
  */
 int SendSingleHighScore(Player *Play, struct HISCORE *Score,
                         int ind, gboolean Bold)
 {
-  gchar *Data, *prstr;
+  gchar *Data, prstr[PRICE_BUFLEN];
 
   if (!Score->Time || Score->Time[0] == 0)
     return 0;
-  Data = g_strdup_printf("%d^%c%c%18s  %-14s %-34s %8s%c", ind,
-                         Bold ? 'B' : 'N', Bold ? '>' : ' ',
-                         prstr = FormatPrice(Score->Money),
-                         Score->Time, Score->Name,
-                         Score->Dead ? _("(R.I.P.)") : "",
-                         Bold ? '<' : ' ');
+  if (HaveAbility(Play, A_HISCOREDATA)) {
+    /* The client formats (and sorts) the fields itself; the name goes
+       last since it may contain '^' */
+    Data = g_strdup_printf("%d^%c^%s^%s^%d^%s", ind, Bold ? 'B' : 'N',
+                           PriceToBuf(Score->Money, prstr), Score->Time,
+                           Score->Dead ? 1 : 0, Score->Name);
+  } else {
+    Data = g_strdup_printf("%d^%c%c%18s  %-14s %-34s %8s%c", ind,
+                           Bold ? 'B' : 'N', Bold ? '>' : ' ',
+                           FormatPriceBuf(Score->Money, prstr,
+                                          sizeof(prstr)),
+                           Score->Time, Score->Name,
+                           Score->Dead ? _("(R.I.P.)") : "",
+                           Bold ? '<' : ' ');
+  }
   SendServerMessage(NULL, C_NONE, C_HISCORE, Play, Data);
-  g_free(prstr);
   g_free(Data);
   return 1;
 }
@@ -2238,13 +2666,15 @@ int SendSingleHighScore(Player *Play, struct HISCORE *Score,
  * ensure that it carries out the correct actions to advance itself to the
  * "next" state; if it fails in this duty it will hang!
  */
-void SendEvent(Player *To)
+static void DoSendEvent(Player *To)
 {
   price_t Money;
   int i, j;
   gchar *text;
   Player *Play;
   GSList *list;
+  GList *rlist, *rnext;
+  DopeRelation *rel;
 
   if (!To)
     return;
@@ -2263,24 +2693,26 @@ void SendEvent(Player *To)
       break;
     case E_OFFOBJECT:
       To->OnBehalfOf = NULL;
-      for (i = 0; i < To->TipList.Number; i++) {
+      rel = (DopeRelation *)g_queue_peek_head(&To->Incoming[REL_TIPOFF]);
+      if (rel) {
         dopelog(3, LF_SERVER, _("%s: Tipoff from %s"), GetPlayerName(To),
-                GetPlayerName(To->TipList.Data[i].Play));
-        To->OnBehalfOf = To->TipList.Data[i].Play;
+                GetPlayerName(rel->From));
+        To->OnBehalfOf = rel->From;
         SendCopOffer(To, FORCECOPS);
         return;
       }
-      for (i = 0; i < To->SpyList.Number; i++) {
-        if (To->SpyList.Data[i].Turns < 0) {
+      for (rlist = To->Incoming[REL_SPY].head; rlist; rlist = rnext) {
+        rnext = g_list_next(rlist);
+        rel = (DopeRelation *)rlist->data;
+        if (rel->Turns < 0) {
           dopelog(3, LF_SERVER, _("%s: Spy offered by %s"), GetPlayerName(To),
-                  GetPlayerName(To->SpyList.Data[i].Play));
-          To->OnBehalfOf = To->SpyList.Data[i].Play;
+                  GetPlayerName(rel->From));
+          To->OnBehalfOf = rel->From;
           SendCopOffer(To, FORCEBITCH);
           return;
         }
-        To->SpyList.Data[i].Turns++;
-        if (To->SpyList.Data[i].Turns > 3 &&
-            brandom(0, 100) < 10 + To->SpyList.Data[i].Turns) {
+        rel->Turns++;
+        if (rel->Turns > 3 && brandom(0, 100) < 10 + rel->Turns) {
           if (TotalGunsCarried(To) > 0)
             j = brandom(0, NUMDISCOVER);
           else
@@ -2288,8 +2720,7 @@ void SendEvent(Player *To)
           text =
               dpg_strdup_printf(_("One of your %tde was spying for %s."
                                   "^The spy %s!"), Names.Bitches,
-                                GetPlayerName(To->SpyList.Data[i].Play),
-                                _(Discover[j]));
+                                GetPlayerName(rel->From), _(Discover[j]));
           if (j != DEFECT)
             LoseBitch(To, NULL, NULL);
           SendPlayerData(To);
@@ -2299,13 +2730,12 @@ void SendEvent(Player *To)
                                    "been discovered!^The spy %s!"),
                                  GetPlayerName(To), _(Discover[j]));
           if (j == ESCAPE)
-            GainBitch(To->SpyList.Data[i].Play);
-          To->SpyList.Data[i].Play->Flags &= ~SPYINGON;
-          SendPlayerData(To->SpyList.Data[i].Play);
-          SendPrintMessage(NULL, C_NONE, To->SpyList.Data[i].Play, text);
+            GainBitch(rel->From);
+          rel->From->Flags &= ~SPYINGON;
+          SendPlayerData(rel->From);
+          SendPrintMessage(NULL, C_NONE, rel->From, text);
           g_free(text);
-          RemoveListEntry(&(To->SpyList), i);
-          i--;
+          RemoveRelation(rel);
         }
       }
       if (Money > 3000000)
@@ -2421,6 +2851,17 @@ void SendEvent(Player *To)
     To->EventNum = E_NONE;
 }
 
+/* 
+ * As DoSendEvent, but timed by the profiler (if active) according to
+ * the state the client starts off in.
+ */
+void SendEvent(Player *To)
+{
+  PROFILE_ENTER(PS_EVENT, To ? (gint)To->EventNum : -1);
+  DoSendEvent(To);
+  PROFILE_LEAVE();
+}
+
 /* 
  * In response to client player "To" being in state E_OFFOBJECT,
  * randomly engages the client in combat with the cops or offers
@@ -2499,6 +2940,163 @@ void CopsAttackPlayer(Player *Play)
   AttackPlayer(Cops, Play);
 }
 
+/* All fights currently in progress */
+static GList *Fights = NULL;
+
+static Player *GetFighter(GPtrArray *Fighters, guint ArrayInd)
+{
+  return ((Fighter *)g_ptr_array_index(Fighters, ArrayInd))->Play;
+}
+
+static gboolean ReloadsBefore(Fighter *a, Fighter *b)
+{
+  return (a->ReloadAt < b->ReloadAt
+          || (a->ReloadAt == b->ReloadAt && a->Seq < b->Seq));
+}
+
+static void HeapSet(GPtrArray *heap, gint pos, Fighter *f)
+{
+  g_ptr_array_index(heap, pos) = f;
+  f->HeapPos = pos;
+}
+
+/* 
+ * Moves the fighter at position "pos" in the reload heap up or down
+ * until the heap is properly ordered again.
+ */
+static void HeapSift(GPtrArray *heap, gint pos)
+{
+  Fighter *f = g_ptr_array_index(heap, pos);
+  gint parent, child;
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (!ReloadsBefore(f, g_ptr_array_index(heap, parent)))
+      break;
+    HeapSet(heap, pos, g_ptr_array_index(heap, parent));
+    pos = parent;
+  }
+  while ((child = 2 * pos + 1) < (gint)heap->len) {
+    if (child + 1 < (gint)heap->len
+        && ReloadsBefore(g_ptr_array_index(heap, child + 1),
+                         g_ptr_array_index(heap, child)))
+      child++;
+    if (!ReloadsBefore(g_ptr_array_index(heap, child), f))
+      break;
+    HeapSet(heap, pos, g_ptr_array_index(heap, child));
+    pos = child;
+  }
+  HeapSet(heap, pos, f);
+}
+
+static void HeapRemove(GPtrArray *heap, Fighter *f)
+{
+  Fighter *last;
+  gint pos = f->HeapPos;
+
+  if (pos < 0)
+    return;
+  f->HeapPos = -1;
+  last = g_ptr_array_remove_index_fast(heap, heap->len - 1);
+  if (last != f) {
+    HeapSet(heap, pos, last);
+    HeapSift(heap, pos);
+  }
+}
+
+/* 
+ * Sets the time at which fighter "f" can next fire, or if "ReloadAt"
+ * is 0, lets it fire right away.
+ */
+static void SetReloadTime(Fighter *f, gint64 ReloadAt)
+{
+  GPtrArray *heap = f->Owner->Reloading;
+
+  f->ReloadAt = ReloadAt;
+  if (ReloadAt == 0) {
+    HeapRemove(heap, f);
+  } else {
+    f->Seq = f->Owner->NextSeq++;
+    if (f->HeapPos < 0) {
+      g_ptr_array_add(heap, f);
+      f->HeapPos = heap->len - 1;
+    }
+    HeapSift(heap, f->HeapPos);
+  }
+}
+
+static Fight *NewFight(void)
+{
+  Fight *fight;
+
+  fight = g_new(Fight, 1);
+  fight->Fighters = g_ptr_array_new();
+  fight->Reloading = g_ptr_array_new();
+  fight->Left = g_ptr_array_new();
+  fight->NextSeq = 0;
+  fight->NumCops = 0;
+  fight->RefCount = 1;
+  Fights = g_list_prepend(Fights, fight);
+  return fight;
+}
+
+static void RefFight(Fight *fight)
+{
+  fight->RefCount++;
+}
+
+static void UnrefFight(Fight *fight)
+{
+  guint i;
+
+  if (--fight->RefCount > 0)
+    return;
+  for (i = 0; i < fight->Fighters->len; i++) {
+    g_free(g_ptr_array_index(fight->Fighters, i));
+  }
+  for (i = 0; i < fight->Left->len; i++) {
+    g_free(g_ptr_array_index(fight->Left, i));
+  }
+  g_ptr_array_free(fight->Fighters, TRUE);
+  g_ptr_array_free(fight->Reloading, TRUE);
+  g_ptr_array_free(fight->Left, TRUE);
+  g_free(fight);
+}
+
+static void JoinFight(Fight *fight, Player *Play)
+{
+  Fighter *f;
+
+  f = g_new(Fighter, 1);
+  f->Play = Play;
+  f->Owner = fight;
+  f->ReloadAt = 0;
+  f->Seq = 0;
+  f->HeapPos = -1;
+  g_ptr_array_add(fight->Fighters, f);
+  if (IsCop(Play))
+    fight->NumCops++;
+  Play->Combat = f;
+}
+
+/* 
+ * Takes the player with handle "f" out of its fight. The handle itself
+ * remains valid (with a NULL Play) until the fight is freed.
+ */
+static void LeaveFight(Fighter *f)
+{
+  Fight *fight = f->Owner;
+
+  HeapRemove(fight->Reloading, f);
+  f->ReloadAt = 0;
+  g_ptr_array_remove(fight->Fighters, f);
+  g_ptr_array_add(fight->Left, f);
+  if (IsCop(f->Play))
+    fight->NumCops--;
+  f->Play->Combat = NULL;
+  f->Play = NULL;
+}
+
 /* 
  * Starts combat between player "Play" and player "Attacked"; if
  * either player is currently engaged in combat, add the other
@@ -2508,12 +3106,12 @@ void CopsAttackPlayer(Player *Play)
  */
 void AttackPlayer(Player *Play, Player *Attacked)
 {
-  GPtrArray *FightArray;
+  Fight *fight;
 
   g_assert(Play && Attacked);
 
-  if (Play->FightArray && Attacked->FightArray) {
-    if (Play->FightArray == Attacked->FightArray) {
+  if (Play->Combat && Attacked->Combat) {
+    if (Play->Combat->Owner == Attacked->Combat->Owner) {
       g_error(_("Players are already in a fight!"));
     } else {
       g_error(_("Players are already in separate fights!"));
@@ -2525,22 +3123,20 @@ void AttackPlayer(Player *Play, Player *Attacked)
     return;
   }
 
-  if (!Play->FightArray && !Attacked->FightArray) {
-    FightArray = g_ptr_array_new();
+  if (!Play->Combat && !Attacked->Combat) {
+    fight = NewFight();
   } else {
-    FightArray =
-        Play->FightArray ? Play->FightArray : Attacked->FightArray;
+    fight = Play->Combat ? Play->Combat->Owner : Attacked->Combat->Owner;
   }
 
-  if (!Play->FightArray) {
+  if (!Play->Combat) {
     Play->ResyncNum = Play->EventNum;
-    g_ptr_array_add(FightArray, Play);
+    JoinFight(fight, Play);
   }
-  if (!Attacked->FightArray) {
+  if (!Attacked->Combat) {
     Attacked->ResyncNum = Attacked->EventNum;
-    g_ptr_array_add(FightArray, Attacked);
+    JoinFight(fight, Attacked);
   }
-  Play->FightArray = Attacked->FightArray = FightArray;
   Play->EventNum = Attacked->EventNum = E_FIGHT;
 
   Play->Attacking = Attacked;
@@ -2636,10 +3232,10 @@ void AllowNextShooter(Player *Play)
 {
   Player *NextShooter;
 
-  if (FightTimeout) {
+  if (GetFightTimeout()) {
     NextShooter = GetNextShooter(Play);
     if (NextShooter && !CanPlayerFire(NextShooter)) {
-      NextShooter->FightTimeout = 0;
+      ClearFightTimeout(NextShooter);
     }
   }
 }
@@ -2648,18 +3244,23 @@ void DoReturnFire(Player *Play)
 {
   guint ArrayInd;
   Player *Defend;
+  Fighter *self;
+  Fight *fight;
 
-  if (!Play || !Play->FightArray)
+  if (!Play || !Play->Combat || Play->Combat->Owner->NumCops == 0)
     return;
 
-  if (FightTimeout != 0 || !IsCop(Play)) {
-    for (ArrayInd = 0;
-         Play->FightArray && ArrayInd < Play->FightArray->len;
+  if (GetFightTimeout() != 0 || !IsCop(Play)) {
+    self = Play->Combat;
+    fight = self->Owner;
+    RefFight(fight);
+    for (ArrayInd = 0; self->Play && ArrayInd < fight->Fighters->len;
          ArrayInd++) {
-      Defend = (Player *)g_ptr_array_index(Play->FightArray, ArrayInd);
+      Defend = GetFighter(fight->Fighters, ArrayInd);
       if (IsCop(Defend) && CanPlayerFire(Defend))
         Fire(Defend);
     }
+    UnrefFight(fight);
   }
 }
 
@@ -2685,12 +3286,9 @@ static void WaitForFightDone(Player *Play)
 void RunFromCombat(Player *Play, int ToLocation)
 {
   int EscapeProb, RandNum;
-  guint ArrayInd;
-  gboolean FightingCop = FALSE;
-  Player *Defend;
   char BackupAt;
 
-  if (!Play || !Play->FightArray)
+  if (!Play || !Play->Combat)
     return;
 
   EscapeProb = 60;
@@ -2702,16 +3300,9 @@ void RunFromCombat(Player *Play, int ToLocation)
   RandNum = brandom(0, 100);
 
   if (RandNum < EscapeProb) {
-    if (!IsCop(Play) && brandom(0, 100) < 30) {
-      for (ArrayInd = 0; ArrayInd < Play->FightArray->len; ArrayInd++) {
-        Defend = (Player *)g_ptr_array_index(Play->FightArray, ArrayInd);
-        if (IsCop(Defend)) {
-          FightingCop = TRUE;
-          break;
-        }
-      }
-      if (FightingCop)
-        Play->CopIndex--;
+    if (!IsCop(Play) && brandom(0, 100) < 30
+        && Play->Combat->Owner->NumCops > 0) {
+      Play->CopIndex--;
     }
     BackupAt = Play->IsAt;
     Play->IsAt = ToLocation;
@@ -2721,40 +3312,28 @@ void RunFromCombat(Player *Play, int ToLocation)
   } else {
     SendFightMessage(Play, NULL, 0, F_FAILFLEE, (price_t)0, TRUE, NULL);
     AllowNextShooter(Play);
-    if (FightTimeout)
+    if (GetFightTimeout())
       SetFightTimeout(Play);
     DoReturnFire(Play);
   }
 }
 
-void CheckForKilledPlayers(Player *Play)
+/* 
+ * Removes player "Defend" from the fight if "Play" has just killed them.
+ */
+static void CheckForKilledPlayer(Player *Play, Player *Defend)
 {
-  Player *Defend;
-  guint ArrayInd;
-  GPtrArray *KilledPlayers;
-
-  KilledPlayers = g_ptr_array_new();
-  for (ArrayInd = 0; ArrayInd < Play->FightArray->len; ArrayInd++) {
-    Defend = (Player *)g_ptr_array_index(Play->FightArray, ArrayInd);
+  if (Defend == Play || !IsOpponent(Play, Defend) || Defend->Health != 0)
+    return;
 
-    if (Defend && Defend != Play && IsOpponent(Play, Defend) &&
-        Defend->Health == 0) {
-      g_ptr_array_add(KilledPlayers, (gpointer)Defend);
-    }
-  }
-  for (ArrayInd = 0; ArrayInd < KilledPlayers->len; ArrayInd++) {
-    Defend = (Player *)g_ptr_array_index(KilledPlayers, ArrayInd);
-    WithdrawFromCombat(Defend);
-    if (IsCop(Defend)) {
-      if (!IsCop(Play))
-        Play->CopIndex = -Defend->CopIndex;
-      FirstServer = RemovePlayer(Defend, FirstServer);
-    } else {
-      FinishGame(Defend, _("You're dead! Game over."));
-    }
+  WithdrawFromCombat(Defend);
+  if (IsCop(Defend)) {
+    if (!IsCop(Play))
+      Play->CopIndex = -Defend->CopIndex;
+    FirstServer = RemovePlayer(Defend, FirstServer);
+  } else {
+    FinishGame(Defend, _("You're dead! Game over."));
   }
-
-  g_ptr_array_free(KilledPlayers, TRUE);
 }
 
 /* 
@@ -2764,10 +3343,7 @@ void CheckForKilledPlayers(Player *Play)
  */
 static void CheckCopsIntervene(Player *Play)
 {
-  guint ArrayInd;
-  Player *Defend;
-
-  if (!Play || !Play->FightArray || NumCop == 0 || NumGun == 0)
+  if (!Play || !Play->Combat || NumCop == 0 || NumGun == 0)
     return;                     /* Sanity check */
 
   if (!Play->Attacking)
@@ -2778,12 +3354,8 @@ static void CheckCopsIntervene(Player *Play)
                                  * (unless P.P. == 100) */
   }
 
-  for (ArrayInd = 0; Play->FightArray && ArrayInd < Play->FightArray->len;
-       ArrayInd++) {
-    Defend = (Player *)g_ptr_array_index(Play->FightArray, ArrayInd);
-    if (IsCop(Defend))
-      return;                   /* We don't want _more_ cops! */
-  }
+  if (Play->Combat->Owner->NumCops > 0)
+    return;                     /* We don't want _more_ cops! */
 
   /* OK - let 'em have it... */
   CopsAttackPlayer(Play);
@@ -2792,20 +3364,23 @@ static void CheckCopsIntervene(Player *Play)
 /* 
  * Returns a suitable player (or cop) for "Play" to fire at. If "Play"
  * is attacking a designated target already, return that, otherwise
- * return the first valid opponent in the player's FightArray.
+ * return the first valid opponent in the player's fight.
  */
 static Player *GetFireTarget(Player *Play)
 {
   Player *Defend;
+  GPtrArray *Fighters = Play->Combat->Owner->Fighters;
   guint ArrayInd;
 
-  if (Play->Attacking
-      && g_slist_find(FirstServer, (gpointer)Play->Attacking)) {
+  /* Anyone that leaves a fight is cleared from the Attacking field of
+   * the others in that fight, so this is always a valid player */
+  if (Play->Attacking && Play->Attacking->Combat
+      && Play->Attacking->Combat->Owner == Play->Combat->Owner) {
     return Play->Attacking;
   } else {
     Play->Attacking = NULL;
-    for (ArrayInd = 0; ArrayInd < Play->FightArray->len; ArrayInd++) {
-      Defend = (Player *)g_ptr_array_index(Play->FightArray, ArrayInd);
+    for (ArrayInd = 0; ArrayInd < Fighters->len; ArrayInd++) {
+      Defend = GetFighter(Fighters, ArrayInd);
       if (Defend && Defend != Play && IsOpponent(Play, Defend)) {
         return Defend;
       }
@@ -2846,14 +3421,23 @@ void Fire(Player *Play)
   price_t Loot;
   FightPoint fp;
   Player *Defend;
+  Fighter *self;
+  Fight *fight;
 
-  if (!Play->FightArray)
+  if (!Play->Combat)
     return;
   if (!CanPlayerFire(Play))
     return;
+  HOTPATH_COUNT(HP_FIGHTSHOT, 1);
+  PROFILE_ENTER(PS_FIGHT, -1);
+
+  /* Hold onto the fight, so we can tell if "Play" is still in it later */
+  self = Play->Combat;
+  fight = self->Owner;
+  RefFight(fight);
 
   AllowNextShooter(Play);
-  if (FightTimeout)
+  if (GetFightTimeout())
     SetFightTimeout(Play);
 
   Defend = GetFireTarget(Play);
@@ -2878,21 +3462,26 @@ void Fire(Player *Play)
     } else
       fp = F_STAND;
     SendFightMessage(Play, Defend, BitchesKilled, fp, Loot, TRUE, NULL);
+    CheckForKilledPlayer(Play, Defend);
   }
-  CheckForKilledPlayers(Play);
 
-  /* Careful, as we might have killed Player "Play" */
-  if (g_slist_find(FirstServer, (gpointer)Play))
+  /* Careful, as we might have killed Player "Play" (or if it's a cop,
+   * ended the fight and so freed it) */
+  if (self->Play)
     DoReturnFire(Play);
 
-  if (g_slist_find(FirstServer, (gpointer)Play))
+  if (self->Play)
     CheckCopsIntervene(Play);
+
+  UnrefFight(fight);
+  PROFILE_LEAVE();
 }
 
 gboolean CanPlayerFire(Player *Play)
 {
-  return (FightTimeout == 0 || Play->FightTimeout == 0 ||
-          Play->FightTimeout <= time(NULL));
+  return (GetFightTimeout() == 0 || !Play->Combat
+          || Play->Combat->ReloadAt == 0
+          || Play->Combat->ReloadAt <= GetTimeMsec());
 }
 
 gboolean CanRunHere(Player *Play)
@@ -2909,32 +3498,32 @@ gboolean CanRunHere(Player *Play)
  */
 Player *GetNextShooter(Player *Play)
 {
-  Player *MinPlay, *Defend;
-  time_t MinTimeout;
-  guint mintie;
-  guint ArrayInd;
+  Fighter *self, *next;
+  GPtrArray *heap;
+  guint NumReady;
 
-  if (!FightTimeout)
+  if (!GetFightTimeout() || !Play->Combat)
     return NULL;
 
-  MinPlay = NULL;
-  MinTimeout = 0;
-  mintie = 0;
-  for (ArrayInd = 0; ArrayInd < Play->FightArray->len; ArrayInd++) {
-    Defend = (Player *)g_ptr_array_index(Play->FightArray, ArrayInd);
-    if (Defend == Play)
-      continue;
-    if (Defend->FightTimeout == 0)
+  self = Play->Combat;
+  heap = self->Owner->Reloading;
+
+  /* Everybody not in the reload heap can already shoot */
+  NumReady = self->Owner->Fighters->len - heap->len;
+  if (self->HeapPos < 0)
+    NumReady--;
+  if (NumReady > 0 || heap->len == 0)
+    return NULL;
+
+  next = g_ptr_array_index(heap, 0);
+  if (next == self) {
+    if (heap->len == 1)
       return NULL;
-    if (MinTimeout == 0 || Defend->FightTimeout < MinTimeout
-        || (Defend->FightTimeout == MinTimeout && Defend->tiebreak < mintie)) {
-      MinPlay = Defend;
-      MinTimeout = Defend->FightTimeout;
-      mintie = Defend->tiebreak;
-    }
+    next = g_ptr_array_index(heap, 1);
+    if (heap->len > 2 && ReloadsBefore(g_ptr_array_index(heap, 2), next))
+      next = g_ptr_array_index(heap, 2);
   }
-
-  return MinPlay;
+  return next->Play;
 }
 
 void ResolveTipoff(Player *Play)
@@ -2947,7 +3536,7 @@ void ResolveTipoff(Player *Play)
   if (g_slist_find(FirstServer, (gpointer)Play->OnBehalfOf)) {
     dopelog(4, LF_SERVER, _("%s: tipoff by %s finished OK."),
             GetPlayerName(Play), GetPlayerName(Play->OnBehalfOf));
-    RemoveListPlayer(&(Play->TipList), Play->OnBehalfOf);
+    RemoveRelation(GetRelation(Play->OnBehalfOf, Play, REL_TIPOFF));
     text = g_string_new("");
     if (Play->Health == 0) {
       g_string_printf(text,
@@ -2975,24 +3564,27 @@ void WithdrawFromCombat(Player *Play)
   guint AttackInd, DefendInd;
   gboolean FightDone;
   Player *Attack, *Defend;
-  GSList *list;
+  Fight *fight;
+  GPtrArray *Fighters;
   gchar *text;
 
-  for (list = FirstServer; list; list = g_slist_next(list)) {
-    Attack = (Player *)list->data;
+  if (!Play->Combat)
+    return;
+
+  fight = Play->Combat->Owner;
+  Fighters = fight->Fighters;
+  for (AttackInd = 0; AttackInd < Fighters->len; AttackInd++) {
+    Attack = GetFighter(Fighters, AttackInd);
     if (Attack->Attacking == Play)
       Attack->Attacking = NULL;
   }
 
-  if (!Play->FightArray)
-    return;
-
   ResolveTipoff(Play);
   FightDone = TRUE;
-  for (AttackInd = 0; AttackInd < Play->FightArray->len; AttackInd++) {
-    Attack = (Player *)g_ptr_array_index(Play->FightArray, AttackInd);
+  for (AttackInd = 0; AttackInd < Fighters->len; AttackInd++) {
+    Attack = GetFighter(Fighters, AttackInd);
     for (DefendInd = 0; DefendInd < AttackInd; DefendInd++) {
-      Defend = (Player *)g_ptr_array_index(Play->FightArray, DefendInd);
+      Defend = GetFighter(Fighters, DefendInd);
       if (Attack != Play && Defend != Play && IsOpponent(Attack, Defend)) {
         FightDone = FALSE;
         break;
@@ -3003,12 +3595,12 @@ void WithdrawFromCombat(Player *Play)
   }
 
   SendFightLeave(Play, FightDone);
-  g_ptr_array_remove(Play->FightArray, (gpointer)Play);
+  LeaveFight(Play->Combat);
 
   if (FightDone) {
-    for (DefendInd = 0; DefendInd < Play->FightArray->len; DefendInd++) {
-      Defend = (Player *)g_ptr_array_index(Play->FightArray, DefendInd);
-      Defend->FightArray = NULL;
+    while (Fighters->len > 0) {
+      Defend = GetFighter(Fighters, 0);
+      LeaveFight(Defend->Combat);
       ResolveTipoff(Defend);
       if (IsCop(Defend)) {
         FirstServer = RemovePlayer(Defend, FirstServer);
@@ -3029,9 +3621,9 @@ void WithdrawFromCombat(Player *Play)
         WaitForFightDone(Defend);
       }
     }
-    g_ptr_array_free(Play->FightArray, TRUE);
+    Fights = g_list_remove(Fights, fight);
+    UnrefFight(fight);
   }
-  Play->FightArray = NULL;
   Play->Attacking = NULL;
 }
 
@@ -3202,6 +3794,7 @@ static void GenerateDrugsHere(Player *To, enum DealType *Deal)
 {
   int NumEvents, NumDrugs, NumRandom, i;
 
+  PROFILE_ENTER(PS_DRUGS, -1);
   for (i = 0; i < NumDrug; i++) {
     To->Drugs[i].Price = 0;
     Deal[i] = DT_NORMAL;
@@ -3245,6 +3838,7 @@ static void GenerateDrugsHere(Player *To, enum DealType *Deal)
       NumDrugs--;
     }
   }
+  PROFILE_LEAVE();
 }
 
 /* 
@@ -3256,7 +3850,7 @@ void SendDrugsHere(Player *To, gboolean DisplayBusts)
 {
   int i;
   enum DealType *Deal = NULL;
-  gchar *prstr;
+  gchar prstr[PRICE_BUFLEN];
   GString *text;
   gboolean First;
 
@@ -3288,14 +3882,27 @@ void SendDrugsHere(Player *To, gboolean DisplayBusts)
     SendPrintMessage(NULL, C_NONE, To, text->str);
   g_string_truncate(text, 0);
   for (i = 0; i < NumDrug; i++) {
-    g_string_append_printf(text, "%s^",
-                      (prstr = pricetostr(To->Drugs[i].Price)));
-    g_free(prstr);
+    g_string_append(text, PriceToBuf(To->Drugs[i].Price, prstr));
+    g_string_append_c(text, '^');
   }
   SendServerMessage(NULL, C_NONE, C_DRUGHERE, To, text->str);
   g_string_free(text, TRUE);
 }
 
+/* 
+ * Returns the oldest spy from "Spier" that "Target" has not yet
+ * accepted (i.e. the one SendEvent last offered), or NULL.
+ */
+static DopeRelation *GetPendingSpy(Player *Spier, Player *Target)
+{
+  DopeRelation *rel;
+
+  for (rel = GetRelation(Spier, Target, REL_SPY); rel && rel->Turns >= 0;
+       rel = rel->NextDup) {
+  }
+  return rel;
+}
+
 /* 
  * Handles the incoming message in "answer" from player "From" and
  * intended for player "To".
@@ -3305,6 +3912,7 @@ void HandleAnswer(Player *From, Player *To, char *answer)
   int i;
   gchar *text;
   Player *Defender;
+  DopeRelation *rel;
 
   if (!From || From->EventNum == E_NONE)
     return;
@@ -3333,9 +3941,9 @@ void HandleAnswer(Player *From, Player *To, char *answer)
           SendPlayerData(From->OnBehalfOf);
           SendPrintMessage(NULL, C_NONE, From->OnBehalfOf, text);
           g_free(text);
-          i = GetListEntry(&(From->SpyList), From->OnBehalfOf);
-          if (i >= 0)
-            From->SpyList.Data[i].Turns = 0;
+          rel = GetPendingSpy(From->OnBehalfOf, From);
+          if (rel)
+            rel->Turns = 0;
         }
       }
       if (From->Bitches.Price) {
@@ -3442,7 +4050,7 @@ void HandleAnswer(Player *From, Player *To, char *answer)
           SendPlayerData(From->OnBehalfOf);
           SendPrintMessage(NULL, C_NONE, From->OnBehalfOf, text);
           g_free(text);
-          RemoveListPlayer(&(From->SpyList), From->OnBehalfOf);
+          RemoveRelation(GetPendingSpy(From->OnBehalfOf, From));
         }
       }
       From->EventNum++;
@@ -3463,6 +4071,7 @@ void BuyObject(Player *From, char *data)
 {
   char *cp, *type;
   int index, i, amount;
+  gboolean done = FALSE;
 
   cp = data;
   type = GetNextWord(&cp, "");
@@ -3485,6 +4094,7 @@ void BuyObject(Player *From, char *data)
       From->CoatSize -= amount;
       From->Cash -= amount * From->Drugs[index].Price;
       SendPlayerData(From);
+      done = TRUE;
 
       if (!Sanitized && NumCop > 0 && NumGun > 0
           && (From->Drugs[index].Price == 0 &&
@@ -3509,6 +4119,7 @@ void BuyObject(Player *From, char *data)
       From->CoatSize -= amount * Gun[index].Space;
       From->Cash -= amount * From->Guns[index].Price;
       SendPlayerData(From);
+      done = TRUE;
     }
   } else if (strcmp(type, "bitch") == 0) {
     if (From->Bitches.Carried + amount >= 0
@@ -3519,8 +4130,13 @@ void BuyObject(Player *From, char *data)
       if (amount > 0)
         From->Cash -= amount * From->Bitches.Price;
       SendPlayerData(From);
+      done = TRUE;
     }
   }
+  /* The client may already have changed its own cash, coat size etc.,
+   * expecting the purchase to go through */
+  if (!done)
+    SendFullPlayerData(From);
 }
 
 /* 
@@ -3626,31 +4242,30 @@ int LoseBitch(Player *Play, Inventory *Guns, Inventory *Drugs)
 }
 
 /* 
- * If fight timeouts are in force, sets the timeout for the given player.
+ * Returns the fight timeout in milliseconds, or 0 if fight timeouts are
+ * disabled. FightTimeoutMsec, if set, overrides the whole seconds of
+ * FightTimeout so that fast fights can be paced more finely.
  */
-void SetFightTimeout(Player *Play)
+static gint64 GetFightTimeout(void)
 {
-  if (FightTimeout) {
-    Play->FightTimeout = time(NULL) + (time_t) FightTimeout;
-
-    /* Make sure we have a higher tiebreak value than any other player with
-     * the same fight timeout (since FightTimeout only has second resolution,
-     * and possibly only microseconds have elapsed) */
-    Play->tiebreak = 0;
-    if (Play->FightTimeout) {
-      GSList *listpt;
+  if (FightTimeoutMsec > 0)
+    return FightTimeoutMsec;
+  else
+    return (gint64)FightTimeout * 1000;
+}
 
-      for (listpt = FirstServer; listpt; listpt = g_slist_next(listpt)) {
-        Player *listplay = (Player *)listpt->data;
+/* 
+ * If fight timeouts are in force, sets the timeout (the reload time)
+ * for the given player.
+ */
+void SetFightTimeout(Player *Play)
+{
+  gint64 timeout = GetFightTimeout();
 
-        if (listplay && listplay != Play
-            && listplay->FightTimeout == Play->FightTimeout) {
-          Play->tiebreak = MAX(Play->tiebreak, listplay->tiebreak + 1);
-        }
-      }
-    }
+  if (timeout && Play->Combat) {
+    SetReloadTime(Play->Combat, GetTimeMsec() + timeout);
   } else {
-    Play->FightTimeout = 0;
+    ClearFightTimeout(Play);
   }
 }
 
@@ -3659,16 +4274,104 @@ void SetFightTimeout(Player *Play)
  */
 void ClearFightTimeout(Player *Play)
 {
-  Play->FightTimeout = 0;
+  if (Play->Combat)
+    SetReloadTime(Play->Combat, 0);
+}
+
+/* 
+ * Returns the fighter, in any fight, that is due to reload soonest,
+ * or NULL if nobody is reloading.
+ */
+static Fighter *GetNextReload(void)
+{
+  GList *list;
+  Fight *fight;
+  Fighter *f, *next = NULL;
+
+  for (list = Fights; list; list = g_list_next(list)) {
+    fight = (Fight *)list->data;
+    if (fight->Reloading->len > 0) {
+      f = g_ptr_array_index(fight->Reloading, 0);
+      if (!next || ReloadsBefore(f, next))
+        next = f;
+    }
+  }
+  return next;
+}
+
+/* 
+ * Returns the number of milliseconds until the next reload in any
+ * fight, 0 if one is already due, or -1 if there are none pending.
+ */
+static long GetReloadTimeout(void)
+{
+  Fighter *next = GetNextReload();
+  gint64 timenow;
+
+  if (!next)
+    return -1;
+  timenow = GetTimeMsec();
+  if (next->ReloadAt <= timenow)
+    return 0;
+  return (long)(next->ReloadAt - timenow);
 }
 
+/* 
+ * Lets everybody whose reload time has passed fire again, in the order
+ * in which they reloaded. Cops fire straight away; players are told
+ * that they can fire.
+ */
+static void HandleFightTimeouts(void)
+{
+  Fighter *next;
+  Player *Play;
+  gint64 timenow = GetTimeMsec();
+
+#ifdef NETWORKING
+  BeginWriteBatch();
+#endif
+  while ((next = GetNextReload()) && next->ReloadAt <= timenow) {
+    Play = next->Play;
+    ClearFightTimeout(Play);
+    if (IsConnectedPlayer(Play)) {
+      if (IsCop(Play))
+        Fire(Play);
+      else
+        SendFightReload(Play);
+    }
+  }
+#ifdef NETWORKING
+  EndWriteBatch();
+#endif
+}
+
+#ifdef NETWORKING
+/* 
+ * Returns TRUE if the given player should be disconnected because it is
+ * not reading the data we send it - i.e. its write queue has overflowed
+ * the hard limit, or the oldest queued message has been waiting for
+ * longer than WriteQueue.Timeout seconds.
+ */
+static gboolean IsSlowClient(Player *Play, gint64 timenow)
+{
+  if (IsCop(Play) || !IsNetworkBufferActive(&Play->NetBuf))
+    return FALSE;
+  if (Play->NetBuf.error)
+    return TRUE;
+  return (WriteQueue.Timeout > 0
+          && GetWriteQueueAge(&Play->NetBuf, timenow)
+             > (gint64)WriteQueue.Timeout * 1000);
+}
+#endif
+
 /* 
  * Given the time of a pending event in "timeout" and the current time in
- * "timenow", updates "mintime" with the number of seconds to that event,
- * unless "mintime" is already smaller (as long as it's not -1, which
- * means "uninitialized"). Returns 1 if the timeout has already expired.
+ * "timenow" (both in milliseconds, from GetTimeMsec), updates "mintime"
+ * with the number of milliseconds to that event, unless "mintime" is
+ * already smaller (as long as it's not -1, which means "uninitialized").
+ * Returns 1 if the timeout has already expired.
  */
-long AddTimeout(time_t timeout, time_t timenow, long *mintime)
+long AddTimeout(gint64 timeout, gint64 timenow, long *mintime)
 {
   if (timeout == 0)
     return 0;
@@ -3682,32 +4385,43 @@ long AddTimeout(time_t timeout, time_t timenow, long *mintime)
 }
 
 /* 
- * Returns the number of seconds until the next scheduled event. If such
- * an event has already expired, returns 0. If no events are pending,
+ * Returns the number of milliseconds until the next scheduled event. If
+ * such an event has already expired, returns 0. If no events are pending,
  * returns -1. "First" should point to a list of valid players.
  */
 long GetMinimumTimeout(GSList *First)
 {
   Player *Play;
   GSList *list;
-  long mintime = -1;
-  time_t timenow;
+  long mintime;
+  gint64 timenow;
 
-  timenow = time(NULL);
-#ifdef NETWORKING
-  curl_multi_timeout(MetaConn.multi, &mintime);
-#endif
-  if (AddTimeout(MetaMinTimeout, timenow, &mintime))
-    return 0;
-  if (AddTimeout(MetaUpdateTimeout, timenow, &mintime))
+  timenow = GetTimeMsec();
+  mintime = GetReloadTimeout();
+  if (mintime == 0)
     return 0;
   for (list = First; list; list = g_slist_next(list)) {
     Play = (Player *)list->data;
-    if (AddTimeout(Play->FightTimeout, timenow, &mintime) ||
-        AddTimeout(Play->IdleTimeout, timenow, &mintime) ||
+    if (AddTimeout(Play->IdleTimeout, timenow, &mintime) ||
         AddTimeout(Play->ConnectTimeout, timenow, &mintime))
       return 0;
+#ifdef NETWORKING
+    if (IsSlowClient(Play, timenow))
+      return 0;
+    if (WriteQueue.Timeout > 0 && GetWriteQueueDepth(&Play->NetBuf) > 0
+        && AddTimeout(timenow - GetWriteQueueAge(&Play->NetBuf, timenow)
+                      + (gint64)WriteQueue.Timeout * 1000 + 1, timenow,
+                      &mintime))
+      return 0;
+#endif
   }
+#ifdef NETWORKING
+  for (list = PendingConns; list; list = g_slist_next(list)) {
+    if (AddTimeout(((PendingConn *)list->data)->ConnectTimeout, timenow,
+                   &mintime))
+      return 0;
+  }
+#endif
   return mintime;
 }
 
@@ -3721,24 +4435,24 @@ GSList *HandleTimeouts(GSList *First)
 {
   GSList *list, *nextlist;
   Player *Play;
-  time_t timenow;
+  gint64 timenow;
 
-  timenow = time(NULL);
-  if (MetaMinTimeout <= timenow) {
-    MetaMinTimeout = 0;
-    if (MetaPlayerPending) {
-      dopelog(3, LF_SERVER, _("Sending pending updates to the metaserver..."));
-      RegisterWithMetaServer(TRUE, TRUE, FALSE);
-    }
-  }
-  if (MetaUpdateTimeout != 0 && MetaUpdateTimeout <= timenow) {
-    dopelog(3, LF_SERVER, _("Sending reminder message to the metaserver..."));
-    RegisterWithMetaServer(TRUE, FALSE, FALSE);
-  }
+  timenow = GetTimeMsec();
   list = First;
   while (list) {
     nextlist = g_slist_next(list);
     Play = (Player *)list->data;
+#ifdef NETWORKING
+    if (IsSlowClient(Play, timenow)) {
+      dopelog(1, LF_SERVER,
+              _("Player removed as it is not reading data fast enough"));
+      if (IsConnectedPlayer(Play)) {
+        ClientLeftServer(Play);
+        SetPlayerName(Play, NULL);
+      }
+      First = RemovePlayer(Play, First);
+    } else
+#endif
     if (Play->IdleTimeout != 0 && Play->IdleTimeout <= timenow) {
       Play->IdleTimeout = 0;
       dopelog(1, LF_SERVER, _("Player removed due to idle timeout"));
@@ -3749,22 +4463,29 @@ GSList *HandleTimeouts(GSList *First)
       SetPlayerName(Play, NULL);
       /* Make sure they do actually disconnect, eventually! */
       if (ConnectTimeout) {
-        Play->ConnectTimeout = time(NULL) + (time_t) ConnectTimeout;
+        Play->ConnectTimeout = GetTimeMsec() + (gint64)ConnectTimeout * 1000;
       }
     } else if (Play->ConnectTimeout != 0
                && Play->ConnectTimeout <= timenow) {
       Play->ConnectTimeout = 0;
       dopelog(1, LF_SERVER, _("Player removed due to connect timeout"));
       First = RemovePlayer(Play, First);
-    } else if (IsConnectedPlayer(Play) &&
-               Play->FightTimeout != 0 && Play->FightTimeout <= timenow) {
-      ClearFightTimeout(Play);
-      if (IsCop(Play))
-        Fire(Play);
-      else
-        SendFightReload(Play);
     }
     list = nextlist;
   }
+#ifdef NETWORKING
+  list = PendingConns;
+  while (list) {
+    PendingConn *conn = (PendingConn *)list->data;
+
+    nextlist = g_slist_next(list);
+    if (conn->ConnectTimeout != 0 && conn->ConnectTimeout <= timenow) {
+      dopelog(2, LF_SERVER, _("Connection from %s timed out before login"),
+              conn->Peer);
+      RemovePendingConn(conn);
+    }
+    list = nextlist;
+  }
+#endif
   return First;
 }
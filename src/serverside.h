@@ -28,6 +28,7 @@
 #endif
 
 #include "dopewars.h"
+#include "message.h"
 
 extern GSList *FirstServer;
 extern char *PidFile;
@@ -36,10 +37,12 @@ void CleanUpServer(void);
 void BreakHandle(int sig);
 void ClientLeftServer(Player *Play);
 void StopServer(void);
-Player *HandleNewConnection(void);
+void HandleNewConnection(int sock);
 void ServerLoop(struct CMDLINE *cmdline);
 void HandleServerPlayer(Player *Play);
 void HandleServerMessage(gchar *buf, Player *ReallyFrom);
+void DispatchServerMessage(Player *Play, AICode AI, MsgCode Code,
+                           Player *To, char *Data);
 void FinishGame(Player *Play, char *Message);
 void SendHighScores(Player *Play, gboolean EndGame, char *Message);
 void SendEvent(Player *To);
@@ -52,6 +52,34 @@ static GSList *driverlist = NULL;
 typedef SoundDriver *(*InitFunc)(void);
 static gboolean sound_enabled = TRUE;
 
+/* 
+ * Sounds are handed to the driver by a separate thread, so that a driver
+ * that blocks (e.g. ESD) never holds up the game; drivers that must be
+ * called from the main thread (e.g. Cocoa) are instead called directly
+ * from SoundPlay. Either way, bursts of events (as in
+ * a big fight) are thinned out: the same sound is played only once within
+ * SOUND_COALESCE_USEC, at most SOUND_MAX_VOICES sounds (each assumed to
+ * last SOUND_VOICE_USEC) play at once, and events that waited longer than
+ * SOUND_STALE_USEC in the queue are dropped.
+ */
+#define SOUND_COALESCE_USEC (G_USEC_PER_SEC / 15)
+#define SOUND_MAX_VOICES    4
+#define SOUND_VOICE_USEC    G_USEC_PER_SEC
+#define SOUND_STALE_USEC    (G_USEC_PER_SEC / 2)
+
+typedef struct _SoundEvent {
+  gchar *snd;
+  gint64 queued;
+} SoundEvent;
+
+static GThread *sound_thread = NULL;
+static GAsyncQueue *sound_queue = NULL;
+static SoundEvent quit_event;   /* Pushed to stop the sound thread */
+
+/* Used to thin out sounds for drivers without "threadsafe" set */
+static GHashTable *sync_lastplay = NULL;
+static gint64 sync_voices[SOUND_MAX_VOICES];
+
 gchar *GetPluginList(void)
 {
   GSList *listpt;
@@ -180,6 +208,110 @@ static SoundDriver *GetPlugin(gchar *drivername)
   return NULL;
 }
 
+/*
+ * Asks the driver to load every sound that the game is configured to
+ * use, so that they need not be read from disk when they are played.
+ */
+static void PreloadSounds(void)
+{
+  const gchar *sounds[] = {
+    Sounds.FightHit, Sounds.FightMiss, Sounds.FightReload, Sounds.Jet,
+    Sounds.TalkToAll, Sounds.TalkPrivate, Sounds.JoinGame,
+    Sounds.LeaveGame, Sounds.StartGame, Sounds.EndGame,
+    Sounds.EnemyBitchKilled, Sounds.BitchKilled, Sounds.EnemyKilled,
+    Sounds.Killed, Sounds.EnemyFailFlee, Sounds.FailFlee,
+    Sounds.EnemyFlee, Sounds.Flee
+  };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(sounds); i++) {
+    if (sounds[i] && sounds[i][0]) {
+      driver->preload(sounds[i]);
+    }
+  }
+}
+
+static void FreeSoundEvent(SoundEvent *event)
+{
+  g_free(event->snd);
+  g_free(event);
+}
+
+/* 
+ * Returns TRUE if "event" should be passed to the driver now, given the
+ * times that each sound was last played ("lastplay") and the times at
+ * which the sounds currently playing will end ("voices").
+ */
+static gboolean WantSoundEvent(SoundEvent *event, GHashTable *lastplay,
+                               gint64 *voices, gint64 now)
+{
+  gint64 *last;
+  int i;
+
+  if (now - event->queued > SOUND_STALE_USEC) {
+    return FALSE;
+  }
+  last = g_hash_table_lookup(lastplay, event->snd);
+  if (last && now - *last < SOUND_COALESCE_USEC) {
+    return FALSE;
+  }
+  /* Find a free voice */
+  i = 0;
+  while (i < SOUND_MAX_VOICES && voices[i] > now) {
+    i++;
+  }
+  if (i == SOUND_MAX_VOICES) {
+    return FALSE;
+  }
+  voices[i] = now + SOUND_VOICE_USEC;
+  if (!last) {
+    last = g_new(gint64, 1);
+    g_hash_table_insert(lastplay, g_strdup(event->snd), last);
+  }
+  *last = now;
+  return TRUE;
+}
+
+static gpointer SoundThread(gpointer data)
+{
+  SoundEvent *event;
+  GHashTable *lastplay;
+  gint64 voices[SOUND_MAX_VOICES] = { 0 };
+
+  lastplay = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  while ((event = g_async_queue_pop(sound_queue)) != &quit_event) {
+    if (WantSoundEvent(event, lastplay, voices, g_get_monotonic_time())) {
+      driver->play(event->snd);
+    }
+    FreeSoundEvent(event);
+  }
+  g_hash_table_destroy(lastplay);
+  return NULL;
+}
+
+static void StartSoundThread(void)
+{
+  sound_queue = g_async_queue_new();
+  sound_thread = g_thread_new("sound", SoundThread, NULL);
+}
+
+static void StopSoundThread(void)
+{
+  SoundEvent *event;
+
+  if (!sound_thread) {
+    return;
+  }
+  g_async_queue_push(sound_queue, &quit_event);
+  g_thread_join(sound_thread);
+  while ((event = g_async_queue_try_pop(sound_queue)) != NULL) {
+    FreeSoundEvent(event);
+  }
+  g_async_queue_unref(sound_queue);
+  sound_thread = NULL;
+  sound_queue = NULL;
+}
+
 void SoundOpen(gchar *drivername)
 {
   if (!drivername || strcmp(drivername, NOPLUGIN) != 0) {
@@ -187,7 +319,9 @@ void SoundOpen(gchar *drivername)
     if (driver) {
       if (driver->open) {
         dopelog(3, 0, "Using plugin %s", driver->name);
-        driver->open();
+        if (driver->open() && driver->preload) {
+          PreloadSounds();
+        }
       }
     } else if (drivername) {
       gchar *plugins, *err;
@@ -201,6 +335,13 @@ void SoundOpen(gchar *drivername)
       g_free(err);
     }
   }
+  if (driver && driver->play && driver->threadsafe && !sound_thread) {
+    StartSoundThread();
+  } else if (driver && driver->play && !sync_lastplay) {
+    sync_lastplay = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          g_free, g_free);
+    memset(sync_voices, 0, sizeof(sync_voices));
+  }
   sound_enabled = TRUE;
 }
 
@@ -211,6 +352,11 @@ void SoundClose(void)
   SoundDriver *listdriv;
 #endif
 
+  StopSoundThread();
+  if (sync_lastplay) {
+    g_hash_table_destroy(sync_lastplay);
+    sync_lastplay = NULL;
+  }
   if (driver && driver->close) {
     driver->close();
     driver = NULL;
@@ -229,8 +375,22 @@ void SoundClose(void)
 
 void SoundPlay(const gchar *snd)
 {
-  if (sound_enabled && driver && driver->play && snd && snd[0]) {
-    driver->play(snd);
+  SoundEvent *event, direct;
+
+  if (!sound_enabled || !snd || !snd[0]) {
+    return;
+  }
+  if (sound_queue) {
+    event = g_new(SoundEvent, 1);
+    event->snd = g_strdup(snd);
+    event->queued = g_get_monotonic_time();
+    g_async_queue_push(sound_queue, event);
+  } else if (sync_lastplay) {
+    direct.snd = (gchar *)snd;
+    direct.queued = g_get_monotonic_time();
+    if (WantSoundEvent(&direct, sync_lastplay, sync_voices, direct.queued)) {
+      driver->play(snd);
+    }
   }
 }
 
@@ -34,6 +34,10 @@ struct _SoundDriver {
   gboolean (*open) (void);
   void (*close) (void);
   void (*play) (const gchar *snd);
+  void (*preload) (const gchar *snd);   /* Optional; load "snd" ahead of
+                                         * time so that playing it is fast */
+  gboolean threadsafe;          /* TRUE if "play" may be called from the
+                                 * sound thread rather than the main one */
 };
 typedef struct _SoundDriver SoundDriver;
 
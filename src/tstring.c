@@ -161,7 +161,7 @@ gchar *HandleTFmt(gchar *format, va_list va)
   int StrInd, StartPos, EndPos, FmtPos, Wid, Prec, ArgNum, DefaultArgNum;
   guint i;
   char Code[3], Type;
-  gchar *retstr, *fstr;
+  gchar *retstr, *fstr, prbuf[PRICE_BUFLEN];
   GString *string, *tmpfmt;
   GArray *arr;
   FmtData *fdat;
@@ -244,9 +244,9 @@ gchar *HandleTFmt(gchar *format, va_list va)
       g_string_append_printf(string, tmpfmt->str, fdat->data.CharVal);
       break;
     case 'P':
-      fstr = FormatPrice(fdat->data.PriceVal);
-      g_string_append_printf(string, tmpfmt->str, fstr);
-      g_free(fstr);
+      g_string_append_printf(string, tmpfmt->str,
+                             FormatPriceBuf(fdat->data.PriceVal, prbuf,
+                                            sizeof(prbuf)));
       break;
     case 't':
     case 'T':
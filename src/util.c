@@ -239,3 +239,13 @@ void MicroSleep(int microsec)
   bselect(0, NULL, NULL, NULL, &tv);
 #endif
 }
+
+/* 
+ * Returns the current time in milliseconds, from a monotonic clock. Only
+ * differences between two such times are meaningful, but unlike time()
+ * they are unaffected by steps in the system clock (e.g. from NTP).
+ */
+gint64 GetTimeMsec(void)
+{
+  return g_get_monotonic_time() / 1000;
+}
@@ -28,6 +28,7 @@
 #endif
 
 #include <stdio.h>
+#include <glib.h>
 
 #ifdef CYGWIN                   /* Definitions for native Win32 build */
 #include <winsock2.h>
@@ -61,6 +62,7 @@ extern char *optarg;
 #endif
 
 void MicroSleep(int microsec);
+gint64 GetTimeMsec(void);
 
 int ReadLock(FILE *fp);
 int WriteLock(FILE *fp);